@@ -158,6 +158,25 @@ void print_energy(struct state *state)
 	    energy.charge_penetration);
 	msg("\n");
 
+	if (cfg_get_double(state->cfg, "xr_screen_tol") > 0.0) {
+		size_t n_pairs;
+
+		check_fail(efp_get_xr_screen_count(state->efp, &n_pairs));
+		msg("%30s %16zu\n", "XR SCREENED PAIRS", n_pairs);
+		msg("\n");
+	}
+
+	if (cfg_get_enum(state->cfg, "pol_driver") == EFP_POL_DRIVER_DIRECT) {
+		size_t size;
+		double time;
+
+		check_fail(efp_get_pol_direct_info(state->efp, &size, &time));
+		msg("%30s %16.1lf\n", "POL MATRIX MEMORY (MB)",
+		    (double)size / 1048576.0);
+		msg("%30s %16.2lf\n", "POL FACTORIZATION TIME (S)", time);
+		msg("\n");
+	}
+
 	if (state->ff) {
 		msg("%30s %16.10lf\n", "FORCE-FIELD ENERGY",
 		    ff_get_energy(state->ff));
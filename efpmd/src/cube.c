@@ -0,0 +1,332 @@
+/*-
+ * Copyright (c) 2012-2015 Ilya Kaliman
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <math.h>
+
+#include "common.h"
+
+void sim_cube(struct state *state);
+
+struct cube {
+	FILE *fp;
+	size_t n[3];
+	double *pot;     /* whole grid kept for the check or NULL */
+	double max_diff; /* largest difference from direct summation */
+};
+
+static enum efp_result
+write_slab(size_t slab_idx, size_t n_pt, const double *pot, void *user_data)
+{
+	struct cube *cube = user_data;
+
+	if (cube->pot)
+		memcpy(cube->pot + slab_idx * n_pt, pot, n_pt * sizeof(double));
+
+	if (cube->fp == NULL)
+		return EFP_RESULT_SUCCESS;
+
+	for (size_t i = 0; i < cube->n[1]; i++) {
+		for (size_t j = 0; j < cube->n[2]; j++) {
+			fprintf(cube->fp, " %12.5E", pot[i * cube->n[2] + j]);
+
+			if (j % 6 == 5 || j == cube->n[2] - 1)
+				fprintf(cube->fp, "\n");
+		}
+	}
+
+	return ferror(cube->fp) ? EFP_RESULT_FATAL : EFP_RESULT_SUCCESS;
+}
+
+static enum efp_result
+compare_slab(size_t slab_idx, size_t n_pt, const double *pot, void *user_data)
+{
+	struct cube *cube = user_data;
+	const double *ref = cube->pot + slab_idx * n_pt;
+
+	for (size_t i = 0; i < n_pt; i++)
+		cube->max_diff = fmax(cube->max_diff, fabs(pot[i] - ref[i]));
+
+	return EFP_RESULT_SUCCESS;
+}
+
+/* Computes the grid again by direct summation and compares it with the
+ * grid computed using fast multipole method. */
+static void
+check_grid(struct state *state, const double *origin, const double *axes,
+    struct cube *cube)
+{
+	double tol = cfg_get_double(state->cfg, "cube_check_tol");
+	struct efp_opts opts, direct;
+
+	check_fail(efp_get_opts(state->efp, &opts));
+	direct = opts;
+	direct.enable_fmm = 0;
+	check_fail(efp_set_opts(state->efp, &direct));
+
+	cube->max_diff = 0.0;
+	check_fail(efp_get_electrostatic_potential_grid(state->efp, origin,
+		axes, cube->n, compare_slab, cube));
+	check_fail(efp_set_opts(state->efp, &opts));
+
+	msg("%30s %16.5e", "MAX DIFFERENCE FROM DIRECT", cube->max_diff);
+	msg(cube->max_diff < tol ? "  MATCH\n\n" : "  DOES NOT MATCH\n\n");
+}
+
+/* Potential at xyz summed from nuclei, multipoles and induced dipoles
+ * obtained from the library. Sources closer than 1.0e-8 are skipped as the
+ * library does. */
+static double
+get_ref_potential(const double *xyz, const struct efp_atom *atoms,
+    size_t n_atoms, const double *mult_xyz, const double *mult,
+    size_t n_mult, const double *dip_xyz, const double *dip, size_t n_dip)
+{
+	double pot = 0.0;
+
+	for (size_t i = 0; i < n_atoms; i++) {
+		vec_t dr = { xyz[0] - atoms[i].x, xyz[1] - atoms[i].y,
+			     xyz[2] - atoms[i].z };
+		double r = vec_len(&dr);
+
+		if (r > 1.0e-8)
+			pot += atoms[i].znuc / r;
+	}
+
+	for (size_t i = 0; i < n_mult; i++) {
+		const double *m = mult + 20 * i;
+		const double *q = m + 4, *o = m + 10;
+		double x = xyz[0] - mult_xyz[3 * i + 0];
+		double y = xyz[1] - mult_xyz[3 * i + 1];
+		double z = xyz[2] - mult_xyz[3 * i + 2];
+		double r = sqrt(x * x + y * y + z * z);
+
+		if (r <= 1.0e-8)
+			continue;
+
+		pot += m[0] / r;
+		pot += (m[1] * x + m[2] * y + m[3] * z) / pow(r, 3);
+		pot += (q[0] * x * x + q[1] * y * y + q[2] * z * z +
+			2.0 * (q[3] * x * y + q[4] * x * z + q[5] * y * z)) /
+			pow(r, 5);
+		pot += (o[0] * x * x * x + o[1] * y * y * y + o[2] * z * z * z +
+			3.0 * (o[3] * x * x * y + o[4] * x * x * z +
+			o[5] * x * y * y + o[6] * y * y * z + o[7] * x * z * z +
+			o[8] * y * z * z) + 6.0 * o[9] * x * y * z) / pow(r, 7);
+	}
+
+	for (size_t i = 0; i < n_dip; i++) {
+		double x = xyz[0] - dip_xyz[3 * i + 0];
+		double y = xyz[1] - dip_xyz[3 * i + 1];
+		double z = xyz[2] - dip_xyz[3 * i + 2];
+		double r = sqrt(x * x + y * y + z * z);
+
+		if (r > 1.0e-8)
+			pot += (dip[3 * i + 0] * x + dip[3 * i + 1] * y +
+				dip[3 * i + 2] * z) / pow(r, 3);
+	}
+
+	return pot;
+}
+
+/* Compares directly summed potential at each nucleus and at a point near
+ * it with the potential summed here from sources the library reports. */
+static void
+check_points(struct state *state, const struct efp_atom *atoms,
+    size_t n_atoms)
+{
+	static const double offset[3] = { 0.3, -0.2, 0.25 };
+	double tol = cfg_get_double(state->cfg, "cube_check_tol");
+	double axes[9] = { 0.0 }, pot, xyz[3], max_diff = 0.0;
+	size_t n_mult, n_dip = 0;
+	struct efp_opts opts, direct;
+	struct cube cube;
+
+	check_fail(efp_get_opts(state->efp, &opts));
+	check_fail(efp_get_multipole_count(state->efp, &n_mult));
+	if (opts.terms & EFP_TERM_POL)
+		check_fail(efp_get_induced_dipole_count(state->efp, &n_dip));
+
+	double *mult_xyz = xmalloc((3 * n_mult + 1) * sizeof(double));
+	double *mult = xmalloc((20 * n_mult + 1) * sizeof(double));
+	double *dip_xyz = xmalloc((3 * n_dip + 1) * sizeof(double));
+	double *dip = xmalloc((3 * n_dip + 1) * sizeof(double));
+
+	check_fail(efp_get_multipole_coordinates(state->efp, mult_xyz));
+	check_fail(efp_get_multipole_values(state->efp, mult));
+	if (n_dip > 0) {
+		check_fail(efp_get_induced_dipole_coordinates(state->efp,
+			dip_xyz));
+		check_fail(efp_get_induced_dipole_values(state->efp, dip));
+	}
+
+	direct = opts;
+	direct.enable_fmm = 0;
+	check_fail(efp_set_opts(state->efp, &direct));
+
+	cube.fp = NULL;
+	cube.pot = &pot;
+	cube.n[0] = cube.n[1] = cube.n[2] = 1;
+
+	for (size_t i = 0; i < 2 * n_atoms; i++) {
+		const struct efp_atom *at = atoms + i / 2;
+		double shift = i % 2 ? 1.0 : 0.0;
+
+		xyz[0] = at->x + shift * offset[0];
+		xyz[1] = at->y + shift * offset[1];
+		xyz[2] = at->z + shift * offset[2];
+
+		check_fail(efp_get_electrostatic_potential_grid(state->efp,
+			xyz, axes, cube.n, write_slab, &cube));
+
+		double ref = get_ref_potential(xyz, atoms, n_atoms, mult_xyz,
+			mult, n_mult, dip_xyz, dip, n_dip);
+
+		max_diff = isfinite(pot) ? fmax(max_diff, fabs(pot - ref)) :
+			INFINITY;
+	}
+
+	check_fail(efp_set_opts(state->efp, &opts));
+
+	msg("%30s %16.5e", "MAX DIFFERENCE AT ATOMS", max_diff);
+	msg(max_diff < tol ? "  MATCH\n\n" : "  DOES NOT MATCH\n\n");
+
+	free(dip);
+	free(dip_xyz);
+	free(mult);
+	free(mult_xyz);
+}
+
+void
+sim_cube(struct state *state)
+{
+	size_t n_frags, n_atoms_total = 0;
+	double spacing, margin, origin[3], axes[9] = { 0.0 };
+	vec_t lo = { INFINITY, INFINITY, INFINITY };
+	vec_t hi = { -INFINITY, -INFINITY, -INFINITY };
+	const char *path;
+	struct cube cube;
+	bool master = true;
+
+	msg("ELECTROSTATIC POTENTIAL CUBE JOB\n\n\n");
+
+	print_geometry(state->efp);
+	compute_energy(state, false);
+	print_energy(state);
+	check_fail(efp_get_frag_count(state->efp, &n_frags));
+
+	for (size_t i = 0; i < n_frags; i++) {
+		size_t n_atoms;
+
+		check_fail(efp_get_frag_atom_count(state->efp, i, &n_atoms));
+		n_atoms_total += n_atoms;
+	}
+
+	struct efp_atom *atoms = xmalloc(n_atoms_total * sizeof(struct efp_atom));
+
+	for (size_t i = 0, k = 0; i < n_frags; i++) {
+		size_t n_atoms;
+
+		check_fail(efp_get_frag_atom_count(state->efp, i, &n_atoms));
+		check_fail(efp_get_frag_atoms(state->efp, i, n_atoms, atoms + k));
+		k += n_atoms;
+	}
+
+	for (size_t i = 0; i < n_atoms_total; i++) {
+		lo.x = fmin(lo.x, atoms[i].x);
+		lo.y = fmin(lo.y, atoms[i].y);
+		lo.z = fmin(lo.z, atoms[i].z);
+		hi.x = fmax(hi.x, atoms[i].x);
+		hi.y = fmax(hi.y, atoms[i].y);
+		hi.z = fmax(hi.z, atoms[i].z);
+	}
+
+	spacing = cfg_get_double(state->cfg, "cube_spacing");
+	margin = cfg_get_double(state->cfg, "cube_margin");
+
+	if (spacing <= 0.0)
+		error("cube_spacing must be positive");
+
+	origin[0] = lo.x - margin;
+	origin[1] = lo.y - margin;
+	origin[2] = lo.z - margin;
+	cube.n[0] = (size_t)ceil((hi.x - lo.x + 2.0 * margin) / spacing) + 1;
+	cube.n[1] = (size_t)ceil((hi.y - lo.y + 2.0 * margin) / spacing) + 1;
+	cube.n[2] = (size_t)ceil((hi.z - lo.z + 2.0 * margin) / spacing) + 1;
+	axes[0] = axes[4] = axes[8] = spacing;
+
+#ifdef EFP_USE_MPI
+	int rank;
+
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	master = rank == 0;
+#endif
+	path = cfg_get_string(state->cfg, "cube_file");
+	cube.fp = NULL;
+	cube.pot = NULL;
+
+	if (cfg_get_bool(state->cfg, "enable_fmm") &&
+	    cfg_get_double(state->cfg, "cube_check_tol") > 0.0)
+		cube.pot = xmalloc(cube.n[0] * cube.n[1] * cube.n[2] *
+		    sizeof(double));
+
+	if (master) {
+		if ((cube.fp = fopen(path, "w")) == NULL)
+			error("unable to open %s", path);
+
+		fprintf(cube.fp, "EFP ELECTROSTATIC POTENTIAL\n");
+		fprintf(cube.fp, "GENERATED BY EFPMD\n");
+		fprintf(cube.fp, "%5zu %12.6f %12.6f %12.6f\n", n_atoms_total,
+			origin[0], origin[1], origin[2]);
+
+		for (size_t a = 0; a < 3; a++)
+			fprintf(cube.fp, "%5zu %12.6f %12.6f %12.6f\n", cube.n[a],
+				axes[3 * a + 0], axes[3 * a + 1], axes[3 * a + 2]);
+
+		for (size_t i = 0; i < n_atoms_total; i++)
+			fprintf(cube.fp, "%5d %12.6f %12.6f %12.6f %12.6f\n",
+				(int)lround(atoms[i].znuc), atoms[i].znuc,
+				atoms[i].x, atoms[i].y, atoms[i].z);
+	}
+
+	msg("WRITING %zu x %zu x %zu POINTS TO %s\n\n",
+		cube.n[0], cube.n[1], cube.n[2], path);
+
+	check_fail(efp_get_electrostatic_potential_grid(state->efp, origin,
+		axes, cube.n, write_slab, &cube));
+
+	if (cube.fp && fclose(cube.fp))
+		error("unable to write %s", path);
+
+	if (cube.pot)
+		check_grid(state, origin, axes, &cube);
+
+	if (cfg_get_double(state->cfg, "cube_check_tol") > 0.0)
+		check_points(state, atoms, n_atoms_total);
+
+	free(cube.pot);
+	free(atoms);
+
+	msg("ELECTROSTATIC POTENTIAL CUBE JOB COMPLETED SUCCESSFULLY\n");
+}
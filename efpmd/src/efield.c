@@ -59,22 +59,43 @@ sim_efield(struct state *state)
 	msg("COORDINATES ARE IN ANGSTROMS\n");
 	msg("ELECTRIC FIELD IS IN ATOMIC UNITS\n\n");
 
+	size_t n_pts = 0;
+
 	for (size_t i = 0; i < n_frags; i++) {
-		double field[3];
-		struct efp_atom *atoms;
 		size_t n_atoms;
 
 		check_fail(efp_get_frag_atom_count(state->efp, i, &n_atoms));
-		atoms = xmalloc(n_atoms * sizeof(struct efp_atom));
-		check_fail(efp_get_frag_atoms(state->efp, i, n_atoms, atoms));
+		n_pts += n_atoms;
+	}
 
-		for (size_t j = 0; j < n_atoms; j++) {
-			check_fail(efp_get_electric_field(state->efp, i, &atoms[j].x, field));
-			print_field(i + 1, atoms + j, field);
-		}
+	struct efp_atom *atoms = xmalloc(n_pts * sizeof(struct efp_atom));
+	size_t *frag_idx = xmalloc(n_pts * sizeof(size_t));
+	double *xyz = xmalloc(3 * n_pts * sizeof(double));
+	double *field = xmalloc(3 * n_pts * sizeof(double));
 
-		free(atoms);
+	for (size_t i = 0, k = 0; i < n_frags; i++) {
+		size_t n_atoms;
+
+		check_fail(efp_get_frag_atom_count(state->efp, i, &n_atoms));
+		check_fail(efp_get_frag_atoms(state->efp, i, n_atoms, atoms + k));
+
+		for (size_t j = 0; j < n_atoms; j++, k++) {
+			frag_idx[k] = i;
+			xyz[3 * k + 0] = atoms[k].x;
+			xyz[3 * k + 1] = atoms[k].y;
+			xyz[3 * k + 2] = atoms[k].z;
+		}
 	}
 
+	check_fail(efp_get_electric_field_batch(state->efp, n_pts, frag_idx, xyz, field));
+
+	for (size_t k = 0; k < n_pts; k++)
+		print_field(frag_idx[k] + 1, atoms + k, field + 3 * k);
+
+	free(atoms);
+	free(frag_idx);
+	free(xyz);
+	free(field);
+
 	msg("ELECTRIC FIELD JOB COMPLETED SUCCESSFULLY\n");
 }
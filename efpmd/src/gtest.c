@@ -156,6 +156,172 @@ static void test_energy(struct state *state)
 	msg(fabs(eref - state->energy) < tol ? "  MATCH\n" : "  DOES NOT MATCH\n");
 }
 
+/* Moves fragments one at a time and compares energy updated by
+ * efp_compute_incremental with energy from full computation. */
+static void test_incremental(struct state *state)
+{
+	double tol = cfg_get_double(state->cfg, "gtest_tol");
+
+	size_t n_frags;
+	check_fail(efp_get_frag_count(state->efp, &n_frags));
+
+	double xyzabc[6 * n_frags];
+	check_fail(efp_get_coordinates(state->efp, xyzabc));
+	check_fail(efp_compute_incremental(state->efp));
+
+	for (size_t i = 0; i < n_frags; i++) {
+		struct efp_energy energy;
+		double e_inc;
+
+		xyzabc[6 * i + 0] += 0.2;
+		xyzabc[6 * i + 4] += 0.1;
+		check_fail(efp_set_frag_coordinates(state->efp, i, EFP_COORD_TYPE_XYZABC,
+		    xyzabc + 6 * i));
+		check_fail(efp_compute_incremental(state->efp));
+		check_fail(efp_get_energy(state->efp, &energy));
+		e_inc = energy.total;
+
+		check_fail(efp_compute(state->efp, 0));
+		check_fail(efp_get_energy(state->efp, &energy));
+
+		msg("I F%04zu %16.10lf\n", i + 1, e_inc);
+		msg("E F%04zu %16.10lf", i + 1, energy.total);
+		msg(fabs(e_inc - energy.total) < tol ? "  MATCH\n" : "  DOES NOT MATCH\n");
+	}
+
+	for (size_t i = 0; i < n_frags; i++) {
+		xyzabc[6 * i + 0] -= 0.2;
+		xyzabc[6 * i + 4] -= 0.1;
+	}
+
+	check_fail(efp_set_coordinates(state->efp, EFP_COORD_TYPE_XYZABC, xyzabc));
+}
+
+/* Compares energy and gradient computed with exchange repulsion screening
+ * with energy and gradient of the unscreened computation. */
+static void test_xr_screen(struct state *state)
+{
+	double tol = cfg_get_double(state->cfg, "gtest_tol");
+	struct efp_opts opts, opts_full;
+	size_t n_frags, n_pairs;
+	double e_screen;
+
+	check_fail(efp_get_frag_count(state->efp, &n_frags));
+	check_fail(efp_get_opts(state->efp, &opts));
+
+	double grad[6 * n_frags];
+
+	compute_energy(state, 1);
+	check_fail(efp_get_xr_screen_count(state->efp, &n_pairs));
+	e_screen = state->energy;
+	memcpy(grad, state->grad, 6 * n_frags * sizeof(double));
+
+	msg("%30s %16zu", "SCREENED FRAGMENT PAIRS", n_pairs);
+	msg(n_pairs > 0 ? "  MATCH\n" : "  DOES NOT MATCH\n");
+
+	opts_full = opts;
+	opts_full.xr_screen_tol = 0.0;
+	check_fail(efp_set_opts(state->efp, &opts_full));
+	compute_energy(state, 1);
+
+	msg("%30s %16.10lf\n", "SCREENED ENERGY", e_screen);
+	msg("%30s %16.10lf", "UNSCREENED ENERGY", state->energy);
+	msg(fabs(e_screen - state->energy) < tol ? "  MATCH\n" : "  DOES NOT MATCH\n");
+
+	for (size_t i = 0; i < n_frags; i++) {
+		bool match = true;
+
+		for (size_t j = 0; j < 6; j++)
+			if (fabs(grad[6 * i + j] - state->grad[6 * i + j]) > tol)
+				match = false;
+
+		msg("S F%04zu  ", i + 1);
+		print_vec(grad + 6 * i);
+		msg(" ");
+		print_vec(grad + 6 * i + 3);
+		msg("\n");
+		msg("U F%04zu  ", i + 1);
+		print_vec(state->grad + 6 * i);
+		msg(" ");
+		print_vec(state->grad + 6 * i + 3);
+		msg(match ? "  MATCH\n" : "  DOES NOT MATCH\n");
+	}
+
+	check_fail(efp_set_opts(state->efp, &opts));
+	compute_energy(state, 1);
+}
+
+/* Compares ab initio dispersion energy of model orbitals with the sum of
+ * energies of their occupied-virtual pairs taken one at a time. Dipole
+ * integrals of all orbital pairs are set, so only the occupied-virtual block
+ * must be picked up. There are more pairs than fit in one contraction block. */
+static void test_ai_disp(struct state *state)
+{
+	double tol = cfg_get_double(state->cfg, "gtest_tol");
+	size_t n_core = 2, n_act = 3, n_vir = 300;
+	size_t n_occ = n_core + n_act, size = n_occ + n_vir;
+	struct efp_opts opts, opts_ai;
+	struct efp_energy energy;
+	double e_all, e_sum = 0.0;
+	double oe_pair[2], dipint_pair[3 * 2 * 2];
+	double *oe, *dipint;
+
+	oe = xmalloc(size * sizeof(double));
+	dipint = xmalloc(3 * size * size * sizeof(double));
+
+	for (size_t i = 0; i < size; i++)
+		oe[i] = i < n_occ ? -1.0 + 0.1 * i : 0.2 + 0.01 * (i - n_occ);
+
+	for (size_t a = 0; a < 3; a++)
+		for (size_t i = 0; i < size; i++)
+			for (size_t j = 0; j < size; j++)
+				dipint[a * size * size + i * size + j] =
+				    0.1 * sin(1.0 + a + 0.37 * i + 0.11 * j);
+
+	check_fail(efp_get_opts(state->efp, &opts));
+	opts_ai = opts;
+	opts_ai.terms = EFP_TERM_AI_DISP;
+	check_fail(efp_set_opts(state->efp, &opts_ai));
+
+	check_fail(efp_set_orbital_energies(state->efp, n_core, n_act, n_vir,
+	    oe));
+	check_fail(efp_set_dipole_integrals(state->efp, n_core, n_act, n_vir,
+	    dipint));
+	check_fail(efp_compute(state->efp, 0));
+	check_fail(efp_get_energy(state->efp, &energy));
+	e_all = energy.ai_dispersion;
+
+	memset(dipint_pair, 0, sizeof(dipint_pair));
+
+	for (size_t i = 0; i < n_occ; i++) {
+		for (size_t j = n_occ; j < size; j++) {
+			oe_pair[0] = oe[i];
+			oe_pair[1] = oe[j];
+
+			for (size_t a = 0; a < 3; a++)
+				dipint_pair[4 * a + 1] =
+				    dipint[a * size * size + i * size + j];
+
+			check_fail(efp_set_orbital_energies(state->efp, 0, 1,
+			    1, oe_pair));
+			check_fail(efp_set_dipole_integrals(state->efp, 0, 1,
+			    1, dipint_pair));
+			check_fail(efp_compute(state->efp, 0));
+			check_fail(efp_get_energy(state->efp, &energy));
+			e_sum += energy.ai_dispersion;
+		}
+	}
+
+	msg("%30s %16.10lf", "ALL PAIRS ENERGY", e_all);
+	msg(fabs(e_all) > tol ? "  MATCH\n" : "  DOES NOT MATCH\n");
+	msg("%30s %16.10lf", "SUM OF PAIR ENERGIES", e_sum);
+	msg(fabs(e_all - e_sum) < tol ? "  MATCH\n" : "  DOES NOT MATCH\n");
+
+	check_fail(efp_set_opts(state->efp, &opts));
+	free(dipint);
+	free(oe);
+}
+
 void sim_gtest(struct state *state)
 {
 	msg("GRADIENT TEST JOB\n\n\n");
@@ -169,5 +335,23 @@ void sim_gtest(struct state *state)
 	test_grad(state);
 	msg("\n");
 
+	if (cfg_get_bool(state->cfg, "gtest_incremental")) {
+		msg("    COMPARING INCREMENTAL AND FULL ENERGY\n\n");
+		test_incremental(state);
+		msg("\n");
+	}
+
+	if (cfg_get_bool(state->cfg, "gtest_xr_screen")) {
+		msg("    COMPARING SCREENED AND UNSCREENED EXCHANGE REPULSION\n\n");
+		test_xr_screen(state);
+		msg("\n");
+	}
+
+	if (cfg_get_bool(state->cfg, "gtest_ai_disp")) {
+		msg("    COMPARING AB INITIO DISPERSION WITH PAIR SUM\n\n");
+		test_ai_disp(state);
+		msg("\n");
+	}
+
 	msg("GRADIENT TEST JOB COMPLETED SUCCESSFULLY\n");
 }
@@ -281,7 +281,7 @@ void sim_hess(struct state *state)
 	print_gradient(state);
 
 	size_t n_frags, n_coord;
-	double *hess, *mass_hess, *eigen;
+	double *hess, *mass_hess, *eigen, *work;
 
 	check_fail(efp_get_frag_count(state->efp, &n_frags));
 	n_coord = 6 * n_frags;
@@ -301,8 +301,10 @@ void sim_hess(struct state *state)
 	msg("    NORMAL MODE ANALYSIS\n\n");
 
 	eigen = xmalloc(n_coord * sizeof(double));
+	work = xmalloc(n_coord * n_coord * sizeof(double));
 
-	if (efp_dsyev('V', 'U', (int)n_coord, mass_hess, (int)n_coord, eigen))
+	if (efp_dsyev('V', 'U', (int)n_coord, mass_hess, (int)n_coord, eigen,
+	    work, (int)(n_coord * n_coord)))
 		error("unable to diagonalize mass-weighted hessian matrix");
 
 	for (size_t i = 0; i < n_coord; i++) {
@@ -313,6 +315,7 @@ void sim_hess(struct state *state)
 	free(hess);
 	free(mass_hess);
 	free(eigen);
+	free(work);
 
 	msg("HESSIAN JOB COMPLETED SUCCESSFULLY\n");
 }
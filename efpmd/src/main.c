@@ -36,6 +36,7 @@ void sim_hess(struct state *);
 void sim_opt(struct state *);
 void sim_md(struct state *);
 void sim_efield(struct state *);
+void sim_cube(struct state *);
 void sim_gtest(struct state *);
 
 #define USAGE_STRING \
@@ -55,6 +56,7 @@ static struct cfg *make_cfg(void)
 		"opt\n"
 		"md\n"
 		"efield\n"
+		"cube\n"
 		"gtest\n",
 		(int []) { RUN_TYPE_SP,
 			   RUN_TYPE_GRAD,
@@ -62,6 +64,7 @@ static struct cfg *make_cfg(void)
 			   RUN_TYPE_OPT,
 			   RUN_TYPE_MD,
 			   RUN_TYPE_EFIELD,
+			   RUN_TYPE_CUBE,
 			   RUN_TYPE_GTEST });
 
 	cfg_add_enum(cfg, "coord", EFP_COORD_TYPE_XYZABC,
@@ -98,9 +101,24 @@ static struct cfg *make_cfg(void)
 
 	cfg_add_enum(cfg, "pol_driver", EFP_POL_DRIVER_ITERATIVE,
 		"iterative\n"
-		"direct\n",
+		"direct\n"
+		"krylov\n",
 		(int []) { EFP_POL_DRIVER_ITERATIVE,
-			   EFP_POL_DRIVER_DIRECT });
+			   EFP_POL_DRIVER_DIRECT,
+			   EFP_POL_DRIVER_KRYLOV });
+
+	cfg_add_double(cfg, "pol_scf_tol", 0.0);
+	cfg_add_int(cfg, "pol_scf_max_iter", 0);
+	cfg_add_int(cfg, "pol_guess_history", 0);
+	cfg_add_bool(cfg, "enable_pol_cache", false);
+	cfg_add_int(cfg, "pol_cache_size", 0);
+	cfg_add_bool(cfg, "enable_pol_mixed_precision", false);
+
+	cfg_add_enum(cfg, "mpi_balance", EFP_MPI_BALANCE_MASTER,
+		"master\n"
+		"rma\n",
+		(int []) { EFP_MPI_BALANCE_MASTER,
+			   EFP_MPI_BALANCE_RMA });
 
 	cfg_add_bool(cfg, "enable_ff", false);
 	cfg_add_bool(cfg, "enable_multistep", false);
@@ -110,18 +128,34 @@ static struct cfg *make_cfg(void)
 	cfg_add_string(cfg, "efp_params_file", "params.efp");
 	cfg_add_bool(cfg, "enable_cutoff", false);
 	cfg_add_double(cfg, "swf_cutoff", 10.0);
+	cfg_add_double(cfg, "nblist_skin", 1.0);
+	cfg_add_double(cfg, "xr_screen_tol", 0.0);
 	cfg_add_int(cfg, "max_steps", 100);
 	cfg_add_int(cfg, "multistep_steps", 1);
 	cfg_add_string(cfg, "fraglib_path", FRAGLIB_PATH);
 	cfg_add_string(cfg, "userlib_path", ".");
 	cfg_add_bool(cfg, "enable_pbc", false);
 	cfg_add_string(cfg, "periodic_box", "30.0 30.0 30.0");
+	cfg_add_bool(cfg, "enable_pme", false);
+	cfg_add_double(cfg, "pme_alpha", 0.0);
+	cfg_add_double(cfg, "pme_spacing", 0.0);
+	cfg_add_int(cfg, "pme_order", 0);
+	cfg_add_bool(cfg, "enable_fmm", false);
+	cfg_add_int(cfg, "fmm_order", 0);
+	cfg_add_double(cfg, "fmm_theta", 0.0);
 	cfg_add_double(cfg, "opt_tol", 1.0e-4);
 	cfg_add_double(cfg, "gtest_tol", 1.0e-6);
+	cfg_add_bool(cfg, "gtest_incremental", false);
+	cfg_add_bool(cfg, "gtest_xr_screen", false);
+	cfg_add_bool(cfg, "gtest_ai_disp", false);
 	cfg_add_double(cfg, "ref_energy", 0.0);
 	cfg_add_bool(cfg, "hess_central", false);
 	cfg_add_double(cfg, "num_step_dist", 0.001);
 	cfg_add_double(cfg, "num_step_angle", 0.01);
+	cfg_add_string(cfg, "cube_file", "efp.cube");
+	cfg_add_double(cfg, "cube_spacing", 0.2);
+	cfg_add_double(cfg, "cube_margin", 3.0);
+	cfg_add_double(cfg, "cube_check_tol", 0.0);
 
 	cfg_add_enum(cfg, "ensemble", ENSEMBLE_TYPE_NVE,
 		"nve\n"
@@ -133,6 +167,7 @@ static struct cfg *make_cfg(void)
 
 	cfg_add_double(cfg, "time_step", 1.0);
 	cfg_add_int(cfg, "print_step", 1);
+	cfg_add_bool(cfg, "check_alloc", false);
 	cfg_add_bool(cfg, "velocitize", false);
 	cfg_add_double(cfg, "temperature", 300.0);
 	cfg_add_double(cfg, "pressure", 1.0);
@@ -157,6 +192,8 @@ static sim_fn_t get_sim_fn(enum run_type run_type)
 		return sim_md;
 	case RUN_TYPE_EFIELD:
 		return sim_efield;
+	case RUN_TYPE_CUBE:
+		return sim_cube;
 	case RUN_TYPE_GTEST:
 		return sim_gtest;
 	}
@@ -247,7 +284,23 @@ static struct efp *create_efp(const struct cfg *cfg, const struct sys *sys)
 		.pol_driver = cfg_get_enum(cfg, "pol_driver"),
 		.enable_pbc = cfg_get_bool(cfg, "enable_pbc"),
 		.enable_cutoff = cfg_get_bool(cfg, "enable_cutoff"),
-		.swf_cutoff = cfg_get_double(cfg, "swf_cutoff")
+		.swf_cutoff = cfg_get_double(cfg, "swf_cutoff"),
+		.nblist_skin = cfg_get_double(cfg, "nblist_skin"),
+		.xr_screen_tol = cfg_get_double(cfg, "xr_screen_tol"),
+		.mpi_balance = cfg_get_enum(cfg, "mpi_balance"),
+		.enable_pme = cfg_get_bool(cfg, "enable_pme"),
+		.pme_alpha = cfg_get_double(cfg, "pme_alpha"),
+		.pme_spacing = cfg_get_double(cfg, "pme_spacing"),
+		.pme_order = (size_t)cfg_get_int(cfg, "pme_order"),
+		.enable_fmm = cfg_get_bool(cfg, "enable_fmm"),
+		.fmm_order = (size_t)cfg_get_int(cfg, "fmm_order"),
+		.fmm_theta = cfg_get_double(cfg, "fmm_theta"),
+		.pol_scf_tol = cfg_get_double(cfg, "pol_scf_tol"),
+		.pol_scf_max_iter = (size_t)cfg_get_int(cfg, "pol_scf_max_iter"),
+		.pol_guess_history = (size_t)cfg_get_int(cfg, "pol_guess_history"),
+		.enable_pol_cache = cfg_get_bool(cfg, "enable_pol_cache"),
+		.pol_cache_size = (size_t)cfg_get_int(cfg, "pol_cache_size"),
+		.enable_pol_mixed_precision = cfg_get_bool(cfg, "enable_pol_mixed_precision")
 	};
 
 	enum efp_coord_type coord_type = cfg_get_enum(cfg, "coord");
@@ -384,8 +437,18 @@ static void convert_units(struct cfg *cfg, struct sys *sys)
 		cfg_get_double(cfg, "pressure") * BAR_TO_AU);
 	cfg_set_double(cfg, "swf_cutoff",
 		cfg_get_double(cfg, "swf_cutoff") / BOHR_RADIUS);
+	cfg_set_double(cfg, "nblist_skin",
+		cfg_get_double(cfg, "nblist_skin") / BOHR_RADIUS);
+	cfg_set_double(cfg, "pme_alpha",
+		cfg_get_double(cfg, "pme_alpha") * BOHR_RADIUS);
+	cfg_set_double(cfg, "pme_spacing",
+		cfg_get_double(cfg, "pme_spacing") / BOHR_RADIUS);
 	cfg_set_double(cfg, "num_step_dist",
 		cfg_get_double(cfg, "num_step_dist") / BOHR_RADIUS);
+	cfg_set_double(cfg, "cube_spacing",
+		cfg_get_double(cfg, "cube_spacing") / BOHR_RADIUS);
+	cfg_set_double(cfg, "cube_margin",
+		cfg_get_double(cfg, "cube_margin") / BOHR_RADIUS);
 
 	size_t n_convert = (size_t []) {
 		[EFP_COORD_TYPE_XYZABC] = 3,
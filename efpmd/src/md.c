@@ -914,6 +914,9 @@ void sim_md(struct state *state)
 	remove_system_drift(md);
 	compute_forces(md);
 
+	size_t n_alloc_start, n_alloc_end;
+	check_fail(efp_get_alloc_count(state->efp, &n_alloc_start));
+
 	msg("    INITIAL STATE\n\n");
 	print_status(md);
 
@@ -928,6 +931,23 @@ void sim_md(struct state *state)
 		}
 	}
 
+	check_fail(efp_get_alloc_count(state->efp, &n_alloc_end));
+	msg("    %zu HEAP ALLOCATIONS DURING DYNAMICS",
+	    n_alloc_end - n_alloc_start);
+
+	if (cfg_get_bool(state->cfg, "check_alloc"))
+		msg(n_alloc_end == n_alloc_start ? "  MATCH\n\n" :
+		    "  DOES NOT MATCH\n\n");
+	else
+		msg("\n\n");
+
+	if (cfg_get_bool(state->cfg, "enable_cutoff")) {
+		size_t n_builds;
+
+		check_fail(efp_get_nblist_build_count(state->efp, &n_builds));
+		msg("    NEIGHBOR LIST WAS BUILT %zu TIMES\n\n", n_builds);
+	}
+
 	md_shutdown(md);
 
 	msg("MOLECULAR DYNAMICS JOB COMPLETED SUCCESSFULLY\n");
@@ -39,6 +39,10 @@ integer(kind=c_int), parameter :: EFP_ELEC_DAMP_OFF = 2
 integer(kind=c_int), parameter :: EFP_POL_DAMP_TT = 0
 integer(kind=c_int), parameter :: EFP_POL_DAMP_OFF = 1
 
+! efp_mpi_balance
+integer(kind=c_int), parameter :: EFP_MPI_BALANCE_MASTER = 0
+integer(kind=c_int), parameter :: EFP_MPI_BALANCE_RMA = 1
+
 ! efp_coord_type
 integer(kind=c_int), parameter :: EFP_COORD_TYPE_XYZABC = 0
 integer(kind=c_int), parameter :: EFP_COORD_TYPE_POINTS = 1
@@ -53,6 +57,22 @@ type, bind(c) :: efp_opts
   integer(kind=c_int) enable_pbc
   integer(kind=c_int) enable_cutoff
   real(kind=c_double) swf_cutoff
+  real(kind=c_double) nblist_skin
+  real(kind=c_double) xr_screen_tol
+  integer(kind=c_int) mpi_balance
+  integer(kind=c_int) enable_pme
+  real(kind=c_double) pme_alpha
+  real(kind=c_double) pme_spacing
+  integer(kind=c_size_t) pme_order
+  integer(kind=c_int) enable_fmm
+  integer(kind=c_size_t) fmm_order
+  real(kind=c_double) fmm_theta
+  real(kind=c_double) pol_scf_tol
+  integer(kind=c_size_t) pol_scf_max_iter
+  integer(kind=c_size_t) pol_guess_history
+  integer(kind=c_int) enable_pol_cache
+  integer(kind=c_size_t) pol_cache_size
+  integer(kind=c_int) enable_pol_mixed_precision
 end type efp_opts
 
 type, bind(c) :: efp_energy
@@ -274,6 +294,39 @@ function efp_get_stress_tensor(efp, stress) bind(c)
   type(c_ptr), value :: stress
 end function
 
+! efp_result_t efp_get_nblist_build_count(struct efp *efp, size_t *n_builds);
+function efp_get_nblist_build_count(efp, n_builds) bind(c)
+  use iso_c_binding, only: c_int, c_ptr
+  integer(c_int) :: efp_get_nblist_build_count
+  type(c_ptr), value :: efp
+  type(c_ptr), value :: n_builds
+end function
+
+! efp_result_t efp_get_xr_screen_count(struct efp *efp, size_t *n_pairs);
+function efp_get_xr_screen_count(efp, n_pairs) bind(c)
+  use iso_c_binding, only: c_int, c_ptr
+  integer(c_int) :: efp_get_xr_screen_count
+  type(c_ptr), value :: efp
+  type(c_ptr), value :: n_pairs
+end function
+
+! efp_result_t efp_get_pol_direct_info(struct efp *efp, size_t *size, double *time);
+function efp_get_pol_direct_info(efp, size, time) bind(c)
+  use iso_c_binding, only: c_int, c_ptr
+  integer(c_int) :: efp_get_pol_direct_info
+  type(c_ptr), value :: efp
+  type(c_ptr), value :: size
+  type(c_ptr), value :: time
+end function
+
+! efp_result_t efp_get_alloc_count(struct efp *efp, size_t *n_alloc);
+function efp_get_alloc_count(efp, n_alloc) bind(c)
+  use iso_c_binding, only: c_int, c_ptr
+  integer(c_int) :: efp_get_alloc_count
+  type(c_ptr), value :: efp
+  type(c_ptr), value :: n_alloc
+end function
+
 ! efp_result_t efp_get_ai_screen(struct efp *efp, size_t frag_idx, double *screen);
 function efp_get_ai_screen(efp, frag_idx, screen) bind(c)
   use iso_c_binding, only: c_int, c_ptr, c_size_t
@@ -321,6 +374,20 @@ function efp_compute(efp, do_gradient) bind(c)
   integer(c_int), value :: do_gradient
 end function
 
+! efp_result_t efp_compute_incremental(struct efp *efp);
+function efp_compute_incremental(efp) bind(c)
+  use iso_c_binding, only: c_int, c_ptr
+  integer(c_int) :: efp_compute_incremental
+  type(c_ptr), value :: efp
+end function
+
+! efp_result_t efp_reset_pol_history(struct efp *efp);
+function efp_reset_pol_history(efp) bind(c)
+  use iso_c_binding, only: c_int, c_ptr
+  integer(c_int) :: efp_reset_pol_history
+  type(c_ptr), value :: efp
+end function
+
 ! efp_result_t efp_get_frag_charge(struct efp *efp, size_t frag_idx, double *charge);
 function efp_get_frag_charge(efp, frag_idx, charge) bind(c)
   use iso_c_binding, only: c_int, c_ptr, c_size_t
@@ -512,6 +579,29 @@ function efp_get_electric_field(efp, frag_idx, xyz, field) bind(c)
   type(c_ptr), value :: field
 end function
 
+! efp_result_t efp_get_electric_field_batch(struct efp *efp, size_t n_pt, const size_t *frag_idx, const double *xyz, double *field);
+function efp_get_electric_field_batch(efp, n_pt, frag_idx, xyz, field) bind(c)
+  use iso_c_binding, only: c_int, c_ptr, c_size_t
+  integer(c_int) :: efp_get_electric_field_batch
+  type(c_ptr), value :: efp
+  integer(c_size_t), value :: n_pt
+  type(c_ptr), value :: frag_idx
+  type(c_ptr), value :: xyz
+  type(c_ptr), value :: field
+end function
+
+! efp_result_t efp_get_electrostatic_potential_grid(struct efp *efp, const double *origin, const double *axes, const size_t *n, efp_potential_slab_fn fn, void *user_data);
+function efp_get_electrostatic_potential_grid(efp, origin, axes, n, fn, user_data) bind(c)
+  use iso_c_binding, only: c_int, c_ptr, c_funptr
+  integer(c_int) :: efp_get_electrostatic_potential_grid
+  type(c_ptr), value :: efp
+  type(c_ptr), value :: origin
+  type(c_ptr), value :: axes
+  type(c_ptr), value :: n
+  type(c_funptr), value :: fn
+  type(c_ptr), value :: user_data
+end function
+
 ! void efp_torque_to_derivative(const double *euler, const double *torque, double *deriv);
 subroutine efp_torque_to_derivative(euler, torque, deriv) bind(c)
   use iso_c_binding, only: c_ptr
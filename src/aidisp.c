@@ -24,7 +24,11 @@
  * SUCH DAMAGE.
  */
 
+#include <stdlib.h>
+#include <string.h>
+
 #include "balance.h"
+#include "clapack.h"
 #include "private.h"
 
 static const double quad_fact[12] = {
@@ -45,72 +49,94 @@ static const double quad_freq[12] = {
 	3.54935126637048206534e+01, 1.03935828835455831714e+03
 };
 
-static double
-quadrature(const mat_t *tensor, size_t i, size_t j, double de)
+/*
+ * Contracts transition dipoles of all occupied-virtual pairs with the
+ * frequency factors. Element [9 * k + 3 * i + j] of the result multiplies
+ * component ij of the polarizability tensor at quadrature point k.
+ */
+static enum efp_result
+compute_ai_disp_coef(struct efp *efp, double *coef)
 {
-	double m, sum = 0.0;
-
-	for (int k = 0; k < 12; k++) {
-		m = mat_get(tensor + k, i, j);
-		sum += m * quad_fact[k] / (de * de + quad_freq[k]);
+	size_t n_occ = efp->n_ai_core + efp->n_ai_act;
+	size_t n_vir = efp->n_ai_vir;
+	size_t n_pair = n_occ * n_vir;
+	double *fact, *dip2, m[12 * 9];
+
+	fact = (double *)efp_scratch_alloc(efp,
+	    AI_DISP_BLOCK * 12 * sizeof(double));
+	dip2 = (double *)efp_scratch_alloc(efp,
+	    AI_DISP_BLOCK * 9 * sizeof(double));
+	if (fact == NULL || dip2 == NULL) {
+		efp_scratch_free(efp, dip2);
+		efp_scratch_free(efp, fact);
+		return EFP_RESULT_NO_MEMORY;
 	}
-	return sum * de;
-}
 
-static double
-get_dip_int(struct efp *efp, size_t i_occ, size_t i_vir, size_t axis)
-{
-	size_t idx, size;
+	memset(m, 0, sizeof(m));
+
+	for (size_t from = 0; from < n_pair; from += AI_DISP_BLOCK) {
+		size_t n = n_pair - from < AI_DISP_BLOCK ?
+		    n_pair - from : AI_DISP_BLOCK;
+
+		for (size_t p = 0; p < n; p++) {
+			size_t i_occ = (from + p) / n_vir;
+			size_t i_vir = (from + p) % n_vir;
+			const double *dip = efp->ai_dipole_integrals +
+			    3 * (from + p);
+			double de = efp->ai_orbital_energies[n_occ + i_vir] -
+			    efp->ai_orbital_energies[i_occ];
+
+			for (size_t k = 0; k < 12; k++)
+				fact[k * n + p] = de * quad_fact[k] /
+				    (de * de + quad_freq[k]);
+			for (size_t i = 0; i < 3; i++)
+				for (size_t j = 0; j < 3; j++)
+					dip2[(3 * i + j) * n + p] =
+					    dip[i] * dip[j];
+		}
 
-	size = efp->n_ai_core + efp->n_ai_act + efp->n_ai_vir;
-	idx = axis * size * size + i_occ * size +
-	    (efp->n_ai_core + efp->n_ai_act) + i_vir;
+		/* m[12 x 9] += fact^T * dip2, column-major */
+		efp_dgemm('T', 'N', 12, 9, (fortranint_t)n, 1.0, fact,
+		    (fortranint_t)n, dip2, (fortranint_t)n, 1.0, m, 12);
+	}
 
-	return efp->ai_dipole_integrals[idx];
+	for (size_t k = 0; k < 12; k++)
+		for (size_t c = 0; c < 9; c++)
+			coef[9 * k + c] = m[12 * c + k];
+
+	efp_scratch_free(efp, dip2);
+	efp_scratch_free(efp, fact);
+	return EFP_RESULT_SUCCESS;
 }
 
 static double
-compute_ai_disp_pt(struct efp *efp, size_t fr_idx, size_t pt_idx)
+compute_ai_disp_pt(struct efp *efp, size_t fr_idx, size_t pt_idx,
+    const double *coef)
 {
 	struct frag *frag;
 	struct dynamic_polarizable_pt *pt;
+	const double *tensor;
 	double sum = 0.0;
-	size_t ncoreact;
 
 	frag = efp->frags + fr_idx;
 	pt = frag->dynamic_polarizable_pts + pt_idx;
-	ncoreact = efp->n_ai_core + efp->n_ai_act;
+	tensor = (const double *)pt->tensor;
 
-	for (size_t i_vir = 0; i_vir < efp->n_ai_vir; i_vir++) {
-		double e_vir = efp->ai_orbital_energies[ncoreact + i_vir];
-
-		for (size_t i_occ = 0; i_occ < ncoreact; i_occ++) {
-			double e_occ = efp->ai_orbital_energies[i_occ];
-
-			for (size_t i = 0; i < 3; i++) {
-				double di = get_dip_int(efp,
-				    i_occ, i_vir, i);
-
-				for (size_t j = 0; j < 3; j++) {
-					double dj = get_dip_int(efp,
-					    i_occ, i_vir, j);
+#ifdef _OPENMP
+#pragma omp simd reduction(+:sum)
+#endif
+	for (size_t k = 0; k < 12 * 9; k++)
+		sum += tensor[k] * coef[k];
 
-					sum += di * dj * quadrature(pt->tensor,
-					    i, j, e_vir - e_occ);
-				}
-			}
-		}
-	}
 	return -sum / PI;
 }
 
 static void
 compute_ai_disp_range(struct efp *efp, size_t from, size_t to, void *data)
 {
+	const double *coef = (const double *)data;
 	double energy = 0.0;
 
-	(void)data;
-
 #ifdef _OPENMP
 #pragma omp parallel for schedule(dynamic) reduction(+:energy)
 #endif
@@ -118,7 +144,7 @@ compute_ai_disp_range(struct efp *efp, size_t from, size_t to, void *data)
 		size_t n_pt = efp->frags[i].n_dynamic_polarizable_pts;
 
 		for (size_t j = 0; j < n_pt; j++)
-			energy += compute_ai_disp_pt(efp, i, j);
+			energy += compute_ai_disp_pt(efp, i, j, coef);
 	}
 	efp->energy.ai_dispersion += energy;
 }
@@ -126,6 +152,9 @@ compute_ai_disp_range(struct efp *efp, size_t from, size_t to, void *data)
 enum efp_result
 efp_compute_ai_disp(struct efp *efp)
 {
+	double coef[12 * 9];
+	enum efp_result res;
+
 	if (!(efp->opts.terms & EFP_TERM_AI_DISP))
 		return EFP_RESULT_SUCCESS;
 
@@ -134,7 +163,10 @@ efp_compute_ai_disp(struct efp *efp)
 		return EFP_RESULT_FATAL;
 	}
 
-	efp_balance_work(efp, compute_ai_disp_range, NULL);
+	if ((res = compute_ai_disp_coef(efp, coef)))
+		return res;
+
+	efp_balance_work(efp, compute_ai_disp_range, coef);
 	efp_allreduce(&efp->energy.ai_dispersion, 1);
 
 	return EFP_RESULT_SUCCESS;
@@ -24,6 +24,9 @@
  * SUCH DAMAGE.
  */
 
+#include <stdlib.h>
+#include <time.h>
+
 #ifdef EFP_USE_MPI
 #include <mpi.h>
 #endif
@@ -36,29 +39,81 @@
 #include "private.h"
 
 #ifdef EFP_USE_MPI
-struct master {
-	int total, range[2];
+#define MPI_CHUNK_SIZE 16
+#define MPI_CHUNKS_PER_RANK 16
+
+/* share of chunks distributed statically by the RMA scheduler */
+#define MPI_STATIC_CHUNKS_PER_RANK 8
+
+struct chunks {
+	int n;       /* number of chunks */
+	int *bounds; /* chunk i is [bounds[i], bounds[i + 1]) */
 };
 
-#define MPI_CHUNK_SIZE 16
+/* Splits fragments into chunks of equal cost or, if no cost is given, of
+ * equal size. All ranks get the same chunks as costs are identical. */
+static int
+make_chunks(struct efp *efp, const double *cost, int size,
+    struct chunks *chunks)
+{
+	int total = (int)efp->n_frag;
+	double total_cost = 0.0, chunk_cost = 0.0;
+
+	if (cost) {
+		for (int i = 0; i < total; i++)
+			total_cost += cost[i];
+
+		chunk_cost = total_cost / (size * MPI_CHUNKS_PER_RANK);
+	}
+
+	chunks->n = 0;
+	chunks->bounds = (int *)efp_scratch_alloc(efp,
+	    (total + 1) * sizeof(int));
+
+	if (chunks->bounds == NULL)
+		return 0;
+
+	chunks->bounds[0] = 0;
+
+	for (int end = 0; end < total; chunks->n++) {
+		if (total_cost > 0.0) {
+			double sum = 0.0;
+
+			while (end < total && sum < chunk_cost)
+				sum += cost[end++];
+		} else {
+			end += MPI_CHUNK_SIZE;
+
+			if (end > total)
+				end = total;
+		}
+		chunks->bounds[chunks->n + 1] = end;
+	}
+	return 1;
+}
+
+struct master {
+	struct chunks chunks;
+	int next;
+};
 
 static int
 master_get_work(struct master *master, int range[2])
 {
+	int idx;
+
 #ifdef _OPENMP
-#pragma omp critical
+#pragma omp atomic capture
 #endif
-	{
-		master->range[0] = master->range[1];
-		master->range[1] += MPI_CHUNK_SIZE;
+	idx = master->next++;
 
-		if (master->range[1] > master->total)
-			master->range[1] = master->total;
+	if (idx >= master->chunks.n)
+		return 0;
 
-		range[0] = master->range[0];
-		range[1] = master->range[1];
-	}
-	return range[1] > range[0];
+	range[0] = master->chunks.bounds[idx];
+	range[1] = master->chunks.bounds[idx + 1];
+
+	return 1;
 }
 
 static void
@@ -104,12 +159,12 @@ omp_get_thread_num(void)
 #endif /* _OPENMP */
 
 static void
-do_master(struct efp *efp, work_fn fn, void *data)
+do_master(struct efp *efp, work_fn fn, void *data, const struct chunks *chunks)
 {
 	struct master master;
 
-	master.total = (int)efp->n_frag;
-	master.range[0] = master.range[1] = 0;
+	master.chunks = *chunks;
+	master.next = 0;
 
 #ifdef _OPENMP
 #pragma omp parallel
@@ -139,6 +194,55 @@ do_slave(struct efp *efp, work_fn fn, void *data)
 		fn(efp, range[0], range[1], data);
 	}
 }
+
+#if MPI_VERSION >= 3
+/* Decentralized scheduling. Each rank first processes its own contiguous
+ * block of the leading chunks. The remaining chunks are taken in order by
+ * atomically incrementing a shared counter located on rank 0. No thread is
+ * dedicated to dispatching and no messages are exchanged per chunk. */
+static void
+do_rma(struct efp *efp, work_fn fn, void *data, const struct chunks *chunks)
+{
+	MPI_Win win;
+	int rank, size, n_static, one = 1, idx, *counter;
+
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+	n_static = MPI_STATIC_CHUNKS_PER_RANK;
+
+	if (n_static * size > chunks->n / 2)
+		n_static = chunks->n / 2 / size;
+
+	MPI_Win_allocate(rank == 0 ? sizeof(int) : 0, sizeof(int),
+	    MPI_INFO_NULL, MPI_COMM_WORLD, &counter, &win);
+
+	if (rank == 0) {
+		MPI_Win_lock(MPI_LOCK_EXCLUSIVE, 0, 0, win);
+		*counter = n_static * size;
+		MPI_Win_unlock(0, win);
+	}
+	MPI_Barrier(MPI_COMM_WORLD);
+
+	for (idx = rank * n_static; idx < (rank + 1) * n_static; idx++)
+		fn(efp, chunks->bounds[idx], chunks->bounds[idx + 1], data);
+
+	MPI_Win_lock_all(0, win);
+
+	for (;;) {
+		MPI_Fetch_and_op(&one, &idx, MPI_INT, 0, 0, MPI_SUM, win);
+		MPI_Win_flush(0, win);
+
+		if (idx >= chunks->n)
+			break;
+
+		fn(efp, chunks->bounds[idx], chunks->bounds[idx + 1], data);
+	}
+
+	MPI_Win_unlock_all(win);
+	MPI_Win_free(&win);
+}
+#endif /* MPI_VERSION >= 3 */
 #endif /* EFP_USE_MPI */
 
 void
@@ -153,28 +257,123 @@ efp_allreduce(double *x, size_t n)
 #endif
 }
 
+/* Returns rank of this MPI process, work that is not distributed between
+ * processes is done by rank 0. */
+int
+efp_mpi_rank(void)
+{
+#ifdef EFP_USE_MPI
+	int rank;
+
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	return rank;
+#else
+	return 0;
+#endif
+}
+
+double
+efp_wtime(void)
+{
+#if defined(EFP_USE_MPI)
+	return MPI_Wtime();
+#elif defined(_OPENMP)
+	return omp_get_wtime();
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static void
+sift_down(const double *cost, size_t *heap, size_t root, size_t n)
+{
+	/* min-heap on cost, so that heap sort yields decreasing order */
+	for (;;) {
+		size_t child = 2 * root + 1;
+
+		if (child >= n)
+			break;
+		if (child + 1 < n && cost[heap[child + 1]] < cost[heap[child]])
+			child++;
+		if (cost[heap[root]] <= cost[heap[child]])
+			break;
+
+		size_t t = heap[root];
+		heap[root] = heap[child];
+		heap[child] = t;
+		root = child;
+	}
+}
+
+/* Arranges fragment indices from the range [from, to) in order of
+ * decreasing cost. Processing the most expensive fragments first keeps the
+ * dynamic scheduling of threads balanced at the end of a parallel loop. */
 void
-efp_balance_work(struct efp *efp, work_fn fn, void *data)
+efp_balance_order(const double *cost, size_t from, size_t to, size_t *order)
+{
+	size_t n = to - from;
+	size_t *heap = order + from;
+
+	for (size_t i = 0; i < n; i++)
+		heap[i] = from + i;
+	for (size_t i = n / 2; i > 0; i--)
+		sift_down(cost, heap, i - 1, n);
+	for (size_t i = n; i > 1; i--) {
+		size_t t = heap[0];
+		heap[0] = heap[i - 1];
+		heap[i - 1] = t;
+		sift_down(cost, heap, 0, i - 1);
+	}
+}
+
+void
+efp_balance_work_cost(struct efp *efp, work_fn fn, void *data,
+    const double *cost)
 {
 #ifdef EFP_USE_MPI
-	int rank, size;
+	struct chunks chunks;
+	int rank, size, ok;
 
 	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 	MPI_Comm_size(MPI_COMM_WORLD, &size);
 
-	if (size == 1)
+	if (size == 1) {
 		fn(efp, 0, efp->n_frag, data);
-	else {
-		MPI_Barrier(MPI_COMM_WORLD);
+		return;
+	}
 
-		if (rank == 0)
-			do_master(efp, fn, data);
-		else
-			do_slave(efp, fn, data);
+	ok = make_chunks(efp, cost, size, &chunks);
+	MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
 
-		MPI_Barrier(MPI_COMM_WORLD);
+	if (!ok) {
+		/* out of memory on some rank, do everything on master */
+		if (rank == 0)
+			fn(efp, 0, efp->n_frag, data);
+		efp_scratch_free(efp, chunks.bounds);
+		return;
 	}
+
+#if MPI_VERSION >= 3
+	if (efp->opts.mpi_balance == EFP_MPI_BALANCE_RMA)
+		do_rma(efp, fn, data, &chunks);
+	else
+#endif
+	if (rank == 0)
+		do_master(efp, fn, data, &chunks);
+	else
+		do_slave(efp, fn, data);
+
+	MPI_Barrier(MPI_COMM_WORLD);
+	efp_scratch_free(efp, chunks.bounds);
 #else
+	(void)cost;
+
 	fn(efp, 0, efp->n_frag, data);
 #endif
 }
+
+void
+efp_balance_work(struct efp *efp, work_fn fn, void *data)
+{
+	efp_balance_work_cost(efp, fn, data, NULL);
+}
@@ -34,6 +34,10 @@ struct efp;
 typedef void (*work_fn)(struct efp *, size_t, size_t, void *);
 
 void efp_allreduce(double *, size_t);
+int efp_mpi_rank(void);
+double efp_wtime(void);
+void efp_balance_order(const double *, size_t, size_t, size_t *);
 void efp_balance_work(struct efp *, work_fn, void *);
+void efp_balance_work_cost(struct efp *, work_fn, void *, const double *);
 
 #endif /* LIBEFP_BALANCE_H */
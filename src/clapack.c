@@ -52,14 +52,43 @@ void dsyev_(char *,
 	    fortranint_t *,
 	    fortranint_t *);
 
-void dgesv_(fortranint_t *,
-	    fortranint_t *,
-	    double *,
-	    fortranint_t *,
-	    fortranint_t *,
-	    double *,
-	    fortranint_t *,
-	    fortranint_t *);
+void dgetrf_(fortranint_t *,
+	     fortranint_t *,
+	     double *,
+	     fortranint_t *,
+	     fortranint_t *,
+	     fortranint_t *);
+
+void dgetrs_(char *,
+	     fortranint_t *,
+	     fortranint_t *,
+	     double *,
+	     fortranint_t *,
+	     fortranint_t *,
+	     double *,
+	     fortranint_t *,
+	     fortranint_t *);
+
+void dgbtrf_(fortranint_t *,
+	     fortranint_t *,
+	     fortranint_t *,
+	     fortranint_t *,
+	     double *,
+	     fortranint_t *,
+	     fortranint_t *,
+	     fortranint_t *);
+
+void dgbtrs_(char *,
+	     fortranint_t *,
+	     fortranint_t *,
+	     fortranint_t *,
+	     fortranint_t *,
+	     double *,
+	     fortranint_t *,
+	     fortranint_t *,
+	     double *,
+	     fortranint_t *,
+	     fortranint_t *);
 
 void
 efp_dgemm(char transa, char transb, fortranint_t m, fortranint_t n,
@@ -72,27 +101,56 @@ efp_dgemm(char transa, char transb, fortranint_t m, fortranint_t n,
 
 fortranint_t
 efp_dsyev(char jobz, char uplo, fortranint_t n, double *a, fortranint_t lda,
-    double *w)
+    double *w, double *work, fortranint_t lwork)
 {
-	fortranint_t info, lwork;
-	double *work;
-
-	lwork = n * n;
-	work = (double *)malloc(lwork * sizeof *work);
+	fortranint_t info;
 
 	dsyev_(&jobz, &uplo, &n, a, &lda, w, work, &lwork, &info);
 
-	free(work);
 	return info;
 }
 
 fortranint_t
-efp_dgesv(fortranint_t n, fortranint_t nrhs, double *a, fortranint_t lda,
-    fortranint_t *ipiv, double *b, fortranint_t ldb)
+efp_dgetrf(fortranint_t m, fortranint_t n, double *a, fortranint_t lda,
+    fortranint_t *ipiv)
+{
+	fortranint_t info;
+
+	dgetrf_(&m, &n, a, &lda, ipiv, &info);
+
+	return info;
+}
+
+fortranint_t
+efp_dgetrs(char trans, fortranint_t n, fortranint_t nrhs, double *a,
+    fortranint_t lda, fortranint_t *ipiv, double *b, fortranint_t ldb)
+{
+	fortranint_t info;
+
+	dgetrs_(&trans, &n, &nrhs, a, &lda, ipiv, b, &ldb, &info);
+
+	return info;
+}
+
+fortranint_t
+efp_dgbtrf(fortranint_t m, fortranint_t n, fortranint_t kl, fortranint_t ku,
+    double *ab, fortranint_t ldab, fortranint_t *ipiv)
+{
+	fortranint_t info;
+
+	dgbtrf_(&m, &n, &kl, &ku, ab, &ldab, ipiv, &info);
+
+	return info;
+}
+
+fortranint_t
+efp_dgbtrs(char trans, fortranint_t n, fortranint_t kl, fortranint_t ku,
+    fortranint_t nrhs, double *ab, fortranint_t ldab, fortranint_t *ipiv,
+    double *b, fortranint_t ldb)
 {
 	fortranint_t info;
 
-	dgesv_(&n, &nrhs, a, &lda, ipiv, b, &ldb, &info);
+	dgbtrs_(&trans, &n, &kl, &ku, &nrhs, ab, &ldab, ipiv, b, &ldb, &info);
 
 	return info;
 }
@@ -51,15 +51,43 @@ fortranint_t efp_dsyev(char,
 		       char,
 		       fortranint_t,
 		       double *,
-		       fortranint_t,
-		       double *);
-
-fortranint_t efp_dgesv(fortranint_t,
 		       fortranint_t,
 		       double *,
-		       fortranint_t,
-		       fortranint_t *,
 		       double *,
 		       fortranint_t);
 
+fortranint_t efp_dgetrf(fortranint_t,
+			fortranint_t,
+			double *,
+			fortranint_t,
+			fortranint_t *);
+
+fortranint_t efp_dgetrs(char,
+			fortranint_t,
+			fortranint_t,
+			double *,
+			fortranint_t,
+			fortranint_t *,
+			double *,
+			fortranint_t);
+
+fortranint_t efp_dgbtrf(fortranint_t,
+			fortranint_t,
+			fortranint_t,
+			fortranint_t,
+			double *,
+			fortranint_t,
+			fortranint_t *);
+
+fortranint_t efp_dgbtrs(char,
+			fortranint_t,
+			fortranint_t,
+			fortranint_t,
+			fortranint_t,
+			double *,
+			fortranint_t,
+			fortranint_t *,
+			double *,
+			fortranint_t);
+
 #endif /* LIBEFP_CLAPACK_H */
@@ -98,11 +98,11 @@ disp_tt(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx, size_t pt_i_idx,
 			g * dr.z * swf->swf
 		};
 
-		efp_add_force(efp->grad + fr_i_idx, CVEC(fr_i->x),
+		efp_add_force(efp, fr_i_idx, CVEC(fr_i->x),
 		    CVEC(pt_i->x), &force, NULL);
-		efp_sub_force(efp->grad + fr_j_idx, CVEC(fr_j->x),
+		efp_sub_force(efp, fr_j_idx, CVEC(fr_j->x),
 		    CVEC(pt_j->x), &force, NULL);
-		efp_add_stress(&swf->dr, &force, &efp->stress);
+		efp_add_stress(efp, &swf->dr, &force);
 	}
 	return energy;
 }
@@ -171,11 +171,9 @@ disp_overlap(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
 		    t2 * (ds_ij.y * swf->dr.x - ds_ij.x * swf->dr.y) +
 		    t2 * ds_ij.c);
 
-		six_atomic_add_xyz(efp->grad + fr_i_idx, &force);
-		six_atomic_add_abc(efp->grad + fr_i_idx, &torque_i);
-		six_atomic_sub_xyz(efp->grad + fr_j_idx, &force);
-		six_atomic_sub_abc(efp->grad + fr_j_idx, &torque_j);
-		efp_add_stress(&swf->dr, &force, &efp->stress);
+		efp_add_grad(efp, fr_i_idx, &force, &torque_i);
+		efp_sub_grad(efp, fr_j_idx, &force, &torque_j);
+		efp_add_stress(efp, &swf->dr, &force);
 	}
 	return energy;
 }
@@ -214,11 +212,11 @@ disp_off(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx, size_t pt_i_idx,
 			g * dr.z * swf->swf
 		};
 
-		efp_add_force(efp->grad + fr_i_idx, CVEC(fr_i->x),
+		efp_add_force(efp, fr_i_idx, CVEC(fr_i->x),
 		    CVEC(pt_i->x), &force, NULL);
-		efp_sub_force(efp->grad + fr_j_idx, CVEC(fr_j->x),
+		efp_sub_force(efp, fr_j_idx, CVEC(fr_j->x),
 		    CVEC(pt_j->x), &force, NULL);
-		efp_add_stress(&swf->dr, &force, &efp->stress);
+		efp_add_stress(efp, &swf->dr, &force);
 	}
 	return energy;
 }
@@ -230,22 +228,16 @@ point_point_disp(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
 	struct frag *fr_i = efp->frags + fr_i_idx;
 	struct frag *fr_j = efp->frags + fr_j_idx;
 
-	const struct dynamic_polarizable_pt *pt_i =
-	    fr_i->dynamic_polarizable_pts + pt_i_idx;
-	const struct dynamic_polarizable_pt *pt_j =
-	    fr_j->dynamic_polarizable_pts + pt_j_idx;
+	const double *tr_i = fr_i->lib->disp_traces + 12 * pt_i_idx;
+	const double *tr_j = fr_j->lib->disp_traces + 12 * pt_j_idx;
 
 	double sum = 0.0;
 
-	for (size_t k = 0; k < ARRAY_SIZE(weights); k++) {
-		double tr_i = (pt_i->tensor[k].xx +
-			       pt_i->tensor[k].yy +
-			       pt_i->tensor[k].zz) / 3;
-		double tr_j = (pt_j->tensor[k].xx +
-			       pt_j->tensor[k].yy +
-			       pt_j->tensor[k].zz) / 3;
-		sum += weights[k] * tr_i * tr_j;
-	}
+#ifdef _OPENMP
+#pragma omp simd reduction(+:sum)
+#endif
+	for (size_t k = 0; k < ARRAY_SIZE(weights); k++)
+		sum += weights[k] * tr_i[k] * tr_j[k];
 
 	switch (efp->opts.disp_damp) {
 	case EFP_DISP_DAMP_TT:
@@ -288,7 +280,7 @@ efp_frag_frag_disp(struct efp *efp, size_t frag_i, size_t frag_j,
 	for (size_t ii = 0, idx = 0; ii < n_disp_i; ii++)
 		for (size_t jj = 0; jj < n_disp_j; jj++, idx++)
 			energy += point_point_disp(efp, frag_i, frag_j, ii, jj,
-			    s[idx], ds[idx], &swf);
+			    s ? s[idx] : 0.0, ds ? ds[idx] : six_zero, &swf);
 
 	vec_t force = {
 		swf.dswf.x * energy,
@@ -296,9 +288,9 @@ efp_frag_frag_disp(struct efp *efp, size_t frag_i, size_t frag_j,
 		swf.dswf.z * energy
 	};
 
-	six_atomic_add_xyz(efp->grad + frag_i, &force);
-	six_atomic_sub_xyz(efp->grad + frag_j, &force);
-	efp_add_stress(&swf.dr, &force, &efp->stress);
+	efp_add_grad(efp, frag_i, &force, NULL);
+	efp_sub_grad(efp, frag_j, &force, NULL);
+	efp_add_stress(efp, &swf.dr, &force);
 
 	return energy * swf.swf;
 }
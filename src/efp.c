@@ -27,6 +27,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef EFP_USE_MPI
+#include <mpi.h>
+#endif
+
 #include "balance.h"
 #include "clapack.h"
 #include "elec.h"
@@ -127,17 +135,21 @@ free_frag(struct frag *frag)
 
 	free(frag->atoms);
 	free(frag->multipole_pts);
+	free(frag->multipole_soa.x);
 	free(frag->polarizable_pts);
 	free(frag->dynamic_polarizable_pts);
+	free(frag->disp_traces);
 	free(frag->lmo_centroids);
 	free(frag->xr_fock_mat);
 	free(frag->xr_wf);
 	free(frag->xrfit);
+	free(frag->xr_tails);
+	efp_free_xr_basis(&frag->xr_basis);
 	free(frag->screen_params);
 	free(frag->ai_screen_params);
 
-	for (size_t i = 0; i < 3; i++)
-		free(frag->xr_wf_deriv[i]);
+	/* all three derivatives share one allocation */
+	free(frag->xr_wf_deriv[0]);
 
 	for (size_t i = 0; i < frag->n_xr_atoms; i++) {
 		for (size_t j = 0; j < frag->xr_atoms[i].n_shells; j++)
@@ -151,43 +163,50 @@ free_frag(struct frag *frag)
 }
 
 static enum efp_result
-copy_frag(struct frag *dest, const struct frag *src)
+copy_frag(struct efp *efp, struct frag *dest, const struct frag *src)
 {
 	size_t size;
 
 	memcpy(dest, src, sizeof(*dest));
 
+	/* basis is shared with the library fragment */
+	memset(&dest->xr_basis, 0, sizeof(dest->xr_basis));
+	memset(&dest->multipole_soa, 0, sizeof(dest->multipole_soa));
+
+	/* polarizability traces do not depend on orientation */
+	dest->disp_traces = NULL;
+
 	if (src->atoms) {
 		size = src->n_atoms * sizeof(struct efp_atom);
-		dest->atoms = (struct efp_atom *)malloc(size);
+		dest->atoms = (struct efp_atom *)efp_malloc(efp, size);
 		if (!dest->atoms)
 			return EFP_RESULT_NO_MEMORY;
 		memcpy(dest->atoms, src->atoms, size);
 	}
 	if (src->multipole_pts) {
 		size = src->n_multipole_pts * sizeof(struct multipole_pt);
-		dest->multipole_pts = (struct multipole_pt *)malloc(size);
+		dest->multipole_pts = (struct multipole_pt *)efp_malloc(efp, size);
 		if (!dest->multipole_pts)
 			return EFP_RESULT_NO_MEMORY;
 		memcpy(dest->multipole_pts, src->multipole_pts, size);
 	}
 	if (src->screen_params) {
 		size = src->n_multipole_pts * sizeof(double);
-		dest->screen_params = (double *)malloc(size);
+		dest->screen_params = (double *)efp_malloc(efp, size);
 		if (!dest->screen_params)
 			return EFP_RESULT_NO_MEMORY;
 		memcpy(dest->screen_params, src->screen_params, size);
 	}
 	if (src->ai_screen_params) {
 		size = src->n_multipole_pts * sizeof(double);
-		dest->ai_screen_params = (double *)malloc(size);
+		dest->ai_screen_params = (double *)efp_malloc(efp, size);
 		if (!dest->ai_screen_params)
 			return EFP_RESULT_NO_MEMORY;
 		memcpy(dest->ai_screen_params, src->ai_screen_params, size);
 	}
 	if (src->polarizable_pts) {
 		size = src->n_polarizable_pts * sizeof(struct polarizable_pt);
-		dest->polarizable_pts = (struct polarizable_pt *)malloc(size);
+		dest->polarizable_pts = (struct polarizable_pt *)efp_malloc(efp, size);
 		if (!dest->polarizable_pts)
 			return EFP_RESULT_NO_MEMORY;
 		memcpy(dest->polarizable_pts, src->polarizable_pts, size);
@@ -196,7 +215,7 @@ copy_frag(struct frag *dest, const struct frag *src)
 		size = src->n_dynamic_polarizable_pts *
 				sizeof(struct dynamic_polarizable_pt);
 		dest->dynamic_polarizable_pts =
-				(struct dynamic_polarizable_pt *)malloc(size);
+				(struct dynamic_polarizable_pt *)efp_malloc(efp, size);
 		if (!dest->dynamic_polarizable_pts)
 			return EFP_RESULT_NO_MEMORY;
 		memcpy(dest->dynamic_polarizable_pts,
@@ -204,14 +223,14 @@ copy_frag(struct frag *dest, const struct frag *src)
 	}
 	if (src->lmo_centroids) {
 		size = src->n_lmo * sizeof(vec_t);
-		dest->lmo_centroids = (vec_t *)malloc(size);
+		dest->lmo_centroids = (vec_t *)efp_malloc(efp, size);
 		if (!dest->lmo_centroids)
 			return EFP_RESULT_NO_MEMORY;
 		memcpy(dest->lmo_centroids, src->lmo_centroids, size);
 	}
 	if (src->xr_atoms) {
 		size = src->n_xr_atoms * sizeof(struct xr_atom);
-		dest->xr_atoms = (struct xr_atom *)malloc(size);
+		dest->xr_atoms = (struct xr_atom *)efp_malloc(efp, size);
 		if (!dest->xr_atoms)
 			return EFP_RESULT_NO_MEMORY;
 		memcpy(dest->xr_atoms, src->xr_atoms, size);
@@ -221,7 +240,7 @@ copy_frag(struct frag *dest, const struct frag *src)
 			struct xr_atom *at_dest = dest->xr_atoms + j;
 
 			size = at_src->n_shells * sizeof(struct shell);
-			at_dest->shells = (struct shell *)malloc(size);
+			at_dest->shells = (struct shell *)efp_malloc(efp, size);
 			if (!at_dest->shells)
 				return EFP_RESULT_NO_MEMORY;
 			memcpy(at_dest->shells, at_src->shells, size);
@@ -230,7 +249,7 @@ copy_frag(struct frag *dest, const struct frag *src)
 				size = (at_src->shells[i].type == 'L' ? 3 : 2) *
 				    at_src->shells[i].n_funcs * sizeof(double);
 				at_dest->shells[i].coef =
-				    (double *)malloc(size);
+				    (double *)efp_malloc(efp, size);
 				if (!at_dest->shells[i].coef)
 					return EFP_RESULT_NO_MEMORY;
 				memcpy(at_dest->shells[i].coef,
@@ -240,21 +259,21 @@ copy_frag(struct frag *dest, const struct frag *src)
 	}
 	if (src->xr_fock_mat) {
 		size = src->n_lmo * (src->n_lmo + 1) / 2 * sizeof(double);
-		dest->xr_fock_mat = (double *)malloc(size);
+		dest->xr_fock_mat = (double *)efp_malloc(efp, size);
 		if (!dest->xr_fock_mat)
 			return EFP_RESULT_NO_MEMORY;
 		memcpy(dest->xr_fock_mat, src->xr_fock_mat, size);
 	}
 	if (src->xr_wf) {
 		size = src->n_lmo * src->xr_wf_size * sizeof(double);
-		dest->xr_wf = (double *)malloc(size);
+		dest->xr_wf = (double *)efp_malloc(efp, size);
 		if (!dest->xr_wf)
 			return EFP_RESULT_NO_MEMORY;
 		memcpy(dest->xr_wf, src->xr_wf, size);
 	}
 	if (src->xrfit) {
 		size = src->n_lmo * 4 * sizeof(double);
-		dest->xrfit = (double *)malloc(size);
+		dest->xrfit = (double *)efp_malloc(efp, size);
 		if (!dest->xrfit)
 			return EFP_RESULT_NO_MEMORY;
 		memcpy(dest->xrfit, src->xrfit, size);
@@ -262,6 +281,51 @@ copy_frag(struct frag *dest, const struct frag *src)
 	return EFP_RESULT_SUCCESS;
 }
 
+static enum efp_result
+skiplist_add(struct efp *efp, size_t i, size_t idx)
+{
+	struct skip_list *list = efp->skiplist + i;
+	size_t pos;
+
+	if (efp_skiplist_find(list, idx, &pos))
+		return EFP_RESULT_SUCCESS;
+
+	if (list->n == list->size) {
+		size_t size = list->size ? 2 * list->size : 4;
+		size_t *ptr;
+
+		ptr = (size_t *)efp_realloc(efp, list->idx,
+		    size * sizeof(size_t));
+		if (ptr == NULL)
+			return EFP_RESULT_NO_MEMORY;
+
+		list->idx = ptr;
+		list->size = size;
+	}
+	memmove(list->idx + pos + 1, list->idx + pos,
+	    (list->n - pos) * sizeof(size_t));
+	list->idx[pos] = idx;
+	list->n++;
+	efp->n_skipped++;
+
+	return EFP_RESULT_SUCCESS;
+}
+
+static void
+skiplist_remove(struct efp *efp, size_t i, size_t idx)
+{
+	struct skip_list *list = efp->skiplist + i;
+	size_t pos;
+
+	if (!efp_skiplist_find(list, idx, &pos))
+		return;
+
+	memmove(list->idx + pos, list->idx + pos + 1,
+	    (list->n - pos - 1) * sizeof(size_t));
+	list->n--;
+	efp->n_skipped--;
+}
+
 static enum efp_result
 check_opts(const struct efp_opts *opts)
 {
@@ -286,6 +350,64 @@ check_opts(const struct efp_opts *opts)
 			efp_log("interaction cutoff is too small");
 			return EFP_RESULT_FATAL;
 		}
+		if (opts->nblist_skin < 0.0) {
+			efp_log("neighbor list skin distance is negative");
+			return EFP_RESULT_FATAL;
+		}
+	}
+	if (opts->enable_pme) {
+		if (!opts->enable_pbc) {
+			efp_log("particle mesh Ewald requires periodic "
+			    "boundary conditions");
+			return EFP_RESULT_FATAL;
+		}
+		if (opts->pol_driver == EFP_POL_DRIVER_DIRECT) {
+			efp_log("particle mesh Ewald is not compatible with "
+			    "direct polarization driver");
+			return EFP_RESULT_FATAL;
+		}
+		if (opts->pme_alpha < 0.0 || opts->pme_spacing < 0.0) {
+			efp_log("particle mesh Ewald parameters are negative");
+			return EFP_RESULT_FATAL;
+		}
+		if (opts->pme_order != 0 && (opts->pme_order < PME_MIN_ORDER ||
+		    opts->pme_order > PME_MAX_ORDER)) {
+			efp_log("particle mesh Ewald interpolation order "
+			    "must be from %d to %d", PME_MIN_ORDER,
+			    PME_MAX_ORDER);
+			return EFP_RESULT_FATAL;
+		}
+	}
+	if (opts->enable_fmm) {
+		if (opts->enable_pbc) {
+			efp_log("fast multipole method is not compatible with "
+			    "periodic boundary conditions");
+			return EFP_RESULT_FATAL;
+		}
+		if (opts->pol_driver == EFP_POL_DRIVER_DIRECT) {
+			efp_log("fast multipole method is not compatible with "
+			    "direct polarization driver");
+			return EFP_RESULT_FATAL;
+		}
+		if (opts->fmm_order != 0 && (opts->fmm_order < FMM_MIN_ORDER ||
+		    opts->fmm_order > FMM_MAX_ORDER)) {
+			efp_log("fast multipole method expansion order must "
+			    "be from %d to %d", FMM_MIN_ORDER, FMM_MAX_ORDER);
+			return EFP_RESULT_FATAL;
+		}
+		if (opts->fmm_theta < 0.0 || opts->fmm_theta >= 1.0) {
+			efp_log("fast multipole method opening angle must be "
+			    "less than one");
+			return EFP_RESULT_FATAL;
+		}
+	}
+	if (opts->pol_scf_tol < 0.0) {
+		efp_log("polarization convergence threshold is negative");
+		return EFP_RESULT_FATAL;
+	}
+	if (opts->xr_screen_tol < 0.0) {
+		efp_log("exchange repulsion screening tolerance is negative");
+		return EFP_RESULT_FATAL;
 	}
 	return EFP_RESULT_SUCCESS;
 }
@@ -346,10 +468,11 @@ check_params(struct efp *efp)
 	return EFP_RESULT_SUCCESS;
 }
 
+/* with fast multipole method electrostatics is computed separately */
 static int
 do_elec(const struct efp_opts *opts)
 {
-	return opts->terms & EFP_TERM_ELEC;
+	return (opts->terms & EFP_TERM_ELEC) && !opts->enable_fmm;
 }
 
 static int
@@ -369,54 +492,160 @@ do_xr(const struct efp_opts *opts)
 	return xr || cp || dd;
 }
 
+static void
+get_pair_energy(struct efp *efp, size_t i, size_t j,
+    struct pair_energy *energy)
+{
+	double *s = NULL;
+	six_t *ds = NULL;
+	size_t n_lmo_ij = efp->frags[i].n_lmo * efp->frags[j].n_lmo;
+
+	memset(energy, 0, sizeof(*energy));
+
+	if (do_xr(&efp->opts)) {
+		if (efp_xr_screen(efp, i, j)) {
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+			efp->n_xr_screened++;
+		} else {
+			s = (double *)efp_scratch_alloc(efp,
+			    n_lmo_ij * sizeof(double));
+			ds = (six_t *)efp_scratch_alloc(efp,
+			    n_lmo_ij * sizeof(six_t));
+			memset(ds, 0, n_lmo_ij * sizeof(six_t));
+
+			efp_frag_frag_xr(efp, i, j, s, ds,
+			    &energy->exchange_repulsion,
+			    &energy->charge_penetration);
+		}
+	}
+	if (do_elec(&efp->opts))
+		energy->electrostatic = efp_frag_frag_elec(efp, i, j);
+	if (do_disp(&efp->opts))
+		energy->dispersion = efp_frag_frag_disp(efp, i, j, s, ds);
+
+	efp_scratch_free(efp, ds);
+	efp_scratch_free(efp, s);
+}
+
+/* Returns the number of stored pair energies. With cutoff only pairs of the
+ * neighbor list are stored. */
+static size_t
+get_pair_count(const struct efp *efp)
+{
+	if (efp->opts.enable_cutoff)
+		return efp->nblist.offset[efp->n_frag];
+
+	return efp->n_frag * (efp->n_frag - 1) / 2;
+}
+
+/* Returns stored energy of pair (i, j). Without cutoff pairs are packed in
+ * the upper triangle, with cutoff each pair is stored at the neighbor list
+ * entry of the fragment which owns it. Returns NULL for pairs which are not
+ * in the neighbor list. */
+static struct pair_energy *
+get_pair_slot(struct efp *efp, size_t i, size_t j)
+{
+	size_t lo = i < j ? i : j;
+	size_t hi = i < j ? j : i;
+	size_t pos;
+
+	if (efp->opts.enable_cutoff) {
+		if (!efp_nblist_owns_pair(efp->n_frag, i, j))
+			return get_pair_slot(efp, j, i);
+		if (!efp_nblist_find(&efp->nblist, i, j, &pos))
+			return NULL;
+		return efp->pair_energy + pos;
+	}
+	return efp->pair_energy + lo * efp->n_frag - lo * (lo + 1) / 2 +
+	    hi - lo - 1;
+}
+
+static enum efp_result
+reserve_pair_energy(struct efp *efp)
+{
+	size_t n_pairs = get_pair_count(efp);
+
+	if (n_pairs > efp->pair_energy_size || efp->pair_energy == NULL) {
+		free(efp->pair_energy);
+		efp->pair_energy = (struct pair_energy *)efp_malloc(efp,
+		    (n_pairs + 1) * sizeof(struct pair_energy));
+		efp->pair_energy_size = 0;
+		efp->pair_energy_valid = 0;
+		if (efp->pair_energy == NULL)
+			return EFP_RESULT_NO_MEMORY;
+		efp->pair_energy_size = n_pairs;
+	}
+	memset(efp->pair_energy, 0, n_pairs * sizeof(struct pair_energy));
+	return EFP_RESULT_SUCCESS;
+}
+
+static void
+compute_two_body_pair(struct efp *efp, size_t i, size_t j, double *e_elec,
+    double *e_disp, double *e_xr, double *e_cp)
+{
+	struct pair_energy energy;
+
+	get_pair_energy(efp, i, j, &energy);
+
+	*e_elec += energy.electrostatic;
+	*e_disp += energy.dispersion;
+	*e_xr += energy.exchange_repulsion;
+	*e_cp += energy.charge_penetration;
+
+	if (efp->keep_pair_energy)
+		*get_pair_slot(efp, i, j) = energy;
+}
+
 static void
 compute_two_body_range(struct efp *efp, size_t frag_from, size_t frag_to,
     void *data)
 {
 	double e_elec = 0.0, e_disp = 0.0, e_xr = 0.0, e_cp = 0.0;
+	const struct nblist *nblist = &efp->nblist;
 
 	(void)data;
 
+	efp_balance_order(efp->two_body_cost, frag_from, frag_to,
+	    efp->two_body_order);
+
 #ifdef _OPENMP
 #pragma omp parallel for schedule(dynamic) reduction(+:e_elec,e_disp,e_xr,e_cp)
 #endif
-	for (size_t i = frag_from; i < frag_to; i++) {
-		size_t cnt = efp->n_frag % 2 ? (efp->n_frag - 1) / 2 :
-		    i < efp->n_frag / 2 ? efp->n_frag / 2 :
-		    efp->n_frag / 2 - 1;
-
-		for (size_t j = i + 1; j < i + 1 + cnt; j++) {
-			size_t fr_j = j % efp->n_frag;
-
-			if (!efp_skip_frag_pair(efp, i, fr_j)) {
-				double *s;
-				six_t *ds;
-				size_t n_lmo_ij = efp->frags[i].n_lmo *
-				    efp->frags[fr_j].n_lmo;
-
-				s = (double *)calloc(n_lmo_ij, sizeof(double));
-				ds = (six_t *)calloc(n_lmo_ij, sizeof(six_t));
-
-				if (do_xr(&efp->opts)) {
-					double exr, ecp;
-
-					efp_frag_frag_xr(efp, i, fr_j,
-					    s, ds, &exr, &ecp);
-					e_xr += exr;
-					e_cp += ecp;
-				}
-				if (do_elec(&efp->opts)) {
-					e_elec += efp_frag_frag_elec(efp,
-					    i, fr_j);
-				}
-				if (do_disp(&efp->opts)) {
-					e_disp += efp_frag_frag_disp(efp,
-					    i, fr_j, s, ds);
-				}
-				free(s);
-				free(ds);
+	for (size_t ii = frag_from; ii < frag_to; ii++) {
+		size_t i = efp->two_body_order[ii];
+		double start = efp_wtime();
+
+		if (efp->opts.enable_cutoff) {
+			for (size_t k = nblist->offset[i];
+			    k < nblist->offset[i + 1]; k++) {
+				size_t j = nblist->idx[k];
+
+				if (!efp_nblist_owns_pair(efp->n_frag, i, j))
+					continue;
+				if (efp_skip_frag_pair(efp, i, j))
+					continue;
+
+				compute_two_body_pair(efp, i, j,
+				    &e_elec, &e_disp, &e_xr, &e_cp);
+			}
+		} else {
+			size_t cnt = efp->n_frag % 2 ? (efp->n_frag - 1) / 2 :
+			    i < efp->n_frag / 2 ? efp->n_frag / 2 :
+			    efp->n_frag / 2 - 1;
+
+			for (size_t j = i + 1; j < i + 1 + cnt; j++) {
+				size_t fr_j = j % efp->n_frag;
+
+				if (efp_skip_frag_pair(efp, i, fr_j))
+					continue;
+
+				compute_two_body_pair(efp, i, fr_j,
+				    &e_elec, &e_disp, &e_xr, &e_cp);
 			}
 		}
+		efp->two_body_time[i] = efp_wtime() - start;
 	}
 	efp->energy.electrostatic += e_elec;
 	efp->energy.dispersion += e_disp;
@@ -424,6 +653,131 @@ compute_two_body_range(struct efp *efp, size_t frag_from, size_t frag_to,
 	efp->energy.charge_penetration += e_cp;
 }
 
+#define N_COST_FEATURES 4
+
+/* Per-fragment features whose pairwise products approximate the relative
+ * cost of fragment-fragment terms. */
+static void
+get_cost_features(const struct efp *efp, const struct frag *frag, double *f)
+{
+	f[0] = do_xr(&efp->opts) ?
+	    (double)frag->xr_wf_size + (double)frag->n_lmo : 0.0;
+	f[1] = do_xr(&efp->opts) ? (double)frag->n_lmo : 0.0;
+	f[2] = do_elec(&efp->opts) ?
+	    (double)(frag->n_multipole_pts + frag->n_atoms) : 0.0;
+	f[3] = do_disp(&efp->opts) ?
+	    3.0 * (double)frag->n_dynamic_polarizable_pts : 0.0;
+}
+
+/* Estimates two-body work of each fragment from library parameters. Cost
+ * of a pair is the sum of products of fragment features. The features of
+ * all partners owned by a fragment are summed using the neighbor list or,
+ * without cutoff, prefix sums over the cyclic range of partners. */
+static enum efp_result
+estimate_two_body_cost(struct efp *efp)
+{
+	size_t n = efp->n_frag;
+	double (*prefix)[N_COST_FEATURES];
+
+	prefix = (double (*)[N_COST_FEATURES])efp_scratch_alloc(efp,
+	    (2 * n + 1) * sizeof(*prefix));
+	if (prefix == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	for (size_t k = 0; k < N_COST_FEATURES; k++)
+		prefix[0][k] = 0.0;
+
+	for (size_t i = 0; i < 2 * n; i++) {
+		double f[N_COST_FEATURES];
+
+		get_cost_features(efp, efp->frags + i % n, f);
+
+		for (size_t k = 0; k < N_COST_FEATURES; k++)
+			prefix[i + 1][k] = prefix[i][k] + f[k];
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		double f[N_COST_FEATURES], sum[N_COST_FEATURES];
+
+		get_cost_features(efp, efp->frags + i, f);
+
+		if (efp->opts.enable_cutoff) {
+			const struct nblist *nblist = &efp->nblist;
+
+			for (size_t k = 0; k < N_COST_FEATURES; k++)
+				sum[k] = 0.0;
+
+			for (size_t l = nblist->offset[i];
+			    l < nblist->offset[i + 1]; l++) {
+				size_t j = nblist->idx[l];
+
+				if (!efp_nblist_owns_pair(n, i, j))
+					continue;
+
+				for (size_t k = 0; k < N_COST_FEATURES; k++)
+					sum[k] += prefix[j + 1][k] - prefix[j][k];
+			}
+		} else {
+			size_t cnt = n % 2 ? (n - 1) / 2 :
+			    i < n / 2 ? n / 2 : n / 2 - 1;
+
+			for (size_t k = 0; k < N_COST_FEATURES; k++)
+				sum[k] = prefix[i + 1 + cnt][k] -
+				    prefix[i + 1][k];
+		}
+
+		efp->two_body_cost[i] = 0.0;
+
+		for (size_t k = 0; k < N_COST_FEATURES; k++)
+			efp->two_body_cost[i] += f[k] * sum[k];
+	}
+
+	efp_scratch_free(efp, prefix);
+	return EFP_RESULT_SUCCESS;
+}
+
+static enum efp_result
+compute_two_body(struct efp *efp)
+{
+	enum efp_result res;
+
+	if (!efp->two_body_cost_measured)
+		if ((res = estimate_two_body_cost(efp)))
+			return res;
+
+	memset(efp->two_body_time, 0, efp->n_frag * sizeof(double));
+	efp->n_xr_screened = 0;
+
+	if (efp->keep_pair_energy)
+		if ((res = reserve_pair_energy(efp)))
+			return res;
+
+	efp_balance_work_cost(efp, compute_two_body_range, NULL,
+	    efp->two_body_cost);
+
+	/* use measured timings to balance the next call */
+#ifdef EFP_USE_MPI
+	efp_allreduce(efp->two_body_time, efp->n_frag);
+
+	double n_xr_screened = (double)efp->n_xr_screened;
+	efp_allreduce(&n_xr_screened, 1);
+	efp->n_xr_screened = (size_t)n_xr_screened;
+
+	if (efp->keep_pair_energy)
+		efp_allreduce((double *)efp->pair_energy,
+		    get_pair_count(efp) * sizeof(struct pair_energy) /
+		    sizeof(double));
+#endif
+	memcpy(efp->two_body_cost, efp->two_body_time,
+	    efp->n_frag * sizeof(double));
+	efp->two_body_cost_measured = 1;
+
+	efp->pair_energy_valid = efp->keep_pair_energy;
+	memset(efp->frag_dirty, 0, efp->n_frag);
+
+	return EFP_RESULT_SUCCESS;
+}
+
 EFP_EXPORT enum efp_result
 efp_get_energy(struct efp *efp, struct efp_energy *energy)
 {
@@ -464,6 +818,7 @@ efp_get_atomic_gradient(struct efp *efp, double *grad)
 				 individual atom */
 	mat_t Id; /* Total inertia tensor of a fragment */
 	vec_t v, g; /* Principal axis and Inertia along that axis */
+	double work[9]; /* LAPACK work array */
 	vec_t rbuf, rbuf2, tq, ri, rt;
 	double dist, sina, ft, norm;
 	enum efp_result res;
@@ -486,15 +841,16 @@ efp_get_atomic_gradient(struct efp *efp, double *grad)
 
 	res = EFP_RESULT_NO_MEMORY;
 	/* Create and initialize some arrays for work */
-	if ((r = (vec_t *)malloc(maxa * sizeof(*r))) == NULL)
+	if ((r = (vec_t *)efp_malloc(efp, maxa * sizeof(*r))) == NULL)
 		goto error;
-	if ((m = (double *)malloc(maxa * sizeof(*m))) == NULL)
+	if ((m = (double *)efp_malloc(efp, maxa * sizeof(*m))) == NULL)
 		goto error;
-	if ((Ia = (double *)malloc(maxa * sizeof(*Ia))) == NULL)
+	if ((Ia = (double *)efp_malloc(efp, maxa * sizeof(*Ia))) == NULL)
 		goto error;
 
 	/* Copy computed efp->grad */
-	if ((efpgrad = (six_t *)malloc(efp->n_frag * sizeof(*efpgrad))) == NULL)
+	if ((efpgrad = (six_t *)efp_malloc(efp,
+	    efp->n_frag * sizeof(*efpgrad))) == NULL)
 		goto error;
 	memcpy(efpgrad, efp->grad, efp->n_frag * sizeof(*efpgrad));
 
@@ -529,7 +885,8 @@ efp_get_atomic_gradient(struct efp *efp, double *grad)
 		}
 
 		/* Try to diagonalize Id and get principal axis */
-		if (efp_dsyev('V', 'U', 3, (double *)&Id, 3, (double *)&g)) {
+		if (efp_dsyev('V', 'U', 3, (double *)&Id, 3, (double *)&g,
+		    work, 9)) {
 			efp_log("inertia tensor diagonalization failed");
 			res = EFP_RESULT_FATAL;
 			goto error;
@@ -618,6 +975,7 @@ efp_set_point_charges(struct efp *efp, size_t n_ptc, const double *ptc,
 {
 	assert(efp);
 	efp->n_ptc = n_ptc;
+	efp->elec_field_valid = 0;
 
 	if (n_ptc == 0) {
 		free(efp->ptc);
@@ -626,15 +984,32 @@ efp_set_point_charges(struct efp *efp, size_t n_ptc, const double *ptc,
 		efp->ptc = NULL;
 		efp->ptc_xyz = NULL;
 		efp->ptc_grad = NULL;
+		efp->ptc_size = 0;
 		return EFP_RESULT_SUCCESS;
 	}
 
 	assert(ptc);
 	assert(xyz);
 
-	efp->ptc = (double *)realloc(efp->ptc, n_ptc * sizeof(double));
-	efp->ptc_xyz = (vec_t *)realloc(efp->ptc_xyz, n_ptc * sizeof(vec_t));
-	efp->ptc_grad = (vec_t *)realloc(efp->ptc_grad, n_ptc * sizeof(vec_t));
+	/* charges are usually set for every geometry, arrays only grow */
+	if (n_ptc > efp->ptc_size) {
+		free(efp->ptc);
+		free(efp->ptc_xyz);
+		free(efp->ptc_grad);
+
+		efp->ptc_size = 0;
+		efp->ptc = (double *)efp_malloc(efp, n_ptc * sizeof(double));
+		efp->ptc_xyz = (vec_t *)efp_malloc(efp, n_ptc * sizeof(vec_t));
+		efp->ptc_grad = (vec_t *)efp_malloc(efp,
+		    n_ptc * sizeof(vec_t));
+
+		if (efp->ptc == NULL || efp->ptc_xyz == NULL ||
+		    efp->ptc_grad == NULL) {
+			efp->n_ptc = 0;
+			return EFP_RESULT_NO_MEMORY;
+		}
+		efp->ptc_size = n_ptc;
+	}
 
 	memcpy(efp->ptc, ptc, n_ptc * sizeof(double));
 	memcpy(efp->ptc_xyz, xyz, n_ptc * sizeof(vec_t));
@@ -685,6 +1060,7 @@ efp_set_point_charge_coordinates(struct efp *efp, const double *xyz)
 	assert(xyz);
 
 	memcpy(efp->ptc_xyz, xyz, efp->n_ptc * sizeof(vec_t));
+	efp->elec_field_valid = 0;
 	return EFP_RESULT_SUCCESS;
 }
 
@@ -705,6 +1081,7 @@ efp_set_point_charge_values(struct efp *efp, const double *ptc)
 	assert(ptc);
 
 	memcpy(efp->ptc, ptc, efp->n_ptc * sizeof(double));
+	efp->elec_field_valid = 0;
 	return EFP_RESULT_SUCCESS;
 }
 
@@ -742,6 +1119,7 @@ efp_set_frag_coordinates(struct efp *efp, size_t frag_idx,
     enum efp_coord_type coord_type, const double *coord)
 {
 	struct frag *frag;
+	enum efp_result res;
 
 	assert(efp);
 	assert(coord);
@@ -751,13 +1129,29 @@ efp_set_frag_coordinates(struct efp *efp, size_t frag_idx,
 
 	switch (coord_type) {
 	case EFP_COORD_TYPE_XYZABC:
-		return set_coord_xyzabc(frag, coord);
+		res = set_coord_xyzabc(frag, coord);
+		break;
 	case EFP_COORD_TYPE_POINTS:
-		return set_coord_points(frag, coord);
+		res = set_coord_points(frag, coord);
+		break;
 	case EFP_COORD_TYPE_ROTMAT:
-		return set_coord_rotmat(frag, coord);
+		res = set_coord_rotmat(frag, coord);
+		break;
+	default:
+		assert(0);
+		return EFP_RESULT_FATAL;
 	}
-	assert(0);
+	efp_nblist_check_frag(efp, frag_idx);
+	efp->pme.field_valid = 0;
+	efp->fmm.valid = 0;
+	efp->pol_cache.valid = 0;
+	efp->pol_direct.valid = 0;
+	efp->elec_field_valid = 0;
+
+	if (efp->frag_dirty)
+		efp->frag_dirty[frag_idx] = 1;
+
+	return res;
 }
 
 EFP_EXPORT enum efp_result
@@ -818,6 +1212,13 @@ efp_set_periodic_box(struct efp *efp, double x, double y, double z)
 		return EFP_RESULT_FATAL;
 	}
 
+	if (efp->box.x != x || efp->box.y != y || efp->box.z != z) {
+		efp->pair_energy_valid = 0;
+		efp->pol_cache.valid = 0;
+		efp->pol_direct.valid = 0;
+		efp->elec_field_valid = 0;
+	}
+
 	efp->box.x = x;
 	efp->box.y = y;
 	efp->box.z = z;
@@ -854,6 +1255,52 @@ efp_get_stress_tensor(struct efp *efp, double *stress)
 	return EFP_RESULT_SUCCESS;
 }
 
+EFP_EXPORT enum efp_result
+efp_get_nblist_build_count(struct efp *efp, size_t *n_builds)
+{
+	assert(efp);
+	assert(n_builds);
+
+	*n_builds = efp->nblist.n_builds;
+
+	return EFP_RESULT_SUCCESS;
+}
+
+EFP_EXPORT enum efp_result
+efp_get_xr_screen_count(struct efp *efp, size_t *n_pairs)
+{
+	assert(efp);
+	assert(n_pairs);
+
+	*n_pairs = efp->n_xr_screened;
+
+	return EFP_RESULT_SUCCESS;
+}
+
+EFP_EXPORT enum efp_result
+efp_get_pol_direct_info(struct efp *efp, size_t *size, double *time)
+{
+	assert(efp);
+	assert(size);
+	assert(time);
+
+	*size = efp->pol_direct.size;
+	*time = efp->pol_direct.time;
+
+	return EFP_RESULT_SUCCESS;
+}
+
+EFP_EXPORT enum efp_result
+efp_get_alloc_count(struct efp *efp, size_t *n_alloc)
+{
+	assert(efp);
+	assert(n_alloc);
+
+	*n_alloc = efp->n_alloc;
+
+	return EFP_RESULT_SUCCESS;
+}
+
 EFP_EXPORT enum efp_result
 efp_get_ai_screen(struct efp *efp, size_t frag_idx, double *screen)
 {
@@ -877,43 +1324,208 @@ efp_get_ai_screen(struct efp *efp, size_t frag_idx, double *screen)
 	return EFP_RESULT_SUCCESS;
 }
 
+static size_t
+get_max_threads(void)
+{
+#ifdef _OPENMP
+	return (size_t)omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+
+/* Returns the size of scratch memory needed by each thread to compute
+ * any fragment-fragment interaction. */
+static size_t
+get_pair_scratch_size(const struct efp *efp)
+{
+	size_t wf = 0, lmo = 0, atoms = 0, mult = 0;
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		if (frag->n_multipole_pts > mult)
+			mult = frag->n_multipole_pts;
+
+		if (frag->xr_wf_size > wf)
+			wf = frag->xr_wf_size;
+		if (frag->n_lmo > lmo)
+			lmo = frag->n_lmo;
+		if (frag->n_xr_atoms > atoms)
+			atoms = frag->n_xr_atoms;
+	}
+
+	/* overlap integrals and derivatives in compute_two_body_pair */
+	size_t size = efp_scratch_align(lmo * lmo * sizeof(double)) +
+	    efp_scratch_align(lmo * lmo * sizeof(six_t));
+
+	/* efp_frag_frag_xr */
+	size += efp_scratch_align(2 * wf * wf * sizeof(double)) +
+	    efp_scratch_align(2 * lmo * lmo * sizeof(double)) +
+	    efp_scratch_align(lmo * lmo * sizeof(double)) +
+	    efp_scratch_align(2 * lmo * wf * sizeof(double)) +
+	    efp_scratch_align(atoms * sizeof(struct xr_atom)) +
+	    efp_scratch_align(12 * wf * wf * sizeof(double)) +
+	    efp_scratch_align(12 * lmo * lmo * sizeof(double)) +
+	    efp_scratch_align(12 * lmo * wf * sizeof(double)) +
+	    efp_scratch_align(lmo * lmo * sizeof(six_t));
+
+	/* charge - charge damping factors in efp_frag_frag_elec */
+	size += 2 * efp_scratch_align(mult * sizeof(double));
+
+	/* thread-private fields in pair loops of polarization */
+	size += efp_scratch_align(2 * efp->n_polarizable_pts * sizeof(vec_t));
+
+	return size;
+}
+
+/* Returns the size of scratch memory needed by the master thread in
+ * addition to pair scratch memory. */
+static size_t
+get_master_scratch_size(const struct efp *efp)
+{
+	/* polarization work arrays, reciprocal space or far fields are
+	 * stored separately with particle mesh Ewald or fast multipole
+	 * method */
+	size_t n_pol = efp->opts.pol_driver == EFP_POL_DRIVER_KRYLOV ? 8 : 2;
+
+	if (efp->opts.enable_pme || efp->opts.enable_fmm)
+		n_pol += 2;
+
+	size_t pol = n_pol *
+	    efp_scratch_align(efp->n_polarizable_pts * sizeof(vec_t));
+
+	/* dipole updates and single precision corrections */
+	if (efp->opts.enable_pol_mixed_precision)
+		pol += 4 * efp_scratch_align(efp->n_polarizable_pts *
+		    sizeof(vec_t)) + 3 * efp_scratch_align(
+		    efp->n_polarizable_pts * 3 * sizeof(float));
+
+	/* two-body cost estimation */
+	size_t cost = efp_scratch_align((2 * efp->n_frag + 1) *
+	    N_COST_FEATURES * sizeof(double));
+
+	/* blocks of the ab initio dispersion contraction */
+	size_t ai_disp = efp->opts.terms & EFP_TERM_AI_DISP ?
+	    efp_scratch_align(AI_DISP_BLOCK * 12 * sizeof(double)) +
+	    efp_scratch_align(AI_DISP_BLOCK * 9 * sizeof(double)) : 0;
+
+	/* cell grid of the neighbor list build */
+	size_t nblist = efp->opts.enable_cutoff ?
+	    3 * efp_scratch_align(efp->n_frag * sizeof(size_t)) : 0;
+
+	/* octant assignment of the fast multipole method tree build */
+	size_t fmm = efp->opts.enable_fmm ?
+	    efp_scratch_align(2 * efp->n_frag * sizeof(size_t)) : 0;
+
+	/* work chunk bounds for MPI load balancing */
+	size_t chunks = efp_scratch_align((efp->n_frag + 1) * sizeof(int));
+
+	if (cost < ai_disp)
+		cost = ai_disp;
+	if (cost < nblist)
+		cost = nblist;
+	if (cost < fmm)
+		cost = fmm;
+
+	return (pol > cost ? pol : cost) + chunks;
+}
+
+/* Allocates scratch buffers for all threads. Buffers are kept across
+ * calls and are reallocated only if the number of threads grows. */
+static enum efp_result
+setup_scratch(struct efp *efp)
+{
+	size_t n_thr = get_max_threads();
+	size_t size = get_pair_scratch_size(efp);
+	struct scratch *scratch;
+
+	if (n_thr <= efp->n_scratch)
+		return EFP_RESULT_SUCCESS;
+
+	scratch = (struct scratch *)efp_realloc(efp, efp->scratch,
+	    n_thr * sizeof(struct scratch));
+	if (scratch == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	efp->scratch = scratch;
+
+	for (size_t i = efp->n_scratch; i < n_thr; i++) {
+		scratch[i].size = size;
+		scratch[i].used = 0;
+
+		if (i == 0)
+			scratch[i].size += get_master_scratch_size(efp);
+
+		scratch[i].buf = (char *)efp_malloc(efp, scratch[i].size);
+		if (scratch[i].buf == NULL)
+			return EFP_RESULT_NO_MEMORY;
+
+		efp->n_scratch = i + 1;
+	}
+	return EFP_RESULT_SUCCESS;
+}
+
 EFP_EXPORT enum efp_result
 efp_prepare(struct efp *efp)
 {
+	enum efp_result res;
+
 	assert(efp);
 
 	efp->n_polarizable_pts = 0;
 
+	for (size_t i = 0; i < efp->n_lib; i++)
+		if ((res = efp_setup_xr_screen(efp, efp->lib[i])))
+			return res;
+
 	for (size_t i = 0; i < efp->n_frag; i++) {
 		efp->frags[i].polarizable_offset = efp->n_polarizable_pts;
 		efp->n_polarizable_pts += efp->frags[i].n_polarizable_pts;
 	}
 
-	efp->indip = (vec_t *)calloc(efp->n_polarizable_pts, sizeof(vec_t));
-	efp->indipconj = (vec_t *)calloc(efp->n_polarizable_pts, sizeof(vec_t));
-	efp->grad = (six_t *)calloc(efp->n_frag, sizeof(six_t));
-	efp->skiplist = (char *)calloc(efp->n_frag * efp->n_frag, 1);
+	efp->indip = (vec_t *)efp_calloc(efp, efp->n_polarizable_pts,
+	    sizeof(vec_t));
+	efp->indipconj = (vec_t *)efp_calloc(efp, efp->n_polarizable_pts,
+	    sizeof(vec_t));
+	efp->grad = (six_t *)efp_calloc(efp, efp->n_frag, sizeof(six_t));
+	efp->two_body_cost = (double *)efp_calloc(efp, efp->n_frag,
+	    sizeof(double));
+	efp->two_body_time = (double *)efp_calloc(efp, efp->n_frag,
+	    sizeof(double));
+	efp->two_body_order = (size_t *)efp_calloc(efp, efp->n_frag,
+	    sizeof(size_t));
+	efp->frag_dirty = (char *)efp_calloc(efp, efp->n_frag, sizeof(char));
+
+	if (efp->two_body_cost == NULL || efp->two_body_time == NULL ||
+	    efp->two_body_order == NULL || efp->frag_dirty == NULL)
+		return EFP_RESULT_NO_MEMORY;
 
-	return EFP_RESULT_SUCCESS;
+	return setup_scratch(efp);
 }
 
 EFP_EXPORT enum efp_result
 efp_set_orbital_energies(struct efp *efp, size_t n_core, size_t n_act,
     size_t n_vir, const double *oe)
 {
+	double *ptr;
 	size_t size;
 
 	assert(efp);
 	assert(oe);
 
+	size = (n_core + n_act + n_vir) * sizeof(double);
+
+	/* stored energies stay valid if memory is short */
+	ptr = (double *)efp_realloc(efp, efp->ai_orbital_energies, size);
+	if (ptr == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	efp->ai_orbital_energies = ptr;
 	efp->n_ai_core = n_core;
 	efp->n_ai_act = n_act;
 	efp->n_ai_vir = n_vir;
 
-	size = (n_core + n_act + n_vir) * sizeof(double);
-
-	efp->ai_orbital_energies = (double *)realloc(efp->ai_orbital_energies,
-	    size);
 	memcpy(efp->ai_orbital_energies, oe, size);
 
 	return EFP_RESULT_SUCCESS;
@@ -923,19 +1535,32 @@ EFP_EXPORT enum efp_result
 efp_set_dipole_integrals(struct efp *efp, size_t n_core, size_t n_act,
     size_t n_vir, const double *dipint)
 {
+	double *ptr;
 	size_t size;
 
 	assert(efp);
 	assert(dipint);
 
+	/* only the occupied-virtual block is needed, stored integrals stay
+	 * valid if memory is short */
+	ptr = (double *)efp_realloc(efp, efp->ai_dipole_integrals,
+	    3 * (n_core + n_act) * n_vir * sizeof(double));
+	if (ptr == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	efp->ai_dipole_integrals = ptr;
 	efp->n_ai_core = n_core;
 	efp->n_ai_act = n_act;
 	efp->n_ai_vir = n_vir;
 
-	size = 3 * (n_core + n_act + n_vir) * (n_core + n_act + n_vir);
-	efp->ai_dipole_integrals = (double *)realloc(efp->ai_dipole_integrals,
-	    size * sizeof(double));
-	memcpy(efp->ai_dipole_integrals, dipint, size * sizeof(double));
+	size = n_core + n_act + n_vir;
+
+	for (size_t i = 0, idx = 0; i < n_core + n_act; i++)
+		for (size_t j = 0; j < n_vir; j++)
+			for (size_t a = 0; a < 3; a++, idx++)
+				efp->ai_dipole_integrals[idx] =
+				    dipint[a * size * size + i * size +
+				    n_core + n_act + j];
 
 	return EFP_RESULT_SUCCESS;
 }
@@ -943,6 +1568,8 @@ efp_set_dipole_integrals(struct efp *efp, size_t n_core, size_t n_act,
 EFP_EXPORT enum efp_result
 efp_get_wavefunction_dependent_energy(struct efp *efp, double *energy)
 {
+	enum efp_result res;
+
 	assert(efp);
 	assert(energy);
 
@@ -951,7 +1578,93 @@ efp_get_wavefunction_dependent_energy(struct efp *efp, double *energy)
 		*energy = 0.0;
 		return EFP_RESULT_SUCCESS;
 	}
-	return efp_compute_pol_energy(efp, energy);
+
+	/* if nothing has moved since the last call induced dipoles from the
+	 * previous scf iteration are used as initial guess */
+	efp->pol_guess = efp->elec_field_valid;
+	res = efp_compute_pol_energy(efp, energy);
+	efp->pol_guess = 0;
+
+	return res;
+}
+
+static void
+update_total_energy(struct efp_energy *energy)
+{
+	energy->total = energy->electrostatic +
+			energy->charge_penetration +
+			energy->electrostatic_point_charges +
+			energy->polarization +
+			energy->dispersion +
+			energy->ai_dispersion +
+			energy->exchange_repulsion;
+}
+
+static enum efp_result
+setup_thread_grad(struct efp *efp)
+{
+	size_t n_thr = get_max_threads();
+
+	if (n_thr != efp->n_thr || efp->n_ptc != efp->n_thr_ptc) {
+		free(efp->thr_grad);
+		free(efp->thr_stress);
+		free(efp->thr_ptc_grad);
+
+		efp->n_thr = 0;
+		efp->n_thr_ptc = 0;
+		efp->thr_grad = (six_t *)efp_malloc(efp, n_thr * efp->n_frag *
+		    sizeof(six_t));
+		efp->thr_stress = (mat_t *)efp_malloc(efp,
+		    n_thr * sizeof(mat_t));
+		efp->thr_ptc_grad = (vec_t *)efp_malloc(efp,
+		    n_thr * efp->n_ptc * sizeof(vec_t));
+
+		if (efp->thr_grad == NULL || efp->thr_stress == NULL ||
+		    (efp->n_ptc > 0 && efp->thr_ptc_grad == NULL))
+			return EFP_RESULT_NO_MEMORY;
+
+		efp->n_thr = n_thr;
+		efp->n_thr_ptc = efp->n_ptc;
+	}
+
+	memset(efp->thr_grad, 0, efp->n_thr * efp->n_frag * sizeof(six_t));
+	memset(efp->thr_stress, 0, efp->n_thr * sizeof(mat_t));
+
+	if (efp->n_ptc > 0)
+		memset(efp->thr_ptc_grad, 0,
+		    efp->n_thr * efp->n_ptc * sizeof(vec_t));
+
+	return EFP_RESULT_SUCCESS;
+}
+
+static void
+reduce_thread_grad(struct efp *efp)
+{
+	double *grad = (double *)efp->grad;
+	double *ptc_grad = (double *)efp->ptc_grad;
+	const double *thr_grad = (const double *)efp->thr_grad;
+	const double *thr_ptc_grad = (const double *)efp->thr_ptc_grad;
+	size_t n_grad = 6 * efp->n_frag;
+	size_t n_ptc_grad = 3 * efp->n_ptc;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (size_t i = 0; i < n_grad; i++)
+		for (size_t t = 0; t < efp->n_thr; t++)
+			grad[i] += thr_grad[t * n_grad + i];
+
+	for (size_t i = 0; i < n_ptc_grad; i++)
+		for (size_t t = 0; t < efp->n_thr; t++)
+			ptc_grad[i] += thr_ptc_grad[t * n_ptc_grad + i];
+
+	for (size_t t = 0; t < efp->n_thr; t++) {
+		double *stress = (double *)&efp->stress;
+		const double *thr_stress = (const double *)(efp->thr_stress + t);
+
+		for (size_t i = 0; i < 9; i++)
+			stress[i] += thr_stress[i];
+	}
 }
 
 EFP_EXPORT enum efp_result
@@ -976,7 +1689,31 @@ efp_compute(struct efp *efp, int do_gradient)
 	memset(efp->grad, 0, efp->n_frag * sizeof(six_t));
 	memset(efp->ptc_grad, 0, efp->n_ptc * sizeof(vec_t));
 
-	efp_balance_work(efp, compute_two_body_range, NULL);
+	if (efp->opts.enable_cutoff)
+		if ((res = efp_nblist_update(efp, &efp->nblist)))
+			return res;
+
+	if (efp->opts.enable_pme)
+		if ((res = efp_pme_update(efp, &efp->pme)))
+			return res;
+
+	if (efp->opts.enable_fmm)
+		if ((res = efp_fmm_update(efp, &efp->fmm)))
+			return res;
+
+	if ((res = setup_scratch(efp)))
+		return res;
+
+	if (efp->do_gradient)
+		if ((res = setup_thread_grad(efp)))
+			return res;
+
+	if ((res = compute_two_body(efp)))
+		return res;
+	if ((res = efp_compute_elec_pme(efp)))
+		return res;
+	if ((res = efp_compute_elec_fmm(efp)))
+		return res;
 
 	if ((res = efp_compute_pol(efp)))
 		return res;
@@ -985,6 +1722,9 @@ efp_compute(struct efp *efp, int do_gradient)
 	if ((res = efp_compute_ai_disp(efp)))
 		return res;
 
+	if (efp->do_gradient)
+		reduce_thread_grad(efp);
+
 #ifdef EFP_USE_MPI
 	efp_allreduce(&efp->energy.electrostatic, 1);
 	efp_allreduce(&efp->energy.dispersion, 1);
@@ -997,17 +1737,190 @@ efp_compute(struct efp *efp, int do_gradient)
 		efp_allreduce((double *)&efp->stress, 9);
 	}
 #endif
-	efp->energy.total = efp->energy.electrostatic +
-			    efp->energy.charge_penetration +
-			    efp->energy.electrostatic_point_charges +
-			    efp->energy.polarization +
-			    efp->energy.dispersion +
-			    efp->energy.ai_dispersion +
-			    efp->energy.exchange_repulsion;
+	update_total_energy(&efp->energy);
 
 	return EFP_RESULT_SUCCESS;
 }
 
+/* Recomputes two-body energies of all pairs which involve moved fragments
+ * and updates the energy terms by the difference from the stored values.
+ * With cutoff only neighbor list partners of moved fragments are visited. */
+static enum efp_result
+compute_two_body_incremental(struct efp *efp)
+{
+	size_t n_frag = efp->n_frag;
+	size_t n_work = 0;
+	size_t *work;
+	struct pair_energy *pair, delta;
+	int rank = 0, size = 1;
+
+	for (size_t i = 0; i < n_frag; i++) {
+		const size_t *row;
+
+		if (efp->frag_dirty[i])
+			n_work += efp_nblist_get_row(efp, i, &row);
+	}
+
+	/* work item k is the pair of fragments work[2k] and work[2k+1], the
+	 * first of which has moved */
+	work = (size_t *)efp_malloc(efp, (2 * n_work + 1) * sizeof(size_t));
+	if (work == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	for (size_t i = 0, k = 0; i < n_frag; i++) {
+		const size_t *row;
+		size_t cnt;
+
+		if (!efp->frag_dirty[i])
+			continue;
+
+		cnt = efp_nblist_get_row(efp, i, &row);
+
+		for (size_t l = 0; l < cnt; l++, k++) {
+			work[2 * k] = i;
+			work[2 * k + 1] = row ? row[l] : l;
+		}
+	}
+
+	pair = (struct pair_energy *)efp_calloc(efp, n_work + 1, sizeof(*pair));
+	if (pair == NULL) {
+		free(work);
+		return EFP_RESULT_NO_MEMORY;
+	}
+
+#ifdef EFP_USE_MPI
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &size);
+#endif
+	efp->n_xr_screened = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (size_t k = (size_t)rank; k < n_work; k += (size_t)size) {
+		size_t i = work[2 * k];
+		size_t j = work[2 * k + 1];
+
+		/* pairs of two dirty fragments are computed once */
+		if (j == i || (efp->frag_dirty[j] && j < i))
+			continue;
+		if (efp_skip_frag_pair(efp, i, j))
+			continue;
+
+		/* same order of fragments as in the full pair loop */
+		if (efp_nblist_owns_pair(n_frag, i, j))
+			get_pair_energy(efp, i, j, pair + k);
+		else
+			get_pair_energy(efp, j, i, pair + k);
+	}
+
+#ifdef EFP_USE_MPI
+	efp_allreduce((double *)pair,
+	    n_work * sizeof(*pair) / sizeof(double));
+
+	double n_xr_screened = (double)efp->n_xr_screened;
+	efp_allreduce(&n_xr_screened, 1);
+	efp->n_xr_screened = (size_t)n_xr_screened;
+#endif
+	memset(&delta, 0, sizeof(delta));
+
+	for (size_t k = 0; k < n_work; k++) {
+		size_t i = work[2 * k];
+		size_t j = work[2 * k + 1];
+
+		if (j == i || (efp->frag_dirty[j] && j < i))
+			continue;
+
+		struct pair_energy *old = get_pair_slot(efp, i, j);
+
+		delta.electrostatic += pair[k].electrostatic -
+		    old->electrostatic;
+		delta.charge_penetration += pair[k].charge_penetration -
+		    old->charge_penetration;
+		delta.dispersion += pair[k].dispersion - old->dispersion;
+		delta.exchange_repulsion += pair[k].exchange_repulsion -
+		    old->exchange_repulsion;
+
+		*old = pair[k];
+	}
+
+	efp->energy.electrostatic += delta.electrostatic;
+	efp->energy.charge_penetration += delta.charge_penetration;
+	efp->energy.dispersion += delta.dispersion;
+	efp->energy.exchange_repulsion += delta.exchange_repulsion;
+
+	memset(efp->frag_dirty, 0, n_frag);
+
+	free(pair);
+	free(work);
+	return EFP_RESULT_SUCCESS;
+}
+
+EFP_EXPORT enum efp_result
+efp_compute_incremental(struct efp *efp)
+{
+	enum efp_result res;
+	size_t n_dirty = 0;
+
+	assert(efp);
+
+	if (efp->grad == NULL) {
+		efp_log("call efp_prepare after all fragments are added");
+		return EFP_RESULT_FATAL;
+	}
+
+	efp->keep_pair_energy = 1;
+
+	for (size_t i = 0; i < efp->n_frag; i++)
+		if (efp->frag_dirty[i])
+			n_dirty++;
+
+	/* full computation is cheaper if most of fragments have moved,
+	 * reciprocal space part of PME and far field of FMM are not
+	 * pairwise; stored energies follow the neighbor list so it must not
+	 * need a rebuild */
+	if (!efp->pair_energy_valid || 2 * n_dirty > efp->n_frag ||
+	    efp->opts.enable_pme || efp->opts.enable_fmm ||
+	    (efp->opts.enable_cutoff && !efp->nblist.valid))
+		return efp_compute(efp, 0);
+
+	efp->do_gradient = 0;
+
+	if ((res = check_params(efp)))
+		return res;
+	if ((res = setup_scratch(efp)))
+		return res;
+	if ((res = compute_two_body_incremental(efp)))
+		return res;
+
+	efp->energy.electrostatic_point_charges = 0.0;
+	efp->energy.ai_dispersion = 0.0;
+
+	efp->pol_guess = 1;
+	res = efp_compute_pol(efp);
+	efp->pol_guess = 0;
+
+	if (res)
+		return res;
+	if ((res = efp_compute_ai_elec(efp)))
+		return res;
+	if ((res = efp_compute_ai_disp(efp)))
+		return res;
+
+	update_total_energy(&efp->energy);
+
+	return EFP_RESULT_SUCCESS;
+}
+
+EFP_EXPORT enum efp_result
+efp_reset_pol_history(struct efp *efp)
+{
+	assert(efp);
+
+	efp->n_pol_history = 0;
+	return EFP_RESULT_SUCCESS;
+}
+
 EFP_EXPORT enum efp_result
 efp_get_frag_charge(struct efp *efp, size_t frag_idx, double *charge)
 {
@@ -1235,9 +2148,30 @@ efp_shutdown(struct efp *efp)
 	free(efp->ptc_grad);
 	free(efp->indip);
 	free(efp->indipconj);
+	free(efp->pol_history);
 	free(efp->ai_orbital_energies);
 	free(efp->ai_dipole_integrals);
-	free(efp->skiplist);
+	if (efp->skiplist) {
+		for (size_t i = 0; i < efp->n_frag; i++)
+			free(efp->skiplist[i].idx);
+		free(efp->skiplist);
+	}
+	efp_nblist_free(&efp->nblist);
+	efp_pme_free(&efp->pme);
+	efp_fmm_free(&efp->fmm);
+	efp_free_pol_cache(&efp->pol_cache);
+	efp_free_pol_direct(&efp->pol_direct);
+	free(efp->two_body_cost);
+	free(efp->two_body_time);
+	free(efp->two_body_order);
+	free(efp->thr_grad);
+	free(efp->thr_stress);
+	free(efp->thr_ptc_grad);
+	for (size_t i = 0; i < efp->n_scratch; i++)
+		free(efp->scratch[i].buf);
+	free(efp->scratch);
+	free(efp->pair_energy);
+	free(efp->frag_dirty);
 	free(efp);
 }
 
@@ -1252,6 +2186,17 @@ efp_set_opts(struct efp *efp, const struct efp_opts *opts)
 	if ((res = check_opts(opts)))
 		return res;
 
+	/* previous timings and pair energies are not valid for other
+	 * options */
+	if (memcmp(&efp->opts, opts, sizeof(*opts)) != 0) {
+		efp->two_body_cost_measured = 0;
+		efp->pair_energy_valid = 0;
+		efp->n_pol_history = 0;
+		efp->pol_cache.valid = 0;
+		efp->pol_direct.valid = 0;
+		efp->elec_field_valid = 0;
+	}
+
 	efp->opts = *opts;
 	return EFP_RESULT_SUCCESS;
 }
@@ -1274,6 +2219,7 @@ efp_opts_default(struct efp_opts *opts)
 	memset(opts, 0, sizeof(*opts));
 	opts->terms = EFP_TERM_ELEC | EFP_TERM_POL | EFP_TERM_DISP |
 	    EFP_TERM_XR | EFP_TERM_AI_ELEC | EFP_TERM_AI_POL;
+	opts->nblist_skin = 2.0;
 }
 
 EFP_EXPORT void
@@ -1290,7 +2236,7 @@ efp_add_fragment(struct efp *efp, const char *name)
 	assert(efp);
 	assert(name);
 
-	if (efp->skiplist) {
+	if (efp->grad) {
 		efp_log("cannot add fragments after efp_prepare");
 		return EFP_RESULT_FATAL;
 	}
@@ -1300,7 +2246,7 @@ efp_add_fragment(struct efp *efp, const char *name)
 	}
 
 	efp->n_frag++;
-	efp->frags = (struct frag *)realloc(efp->frags,
+	efp->frags = (struct frag *)efp_realloc(efp, efp->frags,
 	    efp->n_frag * sizeof(struct frag));
 	if (efp->frags == NULL)
 		return EFP_RESULT_NO_MEMORY;
@@ -1308,30 +2254,57 @@ efp_add_fragment(struct efp *efp, const char *name)
 	enum efp_result res;
 	struct frag *frag = efp->frags + efp->n_frag - 1;
 
-	if ((res = copy_frag(frag, lib)))
+	if ((res = copy_frag(efp, frag, lib)))
 		return res;
 
-	for (size_t a = 0; a < 3; a++) {
-		size_t size = frag->xr_wf_size * frag->n_lmo;
+	size_t size = frag->xr_wf_size * frag->n_lmo;
 
-		frag->xr_wf_deriv[a] = (double *)calloc(size, sizeof(double));
-		if (frag->xr_wf_deriv[a] == NULL)
-			return EFP_RESULT_NO_MEMORY;
-	}
-	return EFP_RESULT_SUCCESS;
+	frag->xr_wf_deriv[0] = (double *)efp_calloc(efp, 3 * size,
+	    sizeof(double));
+	if (frag->xr_wf_deriv[0] == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	frag->xr_wf_deriv[1] = frag->xr_wf_deriv[0] + size;
+	frag->xr_wf_deriv[2] = frag->xr_wf_deriv[0] + 2 * size;
+
+	return efp_setup_multipole_soa(efp, frag);
 }
 
 EFP_EXPORT enum efp_result
 efp_skip_fragments(struct efp *efp, size_t i, size_t j, int value)
 {
+	enum efp_result res;
+
 	assert(efp);
-	assert(efp->skiplist); /* call efp_prepare first */
+	assert(efp->grad); /* call efp_prepare first */
 	assert(i < efp->n_frag);
 	assert(j < efp->n_frag);
 
-	efp->skiplist[i * efp->n_frag + j] = value ? 1 : 0;
-	efp->skiplist[j * efp->n_frag + i] = value ? 1 : 0;
+	if (value) {
+		if (efp->skiplist == NULL) {
+			efp->skiplist = (struct skip_list *)efp_calloc(efp,
+			    efp->n_frag, sizeof(struct skip_list));
+			if (efp->skiplist == NULL)
+				return EFP_RESULT_NO_MEMORY;
+		}
+		int added = !efp_skiplist_find(efp->skiplist + i, j, NULL);
 
+		if ((res = skiplist_add(efp, i, j)))
+			return res;
+		if ((res = skiplist_add(efp, j, i))) {
+			/* keep the lists symmetric */
+			if (added)
+				skiplist_remove(efp, i, j);
+			return res;
+		}
+	} else if (efp->skiplist) {
+		skiplist_remove(efp, i, j);
+		skiplist_remove(efp, j, i);
+	}
+	efp->pair_energy_valid = 0;
+	efp->pol_cache.valid = 0;
+	efp->pol_direct.valid = 0;
+	efp->elec_field_valid = 0;
 	return EFP_RESULT_SUCCESS;
 }
 
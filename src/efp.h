@@ -42,6 +42,9 @@ extern "C" {
 /** Version string. */
 #define LIBEFP_VERSION_STRING "1.5.0"
 
+/** Fragment index of points which do not belong to any fragment. */
+#define EFP_NO_FRAG ((size_t)-1)
+
 /** Result of an operation. */
 enum efp_result {
 	/** Operation was successful. */
@@ -119,7 +122,21 @@ enum efp_pol_driver {
 	/** Iterative solution of polarization equations. */
 	EFP_POL_DRIVER_ITERATIVE = 0,
 	/** Direct solution of polarization equations. */
-	EFP_POL_DRIVER_DIRECT
+	EFP_POL_DRIVER_DIRECT,
+	/**
+	 * Preconditioned biconjugate gradient solution of polarization
+	 * equations. Induced and conjugate induced dipoles are found
+	 * together. */
+	EFP_POL_DRIVER_KRYLOV
+};
+
+/** Scheduler used to distribute work between MPI processes. */
+enum efp_mpi_balance {
+	/** Rank 0 hands out chunks of work on request. */
+	EFP_MPI_BALANCE_MASTER = 0,
+	/** Static distribution of the first chunks followed by work stealing
+	 * through a shared counter updated with MPI-3 one-sided atomics. */
+	EFP_MPI_BALANCE_RMA
 };
 
 /** \struct efp
@@ -150,6 +167,89 @@ struct efp_opts {
 	int enable_cutoff;
 	/** Cutoff distance for fragment-fragment interactions. */
 	double swf_cutoff;
+	/**
+	 * Skin distance of the fragment neighbor list. The list holds pairs
+	 * within swf_cutoff plus this distance and is rebuilt only when some
+	 * fragment moves by more than half of it. The default is 2.0 bohr. */
+	double nblist_skin;
+	/**
+	 * Exchange repulsion screening tolerance. Exchange repulsion, charge
+	 * penetration and overlap-based dispersion damping are skipped for
+	 * fragment pairs with estimated largest LMO overlap below this value.
+	 * The estimate is a heuristic and not a rigorous bound on the overlap.
+	 * Zero disables screening. */
+	double xr_screen_tol;
+	/** Work distribution between MPI processes (see #efp_mpi_balance).
+	 * Ignored if libefp is built without MPI support. */
+	enum efp_mpi_balance mpi_balance;
+	/**
+	 * Use smooth particle mesh Ewald summation for electrostatics and
+	 * polarization if nonzero. Requires periodic boundary conditions.
+	 * Real space part is computed for fragment pairs within swf_cutoff
+	 * without switching function. Charge-octupole interactions are
+	 * short-ranged and are always computed in real space. */
+	int enable_pme;
+	/** Ewald splitting parameter in inverse bohr. Zero selects
+	 * 4.5 / swf_cutoff. */
+	double pme_alpha;
+	/** Largest spacing of the PME grid in bohr. Zero selects
+	 * 0.25 / pme_alpha. */
+	double pme_spacing;
+	/** Order of B-spline interpolation on the PME grid, from 5 to 12.
+	 * Zero selects 8. */
+	size_t pme_order;
+	/**
+	 * Use fast multipole method for electrostatics and polarization if
+	 * nonzero. Interactions are computed for all fragment pairs without
+	 * cutoff, which then applies only to other terms. Fragments far from
+	 * each other interact through multipole expansions without damping,
+	 * other pairs are computed directly. Not compatible with periodic
+	 * boundary conditions. */
+	int enable_fmm;
+	/** Order of multipole expansions from 4 to 16. Zero selects 8. */
+	size_t fmm_order;
+	/**
+	 * Opening angle of the fast multipole method. Groups of fragments
+	 * interact through expansions if the sum of radii of the groups is
+	 * less than this times the distance between their centers. Smaller
+	 * values are more accurate. Zero selects 0.5. */
+	double fmm_theta;
+	/**
+	 * Convergence threshold for iterative polarization drivers. This is
+	 * the average change of induced dipoles in one iteration. Zero
+	 * selects 1.0e-10. */
+	double pol_scf_tol;
+	/**
+	 * Maximum number of iterations of iterative polarization drivers.
+	 * Zero selects 80. */
+	size_t pol_scf_max_iter;
+	/**
+	 * Number of induced dipole solutions from previous computations used
+	 * to predict the initial guess for iterative polarization drivers.
+	 * One reuses the last solution, larger values extrapolate using the
+	 * always stable predictor-corrector coefficients. Computations at an
+	 * unchanged geometry replace the last solution instead of adding a
+	 * new one. Zero disables the guess. See ::efp_reset_pol_history. */
+	size_t pol_guess_history;
+	/**
+	 * Store dipole field tensors between polarizable points if nonzero.
+	 * Tensors are computed once per geometry and iterative polarization
+	 * drivers then only multiply them by induced dipoles. */
+	int enable_pol_cache;
+	/**
+	 * Memory limit in megabytes for stored dipole field tensors.
+	 * Fragments whose tensors do not fit are computed on the fly. Zero
+	 * means no limit. */
+	size_t pol_cache_size;
+	/**
+	 * Run most of the iterative polarization driver in single precision
+	 * if nonzero. Each double precision iteration is followed by single
+	 * precision iterations for the correction of induced dipoles, and
+	 * convergence is checked in double precision with
+	 * efp_opts::pol_scf_tol. Far field with fast multipole method and
+	 * reciprocal space part with particle mesh Ewald are computed in
+	 * double precision only. */
+	int enable_pol_mixed_precision;
 };
 
 /** EFP energy terms. */
@@ -218,6 +318,30 @@ struct efp_atom {
 typedef enum efp_result (*efp_electron_density_field_fn)(size_t n_pt,
     const double *xyz, double *field, void *user_data);
 
+/**
+ * Callback function which receives potential on one slab of a grid.
+ *
+ * This function is called by ::efp_get_electrostatic_potential_grid once
+ * for each slab of the grid in order of increasing first index.
+ *
+ * \param[in] slab_idx Index of the slab along the first grid axis.
+ *
+ * \param[in] n_pt Number of points in the slab, which is the product of the
+ * numbers of points along the second and the third grid axes.
+ *
+ * \param[in] pot Electrostatic potential in atomic units at points of the
+ * slab. The index along the third axis changes fastest, as in Gaussian cube
+ * files. The array is reused for the next slab.
+ *
+ * \param[in] user_data User data which was passed to
+ * ::efp_get_electrostatic_potential_grid.
+ *
+ * \return The implemented function should return ::EFP_RESULT_SUCCESS to
+ * continue or an error code to stop the evaluation of the grid.
+ */
+typedef enum efp_result (*efp_potential_slab_fn)(size_t slab_idx,
+    size_t n_pt, const double *pot, void *user_data);
+
 /**
  * Get a human readable banner string with information about the library.
  *
@@ -591,6 +715,76 @@ enum efp_result efp_get_periodic_box(struct efp *efp, double *xyz);
  */
 enum efp_result efp_get_stress_tensor(struct efp *efp, double *stress);
 
+/**
+ * Get the number of times the fragment neighbor list was built.
+ *
+ * The neighbor list is used when interaction cutoff is enabled. It is
+ * rebuilt by ::efp_compute only when some fragment has moved by more than
+ * half of efp_opts::nblist_skin since the previous build or when cutoff
+ * related options or the periodic box have changed.
+ *
+ * \param[in] efp The efp structure.
+ *
+ * \param[out] n_builds Number of neighbor list builds.
+ *
+ * \return ::EFP_RESULT_SUCCESS on success or error code otherwise.
+ */
+enum efp_result efp_get_nblist_build_count(struct efp *efp, size_t *n_builds);
+
+/**
+ * Get the number of fragment pairs skipped by exchange repulsion screening.
+ *
+ * The number refers to the last call to ::efp_compute. See
+ * efp_opts::xr_screen_tol.
+ *
+ * \param[in] efp The efp structure.
+ *
+ * \param[out] n_pairs Number of skipped fragment pairs.
+ *
+ * \return ::EFP_RESULT_SUCCESS on success or error code otherwise.
+ */
+enum efp_result efp_get_xr_screen_count(struct efp *efp, size_t *n_pairs);
+
+/**
+ * Get memory usage and time of the factorization of the direct
+ * polarization driver.
+ *
+ * The matrix is factorized once per geometry and the factorization is
+ * reused for both induced and conjugate induced dipoles and in following
+ * calls until some fragment moves. With cutoff enabled fragments are
+ * reordered to reduce the bandwidth of the matrix and band storage is
+ * used if it takes less memory than dense storage. Both values are zero if
+ * the direct driver was not used.
+ *
+ * \param[in] efp The efp structure.
+ *
+ * \param[out] size Memory used by the factorization in bytes.
+ *
+ * \param[out] time Time of the last factorization in seconds.
+ *
+ * \return ::EFP_RESULT_SUCCESS on success or error code otherwise.
+ */
+enum efp_result efp_get_pol_direct_info(struct efp *efp, size_t *size,
+    double *time);
+
+/**
+ * Get the number of heap allocations made by the library.
+ *
+ * Temporary arrays used by ::efp_compute are taken from per-thread scratch
+ * buffers which are allocated by ::efp_prepare and reused across calls.
+ * Once buffers are set up, repeated calls to ::efp_compute with the same
+ * number of threads do not allocate memory and this number stays the same.
+ * All allocations are counted except those made while loading fragment
+ * potentials with ::efp_add_potential.
+ *
+ * \param[in] efp The efp structure.
+ *
+ * \param[out] n_alloc Number of heap allocations.
+ *
+ * \return ::EFP_RESULT_SUCCESS on success or error code otherwise.
+ */
+enum efp_result efp_get_alloc_count(struct efp *efp, size_t *n_alloc);
+
 /**
  * Get the ab initio screening parameters.
  *
@@ -648,7 +842,11 @@ enum efp_result efp_set_dipole_integrals(struct efp *efp, size_t n_core,
 /**
  * Update wave function dependent energy terms.
  *
- * This function must be called during \a ab \a initio SCF.
+ * This function must be called during \a ab \a initio SCF. Field of
+ * fragments and point charges at polarizable points is computed once and
+ * reused until coordinates, point charges or options change, only field of
+ * electron density is computed in every call. Induced dipoles from the
+ * previous call are then used as initial guess.
  *
  * \param[in] efp The efp structure.
  *
@@ -671,6 +869,44 @@ enum efp_result efp_get_wavefunction_dependent_energy(struct efp *efp,
  */
 enum efp_result efp_compute(struct efp *efp, int do_gradient);
 
+/**
+ * Update the EFP energy after some fragments have moved.
+ *
+ * Two-body energies of every fragment pair are stored by this function.
+ * Fragments are marked as moved by ::efp_set_frag_coordinates and
+ * ::efp_set_coordinates. On subsequent calls only electrostatic,
+ * dispersion and exchange repulsion energies of pairs which involve moved
+ * fragments are recomputed, so that moving a single fragment costs O(N)
+ * instead of O(N^2). Polarization is solved again using induced dipoles
+ * from the previous call as initial guess. The gradient is not computed.
+ *
+ * The first call, or a call after options, periodic box or skipped
+ * fragments have changed, performs a full computation. A full computation
+ * is also done if more than half of fragments have moved or, with cutoff
+ * enabled, if the neighbor list has to be rebuilt. Stored energies take 32
+ * bytes per fragment pair or, with cutoff enabled, per pair of the neighbor
+ * list.
+ *
+ * \param[in] efp The efp structure.
+ *
+ * \return ::EFP_RESULT_SUCCESS on success or error code otherwise.
+ */
+enum efp_result efp_compute_incremental(struct efp *efp);
+
+/**
+ * Discard induced dipoles stored from previous computations.
+ *
+ * Call this after a discontinuous change of geometry, for example when a
+ * new structure is started, so that the initial guess for polarization is
+ * not extrapolated from unrelated solutions. See
+ * efp_opts::pol_guess_history.
+ *
+ * \param[in] efp The efp structure.
+ *
+ * \return ::EFP_RESULT_SUCCESS on success or error code otherwise.
+ */
+enum efp_result efp_reset_pol_history(struct efp *efp);
+
 /**
  * Get total charge of a fragment.
  *
@@ -1012,6 +1248,68 @@ enum efp_result efp_get_frag_atoms(struct efp *efp, size_t frag_idx,
 enum efp_result efp_get_electric_field(struct efp *efp, size_t frag_idx,
     const double *xyz, double *field);
 
+/**
+ * Get electric field for many points on fragments.
+ *
+ * The result for each point is the same as from ::efp_get_electric_field.
+ * Points are grouped by fragment internally and fragments are distributed
+ * over threads and MPI ranks, so with MPI all ranks must call this
+ * function with the same arguments.
+ *
+ * \param[in] efp The efp structure.
+ *
+ * \param[in] n_pt Number of points.
+ *
+ * \param[in] frag_idx Array of \p n_pt fragment indices. Field at a point
+ * does not include contribution of its fragment. Field at points with index
+ * #EFP_NO_FRAG, e.g. points of a DFT integration grid, includes all
+ * fragments. Such points are not supported with particle mesh Ewald.
+ *
+ * \param[in] xyz Array of \p n_pt points, each point is stored as \a x \a y
+ * \a z coordinates.
+ *
+ * \param[out] field Array of \p n_pt electric field \a x \a y \a z
+ * components in atomic units.
+ *
+ * \return ::EFP_RESULT_SUCCESS on success or error code otherwise.
+ */
+enum efp_result efp_get_electric_field_batch(struct efp *efp, size_t n_pt,
+    const size_t *frag_idx, const double *xyz, double *field);
+
+/**
+ * Get electrostatic potential of all fragments on a regular grid.
+ *
+ * Potential of nuclei, multipoles and induced dipoles from the last
+ * ::efp_compute call is evaluated slab by slab and each slab is passed to
+ * \p fn, so the whole grid is never stored. If fast multipole method is
+ * enabled, distant fragments act through multipole expansions with the
+ * accuracy given by \a fmm_order and \a fmm_theta options. Periodic
+ * images are not included. Sources which coincide with a grid point, such
+ * as the nucleus of an atom the point lies on, are skipped at that point. With MPI all ranks must call this function
+ * and each of them receives all slabs.
+ *
+ * \param[in] efp The efp structure.
+ *
+ * \param[in] origin Array of 3 elements with coordinates of the first grid
+ * point.
+ *
+ * \param[in] axes Array of 9 elements with steps between adjacent grid
+ * points along the three grid axes.
+ *
+ * \param[in] n Array of 3 elements with numbers of points along the axes.
+ *
+ * \param[in] fn The callback function which receives the slabs. See
+ * ::efp_potential_slab_fn.
+ *
+ * \param[in] user_data User data which will be passed to \p fn.
+ *
+ * \return ::EFP_RESULT_SUCCESS on success, the error code returned by
+ * \p fn or other error code otherwise.
+ */
+enum efp_result efp_get_electrostatic_potential_grid(struct efp *efp,
+    const double *origin, const double *axes, const size_t *n,
+    efp_potential_slab_fn fn, void *user_data);
+
 /**
  * Convert rigid body torque to derivatives of energy by Euler angles.
  *
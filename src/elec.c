@@ -24,6 +24,8 @@
  * SUCH DAMAGE.
  */
 
+#include <stdlib.h>
+
 #include "balance.h"
 #include "elec.h"
 #include "private.h"
@@ -154,13 +156,14 @@ atom_mult_grad(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
 	vec_scale(&torque_i, swf->swf);
 	vec_scale(&torque_j, swf->swf);
 
-	efp_add_force(efp->grad + fr_i_idx, CVEC(fr_i->x), CVEC(at_i->x),
+	efp_add_force(efp, fr_i_idx, CVEC(fr_i->x), CVEC(at_i->x),
 	    &force, &torque_i);
-	efp_sub_force(efp->grad + fr_j_idx, CVEC(fr_j->x), CVEC(pt_j->x),
+	efp_sub_force(efp, fr_j_idx, CVEC(fr_j->x), CVEC(pt_j->x),
 	    &force, &torque_j);
-	efp_add_stress(&swf->dr, &force, &efp->stress);
+	efp_add_stress(efp, &swf->dr, &force);
 }
 
+#ifdef EFP_SCALAR_ELEC
 static double
 mult_mult_energy(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
     size_t pt_i_idx, size_t pt_j_idx, const struct swf *swf)
@@ -325,11 +328,231 @@ mult_mult_grad(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
 	vec_scale(&torque_i, swf->swf);
 	vec_scale(&torque_j, swf->swf);
 
-	efp_add_force(efp->grad + fr_i_idx, CVEC(fr_i->x), CVEC(pt_i->x),
+	efp_add_force(efp, fr_i_idx, CVEC(fr_i->x), CVEC(pt_i->x),
 	    &force, &torque_i);
-	efp_sub_force(efp->grad + fr_j_idx, CVEC(fr_j->x), CVEC(pt_j->x),
+	efp_sub_force(efp, fr_j_idx, CVEC(fr_j->x), CVEC(pt_j->x),
 	    &force, &torque_j);
-	efp_add_stress(&swf->dr, &force, &efp->stress);
+	efp_add_stress(efp, &swf->dr, &force);
+}
+
+#else
+/* Computes interactions of all multipole points of fragment i with
+ * multipole points of fragment j using the vectorized kernels. Define
+ * EFP_SCALAR_ELEC to use the reference per-pair code instead. */
+static double
+mult_mult_soa(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
+    const struct swf *swf)
+{
+	const struct frag *fr_i = efp->frags + fr_i_idx;
+	const struct frag *fr_j = efp->frags + fr_j_idx;
+	size_t n_j = fr_j->n_multipole_pts;
+	int screen = efp->opts.elec_damp == EFP_ELEC_DAMP_SCREEN;
+	double *damp, *gdamp;
+	double energy = 0.0;
+
+	damp = (double *)efp_scratch_alloc(efp, n_j * sizeof(double));
+	gdamp = (double *)efp_scratch_alloc(efp, n_j * sizeof(double));
+
+	/* the kernels always apply charge - charge damping factors */
+	for (size_t jj = 0; jj < n_j; jj++)
+		damp[jj] = gdamp[jj] = 1.0;
+
+	for (size_t ii = 0; ii < fr_i->n_multipole_pts; ii++) {
+		const struct multipole_pt *pt_i = fr_i->multipole_pts + ii;
+
+		if (screen) {
+			double screen_i = fr_i->screen_params[ii];
+
+			for (size_t jj = 0; jj < n_j; jj++) {
+				const struct multipole_pt *pt_j =
+				    fr_j->multipole_pts + jj;
+				double screen_j = fr_j->screen_params[jj];
+
+				vec_t dr = {
+					pt_j->x - pt_i->x - swf->cell.x,
+					pt_j->y - pt_i->y - swf->cell.y,
+					pt_j->z - pt_i->z - swf->cell.z
+				};
+
+				double r = vec_len(&dr);
+
+				damp[jj] = get_screen_damping(r, screen_i,
+				    screen_j);
+				if (efp->do_gradient)
+					gdamp[jj] = get_screen_damping_grad(r,
+					    screen_i, screen_j);
+			}
+		}
+
+		energy += efp_mult_mult_energy_soa(pt_i, &fr_j->multipole_soa,
+		    n_j, &swf->cell, damp);
+
+		if (efp->do_gradient) {
+			vec_t force, add_i, torque_j;
+
+			efp_mult_mult_grad_soa(pt_i, &fr_j->multipole_soa, n_j,
+			    &swf->cell, CVEC(fr_j->x), gdamp, &force, &add_i,
+			    &torque_j);
+
+			vec_scale(&force, swf->swf);
+			vec_scale(&add_i, swf->swf);
+			vec_scale(&torque_j, swf->swf);
+
+			efp_add_force(efp, fr_i_idx, CVEC(fr_i->x),
+			    CVEC(pt_i->x), &force, &add_i);
+			efp_sub_grad(efp, fr_j_idx, &force, &torque_j);
+			efp_add_stress(efp, &swf->dr, &force);
+		}
+	}
+
+	efp_scratch_free(efp, gdamp);
+	efp_scratch_free(efp, damp);
+	return energy;
+}
+#endif /* EFP_SCALAR_ELEC */
+
+/* Returns screening parameter of site idx of a fragment in the order of
+ * efp_pme_get_site. Nuclei are not screened. */
+static double
+get_site_screen_param(const struct frag *frag, size_t idx)
+{
+	return idx < frag->n_atoms ? HUGE_VAL :
+	    frag->screen_params[idx - frag->n_atoms];
+}
+
+/* Real space part of particle mesh Ewald electrostatics. Sites interact
+ * through the complementary error function kernel without switching.
+ * Charge - charge screening corrections and charge - octupole terms are
+ * short-ranged and are computed with the original kernels, the latter
+ * with switching function applied. */
+static double
+frag_frag_elec_pme(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx)
+{
+	struct frag *fr_i = efp->frags + fr_i_idx;
+	struct frag *fr_j = efp->frags + fr_j_idx;
+	struct swf swf = efp_make_swf(efp, fr_i, fr_j);
+	int screen = efp->opts.elec_damp == EFP_ELEC_DAMP_SCREEN;
+	size_t n_i = efp_pme_get_site_count(fr_i);
+	size_t n_j = efp_pme_get_site_count(fr_j);
+	double energy = 0.0, energy_oct = 0.0;
+
+	for (size_t ii = 0; ii < n_i; ii++) {
+		const struct multipole_pt *pt_i = ii < fr_i->n_atoms ? NULL :
+		    fr_i->multipole_pts + ii - fr_i->n_atoms;
+		struct pme_site si;
+
+		efp_pme_get_site(fr_i, ii, &si);
+
+		for (size_t jj = 0; jj < n_j; jj++) {
+			const struct multipole_pt *pt_j =
+			    jj < fr_j->n_atoms ? NULL :
+			    fr_j->multipole_pts + jj - fr_j->n_atoms;
+			struct pme_site sj;
+			vec_t grad_j, force_, torque_i_, torque_j_;
+			vec_t force = vec_zero, torque_i = vec_zero;
+			vec_t torque_j = vec_zero;
+			double bn[6], r, ccdamp = 1.0, gdamp = 1.0;
+
+			efp_pme_get_site(fr_j, jj, &sj);
+
+			vec_t dr = {
+				sj.r.x - si.r.x - swf.cell.x,
+				sj.r.y - si.r.y - swf.cell.y,
+				sj.r.z - si.r.z - swf.cell.z
+			};
+
+			r = vec_len(&dr);
+			efp_pme_bn(efp->pme.alpha, r, si.rank + sj.rank +
+			    (efp->do_gradient ? 1 : 0), bn);
+
+			if (efp->do_gradient) {
+				energy += efp_pme_site_pair(&si, &sj, &dr, bn,
+				    &grad_j, &torque_i, &torque_j);
+
+				force.x = -grad_j.x;
+				force.y = -grad_j.y;
+				force.z = -grad_j.z;
+				vec_negate(&torque_j);
+			}
+			else
+				energy += efp_pme_site_pair(&si, &sj, &dr, bn,
+				    NULL, NULL, NULL);
+
+			if (screen && (pt_i || pt_j)) {
+				double sp_i = get_site_screen_param(fr_i, ii);
+				double sp_j = get_site_screen_param(fr_j, jj);
+
+				if (!pt_i) {
+					sp_i = sp_j;
+					sp_j = HUGE_VAL;
+				}
+				ccdamp = get_screen_damping(r, sp_i, sp_j);
+				gdamp = get_screen_damping_grad(r, sp_i, sp_j);
+			}
+
+			/* charge - charge screening */
+			energy += (ccdamp - 1.0) *
+			    efp_charge_charge_energy(si.q, sj.q, &dr);
+
+			/* charge - octupole */
+			if (pt_j)
+				energy_oct += efp_charge_octupole_energy(si.q,
+				    pt_j->octupole, &dr);
+
+			/* octupole - charge */
+			if (pt_i)
+				energy_oct -= efp_charge_octupole_energy(sj.q,
+				    pt_i->octupole, &dr);
+
+			if (!efp->do_gradient)
+				continue;
+
+			efp_charge_charge_grad(si.q, sj.q, &dr,
+			    &force_, &torque_i_, &torque_j_);
+			vec_scale(&force_, gdamp - 1.0);
+			force = vec_add(&force, &force_);
+
+			if (pt_j) {
+				efp_charge_octupole_grad(si.q, pt_j->octupole,
+				    &dr, &force_, &torque_i_, &torque_j_);
+				vec_scale(&force_, swf.swf);
+				vec_scale(&torque_i_, swf.swf);
+				vec_scale(&torque_j_, swf.swf);
+				add_3(&force, &force_, &torque_i, &torque_i_,
+				    &torque_j, &torque_j_);
+			}
+			if (pt_i) {
+				efp_charge_octupole_grad(sj.q, pt_i->octupole,
+				    &dr, &force_, &torque_j_, &torque_i_);
+				vec_negate(&force_);
+				vec_scale(&force_, swf.swf);
+				vec_scale(&torque_i_, swf.swf);
+				vec_scale(&torque_j_, swf.swf);
+				add_3(&force, &force_, &torque_i, &torque_i_,
+				    &torque_j, &torque_j_);
+			}
+
+			efp_add_force(efp, fr_i_idx, CVEC(fr_i->x), &si.r,
+			    &force, &torque_i);
+			efp_sub_force(efp, fr_j_idx, CVEC(fr_j->x), &sj.r,
+			    &force, &torque_j);
+			efp_add_stress(efp, &swf.dr, &force);
+		}
+	}
+
+	if (efp->do_gradient) {
+		vec_t force = {
+			swf.dswf.x * energy_oct,
+			swf.dswf.y * energy_oct,
+			swf.dswf.z * energy_oct
+		};
+
+		efp_add_grad(efp, fr_i_idx, &force, NULL);
+		efp_sub_grad(efp, fr_j_idx, &force, NULL);
+		efp_add_stress(efp, &swf.dr, &force);
+	}
+
+	return energy + energy_oct * swf.swf;
 }
 
 double
@@ -337,9 +560,18 @@ efp_frag_frag_elec(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx)
 {
 	struct frag *fr_i = efp->frags + fr_i_idx;
 	struct frag *fr_j = efp->frags + fr_j_idx;
-	struct swf swf = efp_make_swf(efp, fr_i, fr_j);
+	struct swf swf;
 	double energy = 0.0;
 
+	if (efp->opts.enable_pme)
+		return frag_frag_elec_pme(efp, fr_i_idx, fr_j_idx);
+
+	/* near field of fast multipole method is not truncated */
+	if (efp->opts.enable_fmm)
+		swf = efp_make_unit_swf(fr_i, fr_j);
+	else
+		swf = efp_make_swf(efp, fr_i, fr_j);
+
 	/* nuclei - nuclei */
 	for (size_t ii = 0; ii < fr_i->n_atoms; ii++) {
 		for (size_t jj = 0; jj < fr_j->n_atoms; jj++) {
@@ -360,11 +592,11 @@ efp_frag_frag_elec(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx)
 				efp_charge_charge_grad(at_i->znuc, at_j->znuc,
 				    &dr, &force, &add_i, &add_j);
 				vec_scale(&force, swf.swf);
-				efp_add_force(efp->grad + fr_i_idx,
+				efp_add_force(efp, fr_i_idx,
 				    CVEC(fr_i->x), CVEC(at_i->x), &force, NULL);
-				efp_sub_force(efp->grad + fr_j_idx,
+				efp_sub_force(efp, fr_j_idx,
 				    CVEC(fr_j->x), CVEC(at_j->x), &force, NULL);
-				efp_add_stress(&swf.dr, &force, &efp->stress);
+				efp_add_stress(efp, &swf.dr, &force);
 			}
 		}
 	}
@@ -400,6 +632,7 @@ efp_frag_frag_elec(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx)
 	}
 
 	/* mult points - mult points */
+#ifdef EFP_SCALAR_ELEC
 	for (size_t ii = 0; ii < fr_i->n_multipole_pts; ii++) {
 		for (size_t jj = 0; jj < fr_j->n_multipole_pts; jj++) {
 			energy += mult_mult_energy(efp, fr_i_idx, fr_j_idx,
@@ -410,6 +643,9 @@ efp_frag_frag_elec(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx)
 			}
 		}
 	}
+#else
+	energy += mult_mult_soa(efp, fr_i_idx, fr_j_idx, &swf);
+#endif
 
 	vec_t force = {
 		swf.dswf.x * energy,
@@ -417,9 +653,9 @@ efp_frag_frag_elec(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx)
 		swf.dswf.z * energy
 	};
 
-	six_atomic_add_xyz(efp->grad + fr_i_idx, &force);
-	six_atomic_sub_xyz(efp->grad + fr_j_idx, &force);
-	efp_add_stress(&swf.dr, &force, &efp->stress);
+	efp_add_grad(efp, fr_i_idx, &force, NULL);
+	efp_sub_grad(efp, fr_j_idx, &force, NULL);
+	efp_add_stress(efp, &swf.dr, &force);
 
 	return energy * swf.swf;
 }
@@ -462,6 +698,53 @@ rotate_octupole(const mat_t *rotmat, const double *in, double *out)
 			}
 }
 
+static void
+update_multipole_soa(struct frag *frag)
+{
+	struct multipole_soa *soa = &frag->multipole_soa;
+	size_t n = soa->stride;
+
+	for (size_t i = 0; i < frag->n_multipole_pts; i++) {
+		const struct multipole_pt *pt = frag->multipole_pts + i;
+
+		soa->x[i] = pt->x;
+		soa->y[i] = pt->y;
+		soa->z[i] = pt->z;
+		soa->monopole[i] = pt->monopole;
+		soa->dipole[0 * n + i] = pt->dipole.x;
+		soa->dipole[1 * n + i] = pt->dipole.y;
+		soa->dipole[2 * n + i] = pt->dipole.z;
+
+		for (size_t k = 0; k < 6; k++)
+			soa->quadrupole[k * n + i] = pt->quadrupole[k];
+		for (size_t k = 0; k < 10; k++)
+			soa->octupole[k * n + i] = pt->octupole[k];
+	}
+}
+
+enum efp_result
+efp_setup_multipole_soa(struct efp *efp, struct frag *frag)
+{
+	struct multipole_soa *soa = &frag->multipole_soa;
+	size_t n = frag->n_multipole_pts;
+
+	/* coordinates, monopole, dipole, quadrupole and octupole */
+	soa->x = (double *)efp_malloc(efp, (23 * n + 1) * sizeof(double));
+	if (soa->x == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	soa->stride = n;
+	soa->y = soa->x + n;
+	soa->z = soa->x + 2 * n;
+	soa->monopole = soa->x + 3 * n;
+	soa->dipole = soa->x + 4 * n;
+	soa->quadrupole = soa->x + 7 * n;
+	soa->octupole = soa->x + 13 * n;
+
+	update_multipole_soa(frag);
+	return EFP_RESULT_SUCCESS;
+}
+
 void
 efp_update_elec(struct frag *frag)
 {
@@ -521,6 +804,9 @@ efp_update_elec(struct frag *frag)
 		oct[8] = 2.5 * oct[8] - 0.5 * otry;
 		oct[9] = 2.5 * oct[9];
 	}
+
+	if (frag->multipole_soa.x)
+		update_multipole_soa(frag);
 }
 
 static double
@@ -577,8 +863,8 @@ compute_ai_elec_frag_grad(struct efp *efp, size_t frag_idx)
 
 			efp_charge_charge_grad(efp->ptc[i], at_j->znuc, &dr,
 			    &force, &add_i, &add_j);
-			vec_atomic_add(efp->ptc_grad + i, &force);
-			efp_sub_force(efp->grad + frag_idx, CVEC(fr_j->x),
+			efp_add_ptc_grad(efp, i, &force);
+			efp_sub_force(efp, frag_idx, CVEC(fr_j->x),
 			    CVEC(at_j->x), &force, &add_j);
 		}
 
@@ -616,8 +902,8 @@ compute_ai_elec_frag_grad(struct efp *efp, size_t frag_idx)
 			add_3(&force, &force_, &add_i, &add_i_,
 			    &add_j, &add_j_);
 
-			vec_atomic_add(efp->ptc_grad + i, &force);
-			efp_sub_force(efp->grad + frag_idx, CVEC(fr_j->x),
+			efp_add_ptc_grad(efp, i, &force);
+			efp_sub_force(efp, frag_idx, CVEC(fr_j->x),
 			    CVEC(pt_j->x), &force, &add_j);
 		}
 	}
@@ -652,3 +938,246 @@ efp_compute_ai_elec(struct efp *efp)
 
 	return EFP_RESULT_SUCCESS;
 }
+
+/* Removes interactions of sites of the same fragment, including self
+ * interaction, which are included in the reciprocal space sum. Fragments
+ * are rigid so this contributes only to energy. */
+static double
+compute_elec_pme_self(struct efp *efp, size_t frag_idx)
+{
+	const struct frag *frag = efp->frags + frag_idx;
+	size_t n_sites = efp_pme_get_site_count(frag);
+	double energy = 0.0;
+
+	for (size_t i = 0; i < n_sites; i++) {
+		struct pme_site si;
+
+		efp_pme_get_site(frag, i, &si);
+
+		for (size_t j = i; j < n_sites; j++) {
+			struct pme_site sj;
+			double bn[5], e;
+
+			efp_pme_get_site(frag, j, &sj);
+
+			vec_t dr = vec_sub(&sj.r, &si.r);
+
+			efp_pme_bn_erf(efp->pme.alpha, vec_len(&dr),
+			    si.rank + sj.rank, bn);
+			e = efp_pme_site_pair(&si, &sj, &dr, bn,
+			    NULL, NULL, NULL);
+			energy -= i == j ? 0.5 * e : e;
+		}
+	}
+	return energy;
+}
+
+enum efp_result
+efp_compute_elec_pme(struct efp *efp)
+{
+	struct pme *pme = &efp->pme;
+	double energy = 0.0, charge = 0.0, volume, e_bg;
+
+	if (!(efp->opts.terms & EFP_TERM_ELEC) || !efp->opts.enable_pme)
+		return EFP_RESULT_SUCCESS;
+
+	/* reciprocal space part is computed by the master process */
+	if (efp_mpi_rank() != 0)
+		return EFP_RESULT_SUCCESS;
+
+	efp_pme_clear(pme);
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < efp_pme_get_site_count(frag); j++) {
+			struct pme_site site;
+
+			efp_pme_get_site(frag, j, &site);
+			efp_pme_spread(pme, &site, 0);
+			charge += site.q;
+		}
+	}
+
+	efp_pme_solve(pme, 0, &energy,
+	    efp->do_gradient ? &efp->stress : NULL);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) reduction(+:energy)
+#endif
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		energy += compute_elec_pme_self(efp, i);
+
+		if (!efp->do_gradient)
+			continue;
+
+		for (size_t j = 0; j < efp_pme_get_site_count(frag); j++) {
+			struct pme_site site;
+
+			efp_pme_get_site(frag, j, &site);
+			efp_pme_add_site_grad(efp, i, &site, 0);
+		}
+	}
+
+	/* neutralizing background for charged systems */
+	volume = pme->box.x * pme->box.y * pme->box.z;
+	e_bg = -PI * charge * charge / (2.0 * volume * pme->alpha * pme->alpha);
+
+	if (efp->do_gradient) {
+		efp->stress.xx += e_bg;
+		efp->stress.yy += e_bg;
+		efp->stress.zz += e_bg;
+	}
+
+	efp->energy.electrostatic += energy + e_bg;
+
+	return EFP_RESULT_SUCCESS;
+}
+
+static void
+compute_elec_fmm_range(struct efp *efp, size_t from, size_t to, void *data)
+{
+	double energy = 0.0;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) reduction(+:energy)
+#endif
+	for (size_t i = from; i < to; i++) {
+		const size_t *row;
+		size_t n_row = efp_fmm_get_row(&efp->fmm, i, &row);
+
+		for (size_t k = 0; k < n_row; k++)
+			if (efp_nblist_owns_pair(efp->n_frag, i, row[k]))
+				energy += efp_frag_frag_elec(efp, i, row[k]);
+	}
+
+	*(double *)data += energy;
+}
+
+/* Site of a fragment in the order of efp_pme_get_site with charge only. */
+static void
+get_charge_site(const struct frag *frag, size_t idx, struct pme_site *site)
+{
+	efp_pme_get_site(frag, idx, site);
+
+	site->d = vec_zero;
+	memset(site->quad, 0, sizeof(site->quad));
+	site->rank = 0;
+}
+
+/* Far field part of electrostatics with fast multipole method. Multipoles
+ * up to quadrupoles interact with each other and octupoles interact only
+ * with charges, so octupoles are kept in the second set of sites. */
+static double
+compute_elec_fmm_far(struct efp *efp)
+{
+	struct fmm *fmm = &efp->fmm;
+	double energy = 0.0;
+
+	efp_fmm_clear(fmm);
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < efp_pme_get_site_count(frag); j++) {
+			struct pme_site site;
+
+			efp_pme_get_site(frag, j, &site);
+			efp_fmm_add_site(fmm, i, &site, 0);
+		}
+		for (size_t j = 0; j < frag->n_multipole_pts; j++) {
+			const struct multipole_pt *pt = frag->multipole_pts + j;
+
+			efp_fmm_add_octupole(fmm, i, CVEC(pt->x), pt->octupole,
+			    1);
+		}
+	}
+
+	efp_fmm_solve(fmm);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) reduction(+:energy)
+#endif
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < efp_pme_get_site_count(frag); j++) {
+			struct pme_site site;
+			double phi[20];
+
+			/* pairs of multipoles are counted twice */
+			efp_pme_get_site(frag, j, &site);
+			efp_fmm_eval(fmm, fmm->local, i, &site.r, site.rank, 0,
+			    phi);
+			energy += 0.5 * efp_pme_site_energy(&site, phi);
+
+			if (efp->do_gradient)
+				efp_fmm_add_site_grad(efp, i, &site, 0);
+
+			/* charge - octupole */
+			get_charge_site(frag, j, &site);
+			efp_fmm_eval(fmm, fmm->local, i, &site.r, 0, 1, phi);
+			energy += efp_pme_site_energy(&site, phi);
+
+			if (efp->do_gradient)
+				efp_fmm_add_site_grad(efp, i, &site, 1);
+		}
+	}
+
+	if (!efp->do_gradient)
+		return energy;
+
+	/* octupoles in the potential of charges */
+	efp_fmm_clear(fmm);
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < efp_pme_get_site_count(frag); j++) {
+			struct pme_site site;
+
+			get_charge_site(frag, j, &site);
+			efp_fmm_add_site(fmm, i, &site, 0);
+		}
+	}
+
+	efp_fmm_solve(fmm);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < frag->n_multipole_pts; j++) {
+			const struct multipole_pt *pt = frag->multipole_pts + j;
+
+			efp_fmm_add_octupole_grad(efp, i, CVEC(pt->x),
+			    pt->octupole, 0);
+		}
+	}
+	return energy;
+}
+
+/* Electrostatics with fast multipole method. Fragment pairs of the near
+ * field are computed directly and the rest through expansions. */
+enum efp_result
+efp_compute_elec_fmm(struct efp *efp)
+{
+	double energy = 0.0;
+
+	if (!(efp->opts.terms & EFP_TERM_ELEC) || !efp->opts.enable_fmm)
+		return EFP_RESULT_SUCCESS;
+
+	efp_balance_work(efp, compute_elec_fmm_range, &energy);
+
+	/* far field is computed by the master process */
+	if (efp_mpi_rank() == 0)
+		energy += compute_elec_fmm_far(efp);
+
+	efp->energy.electrostatic += energy;
+
+	return EFP_RESULT_SUCCESS;
+}
@@ -25,28 +25,7 @@
  */
 
 #include "elec.h"
-
-static double
-octupole_sum(const double *oct, const vec_t *dr)
-{
-	/* order in which octupoles are stored */
-	enum { xxx = 0, yyy, zzz, xxy, xxz, xyy, yyz, xzz, yzz, xyz };
-
-	double sum = 0.0;
-
-	sum += oct[xxx] * dr->x * dr->x * dr->x;
-	sum += oct[yyy] * dr->y * dr->y * dr->y;
-	sum += oct[zzz] * dr->z * dr->z * dr->z;
-	sum += oct[xxy] * dr->x * dr->x * dr->y * 3.0;
-	sum += oct[xxz] * dr->x * dr->x * dr->z * 3.0;
-	sum += oct[xyy] * dr->x * dr->y * dr->y * 3.0;
-	sum += oct[yyz] * dr->y * dr->y * dr->z * 3.0;
-	sum += oct[xzz] * dr->x * dr->z * dr->z * 3.0;
-	sum += oct[yzz] * dr->y * dr->z * dr->z * 3.0;
-	sum += oct[xyz] * dr->x * dr->y * dr->z * 6.0;
-
-	return sum;
-}
+#include "private.h"
 
 static double
 octupole_sum_xyz(const double *oct, const vec_t *dr, size_t axis)
@@ -471,3 +450,395 @@ efp_quadrupole_quadrupole_grad(const double *quad1, const double *quad2,
 	add2->y = 2.0 / 3.0 * (q2q1tt[2][0] - q2q1tt[0][2]);
 	add2->z = 2.0 / 3.0 * (q2q1tt[0][1] - q2q1tt[1][0]);
 }
+
+/*
+ * Kernels below compute interactions of one multipole point with all points
+ * of another fragment stored in structure-of-arrays layout. Loops over
+ * partner points contain only arithmetic on scalars so that the compiler
+ * can process several partners per vector instruction. Quadrupoles are
+ * handled as full symmetric matrices and the formulas are equivalent to the
+ * per-pair functions above.
+ */
+
+#define SOA_BLOCK 64
+
+static inline vec_t
+load_dipole(const double *dip, size_t stride)
+{
+	vec_t out = { dip[0], dip[stride], dip[2 * stride] };
+
+	return out;
+}
+
+static inline mat_t
+load_quadrupole(const double *quad, size_t stride)
+{
+	/* order in which quadrupoles are stored */
+	enum { xx = 0, yy, zz, xy, xz, yz };
+
+	mat_t out = { quad[xx * stride], quad[xy * stride], quad[xz * stride],
+		      quad[xy * stride], quad[yy * stride], quad[yz * stride],
+		      quad[xz * stride], quad[yz * stride], quad[zz * stride] };
+
+	return out;
+}
+
+/* returns contraction of octupole with dr twice */
+static inline vec_t
+contract_octupole(const double *oct, size_t stride, const vec_t *dr)
+{
+	/* order in which octupoles are stored */
+	enum { xxx = 0, yyy, zzz, xxy, xxz, xyy, yyz, xzz, yzz, xyz };
+
+	double x2 = dr->x * dr->x, y2 = dr->y * dr->y, z2 = dr->z * dr->z;
+	double xy = 2.0 * dr->x * dr->y;
+	double xz = 2.0 * dr->x * dr->z;
+	double yz = 2.0 * dr->y * dr->z;
+
+	vec_t out = {
+		oct[xxx * stride] * x2 + oct[xyy * stride] * y2 +
+		oct[xzz * stride] * z2 + oct[xxy * stride] * xy +
+		oct[xxz * stride] * xz + oct[xyz * stride] * yz,
+
+		oct[xxy * stride] * x2 + oct[yyy * stride] * y2 +
+		oct[yzz * stride] * z2 + oct[xyy * stride] * xy +
+		oct[xyz * stride] * xz + oct[yyz * stride] * yz,
+
+		oct[xxz * stride] * x2 + oct[yyz * stride] * y2 +
+		oct[zzz * stride] * z2 + oct[xyz * stride] * xy +
+		oct[xzz * stride] * xz + oct[yzz * stride] * yz
+	};
+
+	return out;
+}
+
+static inline double
+mat_ddot(const mat_t *a, const mat_t *b)
+{
+	return a->xx * b->xx + a->xy * b->xy + a->xz * b->xz +
+	       a->yx * b->yx + a->yy * b->yy + a->yz * b->yz +
+	       a->zx * b->zx + a->zy * b->zy + a->zz * b->zz;
+}
+
+/* returns axial vector of the antisymmetric part of a matrix */
+static inline vec_t
+mat_axial(const mat_t *m)
+{
+	vec_t out = { m->yz - m->zy, m->zx - m->xz, m->xy - m->yx };
+
+	return out;
+}
+
+static inline void
+add_scaled(vec_t *out, double s, const vec_t *v)
+{
+	out->x += s * v->x;
+	out->y += s * v->y;
+	out->z += s * v->z;
+}
+
+double
+efp_mult_mult_energy_soa(const struct multipole_pt *pt_i,
+    const struct multipole_soa *soa, size_t n, const vec_t *cell,
+    const double *damp)
+{
+	size_t stride = soa->stride;
+	double xi = pt_i->x + cell->x;
+	double yi = pt_i->y + cell->y;
+	double zi = pt_i->z + cell->z;
+	vec_t pos_i = { xi, yi, zi };
+	double qi = pt_i->monopole;
+	vec_t di = pt_i->dipole;
+	mat_t quad_i = load_quadrupole(pt_i->quadrupole, 1);
+	double energy = 0.0;
+
+	for (size_t j0 = 0; j0 < n; j0 += SOA_BLOCK) {
+		double r[SOA_BLOCK];
+		size_t nb = n - j0 < SOA_BLOCK ? n - j0 : SOA_BLOCK;
+
+		vec_dist_block(nb, soa->x + j0, soa->y + j0, soa->z + j0,
+		    &pos_i, &vec_zero, r);
+
+#ifdef _OPENMP
+#pragma omp simd reduction(+:energy)
+#endif
+		for (size_t k = 0; k < nb; k++) {
+			size_t j = j0 + k;
+			vec_t dr = { soa->x[j] - xi, soa->y[j] - yi,
+				     soa->z[j] - zi };
+			double qj = soa->monopole[j];
+			vec_t dj = load_dipole(soa->dipole + j, stride);
+			mat_t quad_j = load_quadrupole(soa->quadrupole + j,
+			    stride);
+
+			double ri = 1.0 / r[k];
+			double ri2 = ri * ri;
+			double ri3 = ri2 * ri;
+			double ri5 = ri3 * ri2;
+			double ri7 = ri5 * ri2;
+			double ri9 = ri7 * ri2;
+
+			vec_t qidr = mat_vec(&quad_i, &dr);
+			vec_t qjdr = mat_vec(&quad_j, &dr);
+			vec_t oidr = contract_octupole(pt_i->octupole, 1, &dr);
+			vec_t ojdr = contract_octupole(soa->octupole + j,
+			    stride, &dr);
+			double qiss = vec_dot(&qidr, &dr);
+			double qjss = vec_dot(&qjdr, &dr);
+			double oisss = vec_dot(&oidr, &dr);
+			double ojsss = vec_dot(&ojdr, &dr);
+			double didr = vec_dot(&di, &dr);
+			double djdr = vec_dot(&dj, &dr);
+			double e = 0.0;
+
+			/* monopole - monopole */
+			e += qi * qj * ri * damp[j];
+
+			/* monopole - dipole and dipole - monopole */
+			e += ri3 * (qj * didr - qi * djdr);
+
+			/* monopole - quadrupole and quadrupole - monopole */
+			e += ri5 * (qi * qjss + qj * qiss);
+
+			/* monopole - octupole and octupole - monopole */
+			e += ri7 * (qj * oisss - qi * ojsss);
+
+			/* dipole - dipole */
+			e += ri3 * vec_dot(&di, &dj) - 3.0 * ri5 * didr * djdr;
+
+			/* dipole - quadrupole and quadrupole - dipole */
+			e += 5.0 * ri7 * (qjss * didr - qiss * djdr) -
+			    2.0 * ri5 * (vec_dot(&di, &qjdr) -
+			    vec_dot(&dj, &qidr));
+
+			/* quadrupole - quadrupole */
+			e += (2.0 * ri5 * mat_ddot(&quad_i, &quad_j) -
+			    20.0 * ri7 * vec_dot(&qidr, &qjdr) +
+			    35.0 * ri9 * qiss * qjss) / 3.0;
+
+			energy += e;
+		}
+	}
+
+	return energy;
+}
+
+void
+efp_mult_mult_grad_soa(const struct multipole_pt *pt_i,
+    const struct multipole_soa *soa, size_t n, const vec_t *cell,
+    const vec_t *com_j, const double *gdamp, vec_t *force_out,
+    vec_t *add_i_out, vec_t *torque_j_out)
+{
+	size_t stride = soa->stride;
+	double xi = pt_i->x + cell->x;
+	double yi = pt_i->y + cell->y;
+	double zi = pt_i->z + cell->z;
+	vec_t pos_i = { xi, yi, zi };
+	double qi = pt_i->monopole;
+	vec_t di = pt_i->dipole;
+	mat_t quad_i = load_quadrupole(pt_i->quadrupole, 1);
+	double fx = 0.0, fy = 0.0, fz = 0.0;
+	double aix = 0.0, aiy = 0.0, aiz = 0.0;
+	double tjx = 0.0, tjy = 0.0, tjz = 0.0;
+
+	for (size_t j0 = 0; j0 < n; j0 += SOA_BLOCK) {
+		double r[SOA_BLOCK];
+		size_t nb = n - j0 < SOA_BLOCK ? n - j0 : SOA_BLOCK;
+
+		vec_dist_block(nb, soa->x + j0, soa->y + j0, soa->z + j0,
+		    &pos_i, &vec_zero, r);
+
+#ifdef _OPENMP
+#pragma omp simd reduction(+:fx,fy,fz,aix,aiy,aiz,tjx,tjy,tjz)
+#endif
+		for (size_t k = 0; k < nb; k++) {
+			size_t j = j0 + k;
+			vec_t dr = { soa->x[j] - xi, soa->y[j] - yi,
+				     soa->z[j] - zi };
+			double qj = soa->monopole[j];
+			vec_t dj = load_dipole(soa->dipole + j, stride);
+			mat_t quad_j = load_quadrupole(soa->quadrupole + j,
+			    stride);
+
+			double ri = 1.0 / r[k];
+			double ri2 = ri * ri;
+			double ri3 = ri2 * ri;
+			double ri5 = ri3 * ri2;
+			double ri7 = ri5 * ri2;
+			double ri9 = ri7 * ri2;
+			double ri11 = ri9 * ri2;
+
+			vec_t qidr = mat_vec(&quad_i, &dr);
+			vec_t qjdr = mat_vec(&quad_j, &dr);
+			vec_t oidr = contract_octupole(pt_i->octupole, 1, &dr);
+			vec_t ojdr = contract_octupole(soa->octupole + j,
+			    stride, &dr);
+			double qiss = vec_dot(&qidr, &dr);
+			double qjss = vec_dot(&qjdr, &dr);
+			double oisss = vec_dot(&oidr, &dr);
+			double ojsss = vec_dot(&ojdr, &dr);
+			double didr = vec_dot(&di, &dr);
+			double djdr = vec_dot(&dj, &dr);
+			vec_t force = vec_zero, add_i = vec_zero;
+			vec_t add_j = vec_zero;
+			vec_t t;
+
+			/* monopole - monopole */
+			add_scaled(&force, qi * qj * ri3 * gdamp[j],
+			    &dr);
+
+			/* monopole - dipole */
+			add_scaled(&force, qi * ri3, &dj);
+			add_scaled(&force, -3.0 * qi * ri5 * djdr, &dr);
+			t = vec_cross(&dj, &dr);
+			add_scaled(&add_j, qi * ri3, &t);
+
+			/* dipole - monopole */
+			add_scaled(&force, -qj * ri3, &di);
+			add_scaled(&force, 3.0 * qj * ri5 * didr, &dr);
+			t = vec_cross(&di, &dr);
+			add_scaled(&add_i, qj * ri3, &t);
+
+			/* monopole - quadrupole */
+			add_scaled(&force, 5.0 * qi * ri7 * qjss, &dr);
+			add_scaled(&force, -2.0 * qi * ri5, &qjdr);
+			t = vec_cross(&qjdr, &dr);
+			add_scaled(&add_j, -2.0 * qi * ri5, &t);
+
+			/* quadrupole - monopole */
+			add_scaled(&force, 5.0 * qj * ri7 * qiss, &dr);
+			add_scaled(&force, -2.0 * qj * ri5, &qidr);
+			t = vec_cross(&dr, &qidr);
+			add_scaled(&add_i, -2.0 * qj * ri5, &t);
+
+			/* monopole - octupole */
+			add_scaled(&force, -7.0 * qi * ri9 * ojsss, &dr);
+			add_scaled(&force, 3.0 * qi * ri7, &ojdr);
+			t = vec_cross(&ojdr, &dr);
+			add_scaled(&add_j, 3.0 * qi * ri7, &t);
+
+			/* octupole - monopole */
+			add_scaled(&force, 7.0 * qj * ri9 * oisss, &dr);
+			add_scaled(&force, -3.0 * qj * ri7, &oidr);
+			t = vec_cross(&oidr, &dr);
+			add_scaled(&add_i, 3.0 * qj * ri7, &t);
+
+			/* dipole - dipole */
+			add_scaled(&force, 3.0 * ri5 * vec_dot(&di, &dj) -
+			    15.0 * ri7 * didr * djdr, &dr);
+			add_scaled(&force, 3.0 * ri5 * djdr, &di);
+			add_scaled(&force, 3.0 * ri5 * didr, &dj);
+			t = vec_cross(&di, &dj);
+			add_scaled(&add_i, ri3, &t);
+			add_scaled(&add_j, ri3, &t);
+			t = vec_cross(&di, &dr);
+			add_scaled(&add_i, -3.0 * ri5 * djdr, &t);
+			t = vec_cross(&dj, &dr);
+			add_scaled(&add_j, 3.0 * ri5 * didr, &t);
+
+			/* dipole - quadrupole */
+			{
+				vec_t qd = mat_vec(&quad_j, &di);
+				double g = -10.0 * ri7 * vec_dot(&di, &qjdr) +
+				    35.0 * ri9 * qjss * didr;
+
+				add_scaled(&force, g, &dr);
+				add_scaled(&force, 2.0 * ri5, &qd);
+				add_scaled(&force, -5.0 * ri7 * qjss, &di);
+				add_scaled(&force, -10.0 * ri7 * didr, &qjdr);
+
+				t = vec_cross(&qjdr, &di);
+				add_scaled(&add_i, 2.0 * ri5, &t);
+				t = vec_cross(&di, &dr);
+				add_scaled(&add_i, 5.0 * ri7 * qjss, &t);
+				t = vec_cross(&qjdr, &dr);
+				add_scaled(&add_j, -10.0 * ri7 * didr, &t);
+				t = vec_cross(&di, &qjdr);
+				add_scaled(&add_j, -2.0 * ri5, &t);
+				t = vec_cross(&dr, &qd);
+				add_scaled(&add_j, -2.0 * ri5, &t);
+			}
+
+			/* quadrupole - dipole */
+			{
+				vec_t qd = mat_vec(&quad_i, &dj);
+				double g = -10.0 * ri7 * vec_dot(&dj, &qidr) +
+				    35.0 * ri9 * qiss * djdr;
+
+				add_scaled(&force, -g, &dr);
+				add_scaled(&force, -2.0 * ri5, &qd);
+				add_scaled(&force, 5.0 * ri7 * qiss, &dj);
+				add_scaled(&force, 10.0 * ri7 * djdr, &qidr);
+
+				t = vec_cross(&qidr, &dj);
+				add_scaled(&add_j, 2.0 * ri5, &t);
+				t = vec_cross(&dj, &dr);
+				add_scaled(&add_j, 5.0 * ri7 * qiss, &t);
+				t = vec_cross(&qidr, &dr);
+				add_scaled(&add_i, -10.0 * ri7 * djdr, &t);
+				t = vec_cross(&dj, &qidr);
+				add_scaled(&add_i, -2.0 * ri5, &t);
+				t = vec_cross(&dr, &qd);
+				add_scaled(&add_i, -2.0 * ri5, &t);
+			}
+
+			/* quadrupole - quadrupole */
+			vec_t qiqjdr = mat_vec(&quad_i, &qjdr);
+			vec_t qjqidr = mat_vec(&quad_j, &qidr);
+			double g = 30.0 * ri7 * mat_ddot(&quad_i, &quad_j) -
+			    420.0 * ri9 * vec_dot(&qidr, &qjdr) +
+			    945.0 * ri11 * qiss * qjss;
+
+			add_scaled(&force, g / 9.0, &dr);
+			add_scaled(&force, 60.0 / 9.0 * ri7, &qiqjdr);
+			add_scaled(&force, 60.0 / 9.0 * ri7, &qjqidr);
+			add_scaled(&force, -210.0 / 9.0 * ri9 * qjss, &qidr);
+			add_scaled(&force, -210.0 / 9.0 * ri9 * qiss, &qjdr);
+
+			/* quadrupoles are symmetric so
+			 * axial(qj qi) = -axial(qi qj) */
+			mat_t qiqj = mat_mat(&quad_i, &quad_j);
+			vec_t qiqj_ax = mat_axial(&qiqj);
+
+			add_scaled(&add_i, 4.0 / 3.0 * ri5, &qiqj_ax);
+			add_scaled(&add_j, 4.0 / 3.0 * ri5, &qiqj_ax);
+			t = vec_cross(&qiqjdr, &dr);
+			add_scaled(&add_i, -20.0 / 3.0 * ri7, &t);
+			t = vec_cross(&qjqidr, &dr);
+			add_scaled(&add_j, 20.0 / 3.0 * ri7, &t);
+			t = vec_cross(&qidr, &qjdr);
+			add_scaled(&add_i, -20.0 / 3.0 * ri7, &t);
+			add_scaled(&add_j, -20.0 / 3.0 * ri7, &t);
+			t = vec_cross(&qidr, &dr);
+			add_scaled(&add_i, 70.0 / 3.0 * ri9 * qjss, &t);
+			t = vec_cross(&qjdr, &dr);
+			add_scaled(&add_j, -70.0 / 3.0 * ri9 * qiss, &t);
+
+			/* torque on fragment j about its center of mass */
+			vec_t arm = { soa->x[j] - com_j->x,
+				      soa->y[j] - com_j->y,
+				      soa->z[j] - com_j->z };
+			vec_t torque_j = vec_cross(&arm, &force);
+
+			fx += force.x;
+			fy += force.y;
+			fz += force.z;
+			aix += add_i.x;
+			aiy += add_i.y;
+			aiz += add_i.z;
+			tjx += torque_j.x + add_j.x;
+			tjy += torque_j.y + add_j.y;
+			tjz += torque_j.z + add_j.z;
+		}
+	}
+
+	force_out->x = fx;
+	force_out->y = fy;
+	force_out->z = fz;
+	add_i_out->x = aix;
+	add_i_out->y = aiy;
+	add_i_out->z = aiz;
+	torque_j_out->x = tjx;
+	torque_j_out->y = tjy;
+	torque_j_out->z = tjz;
+}
@@ -0,0 +1,333 @@
+/*-
+ * Copyright (c) 2012-2017 Ilya Kaliman
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef EFP_USE_MPI
+#include <mpi.h>
+#endif
+
+#include "balance.h"
+#include "elec.h"
+#include "fmm.h"
+#include "private.h"
+
+/* slabs of the potential grid are split into tiles of ESP_TILE x ESP_TILE
+ * points which are the units of work of threads and processes */
+#define ESP_TILE 8
+
+/* sources closer than this to a grid point are skipped, so that points on
+ * nuclei get finite potential of all other sources */
+#define ESP_MIN_DIST 1.0e-8
+
+struct esp_tile {
+	size_t n;                            /* number of points */
+	vec_t center;                        /* center of bounding sphere */
+	double radius;                       /* radius of bounding sphere */
+	double x[ESP_TILE * ESP_TILE];       /* coordinates of points */
+	double y[ESP_TILE * ESP_TILE];
+	double z[ESP_TILE * ESP_TILE];
+	double r[ESP_TILE * ESP_TILE];       /* distances to current source */
+	double pot[ESP_TILE * ESP_TILE];     /* potential at points */
+};
+
+/* Adds potential of nuclei, multipoles and induced dipoles of a fragment at
+ * points of a tile. */
+static void
+add_frag_potential(const struct efp *efp, size_t frag_idx,
+    struct esp_tile *tile)
+{
+	const struct frag *frag = efp->frags + frag_idx;
+	size_t n = tile->n;
+
+	for (size_t j = 0; j < frag->n_atoms; j++) {
+		const struct efp_atom *at = frag->atoms + j;
+
+		vec_dist_block(n, tile->x, tile->y, tile->z, CVEC(at->x),
+		    &vec_zero, tile->r);
+
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+		for (size_t k = 0; k < n; k++) {
+			double ri = tile->r[k] > ESP_MIN_DIST ?
+			    1.0 / tile->r[k] : 0.0;
+
+			tile->pot[k] += at->znuc * ri;
+		}
+	}
+
+	for (size_t j = 0; j < frag->n_multipole_pts; j++) {
+		const struct multipole_pt *pt = frag->multipole_pts + j;
+
+		vec_dist_block(n, tile->x, tile->y, tile->z, CVEC(pt->x),
+		    &vec_zero, tile->r);
+
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+		for (size_t k = 0; k < n; k++) {
+			vec_t dr = {
+				tile->x[k] - pt->x,
+				tile->y[k] - pt->y,
+				tile->z[k] - pt->z
+			};
+
+			double ri = tile->r[k] > ESP_MIN_DIST ?
+			    1.0 / tile->r[k] : 0.0;
+			double ri2 = ri * ri;
+			double ri3 = ri2 * ri;
+			double ri5 = ri3 * ri2;
+			double ri7 = ri5 * ri2;
+
+			tile->pot[k] += pt->monopole * ri +
+			    vec_dot(&pt->dipole, &dr) * ri3 +
+			    quadrupole_sum(pt->quadrupole, &dr) * ri5 +
+			    octupole_sum(pt->octupole, &dr) * ri7;
+		}
+	}
+
+	if (!(efp->opts.terms & EFP_TERM_POL))
+		return;
+
+	for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+		const struct polarizable_pt *pt = frag->polarizable_pts + j;
+		const vec_t *dipole = efp->indip + frag->polarizable_offset + j;
+
+		vec_dist_block(n, tile->x, tile->y, tile->z, CVEC(pt->x),
+		    &vec_zero, tile->r);
+
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+		for (size_t k = 0; k < n; k++) {
+			vec_t dr = {
+				tile->x[k] - pt->x,
+				tile->y[k] - pt->y,
+				tile->z[k] - pt->z
+			};
+
+			double ri = tile->r[k] > ESP_MIN_DIST ?
+			    1.0 / tile->r[k] : 0.0;
+
+			tile->pot[k] += vec_dot(dipole, &dr) * ri * ri * ri;
+		}
+	}
+}
+
+/* Builds multipole expansions of all sources in the first set of sites of
+ * the octree. */
+static enum efp_result
+setup_fmm(struct efp *efp)
+{
+	struct fmm *fmm = &efp->fmm;
+	enum efp_result res;
+
+	if ((res = efp_fmm_update(efp, fmm)))
+		return res;
+
+	efp_fmm_clear(fmm);
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+		struct pme_site site;
+
+		for (size_t j = 0; j < efp_pme_get_site_count(frag); j++) {
+			efp_pme_get_site(frag, j, &site);
+			efp_fmm_add_site(fmm, i, &site, 0);
+		}
+		for (size_t j = 0; j < frag->n_multipole_pts; j++) {
+			const struct multipole_pt *pt = frag->multipole_pts + j;
+
+			efp_fmm_add_octupole(fmm, i, CVEC(pt->x), pt->octupole,
+			    0);
+		}
+		if (!(efp->opts.terms & EFP_TERM_POL))
+			continue;
+
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+			const struct polarizable_pt *pt =
+			    frag->polarizable_pts + j;
+
+			memset(&site, 0, sizeof(site));
+			site.r = *CVEC(pt->x);
+			site.d = efp->indip[frag->polarizable_offset + j];
+			site.rank = 1;
+			efp_fmm_add_site(fmm, i, &site, 0);
+		}
+	}
+
+	efp_fmm_solve(fmm);
+
+	return EFP_RESULT_SUCCESS;
+}
+
+/* Barnes-Hut traversal of the octree. Cells far enough from the tile act
+ * through a local expansion about the tile center, fragments of other
+ * leaf cells act directly. */
+static void
+visit_cell(const struct efp *efp, size_t cell_idx, struct esp_tile *tile,
+    double *local)
+{
+	const struct fmm *fmm = &efp->fmm;
+	const struct fmm_cell *cell = fmm->cells + cell_idx;
+	double dist = vec_dist(&cell->center, &tile->center);
+
+	if (cell->radius + tile->radius < fmm->theta * dist) {
+		efp_fmm_add_local(fmm, cell_idx, 0, &tile->center, local);
+		return;
+	}
+	if (cell->n_child == 0) {
+		for (size_t i = cell->begin; i < cell->end; i++)
+			add_frag_potential(efp, fmm->frag_idx[i], tile);
+		return;
+	}
+	for (size_t c = cell->child; c < cell->child + cell->n_child; c++)
+		visit_cell(efp, c, tile, local);
+}
+
+/* Computes potential at tile tile_idx of slab ix and stores it in slab. */
+static void
+compute_tile(const struct efp *efp, const double *origin, const double *axes,
+    const size_t *n, size_t ix, size_t tile_idx, double *slab)
+{
+	size_t n_tile_z = (n[2] + ESP_TILE - 1) / ESP_TILE;
+	size_t iy0 = tile_idx / n_tile_z * ESP_TILE;
+	size_t iz0 = tile_idx % n_tile_z * ESP_TILE;
+	size_t ny = n[1] - iy0 < ESP_TILE ? n[1] - iy0 : ESP_TILE;
+	size_t nz = n[2] - iz0 < ESP_TILE ? n[2] - iz0 : ESP_TILE;
+	struct esp_tile tile;
+
+	tile.n = ny * nz;
+	tile.center = vec_zero;
+	tile.radius = 0.0;
+
+	for (size_t iy = 0, k = 0; iy < ny; iy++) {
+		for (size_t iz = 0; iz < nz; iz++, k++) {
+			double a = (double)ix;
+			double b = (double)(iy0 + iy);
+			double c = (double)(iz0 + iz);
+
+			tile.x[k] = origin[0] + a * axes[0] + b * axes[3] +
+			    c * axes[6];
+			tile.y[k] = origin[1] + a * axes[1] + b * axes[4] +
+			    c * axes[7];
+			tile.z[k] = origin[2] + a * axes[2] + b * axes[5] +
+			    c * axes[8];
+			tile.pot[k] = 0.0;
+			tile.center.x += tile.x[k] / tile.n;
+			tile.center.y += tile.y[k] / tile.n;
+			tile.center.z += tile.z[k] / tile.n;
+		}
+	}
+
+	if (efp->opts.enable_fmm) {
+		double local[FMM_MAX_COEF], phi[1];
+
+		for (size_t k = 0; k < tile.n; k++) {
+			vec_t r = { tile.x[k], tile.y[k], tile.z[k] };
+			double dist = vec_dist(&r, &tile.center);
+
+			if (dist > tile.radius)
+				tile.radius = dist;
+		}
+
+		memset(local, 0, efp->fmm.n_coef * sizeof(double));
+		visit_cell(efp, 0, &tile, local);
+
+		for (size_t k = 0; k < tile.n; k++) {
+			vec_t r = { tile.x[k], tile.y[k], tile.z[k] };
+
+			efp_fmm_eval_local(&efp->fmm, local, &tile.center, &r,
+			    0, phi);
+			tile.pot[k] += phi[0];
+		}
+	}
+	else {
+		for (size_t i = 0; i < efp->n_frag; i++)
+			add_frag_potential(efp, i, &tile);
+	}
+
+	for (size_t iy = 0, k = 0; iy < ny; iy++)
+		for (size_t iz = 0; iz < nz; iz++, k++)
+			slab[(iy0 + iy) * n[2] + iz0 + iz] = tile.pot[k];
+}
+
+EFP_EXPORT enum efp_result
+efp_get_electrostatic_potential_grid(struct efp *efp, const double *origin,
+    const double *axes, const size_t *n, efp_potential_slab_fn fn,
+    void *user_data)
+{
+	size_t n_slab, n_tiles;
+	double *slab;
+	int rank = 0, size = 1;
+	enum efp_result res;
+
+	assert(efp);
+	assert(origin);
+	assert(axes);
+	assert(n);
+	assert(fn);
+
+	if (efp->opts.enable_fmm)
+		if ((res = setup_fmm(efp)))
+			return res;
+
+	n_slab = n[1] * n[2];
+	n_tiles = ((n[1] + ESP_TILE - 1) / ESP_TILE) *
+	    ((n[2] + ESP_TILE - 1) / ESP_TILE);
+
+	slab = (double *)efp_malloc(efp, (n_slab + 1) * sizeof(double));
+	if (slab == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+#ifdef EFP_USE_MPI
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &size);
+#endif
+
+	for (size_t ix = 0; ix < n[0]; ix++) {
+		memset(slab, 0, n_slab * sizeof(double));
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+		for (size_t k = (size_t)rank; k < n_tiles; k += (size_t)size)
+			compute_tile(efp, origin, axes, n, ix, k, slab);
+
+		efp_allreduce(slab, n_slab);
+
+		if ((res = fn(ix, n_slab, slab, user_data))) {
+			free(slab);
+			return res;
+		}
+	}
+
+	free(slab);
+	return EFP_RESULT_SUCCESS;
+}
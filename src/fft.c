@@ -0,0 +1,333 @@
+/*-
+ * Copyright (c) 2012-2017 Ilya Kaliman
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "fft.h"
+#include "mathutil.h"
+#include "util.h"
+
+/* Index helpers for the self-sorting mixed-radix transform. Input of a
+ * pass with radix p is viewed as cc[k][q][i] and output as ch[j][k][i]
+ * with dimensions l1, p and ido. */
+#define CC(i, q, k) (cc + 2 * ((i) + ido * ((q) + p * (k))))
+#define CH(i, k, j) (ch + 2 * ((i) + ido * ((k) + l1 * (j))))
+
+/* Stores y multiplied by twiddle factor w, which is conjugated for
+ * backward transform (sign = -1). */
+static inline void
+store_twiddle(double *out, double yr, double yi, const double *w, double sign)
+{
+	double wr = w[0], wi = sign * w[1];
+
+	out[0] = yr * wr - yi * wi;
+	out[1] = yr * wi + yi * wr;
+}
+
+static void
+pass2(const double *cc, double *ch, size_t l1, size_t ido,
+    const double *tw, double sign)
+{
+	const size_t p = 2;
+
+	for (size_t k = 0; k < l1; k++) {
+		for (size_t i = 0; i < ido; i++) {
+			const double *x0 = CC(i, 0, k), *x1 = CC(i, 1, k);
+
+			CH(i, k, 0)[0] = x0[0] + x1[0];
+			CH(i, k, 0)[1] = x0[1] + x1[1];
+			store_twiddle(CH(i, k, 1), x0[0] - x1[0],
+			    x0[1] - x1[1], tw + 2 * (l1 * i), sign);
+		}
+	}
+}
+
+static void
+pass3(const double *cc, double *ch, size_t l1, size_t ido,
+    const double *tw, double sign)
+{
+	const size_t p = 3;
+	const double c = -0.5, s = -sign * 0.86602540378443864676;
+
+	for (size_t k = 0; k < l1; k++) {
+		for (size_t i = 0; i < ido; i++) {
+			const double *x0 = CC(i, 0, k), *x1 = CC(i, 1, k);
+			const double *x2 = CC(i, 2, k);
+			double tr = x1[0] + x2[0], ti = x1[1] + x2[1];
+			double dr = x1[0] - x2[0], di = x1[1] - x2[1];
+			double ar = x0[0] + c * tr, ai = x0[1] + c * ti;
+
+			CH(i, k, 0)[0] = x0[0] + tr;
+			CH(i, k, 0)[1] = x0[1] + ti;
+			store_twiddle(CH(i, k, 1), ar - s * di, ai + s * dr,
+			    tw + 2 * (l1 * i), sign);
+			store_twiddle(CH(i, k, 2), ar + s * di, ai - s * dr,
+			    tw + 2 * (2 * l1 * i), sign);
+		}
+	}
+}
+
+static void
+pass4(const double *cc, double *ch, size_t l1, size_t ido,
+    const double *tw, double sign)
+{
+	const size_t p = 4;
+
+	for (size_t k = 0; k < l1; k++) {
+		for (size_t i = 0; i < ido; i++) {
+			const double *x0 = CC(i, 0, k), *x1 = CC(i, 1, k);
+			const double *x2 = CC(i, 2, k), *x3 = CC(i, 3, k);
+			double a0r = x0[0] + x2[0], a0i = x0[1] + x2[1];
+			double a1r = x0[0] - x2[0], a1i = x0[1] - x2[1];
+			double b0r = x1[0] + x3[0], b0i = x1[1] + x3[1];
+			double b1r = x1[0] - x3[0], b1i = x1[1] - x3[1];
+
+			/* multiplication by -i for forward transform */
+			double rr = sign * b1i, ri = -sign * b1r;
+
+			CH(i, k, 0)[0] = a0r + b0r;
+			CH(i, k, 0)[1] = a0i + b0i;
+			store_twiddle(CH(i, k, 1), a1r + rr, a1i + ri,
+			    tw + 2 * (l1 * i), sign);
+			store_twiddle(CH(i, k, 2), a0r - b0r, a0i - b0i,
+			    tw + 2 * (2 * l1 * i), sign);
+			store_twiddle(CH(i, k, 3), a1r - rr, a1i - ri,
+			    tw + 2 * (3 * l1 * i), sign);
+		}
+	}
+}
+
+static void
+pass5(const double *cc, double *ch, size_t l1, size_t ido,
+    const double *tw, double sign)
+{
+	const size_t p = 5;
+	const double c1 = 0.30901699437494742410;
+	const double c2 = -0.80901699437494742410;
+	const double s1 = -sign * 0.95105651629515357212;
+	const double s2 = -sign * 0.58778525229247312917;
+
+	for (size_t k = 0; k < l1; k++) {
+		for (size_t i = 0; i < ido; i++) {
+			const double *x0 = CC(i, 0, k), *x1 = CC(i, 1, k);
+			const double *x2 = CC(i, 2, k), *x3 = CC(i, 3, k);
+			const double *x4 = CC(i, 4, k);
+			double t1r = x1[0] + x4[0], t1i = x1[1] + x4[1];
+			double t2r = x2[0] + x3[0], t2i = x2[1] + x3[1];
+			double d1r = x1[0] - x4[0], d1i = x1[1] - x4[1];
+			double d2r = x2[0] - x3[0], d2i = x2[1] - x3[1];
+			double a1r = x0[0] + c1 * t1r + c2 * t2r;
+			double a1i = x0[1] + c1 * t1i + c2 * t2i;
+			double a2r = x0[0] + c2 * t1r + c1 * t2r;
+			double a2i = x0[1] + c2 * t1i + c1 * t2i;
+			double b1r = s1 * d1r + s2 * d2r;
+			double b1i = s1 * d1i + s2 * d2i;
+			double b2r = s2 * d1r - s1 * d2r;
+			double b2i = s2 * d1i - s1 * d2i;
+
+			CH(i, k, 0)[0] = x0[0] + t1r + t2r;
+			CH(i, k, 0)[1] = x0[1] + t1i + t2i;
+			store_twiddle(CH(i, k, 1), a1r - b1i, a1i + b1r,
+			    tw + 2 * (l1 * i), sign);
+			store_twiddle(CH(i, k, 2), a2r - b2i, a2i + b2r,
+			    tw + 2 * (2 * l1 * i), sign);
+			store_twiddle(CH(i, k, 3), a2r + b2i, a2i - b2r,
+			    tw + 2 * (3 * l1 * i), sign);
+			store_twiddle(CH(i, k, 4), a1r + b1i, a1i - b1r,
+			    tw + 2 * (4 * l1 * i), sign);
+		}
+	}
+}
+
+#undef CC
+#undef CH
+
+/* Transforms all lines of the grid along the given axis. Each line is
+ * copied to a contiguous buffer and transformed by a sequence of passes
+ * which alternate between two buffers. */
+static void
+fft_axis(const struct fft *fft, double *data, size_t axis, double sign)
+{
+	size_t n = fft->n[axis];
+	size_t stride = 1, n_outer = 1;
+
+	for (size_t a = axis + 1; a < 3; a++)
+		stride *= fft->n[a];
+	for (size_t a = 0; a < axis; a++)
+		n_outer *= fft->n[a];
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) num_threads(fft->n_thr)
+#endif
+	for (size_t line = 0; line < n_outer * stride; line++) {
+		size_t outer = line / stride, inner = line % stride;
+		double *ptr = data + 2 * (outer * n * stride + inner);
+		double *buf = fft->work, *tmp;
+		size_t l1 = 1;
+
+#ifdef _OPENMP
+		buf += (size_t)omp_get_thread_num() * fft->work_size;
+#endif
+		tmp = buf + 2 * n;
+
+		for (size_t k = 0; k < n; k++) {
+			buf[2 * k] = ptr[2 * k * stride];
+			buf[2 * k + 1] = ptr[2 * k * stride + 1];
+		}
+
+		for (size_t f = 0; f < fft->n_factors[axis]; f++) {
+			size_t p = fft->factors[axis][f];
+			double *swap;
+
+			size_t ido = n / (l1 * p);
+			const double *tw = fft->twiddle[axis];
+
+			switch (p) {
+			case 2:
+				pass2(buf, tmp, l1, ido, tw, sign);
+				break;
+			case 3:
+				pass3(buf, tmp, l1, ido, tw, sign);
+				break;
+			case 4:
+				pass4(buf, tmp, l1, ido, tw, sign);
+				break;
+			case 5:
+				pass5(buf, tmp, l1, ido, tw, sign);
+				break;
+			}
+
+			swap = buf;
+			buf = tmp;
+			tmp = swap;
+			l1 *= p;
+		}
+
+		for (size_t k = 0; k < n; k++) {
+			ptr[2 * k * stride] = buf[2 * k];
+			ptr[2 * k * stride + 1] = buf[2 * k + 1];
+		}
+	}
+}
+
+/* Returns the smallest number not less than n which has no prime factors
+ * other than 2, 3 and 5. */
+size_t
+efp_fft_good_size(size_t n)
+{
+	for (;; n++) {
+		size_t m = n;
+
+		while (m % 2 == 0)
+			m /= 2;
+		while (m % 3 == 0)
+			m /= 3;
+		while (m % 5 == 0)
+			m /= 5;
+
+		if (m <= 1)
+			return n > 0 ? n : 1;
+	}
+}
+
+enum efp_result
+efp_fft_init(struct efp *efp, struct fft *fft, const size_t *n)
+{
+	size_t max_n = 0;
+
+	memset(fft, 0, sizeof(*fft));
+
+	for (size_t a = 0; a < 3; a++) {
+		if (efp_fft_good_size(n[a]) != n[a])
+			return EFP_RESULT_FATAL;
+
+		fft->n[a] = n[a];
+		fft->n_factors[a] = 0;
+
+		for (size_t m = n[a]; m > 1; ) {
+			size_t p = m % 4 == 0 ? 4 : m % 2 == 0 ? 2 :
+			    m % 3 == 0 ? 3 : 5;
+
+			fft->factors[a][fft->n_factors[a]++] = p;
+			m /= p;
+		}
+
+		fft->twiddle[a] = (double *)efp_malloc(efp,
+		    2 * n[a] * sizeof(double));
+
+		if (fft->twiddle[a] == NULL)
+			return EFP_RESULT_NO_MEMORY;
+
+		for (size_t k = 0; k < n[a]; k++) {
+			fft->twiddle[a][2 * k] = cos(2.0 * PI * k / n[a]);
+			fft->twiddle[a][2 * k + 1] = -sin(2.0 * PI * k / n[a]);
+		}
+		if (n[a] > max_n)
+			max_n = n[a];
+	}
+
+#ifdef _OPENMP
+	fft->n_thr = (size_t)omp_get_max_threads();
+#else
+	fft->n_thr = 1;
+#endif
+	fft->work_size = 4 * max_n;
+	fft->work = (double *)efp_malloc(efp, fft->n_thr * fft->work_size *
+	    sizeof(double));
+
+	if (fft->work == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	return EFP_RESULT_SUCCESS;
+}
+
+void
+efp_fft_forward(const struct fft *fft, double *data)
+{
+	for (size_t a = 0; a < 3; a++)
+		fft_axis(fft, data, a, 1.0);
+}
+
+void
+efp_fft_backward(const struct fft *fft, double *data)
+{
+	for (size_t a = 0; a < 3; a++)
+		fft_axis(fft, data, a, -1.0);
+}
+
+void
+efp_fft_free(struct fft *fft)
+{
+	for (size_t a = 0; a < 3; a++)
+		free(fft->twiddle[a]);
+
+	free(fft->work);
+	memset(fft, 0, sizeof(*fft));
+}
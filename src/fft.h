@@ -0,0 +1,55 @@
+/*-
+ * Copyright (c) 2012-2017 Ilya Kaliman
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef LIBEFP_FFT_H
+#define LIBEFP_FFT_H
+
+#include "efp.h"
+
+/* Complex 3D discrete Fourier transform for dimensions which are products
+ * of powers of 2, 3 and 5. Data are stored as interleaved real and
+ * imaginary parts in row-major order. Transforms are not normalized, so
+ * backward transform of forward transform multiplies data by the number
+ * of grid points. */
+#define FFT_MAX_FACTORS 64
+
+struct fft {
+	size_t n[3];         /* transform dimensions */
+	size_t n_factors[3]; /* number of radices for each dimension */
+	size_t factors[3][FFT_MAX_FACTORS]; /* radices 2, 3, 4 and 5 */
+	double *twiddle[3];  /* exp(-2 pi i k / n) for each dimension */
+	size_t n_thr;        /* number of work buffers */
+	size_t work_size;    /* size of each work buffer */
+	double *work;        /* per-thread line buffers */
+};
+
+size_t efp_fft_good_size(size_t);
+enum efp_result efp_fft_init(struct efp *, struct fft *, const size_t *);
+void efp_fft_forward(const struct fft *, double *);
+void efp_fft_backward(const struct fft *, double *);
+void efp_fft_free(struct fft *);
+
+#endif /* LIBEFP_FFT_H */
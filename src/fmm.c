@@ -0,0 +1,1050 @@
+/*-
+ * Copyright (c) 2012-2017 Ilya Kaliman
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "elec.h"
+#include "private.h"
+
+/* default expansion order */
+#define FMM_DEFAULT_ORDER 8
+
+/* default opening angle */
+#define FMM_DEFAULT_THETA 0.5
+
+/* cells with at most this many fragments are not split */
+#define FMM_LEAF_SIZE 8
+
+/* cells smaller than the root by this factor are not split */
+#define FMM_MIN_CELL 1.0e-9
+
+/* minimum distance in bohr between points of cells which interact through
+ * expansions; short range damping of such pairs is negligible */
+#define FMM_MIN_DIST 15.0
+
+#define NO_IDX SIZE_MAX
+
+static size_t
+get_coef_count(size_t order)
+{
+	return (order + 1) * (order + 2) * (order + 3) / 6;
+}
+
+static size_t
+get_pow_idx(const struct fmm *fmm, size_t a, size_t b, size_t c)
+{
+	size_t n = fmm->order + 1;
+
+	return fmm->pow_idx[(a * n + b) * n + c];
+}
+
+static void
+free_tables(struct fmm *fmm)
+{
+	free(fmm->pow);
+	free(fmm->pow_idx);
+	free(fmm->fact);
+	free(fmm->terms);
+	fmm->pow = NULL;
+	fmm->pow_idx = NULL;
+	fmm->fact = NULL;
+	fmm->terms = NULL;
+}
+
+/* Enumerates expansion coefficients in the order of increasing total
+ * power and all products of terms with total power within the order. */
+static enum efp_result
+setup_tables(struct efp *efp, struct fmm *fmm, size_t order)
+{
+	size_t n = order + 1, k = 0;
+
+	free_tables(fmm);
+
+	fmm->order = order;
+	fmm->n_coef = get_coef_count(order);
+	fmm->pow = (size_t (*)[3])efp_malloc(efp,
+	    fmm->n_coef * sizeof(*fmm->pow));
+	fmm->pow_idx = (size_t *)efp_malloc(efp, n * n * n * sizeof(size_t));
+	fmm->fact = (double *)efp_malloc(efp, fmm->n_coef * sizeof(double));
+
+	if (fmm->pow == NULL || fmm->pow_idx == NULL || fmm->fact == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	for (size_t l = 0; l < n * n * n; l++)
+		fmm->pow_idx[l] = NO_IDX;
+
+	for (size_t l = 0; l <= order; l++)
+	for (size_t a = l + 1; a-- > 0;)
+	for (size_t b = l - a + 1; b-- > 0;) {
+		size_t c = l - a - b;
+		double f = 1.0;
+
+		for (size_t m = 2; m <= a; m++)
+			f *= m;
+		for (size_t m = 2; m <= b; m++)
+			f *= m;
+		for (size_t m = 2; m <= c; m++)
+			f *= m;
+
+		fmm->pow[k][0] = a;
+		fmm->pow[k][1] = b;
+		fmm->pow[k][2] = c;
+		fmm->pow_idx[(a * n + b) * n + c] = k;
+		fmm->fact[k] = f;
+		k++;
+	}
+
+	fmm->n_terms = 0;
+
+	for (size_t i = 0; i < fmm->n_coef; i++) {
+		const size_t *p = fmm->pow[i];
+
+		fmm->n_terms += get_coef_count(order - p[0] - p[1] - p[2]);
+	}
+
+	fmm->terms = (struct fmm_term *)efp_malloc(efp, fmm->n_terms *
+	    sizeof(struct fmm_term));
+
+	if (fmm->terms == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	k = 0;
+
+	for (size_t i = 0; i < fmm->n_coef; i++) {
+		const size_t *p = fmm->pow[i];
+		size_t l = order - p[0] - p[1] - p[2];
+
+		for (size_t j = 0; j < get_coef_count(l); j++) {
+			const size_t *q = fmm->pow[j];
+
+			fmm->terms[k].i = (unsigned short)i;
+			fmm->terms[k].j = (unsigned short)j;
+			fmm->terms[k].ij = (unsigned short)get_pow_idx(fmm,
+			    p[0] + q[0], p[1] + q[1], p[2] + q[2]);
+			k++;
+		}
+	}
+
+	assert(k == fmm->n_terms);
+	return EFP_RESULT_SUCCESS;
+}
+
+/* Computes terms x^a y^b z^c / (a! b! c!) for all coefficients. */
+static void
+get_powers(const struct fmm *fmm, const vec_t *dr, double *p)
+{
+	double px[FMM_MAX_ORDER + 1], py[FMM_MAX_ORDER + 1];
+	double pz[FMM_MAX_ORDER + 1];
+
+	px[0] = py[0] = pz[0] = 1.0;
+
+	for (size_t l = 1; l <= fmm->order; l++) {
+		px[l] = px[l - 1] * dr->x;
+		py[l] = py[l - 1] * dr->y;
+		pz[l] = pz[l - 1] * dr->z;
+	}
+
+	for (size_t k = 0; k < fmm->n_coef; k++) {
+		const size_t *q = fmm->pow[k];
+
+		p[k] = px[q[0]] * py[q[1]] * pz[q[2]] / fmm->fact[k];
+	}
+}
+
+/* Computes Cartesian derivatives of 1 / r for all coefficients. Taylor
+ * coefficients of 1 / r satisfy the recurrence
+ *
+ * n r^2 a(k) = -(2n - 1) sum_i r_i a(k - e_i) - (n - 1) sum_i a(k - 2e_i)
+ *
+ * where n is the total power of k. */
+static void
+get_derivs(const struct fmm *fmm, const vec_t *dr, double *t)
+{
+	const double *r = (const double *)dr;
+	double r2 = vec_len_2(dr);
+
+	t[0] = 1.0 / sqrt(r2);
+
+	for (size_t k = 1; k < fmm->n_coef; k++) {
+		const size_t *p = fmm->pow[k];
+		size_t n = p[0] + p[1] + p[2];
+		double sum = 0.0;
+
+		for (size_t a = 0; a < 3; a++) {
+			size_t q[3] = { p[0], p[1], p[2] };
+
+			if (q[a] < 1)
+				continue;
+
+			q[a]--;
+			sum -= (2 * n - 1) * r[a] *
+			    t[get_pow_idx(fmm, q[0], q[1], q[2])];
+
+			if (q[a] < 1)
+				continue;
+
+			q[a]--;
+			sum -= (n - 1) * t[get_pow_idx(fmm, q[0], q[1], q[2])];
+		}
+		t[k] = sum / (n * r2);
+	}
+
+	for (size_t k = 0; k < fmm->n_coef; k++)
+		t[k] *= fmm->fact[k];
+}
+
+static enum efp_result
+add_pair(struct efp *efp, struct fmm_pair_list *list, size_t i, size_t j)
+{
+	if (list->n == list->size) {
+		size_t size = list->size ? 2 * list->size : 1024;
+		size_t (*idx)[2];
+
+		idx = (size_t (*)[2])efp_realloc(efp, list->idx,
+		    size * sizeof(*idx));
+		if (idx == NULL)
+			return EFP_RESULT_NO_MEMORY;
+
+		list->idx = idx;
+		list->size = size;
+	}
+	list->idx[list->n][0] = i;
+	list->idx[list->n][1] = j;
+	list->n++;
+
+	return EFP_RESULT_SUCCESS;
+}
+
+static enum efp_result
+add_cell(struct efp *efp, struct fmm *fmm, size_t begin, size_t end,
+    const vec_t *center, double half)
+{
+	struct fmm_cell *cell;
+
+	if (fmm->n_cells == fmm->cells_size) {
+		size_t size = fmm->cells_size ? 2 * fmm->cells_size : 64;
+
+		cell = (struct fmm_cell *)efp_realloc(efp, fmm->cells,
+		    size * sizeof(*cell));
+		if (cell == NULL)
+			return EFP_RESULT_NO_MEMORY;
+
+		fmm->cells = cell;
+		fmm->cells_size = size;
+	}
+
+	/* box of the octant is kept in the bounding box until the tree is
+	 * built */
+	cell = fmm->cells + fmm->n_cells++;
+	cell->begin = begin;
+	cell->end = end;
+	cell->child = 0;
+	cell->n_child = 0;
+	cell->lo = (vec_t){ center->x - half, center->y - half,
+	    center->z - half };
+	cell->hi = (vec_t){ center->x + half, center->y + half,
+	    center->z + half };
+
+	return EFP_RESULT_SUCCESS;
+}
+
+/* Number of points of a fragment which can be sources or targets of
+ * expansions: nuclei, multipole points and polarizable points. */
+static size_t
+get_point_count(const struct frag *frag)
+{
+	return frag->n_atoms + frag->n_multipole_pts + frag->n_polarizable_pts;
+}
+
+static const vec_t *
+get_point(const struct frag *frag, size_t idx)
+{
+	if (idx < frag->n_atoms)
+		return CVEC(frag->atoms[idx].x);
+
+	idx -= frag->n_atoms;
+
+	if (idx < frag->n_multipole_pts)
+		return CVEC(frag->multipole_pts[idx].x);
+
+	idx -= frag->n_multipole_pts;
+
+	return CVEC(frag->polarizable_pts[idx].x);
+}
+
+/* Splits a cell into nonempty octants. */
+static enum efp_result
+split_cell(struct efp *efp, struct fmm *fmm, size_t cell_idx, size_t *buf)
+{
+	struct fmm_cell cell = fmm->cells[cell_idx];
+	size_t count[8], offset[8];
+	double half = 0.25 * (cell.hi.x - cell.lo.x);
+	enum efp_result res;
+
+	vec_t center = {
+		0.5 * (cell.lo.x + cell.hi.x),
+		0.5 * (cell.lo.y + cell.hi.y),
+		0.5 * (cell.lo.z + cell.hi.z)
+	};
+
+	memset(count, 0, sizeof(count));
+
+	for (size_t i = cell.begin; i < cell.end; i++) {
+		const struct frag *frag = efp->frags + fmm->frag_idx[i];
+		size_t oct = (frag->x > center.x ? 1 : 0) |
+			     (frag->y > center.y ? 2 : 0) |
+			     (frag->z > center.z ? 4 : 0);
+
+		buf[i] = oct;
+		count[oct]++;
+	}
+
+	offset[0] = cell.begin;
+
+	for (size_t k = 1; k < 8; k++)
+		offset[k] = offset[k - 1] + count[k - 1];
+
+	/* stable partition of fragments by octants */
+	for (size_t k = 0, i = cell.begin; k < 8; k++)
+		for (size_t l = cell.begin; l < cell.end; l++)
+			if (buf[l] == k)
+				buf[cell.end + i++ - cell.begin] =
+				    fmm->frag_idx[l];
+
+	memcpy(fmm->frag_idx + cell.begin, buf + cell.end,
+	    (cell.end - cell.begin) * sizeof(size_t));
+
+	fmm->cells[cell_idx].child = fmm->n_cells;
+
+	for (size_t k = 0; k < 8; k++) {
+		if (count[k] == 0)
+			continue;
+
+		vec_t c = {
+			center.x + (k & 1 ? half : -half),
+			center.y + (k & 2 ? half : -half),
+			center.z + (k & 4 ? half : -half)
+		};
+
+		if ((res = add_cell(efp, fmm, offset[k], offset[k] + count[k],
+		    &c, half)))
+			return res;
+
+		fmm->cells[cell_idx].n_child++;
+	}
+	return EFP_RESULT_SUCCESS;
+}
+
+/* Sets expansion centers and radii. Centers are taken from the bounding box
+ * of fragment centers, which does not depend on orientations of fragments,
+ * and radii cover all points. Children are processed before parents. */
+static void
+setup_cell_spheres(struct efp *efp, struct fmm *fmm)
+{
+	for (size_t k = fmm->n_cells; k-- > 0;) {
+		struct fmm_cell *cell = fmm->cells + k;
+		vec_t lo = { INFINITY, INFINITY, INFINITY };
+		vec_t hi = { -INFINITY, -INFINITY, -INFINITY };
+
+		for (size_t i = cell->begin; i < cell->end; i++) {
+			const struct frag *frag = efp->frags + fmm->frag_idx[i];
+
+			lo.x = frag->x < lo.x ? frag->x : lo.x;
+			lo.y = frag->y < lo.y ? frag->y : lo.y;
+			lo.z = frag->z < lo.z ? frag->z : lo.z;
+			hi.x = frag->x > hi.x ? frag->x : hi.x;
+			hi.y = frag->y > hi.y ? frag->y : hi.y;
+			hi.z = frag->z > hi.z ? frag->z : hi.z;
+		}
+
+		cell->lo = lo;
+		cell->hi = hi;
+		cell->center.x = 0.5 * (lo.x + hi.x);
+		cell->center.y = 0.5 * (lo.y + hi.y);
+		cell->center.z = 0.5 * (lo.z + hi.z);
+		cell->radius = 0.0;
+
+		if (cell->n_child > 0) {
+			for (size_t c = cell->child;
+			    c < cell->child + cell->n_child; c++) {
+				double r = vec_dist(&cell->center,
+				    &fmm->cells[c].center) +
+				    fmm->cells[c].radius;
+
+				if (r > cell->radius)
+					cell->radius = r;
+			}
+			continue;
+		}
+
+		for (size_t i = cell->begin; i < cell->end; i++) {
+			const struct frag *frag = efp->frags + fmm->frag_idx[i];
+
+			fmm->frag_cell[fmm->frag_idx[i]] = k;
+
+			for (size_t j = 0; j < get_point_count(frag); j++) {
+				double r = vec_dist(&cell->center,
+				    get_point(frag, j));
+
+				if (r > cell->radius)
+					cell->radius = r;
+			}
+		}
+	}
+}
+
+/* Builds the octree over fragment centers of mass. */
+static enum efp_result
+build_tree(struct efp *efp, struct fmm *fmm)
+{
+	vec_t lo = { INFINITY, INFINITY, INFINITY };
+	vec_t hi = { -INFINITY, -INFINITY, -INFINITY };
+	double half, min_half;
+	size_t *buf;
+	enum efp_result res;
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		lo.x = frag->x < lo.x ? frag->x : lo.x;
+		lo.y = frag->y < lo.y ? frag->y : lo.y;
+		lo.z = frag->z < lo.z ? frag->z : lo.z;
+		hi.x = frag->x > hi.x ? frag->x : hi.x;
+		hi.y = frag->y > hi.y ? frag->y : hi.y;
+		hi.z = frag->z > hi.z ? frag->z : hi.z;
+		fmm->frag_idx[i] = i;
+	}
+
+	vec_t center = {
+		0.5 * (lo.x + hi.x),
+		0.5 * (lo.y + hi.y),
+		0.5 * (lo.z + hi.z)
+	};
+
+	half = 0.5 * (hi.x - lo.x);
+	half = 0.5 * (hi.y - lo.y) > half ? 0.5 * (hi.y - lo.y) : half;
+	half = 0.5 * (hi.z - lo.z) > half ? 0.5 * (hi.z - lo.z) : half;
+	min_half = FMM_MIN_CELL * half;
+
+	buf = (size_t *)efp_scratch_alloc(efp,
+	    2 * efp->n_frag * sizeof(size_t));
+	if (buf == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	fmm->n_cells = 0;
+
+	if ((res = add_cell(efp, fmm, 0, efp->n_frag, &center, half)))
+		goto error;
+
+	/* cells are split in breadth-first order so that children of each
+	 * cell are stored next to each other */
+	for (size_t k = 0; k < fmm->n_cells; k++) {
+		const struct fmm_cell *cell = fmm->cells + k;
+
+		if (cell->end - cell->begin <= FMM_LEAF_SIZE ||
+		    cell->hi.x - cell->lo.x <= 2.0 * min_half)
+			continue;
+
+		if ((res = split_cell(efp, fmm, k, buf)))
+			goto error;
+	}
+
+	setup_cell_spheres(efp, fmm);
+	res = EFP_RESULT_SUCCESS;
+error:
+	efp_scratch_free(efp, buf);
+	return res;
+}
+
+static enum efp_result
+add_near_cells(struct efp *efp, const struct fmm *fmm, size_t a, size_t b,
+    struct fmm_pair_list *near)
+{
+	const struct fmm_cell *ca = fmm->cells + a;
+	const struct fmm_cell *cb = fmm->cells + b;
+	enum efp_result res;
+
+	for (size_t i = ca->begin; i < ca->end; i++)
+		for (size_t j = a == b ? i + 1 : cb->begin; j < cb->end; j++)
+			if ((res = add_pair(efp, near, fmm->frag_idx[i],
+			    fmm->frag_idx[j])))
+				return res;
+
+	return EFP_RESULT_SUCCESS;
+}
+
+/* Dual tree traversal. Cells interact through expansions if the sum of
+ * their radii is less than the opening angle times the distance between
+ * their centers and the cells are well separated. Otherwise the larger cell
+ * is split and leaf cells interact directly. */
+static enum efp_result
+interact(struct efp *efp, const struct fmm *fmm, size_t a, size_t b,
+    struct fmm_pair_list *far, struct fmm_pair_list *near)
+{
+	const struct fmm_cell *ca = fmm->cells + a;
+	const struct fmm_cell *cb = fmm->cells + b;
+	double dist;
+	enum efp_result res;
+
+	if (a == b) {
+		if (ca->n_child == 0)
+			return add_near_cells(efp, fmm, a, a, near);
+
+		for (size_t i = ca->child; i < ca->child + ca->n_child; i++)
+			for (size_t j = i; j < ca->child + ca->n_child; j++)
+				if ((res = interact(efp, fmm, i, j, far,
+				    near)))
+					return res;
+
+		return EFP_RESULT_SUCCESS;
+	}
+
+	dist = vec_dist(&ca->center, &cb->center);
+
+	if (ca->radius + cb->radius < fmm->theta * dist &&
+	    dist - ca->radius - cb->radius > FMM_MIN_DIST)
+		return add_pair(efp, far, a, b);
+
+	if (ca->n_child == 0 && cb->n_child == 0)
+		return add_near_cells(efp, fmm, a, b, near);
+
+	if (cb->n_child == 0 || (ca->n_child > 0 && ca->radius >= cb->radius)) {
+		for (size_t i = ca->child; i < ca->child + ca->n_child; i++)
+			if ((res = interact(efp, fmm, i, b, far, near)))
+				return res;
+	}
+	else {
+		for (size_t i = cb->child; i < cb->child + cb->n_child; i++)
+			if ((res = interact(efp, fmm, a, i, far, near)))
+				return res;
+	}
+	return EFP_RESULT_SUCCESS;
+}
+
+/* Stores each pair in the rows of both of its members in compressed row
+ * format. */
+static enum efp_result
+make_rows(struct efp *efp, const struct fmm_pair_list *list, size_t n_rows,
+    size_t **offset, size_t *offset_size, size_t **idx, size_t *idx_size)
+{
+	size_t *off;
+
+	*offset = (size_t *)efp_reserve(efp, *offset, offset_size,
+	    (n_rows + 1) * sizeof(size_t));
+	*idx = (size_t *)efp_reserve(efp, *idx, idx_size,
+	    (2 * list->n + 1) * sizeof(size_t));
+
+	if (*offset == NULL || *idx == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	off = *offset;
+	memset(off, 0, (n_rows + 1) * sizeof(size_t));
+
+	for (size_t k = 0; k < list->n; k++) {
+		off[list->idx[k][0] + 1]++;
+		off[list->idx[k][1] + 1]++;
+	}
+	for (size_t i = 0; i < n_rows; i++)
+		off[i + 1] += off[i];
+
+	for (size_t k = 0; k < list->n; k++) {
+		size_t i = list->idx[k][0];
+		size_t j = list->idx[k][1];
+
+		(*idx)[off[i]++] = j;
+		(*idx)[off[j]++] = i;
+	}
+
+	/* restore row offsets shifted by the fill */
+	for (size_t i = n_rows; i > 0; i--)
+		off[i] = off[i - 1];
+
+	off[0] = 0;
+
+	return EFP_RESULT_SUCCESS;
+}
+
+/* Pair lists are kept across calls, so that rebuilding the lists for a
+ * new geometry does not allocate memory. */
+static enum efp_result
+build_lists(struct efp *efp, struct fmm *fmm)
+{
+	enum efp_result res;
+
+	fmm->far_pairs.n = 0;
+	fmm->near_pairs.n = 0;
+
+	if ((res = interact(efp, fmm, 0, 0, &fmm->far_pairs,
+	    &fmm->near_pairs)))
+		return res;
+	if ((res = make_rows(efp, &fmm->far_pairs, fmm->n_cells,
+	    &fmm->far_offset, &fmm->far_offset_size, &fmm->far_idx,
+	    &fmm->far_size)))
+		return res;
+
+	return make_rows(efp, &fmm->near_pairs, fmm->n_frag,
+	    &fmm->near_offset, &fmm->near_offset_size, &fmm->near_idx,
+	    &fmm->near_size);
+}
+
+enum efp_result
+efp_fmm_update(struct efp *efp, struct fmm *fmm)
+{
+	const struct efp_opts *opts = &efp->opts;
+	size_t order, size;
+	double theta;
+	enum efp_result res;
+
+	if (efp->n_skipped > 0) {
+		efp_log("fast multipole method does not support skipped "
+		    "fragment pairs");
+		return EFP_RESULT_FATAL;
+	}
+
+	order = opts->fmm_order > 0 ? opts->fmm_order : FMM_DEFAULT_ORDER;
+	theta = opts->fmm_theta > 0.0 ? opts->fmm_theta : FMM_DEFAULT_THETA;
+
+	fmm->field_valid = 0;
+
+	if (fmm->valid && fmm->order == order && fmm->theta == theta &&
+	    fmm->n_frag == efp->n_frag)
+		return EFP_RESULT_SUCCESS;
+
+	fmm->valid = 0;
+
+	if (fmm->pow == NULL || fmm->order != order)
+		if ((res = setup_tables(efp, fmm, order)))
+			return res;
+
+	/* the tree is rebuilt for every geometry, arrays only grow */
+	fmm->n_frag = efp->n_frag;
+	fmm->frag_idx = (size_t *)efp_reserve(efp, fmm->frag_idx,
+	    &fmm->frag_idx_size, fmm->n_frag * sizeof(size_t));
+	fmm->frag_cell = (size_t *)efp_reserve(efp, fmm->frag_cell,
+	    &fmm->frag_cell_size, fmm->n_frag * sizeof(size_t));
+
+	if (fmm->frag_idx == NULL || fmm->frag_cell == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	fmm->theta = theta;
+
+	if ((res = build_tree(efp, fmm)))
+		return res;
+	if ((res = build_lists(efp, fmm)))
+		return res;
+
+	size = 2 * fmm->n_cells * fmm->n_coef * sizeof(double);
+
+	fmm->mult = (double *)efp_reserve(efp, fmm->mult, &fmm->mult_size,
+	    size);
+	fmm->local = (double *)efp_reserve(efp, fmm->local, &fmm->local_size,
+	    size);
+	fmm->field = (double *)efp_reserve(efp, fmm->field, &fmm->field_size,
+	    size);
+
+	if (fmm->mult == NULL || fmm->local == NULL || fmm->field == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	fmm->valid = 1;
+
+	return EFP_RESULT_SUCCESS;
+}
+
+void
+efp_fmm_free(struct fmm *fmm)
+{
+	free_tables(fmm);
+	free(fmm->cells);
+	free(fmm->frag_idx);
+	free(fmm->frag_cell);
+	free(fmm->far_offset);
+	free(fmm->far_idx);
+	free(fmm->near_offset);
+	free(fmm->near_idx);
+	free(fmm->far_pairs.idx);
+	free(fmm->near_pairs.idx);
+	free(fmm->mult);
+	free(fmm->local);
+	free(fmm->field);
+	memset(fmm, 0, sizeof(*fmm));
+}
+
+/* Returns fragments which interact with a fragment directly. */
+size_t
+efp_fmm_get_row(const struct fmm *fmm, size_t frag_idx, const size_t **row)
+{
+	*row = fmm->near_idx + fmm->near_offset[frag_idx];
+	return fmm->near_offset[frag_idx + 1] - fmm->near_offset[frag_idx];
+}
+
+void
+efp_fmm_clear(struct fmm *fmm)
+{
+	size_t size = 2 * fmm->n_cells * fmm->n_coef;
+
+	memset(fmm->mult, 0, size * sizeof(double));
+	memset(fmm->local, 0, size * sizeof(double));
+	fmm->n_sites[0] = 0;
+	fmm->n_sites[1] = 0;
+}
+
+/* Adds a site of a fragment to the multipole expansion of the leaf cell
+ * of the fragment in the first (part = 0) or second (part = 1) set. */
+void
+efp_fmm_add_site(struct fmm *fmm, size_t frag_idx,
+    const struct pme_site *site, size_t part)
+{
+	size_t cell = fmm->frag_cell[frag_idx];
+	double *m = fmm->mult + (part * fmm->n_cells + cell) * fmm->n_coef;
+	const double *d = (const double *)&site->d;
+	double p[FMM_MAX_COEF];
+	vec_t dr = vec_sub(&fmm->cells[cell].center, &site->r);
+
+	get_powers(fmm, &dr, p);
+	fmm->n_sites[part]++;
+
+	for (size_t k = 0; k < fmm->n_coef; k++)
+		m[k] += site->q * p[k];
+
+	for (size_t k = 0; site->rank > 0 &&
+	    k < get_coef_count(fmm->order - 1); k++) {
+		const size_t *q = fmm->pow[k];
+
+		m[get_pow_idx(fmm, q[0] + 1, q[1], q[2])] -= d[0] * p[k];
+		m[get_pow_idx(fmm, q[0], q[1] + 1, q[2])] -= d[1] * p[k];
+		m[get_pow_idx(fmm, q[0], q[1], q[2] + 1)] -= d[2] * p[k];
+	}
+
+	for (size_t k = 0; site->rank > 1 &&
+	    k < get_coef_count(fmm->order - 2); k++) {
+		const size_t *q = fmm->pow[k];
+
+		for (size_t a = 0; a < 3; a++)
+		for (size_t b = 0; b < 3; b++) {
+			size_t s[3] = { q[0], q[1], q[2] };
+
+			s[a]++;
+			s[b]++;
+			m[get_pow_idx(fmm, s[0], s[1], s[2])] +=
+			    site->quad[quad_idx(a, b)] * p[k] / 3.0;
+		}
+	}
+}
+
+/* Adds an octupole of a fragment at point r to the multipole expansion of
+ * the leaf cell of the fragment. Octupoles are stored in the same order and
+ * convention as for multipole points. */
+void
+efp_fmm_add_octupole(struct fmm *fmm, size_t frag_idx, const vec_t *r,
+    const double *oct, size_t part)
+{
+	size_t cell = fmm->frag_cell[frag_idx];
+	double *m = fmm->mult + (part * fmm->n_cells + cell) * fmm->n_coef;
+	double p[FMM_MAX_COEF];
+	vec_t dr = vec_sub(&fmm->cells[cell].center, r);
+
+	get_powers(fmm, &dr, p);
+	fmm->n_sites[part]++;
+
+	for (size_t k = 0; k < get_coef_count(fmm->order - 3); k++) {
+		const size_t *q = fmm->pow[k];
+
+		for (size_t a = 0; a < 3; a++)
+		for (size_t b = 0; b < 3; b++)
+		for (size_t c = 0; c < 3; c++) {
+			size_t s[3] = { q[0], q[1], q[2] };
+
+			s[a]++;
+			s[b]++;
+			s[c]++;
+			m[get_pow_idx(fmm, s[0], s[1], s[2])] -=
+			    oct[oct_idx(a, b, c)] * p[k] / 15.0;
+		}
+	}
+}
+
+/* Computes local expansions of both sets of sites. Multipole expansions
+ * are shifted from children to parents, translated to local expansions
+ * of cells in the far field and shifted from parents to children. */
+void
+efp_fmm_solve(struct fmm *fmm)
+{
+	size_t n_coef = fmm->n_coef;
+	size_t stride = fmm->n_cells * n_coef;
+
+	for (size_t k = fmm->n_cells; k-- > 0;) {
+		const struct fmm_cell *cell = fmm->cells + k;
+
+		for (size_t c = cell->child; c < cell->child + cell->n_child;
+		    c++) {
+			double p[FMM_MAX_COEF];
+			vec_t dr = vec_sub(&cell->center,
+			    &fmm->cells[c].center);
+
+			get_powers(fmm, &dr, p);
+
+			for (size_t part = 0; part < 2; part++) {
+				const double *src = fmm->mult +
+				    part * stride + c * n_coef;
+
+				if (fmm->n_sites[part] == 0)
+					continue;
+
+				double *dst = fmm->mult +
+				    part * stride + k * n_coef;
+
+				for (size_t l = 0; l < fmm->n_terms; l++) {
+					const struct fmm_term *t =
+					    fmm->terms + l;
+
+					dst[t->ij] += src[t->i] * p[t->j];
+				}
+			}
+		}
+	}
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (size_t k = 0; k < fmm->n_cells; k++) {
+		const struct fmm_cell *cell = fmm->cells + k;
+
+		for (size_t m = fmm->far_offset[k]; m < fmm->far_offset[k + 1];
+		    m++) {
+			size_t src_idx = fmm->far_idx[m];
+			double t[FMM_MAX_COEF];
+			vec_t dr = vec_sub(&cell->center,
+			    &fmm->cells[src_idx].center);
+
+			get_derivs(fmm, &dr, t);
+
+			for (size_t part = 0; part < 2; part++) {
+				const double *src = fmm->mult +
+				    part * stride + src_idx * n_coef;
+
+				if (fmm->n_sites[part] == 0)
+					continue;
+
+				double *dst = fmm->local +
+				    part * stride + k * n_coef;
+
+				for (size_t l = 0; l < fmm->n_terms; l++) {
+					const struct fmm_term *u =
+					    fmm->terms + l;
+
+					dst[u->i] += src[u->j] * t[u->ij];
+				}
+			}
+		}
+	}
+
+	for (size_t k = 0; k < fmm->n_cells; k++) {
+		const struct fmm_cell *cell = fmm->cells + k;
+
+		for (size_t c = cell->child; c < cell->child + cell->n_child;
+		    c++) {
+			double p[FMM_MAX_COEF];
+			vec_t dr = vec_sub(&fmm->cells[c].center,
+			    &cell->center);
+
+			get_powers(fmm, &dr, p);
+
+			for (size_t part = 0; part < 2; part++) {
+				const double *src = fmm->local +
+				    part * stride + k * n_coef;
+
+				if (fmm->n_sites[part] == 0)
+					continue;
+
+				double *dst = fmm->local +
+				    part * stride + c * n_coef;
+
+				for (size_t l = 0; l < fmm->n_terms; l++) {
+					const struct fmm_term *t =
+					    fmm->terms + l;
+
+					dst[t->i] += src[t->ij] * p[t->j];
+				}
+			}
+		}
+	}
+}
+
+/* Evaluates potential derivatives up to the given order at point r from
+ * a local expansion l about center. */
+void
+efp_fmm_eval_local(const struct fmm *fmm, const double *l, const vec_t *center,
+    const vec_t *r, size_t order, double *phi)
+{
+	double p[FMM_MAX_COEF];
+	vec_t dr = vec_sub(r, center);
+
+	get_powers(fmm, &dr, p);
+
+	for (size_t k = 0; k < efp_pme_n_deriv[order]; k++) {
+		const size_t *d = efp_pme_deriv_pow[k];
+		size_t n = get_coef_count(fmm->order - d[0] - d[1] - d[2]);
+		double sum = 0.0;
+
+		for (size_t j = 0; j < n; j++) {
+			const size_t *q = fmm->pow[j];
+
+			sum += l[get_pow_idx(fmm, d[0] + q[0], d[1] + q[1],
+			    d[2] + q[2])] * p[j];
+		}
+		phi[k] = sum;
+	}
+}
+
+/* Evaluates potential derivatives up to the given order at point r of a
+ * fragment from far field sources of one set. Local expansions are taken
+ * from the array local in the layout of fmm->local. */
+void
+efp_fmm_eval(const struct fmm *fmm, const double *local, size_t frag_idx,
+    const vec_t *r, size_t order, size_t part, double *phi)
+{
+	size_t cell = fmm->frag_cell[frag_idx];
+	const double *l = local + (part * fmm->n_cells + cell) * fmm->n_coef;
+
+	efp_fmm_eval_local(fmm, l, &fmm->cells[cell].center, r, order, phi);
+}
+
+/* Translates the multipole expansion of a cell in the first (part = 0) or
+ * second (part = 1) set to a local expansion about center and adds it to
+ * l. The caller checks that center is in the far field of the cell. */
+void
+efp_fmm_add_local(const struct fmm *fmm, size_t cell, size_t part,
+    const vec_t *center, double *l)
+{
+	const double *m = fmm->mult + (part * fmm->n_cells + cell) *
+	    fmm->n_coef;
+	double t[FMM_MAX_COEF];
+	vec_t dr = vec_sub(center, &fmm->cells[cell].center);
+
+	get_derivs(fmm, &dr, t);
+
+	for (size_t k = 0; k < fmm->n_terms; k++) {
+		const struct fmm_term *u = fmm->terms + k;
+
+		l[u->i] += m[u->j] * t[u->ij];
+	}
+}
+
+/* Adds gradient and torque of a site of fragment frag_idx in the far field
+ * potential of the first (part = 0) or second (part = 1) set. */
+void
+efp_fmm_add_site_grad(struct efp *efp, size_t frag_idx,
+    const struct pme_site *site, size_t part)
+{
+	const struct frag *frag = efp->frags + frag_idx;
+	double phi[20];
+	vec_t grad, torque, com;
+
+	efp_fmm_eval(&efp->fmm, efp->fmm.local, frag_idx, &site->r,
+	    site->rank + 1, part, phi);
+
+	grad = efp_pme_site_grad(site, phi);
+	torque = efp_pme_site_torque(site, phi);
+	com = (vec_t){ -frag->x, -frag->y, -frag->z };
+
+	efp_add_force(efp, frag_idx, CVEC(frag->x), &site->r, &grad, &torque);
+	efp_add_stress(efp, &com, &grad);
+}
+
+/* Adds gradient and torque of an octupole of fragment frag_idx at point r
+ * in the far field potential of one set. */
+void
+efp_fmm_add_octupole_grad(struct efp *efp, size_t frag_idx, const vec_t *r,
+    const double *oct, size_t part)
+{
+	const struct fmm *fmm = &efp->fmm;
+	const struct frag *frag = efp->frags + frag_idx;
+	size_t cell = fmm->frag_cell[frag_idx];
+	const double *l = fmm->local +
+	    (part * fmm->n_cells + cell) * fmm->n_coef;
+	double p[FMM_MAX_COEF], d[FMM_MAX_COEF];
+	double g[3] = { 0.0, 0.0, 0.0 }, t[3] = { 0.0, 0.0, 0.0 };
+	vec_t dr = vec_sub(r, &fmm->cells[cell].center);
+
+	get_powers(fmm, &dr, p);
+
+	/* third and fourth potential derivatives */
+	for (size_t k = get_coef_count(2); k < get_coef_count(4); k++) {
+		const size_t *q = fmm->pow[k];
+		size_t n = get_coef_count(fmm->order - q[0] - q[1] - q[2]);
+
+		d[k] = 0.0;
+
+		for (size_t j = 0; j < n; j++) {
+			const size_t *s = fmm->pow[j];
+
+			d[k] += l[get_pow_idx(fmm, q[0] + s[0], q[1] + s[1],
+			    q[2] + s[2])] * p[j];
+		}
+	}
+
+	for (size_t a = 0; a < 3; a++)
+	for (size_t b = 0; b < 3; b++)
+	for (size_t c = 0; c < 3; c++) {
+		double o = oct[oct_idx(a, b, c)] / 15.0;
+		size_t n[3] = { 0, 0, 0 };
+
+		n[a]++;
+		n[b]++;
+		n[c]++;
+
+		for (size_t e = 0; e < 3; e++) {
+			size_t m[3] = { n[0], n[1], n[2] };
+
+			m[e]++;
+			g[e] += o * d[get_pow_idx(fmm, m[0], m[1], m[2])];
+		}
+
+		/* rotation of the first index of the octupole */
+		for (size_t e = 0; e < 3; e++) {
+			size_t m[3] = { n[0], n[1], n[2] };
+			size_t k = 3 - a - e;
+			double sign = (k + 1) % 3 == a ? 1.0 : -1.0;
+
+			if (e == a)
+				continue;
+
+			m[a]--;
+			m[e]++;
+			t[k] += 3.0 * sign * o *
+			    d[get_pow_idx(fmm, m[0], m[1], m[2])];
+		}
+	}
+
+	vec_t grad = { g[0], g[1], g[2] };
+	vec_t torque = { t[0], t[1], t[2] };
+	vec_t com = { -frag->x, -frag->y, -frag->z };
+
+	efp_add_force(efp, frag_idx, CVEC(frag->x), r, &grad, &torque);
+	efp_add_stress(efp, &com, &grad);
+}
@@ -0,0 +1,132 @@
+/*-
+ * Copyright (c) 2012-2017 Ilya Kaliman
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef LIBEFP_FMM_H
+#define LIBEFP_FMM_H
+
+#include "efp.h"
+#include "mathutil.h"
+#include "pme.h"
+
+#define FMM_MIN_ORDER 4
+#define FMM_MAX_ORDER 16
+
+/* number of expansion coefficients of the highest order */
+#define FMM_MAX_COEF 969
+
+struct efp;
+
+/* Octree cell. Children of a cell are stored next to each other. */
+struct fmm_cell {
+	vec_t center;     /* expansion center */
+	double radius;    /* radius of sphere around center with all points */
+	vec_t lo, hi;     /* bounding box of fragment centers */
+	size_t begin;     /* first fragment in the ordered fragment list */
+	size_t end;       /* end of fragment range */
+	size_t child;     /* index of the first child */
+	size_t n_child;   /* number of children, zero for leaves */
+};
+
+/* Index triple of the product of two expansion terms with total power at
+ * most the expansion order. */
+struct fmm_term {
+	unsigned short i, j, ij;
+};
+
+/* Growing list of index pairs. */
+struct fmm_pair_list {
+	size_t n;
+	size_t size;
+	size_t (*idx)[2];
+};
+
+/* Fast multipole method for non-periodic systems. The octree is built
+ * over fragment centers of mass, so fragments are never split between
+ * cells. Dual tree traversal finds pairs of cells which are far enough
+ * from each other to interact through Cartesian multipole and local
+ * expansions, all other fragment pairs form the near field which is
+ * computed directly by the callers.
+ *
+ * Two independent sets of sites can be handled at once. Potential
+ * derivatives are returned in the layout of particle mesh Ewald. */
+struct fmm {
+	size_t order;         /* expansion order */
+	double theta;         /* opening angle */
+	size_t n_coef;        /* number of expansion coefficients */
+	size_t (*pow)[3];     /* powers of x, y and z of each coefficient */
+	size_t *pow_idx;      /* coefficient index of powers */
+	double *fact;         /* product of factorials of powers */
+	size_t n_terms;       /* number of term products */
+	struct fmm_term *terms; /* term products */
+	size_t n_frag;        /* number of fragments */
+	size_t n_cells;       /* number of cells */
+	size_t cells_size;    /* allocated number of cells */
+	struct fmm_cell *cells; /* cells, parents before children */
+	size_t *frag_idx;     /* fragment indices ordered by cells */
+	size_t *frag_cell;    /* leaf cell of each fragment */
+	struct fmm_pair_list far_pairs;  /* interacting cell pairs */
+	struct fmm_pair_list near_pairs; /* directly interacting fragments */
+	size_t *far_offset;   /* offsets of far field cell lists */
+	size_t *far_idx;      /* source cells of each cell */
+	size_t *near_offset;  /* offsets of near field fragment lists */
+	size_t *near_idx;     /* near field partners of each fragment */
+	size_t n_sites[2];    /* number of sites in each set */
+	double *mult;         /* multipole expansions of both sets */
+	double *local;        /* local expansions of both sets */
+	double *field;        /* local expansions of all sources */
+	size_t frag_idx_size; /* allocated sizes of arrays in bytes */
+	size_t frag_cell_size;
+	size_t far_offset_size;
+	size_t far_size;
+	size_t near_offset_size;
+	size_t near_size;
+	size_t mult_size;
+	size_t local_size;
+	size_t field_size;
+	int field_valid;      /* nonzero if field is up to date */
+	int valid;            /* nonzero if tree matches coordinates */
+};
+
+enum efp_result efp_fmm_update(struct efp *, struct fmm *);
+void efp_fmm_free(struct fmm *);
+size_t efp_fmm_get_row(const struct fmm *, size_t, const size_t **);
+void efp_fmm_clear(struct fmm *);
+void efp_fmm_add_site(struct fmm *, size_t, const struct pme_site *, size_t);
+void efp_fmm_add_octupole(struct fmm *, size_t, const vec_t *, const double *,
+    size_t);
+void efp_fmm_solve(struct fmm *);
+void efp_fmm_eval_local(const struct fmm *, const double *, const vec_t *,
+    const vec_t *, size_t, double *);
+void efp_fmm_eval(const struct fmm *, const double *, size_t, const vec_t *,
+    size_t, size_t, double *);
+void efp_fmm_add_local(const struct fmm *, size_t, size_t, const vec_t *,
+    double *);
+void efp_fmm_add_site_grad(struct efp *, size_t, const struct pme_site *,
+    size_t);
+void efp_fmm_add_octupole_grad(struct efp *, size_t, const vec_t *,
+    const double *, size_t);
+
+#endif /* LIBEFP_FMM_H */
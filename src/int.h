@@ -27,6 +27,7 @@
 #ifndef LIBEFP_INT_H
 #define LIBEFP_INT_H
 
+#include "efp.h"
 #include "mathutil.h"
 
 struct shell {
@@ -42,22 +43,51 @@ struct xr_atom {
 	struct shell *shells;
 };
 
-void efp_st_int(size_t n_atoms_i,
+/* maximum number of basis functions in a shell */
+#define XR_MAX_SHELL_SIZE 10
+
+struct xr_shell {
+	size_t type;     /* shell type index - S,L,P,D,F */
+	size_t atom;     /* index of shell atom */
+	size_t loc;      /* index of first basis function */
+	size_t n_prim;   /* number of primitives */
+	size_t prim;     /* index of first primitive */
+	double min_exp;  /* smallest primitive exponent */
+};
+
+struct xr_basis {
+	size_t n_shells;         /* number of shells */
+	struct xr_shell *shells; /* shells sorted by type */
+	size_t size;             /* number of basis functions */
+	double *exps;            /* primitive exponents */
+	double *coefs;           /* normalized coefficients, XR_MAX_SHELL_SIZE
+				    per primitive */
+};
+
+enum efp_result efp_make_xr_basis(size_t n_atoms,
+				  const struct xr_atom *atoms,
+				  struct xr_basis *basis);
+
+void efp_free_xr_basis(struct xr_basis *basis);
+
+void efp_st_int(const struct xr_basis *basis_i,
 		const struct xr_atom *atoms_i,
-		size_t n_atoms_j,
+		const struct xr_basis *basis_j,
 		const struct xr_atom *atoms_j,
 		size_t stride,
 		double *s,
 		double *t);
 
-void efp_st_int_deriv(size_t n_atoms_i,
+/* Derivatives are stored component-wise: for basis function k of fragment
+ * i, row k * stride holds six blocks (x, y, z, a, b, c) of basis_j->size
+ * elements each. */
+void efp_st_int_deriv(const struct xr_basis *basis_i,
 		      const struct xr_atom *atoms_i,
-		      size_t n_atoms_j,
+		      const struct xr_basis *basis_j,
 		      const struct xr_atom *atoms_j,
 		      const vec_t *com_i,
-		      size_t size_i,
-		      size_t size_j,
-		      six_t *ds,
-		      six_t *dt);
+		      size_t stride,
+		      double *ds,
+		      double *dt);
 
 #endif /* LIBEFP_INT_H */
@@ -219,6 +219,40 @@ vec_dist(const vec_t *a, const vec_t *b)
 	return sqrt(vec_dist_2(a, b));
 }
 
+/* Distances r[k] from points (x[k], y[k], z[k]) to point a shifted by b.
+ * Vectorized kernels take distances from these helpers in a separate loop
+ * because sqrt() may set errno, which keeps the compiler from vectorizing
+ * the loop that calls it. */
+static inline void
+vec_dist_block(size_t n, const double *x, const double *y, const double *z,
+    const vec_t *a, const vec_t *b, double *r)
+{
+	for (size_t k = 0; k < n; k++) {
+		vec_t dr = {
+			x[k] - a->x - b->x,
+			y[k] - a->y - b->y,
+			z[k] - a->z - b->z
+		};
+
+		r[k] = vec_len(&dr);
+	}
+}
+
+/* Single precision vec_dist_block which also stores squared distances. */
+static inline void
+vec_dist_block_sp(size_t n, const float *x, const float *y, const float *z,
+    float x0, float y0, float z0, float *r2, float *r)
+{
+	for (size_t k = 0; k < n; k++) {
+		float dx = x[k] - x0;
+		float dy = y[k] - y0;
+		float dz = z[k] - z0;
+
+		r2[k] = dx * dx + dy * dy + dz * dz;
+		r[k] = sqrtf(r2[k]);
+	}
+}
+
 static inline double
 vec_angle(const vec_t *a, const vec_t *b)
 {
@@ -0,0 +1,426 @@
+/*-
+ * Copyright (c) 2012-2017 Ilya Kaliman
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "nblist.h"
+#include "private.h"
+
+/* Linked-cell search for fragment pairs within the switching function
+ * cutoff plus the skin distance. Cells are at least that wide, so all
+ * partners of a fragment are found in its own cell and in the 26 cells
+ * around it. */
+
+#define NO_FRAG SIZE_MAX
+
+struct cell_grid {
+	size_t n[3];        /* number of cells along each axis */
+	double size[3];     /* cell dimensions */
+	double origin[3];   /* grid origin */
+	size_t *head;       /* first fragment in each cell */
+	size_t *next;       /* next fragment in the same cell */
+	size_t *cell;       /* cell index of each fragment */
+	int pbc;
+};
+
+static size_t
+get_cell_idx(const struct cell_grid *grid, const size_t c[3])
+{
+	return (c[0] * grid->n[1] + c[1]) * grid->n[2] + c[2];
+}
+
+static void
+get_cell_coord(const struct cell_grid *grid, const struct efp *efp,
+    const struct frag *frag, size_t c[3])
+{
+	const double *box = (const double *)&efp->box;
+	const double *pos = &frag->x;
+
+	for (size_t a = 0; a < 3; a++) {
+		double x = pos[a] - grid->origin[a];
+
+		if (grid->pbc)
+			x -= box[a] * floor(x / box[a]);
+
+		c[a] = x > 0.0 ? (size_t)(x / grid->size[a]) : 0;
+
+		if (c[a] >= grid->n[a])
+			c[a] = grid->n[a] - 1;
+	}
+}
+
+static enum efp_result
+make_grid(struct efp *efp, struct cell_grid *grid, double cutoff)
+{
+	const double *box = (const double *)&efp->box;
+	double len[3];
+	size_t n_cell;
+
+	grid->pbc = efp->opts.enable_pbc;
+
+	for (size_t a = 0; a < 3; a++) {
+		if (grid->pbc) {
+			grid->origin[a] = 0.0;
+			len[a] = box[a];
+		} else {
+			double lo = INFINITY, hi = -INFINITY;
+
+			for (size_t i = 0; i < efp->n_frag; i++) {
+				const double *pos = &efp->frags[i].x;
+
+				lo = pos[a] < lo ? pos[a] : lo;
+				hi = pos[a] > hi ? pos[a] : hi;
+			}
+			grid->origin[a] = lo;
+			len[a] = hi - lo;
+		}
+		grid->n[a] = (size_t)(len[a] / cutoff);
+
+		if (grid->n[a] < 1)
+			grid->n[a] = 1;
+	}
+
+	/* sparse systems do not need more cells than fragments */
+	for (;;) {
+		size_t a = 0;
+
+		n_cell = grid->n[0] * grid->n[1] * grid->n[2];
+
+		if (n_cell <= efp->n_frag || n_cell == 1)
+			break;
+		if (grid->n[1] > grid->n[a])
+			a = 1;
+		if (grid->n[2] > grid->n[a])
+			a = 2;
+		grid->n[a] = (grid->n[a] + 1) / 2;
+	}
+
+	for (size_t a = 0; a < 3; a++)
+		grid->size[a] = len[a] > 0.0 ? len[a] / grid->n[a] : 1.0;
+
+	grid->head = (size_t *)efp_scratch_alloc(efp, n_cell * sizeof(size_t));
+	grid->next = (size_t *)efp_scratch_alloc(efp,
+	    efp->n_frag * sizeof(size_t));
+	grid->cell = (size_t *)efp_scratch_alloc(efp,
+	    efp->n_frag * sizeof(size_t));
+
+	if (grid->head == NULL || grid->next == NULL || grid->cell == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	for (size_t i = 0; i < n_cell; i++)
+		grid->head[i] = NO_FRAG;
+
+	/* insert in reverse order so that each cell lists fragments in
+	 * ascending order */
+	for (size_t i = efp->n_frag; i > 0; i--) {
+		size_t c[3], idx;
+
+		get_cell_coord(grid, efp, efp->frags + i - 1, c);
+		idx = get_cell_idx(grid, c);
+
+		grid->cell[i - 1] = idx;
+		grid->next[i - 1] = grid->head[idx];
+		grid->head[idx] = i - 1;
+	}
+	return EFP_RESULT_SUCCESS;
+}
+
+static void
+free_grid(struct efp *efp, struct cell_grid *grid)
+{
+	efp_scratch_free(efp, grid->cell);
+	efp_scratch_free(efp, grid->next);
+	efp_scratch_free(efp, grid->head);
+}
+
+/* unique neighbor cell indices along one axis */
+static size_t
+get_adjacent(const struct cell_grid *grid, size_t axis, size_t c,
+    size_t out[3])
+{
+	size_t n = grid->n[axis], cnt = 0;
+
+	/* cells c - 1, c, c + 1 */
+	for (size_t d = 0; d < 3; d++) {
+		size_t k;
+
+		if (grid->pbc)
+			k = (c + n + d - 1) % n;
+		else if (c + d < 1 || c + d - 1 >= n)
+			continue;
+		else
+			k = c + d - 1;
+
+		int dup = 0;
+
+		for (size_t l = 0; l < cnt; l++)
+			dup |= out[l] == k;
+		if (!dup)
+			out[cnt++] = k;
+	}
+	return cnt;
+}
+
+static int
+in_range(const struct efp *efp, size_t i, size_t j, double cutoff)
+{
+	const struct frag *fr_i = efp->frags + i;
+	const struct frag *fr_j = efp->frags + j;
+	vec_t dr = vec_sub(CVEC(fr_j->x), CVEC(fr_i->x));
+
+	if (efp->opts.enable_pbc) {
+		vec_t cell = { efp->box.x * round(dr.x / efp->box.x),
+			       efp->box.y * round(dr.y / efp->box.y),
+			       efp->box.z * round(dr.z / efp->box.z) };
+		dr = vec_sub(&dr, &cell);
+	}
+	return vec_len_2(&dr) <= cutoff * cutoff;
+}
+
+/* collects neighbors of fragment i; returns their count */
+static size_t
+find_pairs(const struct efp *efp, const struct cell_grid *grid, size_t i,
+    double cutoff, size_t *out)
+{
+	size_t c[3], adj[3][3], n_adj[3], cnt = 0;
+
+	c[0] = grid->cell[i] / (grid->n[1] * grid->n[2]);
+	c[1] = grid->cell[i] / grid->n[2] % grid->n[1];
+	c[2] = grid->cell[i] % grid->n[2];
+
+	for (size_t a = 0; a < 3; a++)
+		n_adj[a] = get_adjacent(grid, a, c[a], adj[a]);
+
+	for (size_t x = 0; x < n_adj[0]; x++)
+	for (size_t y = 0; y < n_adj[1]; y++)
+	for (size_t z = 0; z < n_adj[2]; z++) {
+		size_t cc[3] = { adj[0][x], adj[1][y], adj[2][z] };
+
+		for (size_t j = grid->head[get_cell_idx(grid, cc)];
+		    j != NO_FRAG; j = grid->next[j]) {
+			if (j == i || !in_range(efp, i, j, cutoff))
+				continue;
+			if (out)
+				out[cnt] = j;
+			cnt++;
+		}
+	}
+	return cnt;
+}
+
+static int
+cmp_idx(const void *a, const void *b)
+{
+	size_t x = *(const size_t *)a;
+	size_t y = *(const size_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static int
+is_current(const struct efp *efp, const struct nblist *nblist)
+{
+	if (!nblist->valid || nblist->n_frag != efp->n_frag)
+		return 0;
+	if (nblist->cutoff != efp->opts.swf_cutoff ||
+	    nblist->skin != efp->opts.nblist_skin ||
+	    nblist->pbc != efp->opts.enable_pbc)
+		return 0;
+	if (nblist->pbc && (nblist->box.x != efp->box.x ||
+	    nblist->box.y != efp->box.y || nblist->box.z != efp->box.z))
+		return 0;
+	return 1;
+}
+
+static enum efp_result
+build(struct efp *efp, struct nblist *nblist)
+{
+	struct cell_grid grid;
+	enum efp_result res;
+	double cutoff = efp->opts.swf_cutoff + efp->opts.nblist_skin;
+	size_t n_pairs;
+
+	memset(&grid, 0, sizeof(grid));
+	nblist->valid = 0;
+
+	if (nblist->n_frag != efp->n_frag) {
+		free(nblist->offset);
+		free(nblist->ref_xyz);
+		nblist->offset = (size_t *)efp_calloc(efp, efp->n_frag + 1,
+		    sizeof(size_t));
+		nblist->ref_xyz = (vec_t *)efp_calloc(efp, efp->n_frag,
+		    sizeof(vec_t));
+		nblist->n_frag = efp->n_frag;
+		if (nblist->offset == NULL || nblist->ref_xyz == NULL) {
+			nblist->n_frag = 0;
+			return EFP_RESULT_NO_MEMORY;
+		}
+	}
+
+	if (efp->n_frag == 0)
+		goto done;
+
+	if ((res = make_grid(efp, &grid, cutoff)))
+		goto error;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (size_t i = 0; i < efp->n_frag; i++)
+		nblist->offset[i + 1] = find_pairs(efp, &grid, i, cutoff, NULL);
+
+	nblist->offset[0] = 0;
+
+	for (size_t i = 0; i < efp->n_frag; i++)
+		nblist->offset[i + 1] += nblist->offset[i];
+
+	n_pairs = nblist->offset[efp->n_frag];
+
+	/* extra room absorbs fluctuations of the pair count during dynamics */
+	if (n_pairs > nblist->size) {
+		size_t size = n_pairs + n_pairs / 4;
+
+		free(nblist->idx);
+		nblist->idx = (size_t *)efp_malloc(efp, size * sizeof(size_t));
+		if (nblist->idx == NULL) {
+			nblist->size = 0;
+			res = EFP_RESULT_NO_MEMORY;
+			goto error;
+		}
+		nblist->size = size;
+	}
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		size_t *row = nblist->idx + nblist->offset[i];
+		size_t cnt = nblist->offset[i + 1] - nblist->offset[i];
+
+		find_pairs(efp, &grid, i, cutoff, row);
+		qsort(row, cnt, sizeof(size_t), cmp_idx);
+	}
+done:
+	for (size_t i = 0; i < efp->n_frag; i++)
+		nblist->ref_xyz[i] = *CVEC(efp->frags[i].x);
+
+	nblist->cutoff = efp->opts.swf_cutoff;
+	nblist->skin = efp->opts.nblist_skin;
+	nblist->pbc = efp->opts.enable_pbc;
+	nblist->box = efp->box;
+	nblist->valid = 1;
+	nblist->n_builds++;
+	res = EFP_RESULT_SUCCESS;
+error:
+	free_grid(efp, &grid);
+	return res;
+}
+
+/* Each pair is assigned to one of its two fragments the same way the full
+ * pair loop does it: fragment i owns the next n/2 fragments after it in
+ * cyclic order. This keeps the work per fragment balanced. */
+int
+efp_nblist_owns_pair(size_t n_frag, size_t i, size_t j)
+{
+	size_t lo = i < j ? i : j;
+	size_t hi = i < j ? j : i;
+
+	return (hi - lo <= n_frag / 2 ? lo : hi) == i;
+}
+
+/* Finds fragment j in the row of fragment i. On success *pos is the index
+ * of the entry in nblist->idx. */
+int
+efp_nblist_find(const struct nblist *nblist, size_t i, size_t j, size_t *pos)
+{
+	size_t lo = nblist->offset[i], hi = nblist->offset[i + 1];
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (nblist->idx[mid] < j)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (pos)
+		*pos = lo;
+	return lo < nblist->offset[i + 1] && nblist->idx[lo] == j;
+}
+
+/* Returns the number of fragments to check for interactions with fragment
+ * frag_idx. If the neighbor list is not in use, *row is set to NULL and all
+ * fragments must be checked. The caller still has to test each pair with
+ * efp_skip_frag_pair as the list also includes pairs within the skin. */
+size_t
+efp_nblist_get_row(const struct efp *efp, size_t frag_idx, const size_t **row)
+{
+	const struct nblist *nblist = &efp->nblist;
+
+	if (!efp->opts.enable_cutoff || !is_current(efp, nblist)) {
+		*row = NULL;
+		return efp->n_frag;
+	}
+	*row = nblist->idx + nblist->offset[frag_idx];
+	return nblist->offset[frag_idx + 1] - nblist->offset[frag_idx];
+}
+
+/* invalidates the list if fragment moved by more than half of the skin */
+void
+efp_nblist_check_frag(struct efp *efp, size_t frag_idx)
+{
+	struct nblist *nblist = &efp->nblist;
+
+	if (!nblist->valid || frag_idx >= nblist->n_frag)
+		return;
+
+	vec_t dr = vec_sub(CVEC(efp->frags[frag_idx].x),
+	    nblist->ref_xyz + frag_idx);
+	double max = 0.5 * nblist->skin;
+
+	if (vec_len_2(&dr) > max * max)
+		nblist->valid = 0;
+}
+
+enum efp_result
+efp_nblist_update(struct efp *efp, struct nblist *nblist)
+{
+	if (is_current(efp, nblist))
+		return EFP_RESULT_SUCCESS;
+
+	return build(efp, nblist);
+}
+
+void
+efp_nblist_free(struct nblist *nblist)
+{
+	free(nblist->offset);
+	free(nblist->idx);
+	free(nblist->ref_xyz);
+	memset(nblist, 0, sizeof(*nblist));
+}
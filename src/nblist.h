@@ -0,0 +1,58 @@
+/*-
+ * Copyright (c) 2012-2017 Ilya Kaliman
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef LIBEFP_NBLIST_H
+#define LIBEFP_NBLIST_H
+
+#include "efp.h"
+#include "mathutil.h"
+
+/* Verlet list of fragment pairs within the cutoff plus skin distance in
+ * compressed row format. Each pair is stored in the rows of both of its
+ * fragments. The list stays valid until some fragment moves by more than
+ * half of the skin distance from its position at the time of the build. */
+struct nblist {
+	size_t n_frag;   /* number of rows */
+	size_t *offset;  /* row offsets, size = n_frag + 1 */
+	size_t *idx;     /* neighbor fragment indices */
+	size_t size;     /* allocated size of idx */
+	vec_t *ref_xyz;  /* fragment positions at the time of the build */
+	double cutoff;   /* cutoff used for the build */
+	double skin;     /* skin distance used for the build */
+	int pbc;         /* periodic boundary conditions used for the build */
+	vec_t box;       /* periodic box used for the build */
+	int valid;       /* nonzero if the list can be used */
+	size_t n_builds; /* number of times the list was built */
+};
+
+int efp_nblist_owns_pair(size_t, size_t, size_t);
+int efp_nblist_find(const struct nblist *, size_t, size_t, size_t *);
+size_t efp_nblist_get_row(const struct efp *, size_t, const size_t **);
+void efp_nblist_check_frag(struct efp *, size_t);
+enum efp_result efp_nblist_update(struct efp *, struct nblist *);
+void efp_nblist_free(struct nblist *);
+
+#endif /* LIBEFP_NBLIST_H */
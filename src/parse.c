@@ -421,6 +421,21 @@ parse_dynamic_polarizable_pts(struct frag *frag, struct stream *stream)
 	if (!tok_stop(stream))
 		return EFP_RESULT_SYNTAX_ERROR;
 
+	free(frag->disp_traces);
+	frag->disp_traces = (double *)malloc(
+	    frag->n_dynamic_polarizable_pts * 12 * sizeof(double));
+	if (frag->disp_traces == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	for (size_t i = 0; i < frag->n_dynamic_polarizable_pts; i++) {
+		const struct dynamic_polarizable_pt *pt =
+		    frag->dynamic_polarizable_pts + i;
+
+		for (size_t w = 0; w < 12; w++)
+			frag->disp_traces[12 * i + w] = (pt->tensor[w].xx +
+			    pt->tensor[w].yy + pt->tensor[w].zz) / 3.0;
+	}
+
 	return EFP_RESULT_SUCCESS;
 }
 
@@ -903,6 +918,9 @@ parse_file(struct efp *efp, struct stream *stream)
 			efp_log("LMO centroids are missing");
 			return EFP_RESULT_FATAL;
 		}
+		if ((res = efp_make_xr_basis(frag->n_xr_atoms,
+		    frag->xr_atoms, &frag->xr_basis)))
+			return res;
 	}
 	return EFP_RESULT_SUCCESS;
 }
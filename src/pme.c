@@ -0,0 +1,838 @@
+/*-
+ * Copyright (c) 2012-2017 Ilya Kaliman
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+
+#include "elec.h"
+#include "private.h"
+
+/* default interpolation order */
+#define PME_DEFAULT_ORDER 8
+
+/* default Ewald splitting parameter times the cutoff distance */
+#define PME_ALPHA_CUTOFF 4.5
+
+/* default grid spacing times the Ewald splitting parameter */
+#define PME_SPACING_ALPHA 0.25
+
+/* grid is kept while it is at most this much finer than needed */
+#define PME_GRID_SLACK 1.25
+
+/* powers of x, y and z in potential derivative components */
+const size_t efp_pme_deriv_pow[20][3] = {
+	{ 0, 0, 0 },
+	{ 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 },
+	{ 2, 0, 0 }, { 0, 2, 0 }, { 0, 0, 2 },
+	{ 1, 1, 0 }, { 1, 0, 1 }, { 0, 1, 1 },
+	{ 3, 0, 0 }, { 0, 3, 0 }, { 0, 0, 3 },
+	{ 2, 1, 0 }, { 2, 0, 1 }, { 1, 2, 0 },
+	{ 0, 2, 1 }, { 1, 0, 2 }, { 0, 1, 2 },
+	{ 1, 1, 1 }
+};
+
+/* number of potential derivative components up to a given order */
+const size_t efp_pme_n_deriv[4] = { 1, 4, 10, 20 };
+
+/* B-spline weights of a point for each axis */
+struct bspline {
+	size_t idx[3][PME_MAX_ORDER];     /* grid indices */
+	double w[3][PME_MAX_ORDER][4];    /* weights and their derivatives */
+};
+
+/* Computes values of cardinal B-splines of all orders up to n at points
+ * w + t, where t = 0, ..., n - 1. */
+static void
+get_spline_values(double w, size_t n,
+    double m[PME_MAX_ORDER + 1][PME_MAX_ORDER])
+{
+	m[1][0] = 1.0;
+
+	for (size_t p = 2; p <= n; p++) {
+		for (size_t t = 0; t < p; t++) {
+			double m0 = t < p - 1 ? m[p - 1][t] : 0.0;
+			double m1 = t > 0 ? m[p - 1][t - 1] : 0.0;
+
+			m[p][t] = ((w + t) * m0 + (p - w - t) * m1) / (p - 1);
+		}
+	}
+}
+
+/* Computes B-spline weights of a point and their derivatives with
+ * respect to Cartesian coordinates up to the given order. */
+static void
+get_bspline(const struct pme *pme, const vec_t *r, size_t n_der,
+    struct bspline *bsp)
+{
+	const double *box = (const double *)&pme->box;
+	const double *pos = (const double *)r;
+	size_t n = pme->order;
+
+	for (size_t a = 0; a < 3; a++) {
+		double m[PME_MAX_ORDER + 1][PME_MAX_ORDER];
+		double scale = pme->n[a] / box[a];
+		double u = pos[a] * scale;
+		size_t base;
+
+		u -= pme->n[a] * floor(u / pme->n[a]);
+		base = (size_t)u;
+		get_spline_values(u - base, n, m);
+		base %= pme->n[a];
+
+		for (size_t t = 0; t < n; t++) {
+			double f = 1.0;
+
+			bsp->idx[a][t] = (base + pme->n[a] - t) % pme->n[a];
+
+			/* derivatives are finite differences of splines of
+			 * lower order */
+			for (size_t d = 0; d <= n_der; d++) {
+				double sum = 0.0, binom = 1.0;
+
+				for (size_t j = 0; j <= d; j++) {
+					if (t >= j && t - j < n - d)
+						sum += (j % 2 ? -binom : binom) *
+						    m[n - d][t - j];
+					binom = binom * (d - j) / (j + 1);
+				}
+				bsp->w[a][t][d] = sum * f;
+				f *= scale;
+			}
+		}
+	}
+}
+
+/* Computes squared moduli of the B-spline structure factors along one
+ * axis of the grid. */
+static void
+get_bspline_moduli(size_t n, size_t order, double *mod)
+{
+	double m[PME_MAX_ORDER + 1][PME_MAX_ORDER];
+
+	get_spline_values(0.0, order, m);
+
+	for (size_t i = 0; i < n; i++) {
+		double re = 0.0, im = 0.0;
+
+		for (size_t k = 0; k + 1 < order; k++) {
+			re += m[order][k + 1] * cos(2.0 * PI * i * k / n);
+			im += m[order][k + 1] * sin(2.0 * PI * i * k / n);
+		}
+		mod[i] = re * re + im * im;
+	}
+
+	/* structure factors of odd order splines vanish at the Nyquist
+	 * frequency */
+	for (size_t i = 0; i < n; i++)
+		if (mod[i] < 1.0e-10)
+			mod[i] = 0.5 * (mod[(i + n - 1) % n] + mod[(i + 1) % n]);
+}
+
+static enum efp_result
+setup_kernel(struct efp *efp, struct pme *pme)
+{
+	double *mod[3] = { NULL, NULL, NULL };
+	enum efp_result res = EFP_RESULT_NO_MEMORY;
+	double volume = pme->box.x * pme->box.y * pme->box.z;
+	const double *box = (const double *)&pme->box;
+
+	for (size_t a = 0; a < 3; a++) {
+		if ((mod[a] = (double *)efp_malloc(efp, pme->n[a] *
+		    sizeof(double))) == NULL)
+			goto error;
+
+		get_bspline_moduli(pme->n[a], pme->order, mod[a]);
+	}
+
+	for (size_t m0 = 0; m0 < pme->n[0]; m0++)
+	for (size_t m1 = 0; m1 < pme->n[1]; m1++)
+	for (size_t m2 = 0; m2 < pme->n[2]; m2++) {
+		size_t m[3] = { m0, m1, m2 };
+		size_t idx = (m0 * pme->n[1] + m1) * pme->n[2] + m2;
+		double k2 = 0.0, mod_prod = 1.0;
+
+		for (size_t a = 0; a < 3; a++) {
+			double mm = m[a] <= pme->n[a] / 2 ? (double)m[a] :
+			    (double)m[a] - (double)pme->n[a];
+			double k = 2.0 * PI * mm / box[a];
+
+			k2 += k * k;
+			mod_prod *= mod[a][m[a]];
+		}
+
+		if (idx == 0)
+			pme->kernel[idx] = 0.0;
+		else
+			pme->kernel[idx] = 4.0 * PI / volume / k2 *
+			    exp(-0.25 * k2 / (pme->alpha * pme->alpha)) /
+			    mod_prod;
+	}
+	res = EFP_RESULT_SUCCESS;
+error:
+	for (size_t a = 0; a < 3; a++)
+		free(mod[a]);
+
+	return res;
+}
+
+enum efp_result
+efp_pme_update(struct efp *efp, struct pme *pme)
+{
+	const struct efp_opts *opts = &efp->opts;
+	const double *box = (const double *)&efp->box;
+	double alpha, spacing;
+	size_t n[3], order, size;
+	enum efp_result res;
+
+	alpha = opts->pme_alpha > 0.0 ? opts->pme_alpha :
+	    PME_ALPHA_CUTOFF / opts->swf_cutoff;
+	spacing = opts->pme_spacing > 0.0 ? opts->pme_spacing :
+	    PME_SPACING_ALPHA / alpha;
+	order = opts->pme_order > 0 ? opts->pme_order : PME_DEFAULT_ORDER;
+
+	for (size_t a = 0; a < 3; a++) {
+		size_t min_n = (size_t)ceil(box[a] / spacing);
+
+		if (min_n < order)
+			min_n = order;
+
+		/* small box changes during constant pressure simulations
+		 * should not change the grid as energy would jump */
+		if (pme->grid && pme->order == order && pme->n[a] >= min_n &&
+		    pme->n[a] <= PME_GRID_SLACK * min_n)
+			n[a] = pme->n[a];
+		else
+			n[a] = efp_fft_good_size(min_n);
+	}
+
+	pme->field_valid = 0;
+
+	if (pme->grid && pme->alpha == alpha && pme->order == order &&
+	    pme->n[0] == n[0] && pme->n[1] == n[1] && pme->n[2] == n[2] &&
+	    pme->box.x == efp->box.x && pme->box.y == efp->box.y &&
+	    pme->box.z == efp->box.z)
+		return EFP_RESULT_SUCCESS;
+
+	efp_pme_free(pme);
+
+	pme->n[0] = n[0];
+	pme->n[1] = n[1];
+	pme->n[2] = n[2];
+	pme->order = order;
+	pme->alpha = alpha;
+	pme->box = efp->box;
+
+	size = n[0] * n[1] * n[2];
+
+	pme->kernel = (double *)efp_malloc(efp, size * sizeof(double));
+	pme->grid = (double *)efp_malloc(efp, 2 * size * sizeof(double));
+	pme->field = (double *)efp_malloc(efp, 2 * size * sizeof(double));
+
+	if (pme->kernel == NULL || pme->grid == NULL || pme->field == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	if ((res = efp_fft_init(efp, &pme->fft, n)))
+		return res;
+
+	return setup_kernel(efp, pme);
+}
+
+void
+efp_pme_free(struct pme *pme)
+{
+	free(pme->kernel);
+	free(pme->grid);
+	free(pme->field);
+	efp_fft_free(&pme->fft);
+	memset(pme, 0, sizeof(*pme));
+}
+
+void
+efp_pme_clear(struct pme *pme)
+{
+	memset(pme->grid, 0, 2 * pme->n[0] * pme->n[1] * pme->n[2] *
+	    sizeof(double));
+}
+
+/* Adds a site to the real (part = 0) or imaginary (part = 1) part of
+ * the charge grid. */
+void
+efp_pme_spread(struct pme *pme, const struct pme_site *site, size_t part)
+{
+	struct bspline bsp;
+	double w[3][3][3];
+	size_t rank = site->rank;
+
+	get_bspline(pme, &site->r, rank, &bsp);
+
+	memset(w, 0, sizeof(w));
+	w[0][0][0] = site->q;
+
+	if (rank > 0) {
+		w[1][0][0] = site->d.x;
+		w[0][1][0] = site->d.y;
+		w[0][0][1] = site->d.z;
+	}
+	if (rank > 1) {
+		w[2][0][0] = site->quad[0] / 3.0;
+		w[0][2][0] = site->quad[1] / 3.0;
+		w[0][0][2] = site->quad[2] / 3.0;
+		w[1][1][0] = site->quad[3] * 2.0 / 3.0;
+		w[1][0][1] = site->quad[4] * 2.0 / 3.0;
+		w[0][1][1] = site->quad[5] * 2.0 / 3.0;
+	}
+
+	for (size_t t0 = 0; t0 < pme->order; t0++) {
+		double w0[3][3];
+
+		for (size_t b = 0; b <= rank; b++)
+			for (size_t c = 0; b + c <= rank; c++) {
+				w0[b][c] = 0.0;
+
+				for (size_t a = 0; a + b + c <= rank; a++)
+					w0[b][c] += w[a][b][c] *
+					    bsp.w[0][t0][a];
+			}
+
+		for (size_t t1 = 0; t1 < pme->order; t1++) {
+			double w1[3];
+			double *row = pme->grid + part + 2 * pme->n[2] *
+			    (bsp.idx[0][t0] * pme->n[1] + bsp.idx[1][t1]);
+
+			for (size_t c = 0; c <= rank; c++) {
+				w1[c] = 0.0;
+
+				for (size_t b = 0; b + c <= rank; b++)
+					w1[c] += w0[b][c] * bsp.w[1][t1][b];
+			}
+
+			for (size_t t2 = 0; t2 < pme->order; t2++) {
+				double v = 0.0;
+
+				for (size_t c = 0; c <= rank; c++)
+					v += w1[c] * bsp.w[2][t2][c];
+
+				row[2 * bsp.idx[2][t2]] += v;
+			}
+		}
+	}
+}
+
+/* Transforms the charge grid to the potential grid. If energy or stress
+ * is requested, computes the reciprocal space energy and its contribution
+ * to the stress tensor. If cross is zero, the energy is that of the
+ * sites in the real part of the grid with each other. Otherwise it is
+ * the energy of the sites in the real part with the sites in the
+ * imaginary part. */
+void
+efp_pme_solve(struct pme *pme, int cross, double *energy, mat_t *stress)
+{
+	size_t n0 = pme->n[0], n1 = pme->n[1], n2 = pme->n[2];
+	size_t size = n0 * n1 * n2;
+	double *grid = pme->grid;
+
+	efp_fft_forward(&pme->fft, grid);
+
+	if (energy || stress) {
+		double e = 0.0, sxx = 0.0, syy = 0.0, szz = 0.0;
+		double sxy = 0.0, sxz = 0.0, syz = 0.0;
+		double f0 = 0.25 / (pme->alpha * pme->alpha);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) reduction(+:e,sxx,syy,szz,sxy,sxz,syz)
+#endif
+		for (size_t idx = 0; idx < size; idx++) {
+			size_t m0 = idx / (n1 * n2);
+			size_t m1 = idx / n2 % n1;
+			size_t m2 = idx % n2;
+			double ar = grid[2 * idx], ai = grid[2 * idx + 1];
+			double em, kx, ky, kz, f;
+
+			if (pme->kernel[idx] == 0.0)
+				continue;
+
+			if (cross) {
+				size_t neg = (((n0 - m0) % n0) * n1 +
+				    (n1 - m1) % n1) * n2 + (n2 - m2) % n2;
+				double br = grid[2 * neg];
+				double bi = grid[2 * neg + 1];
+
+				/* separate transforms of real and imaginary
+				 * parts of the grid */
+				double fa_re = 0.5 * (ar + br);
+				double fa_im = 0.5 * (ai - bi);
+				double fb_re = 0.5 * (ai + bi);
+				double fb_im = -0.5 * (ar - br);
+
+				em = pme->kernel[idx] *
+				    (fa_re * fb_re + fa_im * fb_im);
+			}
+			else
+				em = 0.5 * pme->kernel[idx] * (ar * ar + ai * ai);
+
+			e += em;
+
+			kx = 2.0 * PI / pme->box.x *
+			    (m0 <= n0 / 2 ? (double)m0 : (double)m0 - n0);
+			ky = 2.0 * PI / pme->box.y *
+			    (m1 <= n1 / 2 ? (double)m1 : (double)m1 - n1);
+			kz = 2.0 * PI / pme->box.z *
+			    (m2 <= n2 / 2 ? (double)m2 : (double)m2 - n2);
+			f = 2.0 * em * (1.0 / (kx * kx + ky * ky + kz * kz) + f0);
+
+			sxx += em - f * kx * kx;
+			syy += em - f * ky * ky;
+			szz += em - f * kz * kz;
+			sxy -= f * kx * ky;
+			sxz -= f * kx * kz;
+			syz -= f * ky * kz;
+		}
+
+		if (energy)
+			*energy = e;
+
+		if (stress) {
+			stress->xx += sxx;
+			stress->yy += syy;
+			stress->zz += szz;
+			stress->xy += sxy;
+			stress->yx += sxy;
+			stress->xz += sxz;
+			stress->zx += sxz;
+			stress->yz += syz;
+			stress->zy += syz;
+		}
+	}
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (size_t idx = 0; idx < size; idx++) {
+		grid[2 * idx] *= pme->kernel[idx];
+		grid[2 * idx + 1] *= pme->kernel[idx];
+	}
+
+	efp_fft_backward(&pme->fft, grid);
+}
+
+/* Interpolates potential derivatives up to the given order at a point
+ * from the real (part = 0) or imaginary (part = 1) part of a potential
+ * grid. */
+void
+efp_pme_gather(const struct pme *pme, const double *grid, const vec_t *r,
+    size_t order, size_t part, double *phi)
+{
+	struct bspline bsp;
+	double c[4][4][4];
+
+	get_bspline(pme, r, order, &bsp);
+	memset(c, 0, sizeof(c));
+
+	for (size_t t0 = 0; t0 < pme->order; t0++) {
+		double c0[4][4];
+
+		memset(c0, 0, sizeof(c0));
+
+		for (size_t t1 = 0; t1 < pme->order; t1++) {
+			double c1[4] = { 0.0, 0.0, 0.0, 0.0 };
+			const double *row = grid + part + 2 * pme->n[2] *
+			    (bsp.idx[0][t0] * pme->n[1] + bsp.idx[1][t1]);
+
+			for (size_t t2 = 0; t2 < pme->order; t2++) {
+				double v = row[2 * bsp.idx[2][t2]];
+
+				for (size_t z = 0; z <= order; z++)
+					c1[z] += v * bsp.w[2][t2][z];
+			}
+			for (size_t y = 0; y <= order; y++)
+				for (size_t z = 0; y + z <= order; z++)
+					c0[y][z] += c1[z] * bsp.w[1][t1][y];
+		}
+		for (size_t x = 0; x <= order; x++)
+			for (size_t y = 0; x + y <= order; y++)
+				for (size_t z = 0; x + y + z <= order; z++)
+					c[x][y][z] += c0[y][z] *
+					    bsp.w[0][t0][x];
+	}
+
+	for (size_t k = 0; k < efp_pme_n_deriv[order]; k++) {
+		const size_t *p = efp_pme_deriv_pow[k];
+
+		phi[k] = c[p[0]][p[1]][p[2]];
+	}
+}
+
+/* Returns site idx of a fragment. Nuclei go first followed by multipole
+ * points. */
+void
+efp_pme_get_site(const struct frag *frag, size_t idx, struct pme_site *site)
+{
+	memset(site, 0, sizeof(*site));
+
+	if (idx < frag->n_atoms) {
+		const struct efp_atom *at = frag->atoms + idx;
+
+		site->r.x = at->x;
+		site->r.y = at->y;
+		site->r.z = at->z;
+		site->q = at->znuc;
+		site->rank = 0;
+	}
+	else {
+		const struct multipole_pt *pt =
+		    frag->multipole_pts + idx - frag->n_atoms;
+
+		site->r.x = pt->x;
+		site->r.y = pt->y;
+		site->r.z = pt->z;
+		site->q = pt->monopole;
+		site->d = pt->dipole;
+		memcpy(site->quad, pt->quadrupole, sizeof(site->quad));
+		site->rank = 2;
+	}
+}
+
+size_t
+efp_pme_get_site_count(const struct frag *frag)
+{
+	return frag->n_atoms + frag->n_multipole_pts;
+}
+
+/* Radial functions bn[k] = (-1/r d/dr)^k erfc(alpha r) / r for the real
+ * space part of Ewald sum. */
+void
+efp_pme_bn(double alpha, double r, size_t n, double *bn)
+{
+	double r2 = r * r, a2 = 2.0 * alpha * alpha, f = 1.0;
+	double expa = exp(-alpha * alpha * r2) / (alpha * sqrt(PI));
+
+	bn[0] = erfc(alpha * r) / r;
+
+	for (size_t k = 1; k <= n; k++) {
+		f *= a2;
+		bn[k] = ((2 * k - 1) * bn[k - 1] + f * expa) / r2;
+	}
+}
+
+/* Radial functions for erf(alpha r) / r. These are finite at r = 0 and
+ * are used to remove interactions which are not wanted from reciprocal
+ * space sum. */
+void
+efp_pme_bn_erf(double alpha, double r, size_t n, double *bn)
+{
+	double x2 = alpha * alpha * r * r;
+	double f = 2.0 * alpha / sqrt(PI);
+
+	if (x2 > 2.25) {
+		double bc[6];
+
+		efp_pme_bn_coulomb(r, n, bn);
+		efp_pme_bn(alpha, r, n, bc);
+
+		for (size_t k = 0; k <= n; k++)
+			bn[k] -= bc[k];
+		return;
+	}
+
+	/* series expansion avoids cancellation at short distances */
+	for (size_t k = 0; k <= n; k++) {
+		double sum = 0.0, term = 1.0;
+
+		for (size_t j = 0; j < 40; j++) {
+			sum += term / (2 * (k + j) + 1);
+			term *= -x2 / (j + 1);
+		}
+		bn[k] = f * sum;
+		f *= 2.0 * alpha * alpha;
+	}
+}
+
+/* Radial functions for 1 / r. */
+void
+efp_pme_bn_coulomb(double r, size_t n, double *bn)
+{
+	double r2 = r * r;
+
+	bn[0] = 1.0 / r;
+
+	for (size_t k = 1; k <= n; k++)
+		bn[k] = (2 * k - 1) * bn[k - 1] / r2;
+}
+
+/* Computes Cartesian derivatives of a radial function up to order l,
+ * t[a][b][c] = d^(a+b+c) f / dx^a dy^b dz^c, using McMurchie-Davidson
+ * recursion. */
+static void
+get_tensors(const double *bn, const vec_t *dr, size_t l, double t[6][6][6])
+{
+	double rr[6][6][6][6];
+
+	for (size_t n = 0; n <= l; n++)
+		rr[n][0][0][0] = n % 2 ? -bn[n] : bn[n];
+
+	for (size_t k = 1; k <= l; k++)
+	for (size_t n = 0; n + k <= l; n++)
+	for (size_t a = 0; a <= k; a++)
+	for (size_t b = 0; a + b <= k; b++) {
+		size_t c = k - a - b;
+		double v;
+
+		if (a > 0) {
+			v = dr->x * rr[n + 1][a - 1][b][c];
+			if (a > 1)
+				v += (a - 1) * rr[n + 1][a - 2][b][c];
+		}
+		else if (b > 0) {
+			v = dr->y * rr[n + 1][a][b - 1][c];
+			if (b > 1)
+				v += (b - 1) * rr[n + 1][a][b - 2][c];
+		}
+		else {
+			v = dr->z * rr[n + 1][a][b][c - 1];
+			if (c > 1)
+				v += (c - 1) * rr[n + 1][a][b][c - 2];
+		}
+		rr[n][a][b][c] = v;
+	}
+
+	for (size_t a = 0; a <= l; a++)
+		for (size_t b = 0; a + b <= l; b++)
+			for (size_t c = 0; a + b + c <= l; c++)
+				t[a][b][c] = rr[0][a][b][c];
+}
+
+static inline double
+get_tensor(const double t[6][6][6], int flip, size_t a, size_t b, size_t c)
+{
+	return flip && (a + b + c) % 2 ? -t[a][b][c] : t[a][b][c];
+}
+
+/* Adds potential derivatives from a site. If flip is nonzero, tensors
+ * are for the opposite direction. */
+static void
+tensor_field(const double t[6][6][6], int flip, const struct pme_site *src,
+    size_t order, double *phi)
+{
+	const double *d = (const double *)&src->d;
+	const double *quad = src->quad;
+
+	for (size_t k = 0; k < efp_pme_n_deriv[order]; k++) {
+		size_t a = efp_pme_deriv_pow[k][0];
+		size_t b = efp_pme_deriv_pow[k][1];
+		size_t c = efp_pme_deriv_pow[k][2];
+		double v = src->q * get_tensor(t, flip, a, b, c);
+
+		if (src->rank > 0) {
+			v -= d[0] * get_tensor(t, flip, a + 1, b, c) +
+			     d[1] * get_tensor(t, flip, a, b + 1, c) +
+			     d[2] * get_tensor(t, flip, a, b, c + 1);
+		}
+		if (src->rank > 1) {
+			v += (quad[0] * get_tensor(t, flip, a + 2, b, c) +
+			      quad[1] * get_tensor(t, flip, a, b + 2, c) +
+			      quad[2] * get_tensor(t, flip, a, b, c + 2) +
+			      quad[3] * get_tensor(t, flip, a + 1, b + 1, c) *
+			      2.0 +
+			      quad[4] * get_tensor(t, flip, a + 1, b, c + 1) *
+			      2.0 +
+			      quad[5] * get_tensor(t, flip, a, b + 1, c + 1) *
+			      2.0) / 3.0;
+		}
+		phi[k] += v;
+	}
+}
+
+/* Adds potential derivatives up to the given order from a site to phi,
+ * dr is the vector from the site to the point. Array bn must hold radial
+ * functions up to the order plus the site rank. */
+void
+efp_pme_site_field(const struct pme_site *src, const vec_t *dr,
+    const double *bn, size_t order, double *phi)
+{
+	double t[6][6][6];
+
+	get_tensors(bn, dr, src->rank + order, t);
+	tensor_field(t, 0, src, order, phi);
+}
+
+/* Returns interaction energy of two sites with the radial kernel bn,
+ * dr = r_j - r_i. If grad_j is not NULL, computes energy gradient with
+ * respect to the position of site j and rotational derivatives of the
+ * energy with respect to both sites' multipoles. Array bn must hold
+ * radial functions up to the sum of the site ranks plus one if gradient
+ * is requested. */
+double
+efp_pme_site_pair(const struct pme_site *si, const struct pme_site *sj,
+    const vec_t *dr, const double *bn, vec_t *grad_j, vec_t *add_i,
+    vec_t *add_j)
+{
+	double t[6][6][6], phi_i[20], phi_j[20];
+	size_t order = grad_j ? 1 : 0;
+
+	memset(phi_j, 0, sizeof(phi_j));
+	get_tensors(bn, dr, si->rank + sj->rank + order, t);
+	tensor_field(t, 0, si, sj->rank + order, phi_j);
+
+	if (grad_j) {
+		memset(phi_i, 0, sizeof(phi_i));
+		tensor_field(t, 1, sj, si->rank, phi_i);
+
+		*grad_j = efp_pme_site_grad(sj, phi_j);
+		*add_i = efp_pme_site_torque(si, phi_i);
+		*add_j = efp_pme_site_torque(sj, phi_j);
+	}
+	return efp_pme_site_energy(sj, phi_j);
+}
+
+/* Returns energy of a site in the potential with derivatives phi. */
+double
+efp_pme_site_energy(const struct pme_site *site, const double *phi)
+{
+	double energy = site->q * phi[0];
+
+	if (site->rank > 0)
+		energy += site->d.x * phi[1] +
+			  site->d.y * phi[2] +
+			  site->d.z * phi[3];
+
+	if (site->rank > 1)
+		energy += (site->quad[0] * phi[4] +
+			   site->quad[1] * phi[5] +
+			   site->quad[2] * phi[6] +
+			   site->quad[3] * phi[7] * 2.0 +
+			   site->quad[4] * phi[8] * 2.0 +
+			   site->quad[5] * phi[9] * 2.0) / 3.0;
+
+	return energy;
+}
+
+/* Returns energy gradient with respect to site position. Potential
+ * derivatives up to the site rank plus one are needed. */
+vec_t
+efp_pme_site_grad(const struct pme_site *site, const double *phi)
+{
+	const double *d = (const double *)&site->d;
+	double g[3];
+
+	for (size_t c = 0; c < 3; c++) {
+		g[c] = site->q * phi[1 + c];
+
+		if (site->rank > 0)
+			for (size_t a = 0; a < 3; a++)
+				g[c] += d[a] * phi[4 + quad_idx(a, c)];
+
+		if (site->rank > 1)
+			for (size_t a = 0; a < 3; a++)
+				for (size_t b = 0; b < 3; b++)
+					g[c] += site->quad[quad_idx(a, b)] *
+					    phi[10 + oct_idx(a, b, c)] / 3.0;
+	}
+	return (vec_t){ g[0], g[1], g[2] };
+}
+
+/* Returns derivative of site energy with respect to rotation of its
+ * multipoles. */
+vec_t
+efp_pme_site_torque(const struct pme_site *site, const double *phi)
+{
+	vec_t grad = { phi[1], phi[2], phi[3] };
+	vec_t torque = vec_zero;
+	double p[3][3];
+
+	if (site->rank > 0)
+		torque = vec_cross(&site->d, &grad);
+
+	if (site->rank > 1) {
+		for (size_t a = 0; a < 3; a++)
+			for (size_t b = 0; b < 3; b++) {
+				p[a][b] = 0.0;
+
+				for (size_t c = 0; c < 3; c++)
+					p[a][b] += site->quad[quad_idx(a, c)] *
+					    phi[4 + quad_idx(c, b)];
+			}
+
+		torque.x += 2.0 / 3.0 * (p[1][2] - p[2][1]);
+		torque.y += 2.0 / 3.0 * (p[2][0] - p[0][2]);
+		torque.z += 2.0 / 3.0 * (p[0][1] - p[1][0]);
+	}
+	return torque;
+}
+
+/* Adds stress tensor contribution of a site in reciprocal space sum. The
+ * first part comes from the dependence of multipole terms of structure
+ * factors on the box shape and the second converts atomic virial to
+ * molecular one, com is the center of mass of site fragment and grad is
+ * energy gradient on the site. */
+void
+efp_pme_site_stress(struct efp *efp, const struct pme_site *site,
+    const double *phi, const vec_t *com, const vec_t *grad)
+{
+	vec_t dr = vec_sub(&site->r, com);
+
+	if (site->rank > 0) {
+		vec_t gphi = { phi[1], phi[2], phi[3] };
+
+		efp_add_stress(efp, &gphi, &site->d);
+	}
+	if (site->rank > 1) {
+		for (size_t c = 0; c < 3; c++) {
+			vec_t x = {
+				2.0 / 3.0 * phi[4 + quad_idx(0, c)],
+				2.0 / 3.0 * phi[4 + quad_idx(1, c)],
+				2.0 / 3.0 * phi[4 + quad_idx(2, c)]
+			};
+			vec_t y = {
+				site->quad[quad_idx(0, c)],
+				site->quad[quad_idx(1, c)],
+				site->quad[quad_idx(2, c)]
+			};
+
+			efp_add_stress(efp, &x, &y);
+		}
+	}
+	efp_add_stress(efp, &dr, grad);
+}
+
+/* Adds gradient, torque and stress of a site of fragment frag_idx in the
+ * potential interpolated from the real (part = 0) or imaginary (part = 1)
+ * part of the potential grid. */
+void
+efp_pme_add_site_grad(struct efp *efp, size_t frag_idx,
+    const struct pme_site *site, size_t part)
+{
+	const struct frag *frag = efp->frags + frag_idx;
+	double phi[20];
+	vec_t grad, torque;
+
+	efp_pme_gather(&efp->pme, efp->pme.grid, &site->r, site->rank + 1,
+	    part, phi);
+
+	grad = efp_pme_site_grad(site, phi);
+	torque = efp_pme_site_torque(site, phi);
+
+	efp_add_force(efp, frag_idx, CVEC(frag->x), &site->r, &grad, &torque);
+	efp_pme_site_stress(efp, site, phi, CVEC(frag->x), &grad);
+}
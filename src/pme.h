@@ -0,0 +1,101 @@
+/*-
+ * Copyright (c) 2012-2017 Ilya Kaliman
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef LIBEFP_PME_H
+#define LIBEFP_PME_H
+
+#include "efp.h"
+#include "fft.h"
+#include "mathutil.h"
+
+#define PME_MIN_ORDER 5
+#define PME_MAX_ORDER 12
+
+struct efp;
+struct frag;
+
+/* Point multipole up to quadrupole used in Ewald summation and in the fast
+ * multipole method. Quadrupoles are traceless and stored in the same order
+ * and convention as for multipole points. */
+struct pme_site {
+	vec_t r;          /* position */
+	double q;         /* charge */
+	vec_t d;          /* dipole */
+	double quad[6];   /* quadrupole */
+	size_t rank;      /* highest multipole rank of the site */
+};
+
+/* Smooth particle mesh Ewald summation. Sites are spread onto the charge
+ * grid with cardinal B-splines, the grid is convolved with the reciprocal
+ * space Ewald kernel using 3D FFT and potential derivatives are
+ * interpolated back from the grid. The grid is complex, so two sets of
+ * sites can be handled at once, one in the real and one in the imaginary
+ * part of the grid.
+ *
+ * Potential derivatives are stored in arrays of 20 elements: potential,
+ * then first derivatives in x, y, z order, then second derivatives in the
+ * order of quadrupoles and third derivatives in the order of octupoles. */
+struct pme {
+	size_t n[3];      /* grid dimensions */
+	size_t order;     /* B-spline interpolation order */
+	double alpha;     /* Ewald splitting parameter */
+	vec_t box;        /* periodic box used for the setup */
+	double *kernel;   /* reciprocal space kernel with B-spline moduli */
+	double *grid;     /* charge grid, holds potential after solve */
+	double *field;    /* potential of all sources for electric field */
+	int field_valid;  /* nonzero if field is up to date */
+	struct fft fft;   /* transform of the grid */
+};
+
+extern const size_t efp_pme_deriv_pow[20][3];
+extern const size_t efp_pme_n_deriv[4];
+
+enum efp_result efp_pme_update(struct efp *, struct pme *);
+void efp_pme_free(struct pme *);
+void efp_pme_clear(struct pme *);
+void efp_pme_spread(struct pme *, const struct pme_site *, size_t);
+void efp_pme_solve(struct pme *, int, double *, mat_t *);
+void efp_pme_gather(const struct pme *, const double *, const vec_t *,
+    size_t, size_t, double *);
+
+void efp_pme_get_site(const struct frag *, size_t, struct pme_site *);
+size_t efp_pme_get_site_count(const struct frag *);
+void efp_pme_bn(double, double, size_t, double *);
+void efp_pme_bn_erf(double, double, size_t, double *);
+void efp_pme_bn_coulomb(double, size_t, double *);
+void efp_pme_site_field(const struct pme_site *, const vec_t *,
+    const double *, size_t, double *);
+double efp_pme_site_pair(const struct pme_site *, const struct pme_site *,
+    const vec_t *, const double *, vec_t *, vec_t *, vec_t *);
+double efp_pme_site_energy(const struct pme_site *, const double *);
+vec_t efp_pme_site_grad(const struct pme_site *, const double *);
+vec_t efp_pme_site_torque(const struct pme_site *, const double *);
+void efp_pme_site_stress(struct efp *, const struct pme_site *,
+    const double *, const vec_t *, const vec_t *);
+void efp_pme_add_site_grad(struct efp *, size_t, const struct pme_site *,
+    size_t);
+
+#endif /* LIBEFP_PME_H */
@@ -26,6 +26,10 @@
 
 #include <stdlib.h>
 
+#ifdef EFP_USE_MPI
+#include <mpi.h>
+#endif
+
 #include "balance.h"
 #include "elec.h"
 #include "private.h"
@@ -33,13 +37,37 @@
 #define POL_SCF_TOL 1.0e-10
 #define POL_SCF_MAX_ITER 80
 
+/* single precision iterations of mixed precision polarization stop when
+ * the change of the correction is this fraction of its initial value */
+#define POL_SP_REL_TOL 1.0e-4
+
+/* number of points in vectorized blocks of single precision kernels */
+#define POL_SP_BLOCK 64
+
+/* number of points in blocks of electric field evaluation */
+#define POL_FIELD_BLOCK 64
+
 double efp_get_pol_damp_tt(double, double, double);
 enum efp_result efp_compute_id_direct(struct efp *);
 
 struct id_work_data {
-	double conv;
-	vec_t *id_new;
-	vec_t *id_conj_new;
+	const vec_t *id;
+	const vec_t *id_conj;
+	vec_t *field;
+	vec_t *field_conj;
+	vec_t *field_rec;
+	vec_t *field_conj_rec;
+};
+
+/* Arrays of single precision vectors used by mixed precision polarization
+ * store x, y and z components of all n points one after another. */
+struct id_sp_work_data {
+	size_t n;
+	const float *xyz; /* points relative to fragment centers */
+	const float *id;
+	const float *id_conj;
+	vec_t *field;
+	vec_t *field_conj;
 };
 
 double
@@ -60,6 +88,39 @@ efp_get_pol_damp_tt_grad(double r, double pa, double pb)
 	return -2.0 * exp(-ab * r2) * (ab * ab * r2);
 }
 
+/* Returns fragments which interact with a fragment through polarization
+ * directly. With fast multipole method these are fragments of the near
+ * field and the rest is computed through expansions. */
+static size_t
+get_pol_row(const struct efp *efp, size_t frag_idx, const size_t **row)
+{
+	if (efp->opts.enable_fmm)
+		return efp_fmm_get_row(&efp->fmm, frag_idx, row);
+
+	return efp_nblist_get_row(efp, frag_idx, row);
+}
+
+/* Skipped pairs are not allowed with fast multipole method and its near
+ * field is not truncated. */
+static int
+skip_pol_pair(const struct efp *efp, size_t fr_i_idx, size_t fr_j_idx)
+{
+	if (efp->opts.enable_fmm)
+		return 0;
+
+	return efp_skip_frag_pair(efp, fr_i_idx, fr_j_idx);
+}
+
+static struct swf
+make_pol_swf(const struct efp *efp, const struct frag *fr_i,
+    const struct frag *fr_j)
+{
+	if (efp->opts.enable_fmm)
+		return efp_make_unit_swf(fr_i, fr_j);
+
+	return efp_make_swf(efp, fr_i, fr_j);
+}
+
 static vec_t
 get_multipole_field(const vec_t *xyz, const struct multipole_pt *mult_pt,
     const struct swf *swf)
@@ -113,28 +174,63 @@ get_multipole_field(const vec_t *xyz, const struct multipole_pt *mult_pt,
 	return field;
 }
 
-static vec_t
-get_elec_field(const struct efp *efp, size_t frag_idx, size_t pt_idx)
+/* Returns nonzero if polarization of fragments i and j is computed directly
+ * and the pair is assigned to fragment i. Each pair is visited once and
+ * contributions are added to both fragments. */
+static int
+owns_pol_pair(const struct efp *efp, size_t i, size_t j)
 {
-	const struct frag *fr_j = efp->frags + frag_idx;
-	const struct polarizable_pt *pt = fr_j->polarizable_pts + pt_idx;
-	vec_t elec_field = vec_zero;
+	if (i == j || !efp_nblist_owns_pair(efp->n_frag, i, j))
+		return 0;
 
-	for (size_t i = 0; i < efp->n_frag; i++) {
-		if (i == frag_idx || efp_skip_frag_pair(efp, i, frag_idx))
-			continue;
+	return !skip_pol_pair(efp, i, j);
+}
 
-		const struct frag *fr_i = efp->frags + i;
-		struct swf swf = efp_make_swf(efp, fr_i, fr_j);
+/* Switching function of a pair with fragments swapped. */
+static struct swf
+reverse_swf(const struct swf *swf)
+{
+	struct swf rev = *swf;
+
+	vec_negate(&rev.dswf);
+	vec_negate(&rev.dr);
+	vec_negate(&rev.cell);
+
+	return rev;
+}
+
+/* Adds thread-private fields to the shared ones. */
+static void
+reduce_field(size_t n, const vec_t *buf, vec_t *field)
+{
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+	for (size_t i = 0; i < n; i++)
+		field[i] = vec_add(field + i, buf + i);
+}
+
+/* Adds field of nuclei and multipoles of fragment fr_i_idx at polarizable
+ * points of fragment fr_j_idx. */
+static void
+add_elec_field_pair(const struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
+    const struct swf *swf, vec_t *elec_field)
+{
+	const struct frag *fr_i = efp->frags + fr_i_idx;
+	const struct frag *fr_j = efp->frags + fr_j_idx;
+
+	for (size_t k = 0; k < fr_j->n_polarizable_pts; k++) {
+		const struct polarizable_pt *pt = fr_j->polarizable_pts + k;
+		vec_t *field = elec_field + fr_j->polarizable_offset + k;
 
 		/* field due to nuclei */
 		for (size_t j = 0; j < fr_i->n_atoms; j++) {
 			const struct efp_atom *at = fr_i->atoms + j;
 
 			vec_t dr = {
-				pt->x - at->x - swf.cell.x,
-				pt->y - at->y - swf.cell.y,
-				pt->z - at->z - swf.cell.z
+				pt->x - at->x - swf->cell.x,
+				pt->y - at->y - swf->cell.y,
+				pt->z - at->z - swf->cell.z
 			};
 
 			double r = vec_len(&dr);
@@ -145,9 +241,9 @@ get_elec_field(const struct efp *efp, size_t frag_idx, size_t pt_idx)
 				p1 = efp_get_pol_damp_tt(r, fr_i->pol_damp,
 				    fr_j->pol_damp);
 			}
-			elec_field.x += swf.swf * at->znuc * dr.x / r3 * p1;
-			elec_field.y += swf.swf * at->znuc * dr.y / r3 * p1;
-			elec_field.z += swf.swf * at->znuc * dr.z / r3 * p1;
+			field->x += swf->swf * at->znuc * dr.x / r3 * p1;
+			field->y += swf->swf * at->znuc * dr.y / r3 * p1;
+			field->z += swf->swf * at->znuc * dr.z / r3 * p1;
 		}
 
 		/* field due to multipoles */
@@ -155,12 +251,12 @@ get_elec_field(const struct efp *efp, size_t frag_idx, size_t pt_idx)
 			const struct multipole_pt *mult_pt =
 			    fr_i->multipole_pts + j;
 			vec_t mult_field = get_multipole_field(CVEC(pt->x),
-			    mult_pt, &swf);
+			    mult_pt, swf);
 
 			vec_t dr = {
-				pt->x - mult_pt->x - swf.cell.x,
-				pt->y - mult_pt->y - swf.cell.y,
-				pt->z - mult_pt->z - swf.cell.z
+				pt->x - mult_pt->x - swf->cell.x,
+				pt->y - mult_pt->y - swf->cell.y,
+				pt->z - mult_pt->z - swf->cell.z
 			};
 
 			double r = vec_len(&dr);
@@ -170,29 +266,258 @@ get_elec_field(const struct efp *efp, size_t frag_idx, size_t pt_idx)
 				p1 = efp_get_pol_damp_tt(r, fr_i->pol_damp,
 				    fr_j->pol_damp);
 			}
-			elec_field.x += mult_field.x * p1;
-			elec_field.y += mult_field.y * p1;
-			elec_field.z += mult_field.z * p1;
+			field->x += mult_field.x * p1;
+			field->y += mult_field.y * p1;
+			field->z += mult_field.z * p1;
 		}
 	}
+}
 
-	if (efp->opts.terms & EFP_TERM_AI_POL) {
-		/* field due to nuclei from ab initio subsystem */
-		for (size_t i = 0; i < efp->n_ptc; i++) {
-			vec_t dr = vec_sub(CVEC(pt->x), efp->ptc_xyz + i);
+/* Field due to nuclei from ab initio subsystem at a point. */
+static vec_t
+get_ptc_field(const struct efp *efp, const vec_t *xyz)
+{
+	vec_t field = vec_zero;
 
-			double r = vec_len(&dr);
-			double r3 = r * r * r;
+	for (size_t i = 0; i < efp->n_ptc; i++) {
+		vec_t dr = vec_sub(xyz, efp->ptc_xyz + i);
+
+		double r = vec_len(&dr);
+		double r3 = r * r * r;
+
+		field.x += efp->ptc[i] * dr.x / r3;
+		field.y += efp->ptc[i] * dr.y / r3;
+		field.z += efp->ptc[i] * dr.z / r3;
+	}
+
+	return field;
+}
+
+static void
+get_pol_site(const struct polarizable_pt *pt, const vec_t *dipole,
+    struct pme_site *site)
+{
+	memset(site, 0, sizeof(*site));
+
+	site->r.x = pt->x;
+	site->r.y = pt->y;
+	site->r.z = pt->z;
+	site->d = *dipole;
+	site->rank = 1;
+}
+
+/* Radial functions of the real space kernel for polarization with
+ * particle mesh Ewald. Damping applies only to the Coulomb part within
+ * cutoff, so the correction (p1 - 1) / r is added to the Ewald kernel.
+ * If damping is enabled, Coulomb radial functions are stored in bc and
+ * the damping gradient factor is returned. */
+static double
+get_pol_pme_kernel(const struct efp *efp, const struct frag *fr_i,
+    const struct frag *fr_j, double r, size_t n, double *bn, double *bc)
+{
+	double p1;
 
-			elec_field.x += efp->ptc[i] * dr.x / r3;
-			elec_field.y += efp->ptc[i] * dr.y / r3;
-			elec_field.z += efp->ptc[i] * dr.z / r3;
+	efp_pme_bn(efp->pme.alpha, r, n, bn);
+
+	if (efp->opts.pol_damp != EFP_POL_DAMP_TT)
+		return 0.0;
+
+	p1 = efp_get_pol_damp_tt(r, fr_i->pol_damp, fr_j->pol_damp);
+	efp_pme_bn_coulomb(r, n, bc);
+
+	for (size_t k = 0; k <= n; k++)
+		bn[k] += (p1 - 1.0) * bc[k];
+
+	return efp_get_pol_damp_tt_grad(r, fr_i->pol_damp, fr_j->pol_damp);
+}
+
+/* Subtracts potential derivatives at a point from sites of the same
+ * fragment, which are included in the reciprocal space sum. */
+static void
+sub_pme_self_field(const struct efp *efp, const struct pme_site *site,
+    const vec_t *xyz, double *phi)
+{
+	vec_t dr = vec_sub(xyz, &site->r);
+	double bn[4];
+
+	efp_pme_bn_erf(efp->pme.alpha, vec_len(&dr), site->rank + 1, bn);
+
+	for (size_t k = 0; k <= site->rank + 1; k++)
+		bn[k] = -bn[k];
+
+	efp_pme_site_field(site, &dr, bn, 1, phi);
+}
+
+/* Electric field at a polarizable point from particle mesh Ewald sum. The
+ * reciprocal space part is computed beforehand. */
+static vec_t
+get_elec_field_pme(const struct efp *efp, size_t frag_idx, size_t pt_idx,
+    const vec_t *field_rec)
+{
+	const struct frag *fr_j = efp->frags + frag_idx;
+	const struct polarizable_pt *pt = fr_j->polarizable_pts + pt_idx;
+	double phi[4] = { 0.0, 0.0, 0.0, 0.0 };
+	vec_t elec_field;
+
+	const size_t *nb;
+	size_t n_nb = efp_nblist_get_row(efp, frag_idx, &nb);
+
+	for (size_t m = 0; m < n_nb; m++) {
+		size_t i = nb ? nb[m] : m;
+
+		if (i == frag_idx || efp_skip_frag_pair(efp, i, frag_idx))
+			continue;
+
+		const struct frag *fr_i = efp->frags + i;
+		struct swf swf = efp_make_swf(efp, fr_i, fr_j);
+
+		for (size_t j = 0; j < efp_pme_get_site_count(fr_i); j++) {
+			struct pme_site site;
+			double bn[4], bc[4];
+
+			efp_pme_get_site(fr_i, j, &site);
+
+			vec_t dr = {
+				pt->x - site.r.x - swf.cell.x,
+				pt->y - site.r.y - swf.cell.y,
+				pt->z - site.r.z - swf.cell.z
+			};
+
+			get_pol_pme_kernel(efp, fr_i, fr_j, vec_len(&dr),
+			    site.rank + 1, bn, bc);
+			efp_pme_site_field(&site, &dr, bn, 1, phi);
 		}
 	}
 
+	for (size_t j = 0; j < efp_pme_get_site_count(fr_j); j++) {
+		struct pme_site site;
+
+		efp_pme_get_site(fr_j, j, &site);
+		sub_pme_self_field(efp, &site, CVEC(pt->x), phi);
+	}
+
+	elec_field.x = field_rec->x - phi[1];
+	elec_field.y = field_rec->y - phi[2];
+	elec_field.z = field_rec->z - phi[3];
+
+	if (efp->opts.terms & EFP_TERM_AI_POL) {
+		vec_t ptc_field = get_ptc_field(efp, CVEC(pt->x));
+		elec_field = vec_add(&elec_field, &ptc_field);
+	}
+
 	return elec_field;
 }
 
+/* Interpolates electric field at all polarizable points from the real
+ * (part = 0) or imaginary (part = 1) part of the potential grid. */
+static void
+gather_pme_field(struct efp *efp, size_t part, vec_t *field)
+{
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+			const struct polarizable_pt *pt =
+			    frag->polarizable_pts + j;
+			double phi[4];
+
+			efp_pme_gather(&efp->pme, efp->pme.grid, CVEC(pt->x),
+			    1, part, phi);
+
+			field[frag->polarizable_offset + j].x = -phi[1];
+			field[frag->polarizable_offset + j].y = -phi[2];
+			field[frag->polarizable_offset + j].z = -phi[3];
+		}
+	}
+}
+
+/* Reciprocal space part of electric field from multipoles at all
+ * polarizable points. This is computed by all processes. */
+static enum efp_result
+compute_elec_field_rec(struct efp *efp, vec_t *field)
+{
+	enum efp_result res;
+
+	if ((res = efp_pme_update(efp, &efp->pme)))
+		return res;
+
+	efp_pme_clear(&efp->pme);
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < efp_pme_get_site_count(frag); j++) {
+			struct pme_site site;
+
+			efp_pme_get_site(frag, j, &site);
+			efp_pme_spread(&efp->pme, &site, 0);
+		}
+	}
+
+	efp_pme_solve(&efp->pme, 0, NULL, NULL);
+	gather_pme_field(efp, 0, field);
+
+	return EFP_RESULT_SUCCESS;
+}
+
+/* Evaluates electric field at all polarizable points from local expansions
+ * of the first (part = 0) or second (part = 1) set of sites. */
+static void
+gather_fmm_field(struct efp *efp, size_t part, vec_t *field)
+{
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+			const struct polarizable_pt *pt =
+			    frag->polarizable_pts + j;
+			double phi[4];
+
+			efp_fmm_eval(&efp->fmm, efp->fmm.local, i, CVEC(pt->x),
+			    1, part, phi);
+
+			field[frag->polarizable_offset + j].x = -phi[1];
+			field[frag->polarizable_offset + j].y = -phi[2];
+			field[frag->polarizable_offset + j].z = -phi[3];
+		}
+	}
+}
+
+/* Far field part of electric field from multipoles at all polarizable
+ * points with fast multipole method. This is computed by all processes. */
+static enum efp_result
+compute_elec_field_far(struct efp *efp, vec_t *field)
+{
+	enum efp_result res;
+
+	if ((res = efp_fmm_update(efp, &efp->fmm)))
+		return res;
+
+	efp_fmm_clear(&efp->fmm);
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < efp_pme_get_site_count(frag); j++) {
+			struct pme_site site;
+
+			efp_pme_get_site(frag, j, &site);
+			efp_fmm_add_site(&efp->fmm, i, &site, 0);
+		}
+	}
+
+	efp_fmm_solve(&efp->fmm);
+	gather_fmm_field(efp, 0, field);
+
+	return EFP_RESULT_SUCCESS;
+}
+
 static enum efp_result
 add_electron_density_field(struct efp *efp)
 {
@@ -202,8 +527,10 @@ add_electron_density_field(struct efp *efp)
 	if (efp->get_electron_density_field == NULL)
 		return EFP_RESULT_SUCCESS;
 
-	xyz = (vec_t *)malloc(efp->n_polarizable_pts * sizeof(vec_t));
-	field = (vec_t *)malloc(efp->n_polarizable_pts * sizeof(vec_t));
+	xyz = (vec_t *)efp_scratch_alloc(efp,
+	    efp->n_polarizable_pts * sizeof(vec_t));
+	field = (vec_t *)efp_scratch_alloc(efp,
+	    efp->n_polarizable_pts * sizeof(vec_t));
 
 	for (size_t i = 0, idx = 0; i < efp->n_frag; i++) {
 		struct frag *frag = efp->frags + i;
@@ -231,15 +558,18 @@ add_electron_density_field(struct efp *efp)
 		}
 	}
 error:
-	free(xyz);
-	free(field);
+	efp_scratch_free(efp, field);
+	efp_scratch_free(efp, xyz);
 	return res;
 }
 
+/* Real space part of the static field with particle mesh Ewald. */
 static void
-compute_elec_field_range(struct efp *efp, size_t from, size_t to, void *data)
+compute_elec_field_range_pme(struct efp *efp, size_t from, size_t to,
+    void *data)
 {
 	vec_t *elec_field = (vec_t *)data;
+	const vec_t *field_rec = elec_field + efp->n_polarizable_pts;
 
 #ifdef _OPENMP
 #pragma omp parallel for schedule(dynamic)
@@ -248,20 +578,113 @@ compute_elec_field_range(struct efp *efp, size_t from, size_t to, void *data)
 		const struct frag *frag = efp->frags + i;
 
 		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
-			elec_field[frag->polarizable_offset + j] =
-			    get_elec_field(efp, i, j);
+			size_t idx = frag->polarizable_offset + j;
+
+			elec_field[idx] = get_elec_field_pme(efp, i, j,
+			    field_rec + idx);
+		}
+	}
+}
+
+/* Static field from fragment pairs owned by fragments in the range. Both
+ * fragments of a pair receive their contributions in the same visit, so
+ * threads accumulate fields in private buffers. */
+static void
+compute_elec_field_range(struct efp *efp, size_t from, size_t to, void *data)
+{
+	vec_t *elec_field = (vec_t *)data;
+	const vec_t *field_far = elec_field + efp->n_polarizable_pts;
+	size_t npts = efp->n_polarizable_pts;
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		vec_t *field = (vec_t *)efp_scratch_alloc(efp,
+		    npts * sizeof(vec_t));
+		memset(field, 0, npts * sizeof(vec_t));
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+		for (size_t i = from; i < to; i++) {
+			const struct frag *fr_i = efp->frags + i;
+			const size_t *nb;
+			size_t n_nb = get_pol_row(efp, i, &nb);
+
+			for (size_t m = 0; m < n_nb; m++) {
+				size_t j = nb ? nb[m] : m;
+
+				if (!owns_pol_pair(efp, i, j))
+					continue;
+
+				struct swf swf = make_pol_swf(efp, fr_i,
+				    efp->frags + j);
+				struct swf swf_ji = reverse_swf(&swf);
+
+				add_elec_field_pair(efp, i, j, &swf, field);
+				add_elec_field_pair(efp, j, i, &swf_ji, field);
+			}
+
+			for (size_t k = 0; k < fr_i->n_polarizable_pts; k++) {
+				size_t idx = fr_i->polarizable_offset + k;
+
+				if (efp->opts.terms & EFP_TERM_AI_POL) {
+					vec_t ptc_field = get_ptc_field(efp,
+					    CVEC(fr_i->polarizable_pts[k].x));
+					field[idx] = vec_add(field + idx,
+					    &ptc_field);
+				}
+				if (efp->opts.enable_fmm)
+					field[idx] = vec_add(field + idx,
+					    field_far + idx);
+			}
 		}
+
+		reduce_field(npts, field, elec_field);
+		efp_scratch_free(efp, field);
 	}
 }
 
+/* Computes field at polarizable points which does not change during scf.
+ * Field of fragments and point charges is kept until they move, only field
+ * of ab initio electron density is computed in every call. */
 static enum efp_result
 compute_elec_field(struct efp *efp)
 {
 	vec_t *elec_field;
+	size_t n_field = efp->opts.enable_pme || efp->opts.enable_fmm ? 2 : 1;
 	enum efp_result res;
 
-	elec_field = (vec_t *)calloc(efp->n_polarizable_pts, sizeof(vec_t));
-	efp_balance_work(efp, compute_elec_field_range, elec_field);
+	if (efp->elec_field_valid)
+		goto field_wf;
+
+	/* reciprocal space field with PME or far field with FMM is stored
+	 * after the total field */
+	elec_field = (vec_t *)efp_scratch_alloc(efp,
+	    n_field * efp->n_polarizable_pts * sizeof(vec_t));
+	memset(elec_field, 0, efp->n_polarizable_pts * sizeof(vec_t));
+
+	if (efp->opts.enable_pme) {
+		if ((res = compute_elec_field_rec(efp,
+		    elec_field + efp->n_polarizable_pts))) {
+			efp_scratch_free(efp, elec_field);
+			return res;
+		}
+	}
+	if (efp->opts.enable_fmm) {
+		if ((res = compute_elec_field_far(efp,
+		    elec_field + efp->n_polarizable_pts))) {
+			efp_scratch_free(efp, elec_field);
+			return res;
+		}
+	}
+
+	if (efp->opts.enable_pme)
+		efp_balance_work(efp, compute_elec_field_range_pme,
+		    elec_field);
+	else
+		efp_balance_work(efp, compute_elec_field_range, elec_field);
 	efp_allreduce((double *)elec_field, 3 * efp->n_polarizable_pts);
 
 #ifdef _OPENMP
@@ -273,10 +696,18 @@ compute_elec_field(struct efp *efp)
 		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
 			frag->polarizable_pts[j].elec_field =
 			    elec_field[frag->polarizable_offset + j];
-			frag->polarizable_pts[j].elec_field_wf = vec_zero;
 		}
 	}
-	free(elec_field);
+	efp_scratch_free(efp, elec_field);
+	efp->elec_field_valid = 1;
+
+field_wf:
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++)
+			frag->polarizable_pts[j].elec_field_wf = vec_zero;
+	}
 
 	if (efp->opts.terms & EFP_TERM_AI_POL)
 		if ((res = add_electron_density_field(efp)))
@@ -287,19 +718,25 @@ compute_elec_field(struct efp *efp)
 
 static void
 get_induced_dipole_field(struct efp *efp, size_t frag_idx,
-    struct polarizable_pt *pt, vec_t *field, vec_t *field_conj)
+    struct polarizable_pt *pt, const vec_t *id, const vec_t *id_conj,
+    vec_t *field, vec_t *field_conj)
 {
 	struct frag *fr_i = efp->frags + frag_idx;
 
 	*field = vec_zero;
 	*field_conj = vec_zero;
 
-	for (size_t j = 0; j < efp->n_frag; j++) {
-		if (j == frag_idx || efp_skip_frag_pair(efp, frag_idx, j))
+	const size_t *nb;
+	size_t n_nb = get_pol_row(efp, frag_idx, &nb);
+
+	for (size_t m = 0; m < n_nb; m++) {
+		size_t j = nb ? nb[m] : m;
+
+		if (j == frag_idx || skip_pol_pair(efp, frag_idx, j))
 			continue;
 
 		struct frag *fr_j = efp->frags + j;
-		struct swf swf = efp_make_swf(efp, fr_i, fr_j);
+		struct swf swf = make_pol_swf(efp, fr_i, fr_j);
 
 		for (size_t jj = 0; jj < fr_j->n_polarizable_pts; jj++) {
 			struct polarizable_pt *pt_j = fr_j->polarizable_pts+jj;
@@ -315,8 +752,8 @@ get_induced_dipole_field(struct efp *efp, size_t frag_idx,
 			double r3 = r * r * r;
 			double r5 = r3 * r * r;
 
-			double t1 = vec_dot(&efp->indip[idx], &dr);
-			double t2 = vec_dot(&efp->indipconj[idx], &dr);
+			double t1 = vec_dot(&id[idx], &dr);
+			double t2 = vec_dot(&id_conj[idx], &dr);
 
 			double p1 = 1.0;
 
@@ -324,93 +761,675 @@ get_induced_dipole_field(struct efp *efp, size_t frag_idx,
 				p1 = efp_get_pol_damp_tt(r, fr_i->pol_damp,
 				    fr_j->pol_damp);
 			}
-			field->x -= swf.swf * p1 * (efp->indip[idx].x / r3 -
+			field->x -= swf.swf * p1 * (id[idx].x / r3 -
 			    3.0 * t1 * dr.x / r5);
-			field->y -= swf.swf * p1 * (efp->indip[idx].y / r3 -
+			field->y -= swf.swf * p1 * (id[idx].y / r3 -
 			    3.0 * t1 * dr.y / r5);
-			field->z -= swf.swf * p1 * (efp->indip[idx].z / r3 -
+			field->z -= swf.swf * p1 * (id[idx].z / r3 -
 			    3.0 * t1 * dr.z / r5);
 
 			field_conj->x -= swf.swf * p1 *
-			    (efp->indipconj[idx].x / r3 - 3.0 * t2 * dr.x / r5);
+			    (id_conj[idx].x / r3 - 3.0 * t2 * dr.x / r5);
 			field_conj->y -= swf.swf * p1 *
-			    (efp->indipconj[idx].y / r3 - 3.0 * t2 * dr.y / r5);
+			    (id_conj[idx].y / r3 - 3.0 * t2 * dr.y / r5);
 			field_conj->z -= swf.swf * p1 *
-			    (efp->indipconj[idx].z / r3 - 3.0 * t2 * dr.z / r5);
+			    (id_conj[idx].z / r3 - 3.0 * t2 * dr.z / r5);
 		}
 	}
 }
 
-static void
-compute_id_range(struct efp *efp, size_t from, size_t to, void *data)
+/* Field at distance dr from a point dipole scaled by s. */
+static vec_t
+get_dipole_field(const vec_t *dipole, const vec_t *dr, double r3, double r5,
+    double s)
 {
-	double conv = 0.0;
-	vec_t *id_new, *id_conj_new;
+	double t = 3.0 * vec_dot(dipole, dr) / r5;
 
-	id_new = ((struct id_work_data *)data)->id_new;
-	id_conj_new = ((struct id_work_data *)data)->id_conj_new;
+	vec_t field = {
+		s * (t * dr->x - dipole->x / r3),
+		s * (t * dr->y - dipole->y / r3),
+		s * (t * dr->z - dipole->z / r3)
+	};
 
-#ifdef _OPENMP
-#pragma omp parallel for schedule(dynamic) reduction(+:conv)
-#endif
-	for (size_t i = from; i < to; i++) {
-		struct frag *frag = efp->frags + i;
+	return field;
+}
 
-		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
-			struct polarizable_pt *pt = frag->polarizable_pts + j;
-			size_t idx = frag->polarizable_offset + j;
-			vec_t field, field_conj;
+/* Adds field of induced dipoles of each fragment of a pair at polarizable
+ * points of the other one. Dipole field tensor does not change when the
+ * points are swapped, so distance and damping are computed once for each
+ * pair of points. */
+static void
+add_id_field_pair(const struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
+    const struct swf *swf, const vec_t *id, const vec_t *id_conj,
+    vec_t *field, vec_t *field_conj)
+{
+	const struct frag *fr_i = efp->frags + fr_i_idx;
+	const struct frag *fr_j = efp->frags + fr_j_idx;
 
-			/* electric field from other induced dipoles */
-			get_induced_dipole_field(efp, i, pt, &field,
-			    &field_conj);
+	for (size_t ii = 0; ii < fr_i->n_polarizable_pts; ii++) {
+		const struct polarizable_pt *pt_i = fr_i->polarizable_pts + ii;
+		size_t idx_i = fr_i->polarizable_offset + ii;
 
-			/* add field that doesn't change during scf */
-			field.x += pt->elec_field.x + pt->elec_field_wf.x;
-			field.y += pt->elec_field.y + pt->elec_field_wf.y;
-			field.z += pt->elec_field.z + pt->elec_field_wf.z;
+		for (size_t jj = 0; jj < fr_j->n_polarizable_pts; jj++) {
+			const struct polarizable_pt *pt_j =
+			    fr_j->polarizable_pts + jj;
+			size_t idx_j = fr_j->polarizable_offset + jj;
+			vec_t f;
+
+			vec_t dr = {
+				pt_i->x - pt_j->x + swf->cell.x,
+				pt_i->y - pt_j->y + swf->cell.y,
+				pt_i->z - pt_j->z + swf->cell.z
+			};
 
-			field_conj.x += pt->elec_field.x + pt->elec_field_wf.x;
-			field_conj.y += pt->elec_field.y + pt->elec_field_wf.y;
-			field_conj.z += pt->elec_field.z + pt->elec_field_wf.z;
+			double r = vec_len(&dr);
+			double r3 = r * r * r;
+			double r5 = r3 * r * r;
+			double p1 = 1.0;
 
-			id_new[idx] = mat_vec(&pt->tensor, &field);
-			id_conj_new[idx] = mat_trans_vec(&pt->tensor,
-			    &field_conj);
+			if (efp->opts.pol_damp == EFP_POL_DAMP_TT) {
+				p1 = efp_get_pol_damp_tt(r, fr_i->pol_damp,
+				    fr_j->pol_damp);
+			}
 
-			conv += vec_dist(&id_new[idx], &efp->indip[idx]);
-			conv += vec_dist(&id_conj_new[idx],
-			    &efp->indipconj[idx]);
+			f = get_dipole_field(id + idx_j, &dr, r3, r5,
+			    swf->swf * p1);
+			field[idx_i] = vec_add(field + idx_i, &f);
+			f = get_dipole_field(id_conj + idx_j, &dr, r3, r5,
+			    swf->swf * p1);
+			field_conj[idx_i] = vec_add(field_conj + idx_i, &f);
+			f = get_dipole_field(id + idx_i, &dr, r3, r5,
+			    swf->swf * p1);
+			field[idx_j] = vec_add(field + idx_j, &f);
+			f = get_dipole_field(id_conj + idx_i, &dr, r3, r5,
+			    swf->swf * p1);
+			field_conj[idx_j] = vec_add(field_conj + idx_j, &f);
 		}
 	}
-
-	((struct id_work_data *)data)->conv += conv;
 }
 
-static double
-pol_scf_iter(struct efp *efp)
+/* Field of induced dipoles at a polarizable point from particle mesh
+ * Ewald sum without the reciprocal space part. */
+static void
+get_induced_dipole_field_pme(struct efp *efp, size_t frag_idx,
+    struct polarizable_pt *pt, const vec_t *id, const vec_t *id_conj,
+    vec_t *field, vec_t *field_conj)
 {
-	struct id_work_data data;
-	size_t npts = efp->n_polarizable_pts;
-
-	data.conv = 0.0;
-	data.id_new = (vec_t *)calloc(npts, sizeof(vec_t));
-	data.id_conj_new = (vec_t *)calloc(npts, sizeof(vec_t));
+	struct frag *fr_i = efp->frags + frag_idx;
+	double phi[4] = { 0.0, 0.0, 0.0, 0.0 };
+	double phi_conj[4] = { 0.0, 0.0, 0.0, 0.0 };
 
-	efp_balance_work(efp, compute_id_range, &data);
+	const size_t *nb;
+	size_t n_nb = efp_nblist_get_row(efp, frag_idx, &nb);
 
-	efp_allreduce((double *)data.id_new, 3 * npts);
-	efp_allreduce((double *)data.id_conj_new, 3 * npts);
-	efp_allreduce(&data.conv, 1);
+	for (size_t m = 0; m < n_nb; m++) {
+		size_t j = nb ? nb[m] : m;
 
-	memcpy(efp->indip, data.id_new, npts * sizeof(vec_t));
-	memcpy(efp->indipconj, data.id_conj_new, npts * sizeof(vec_t));
+		if (j == frag_idx || efp_skip_frag_pair(efp, frag_idx, j))
+			continue;
 
-	free(data.id_new);
-	free(data.id_conj_new);
+		struct frag *fr_j = efp->frags + j;
+		struct swf swf = efp_make_swf(efp, fr_i, fr_j);
 
-	return data.conv / npts / 2;
-}
+		for (size_t jj = 0; jj < fr_j->n_polarizable_pts; jj++) {
+			struct polarizable_pt *pt_j = fr_j->polarizable_pts+jj;
+			size_t idx = fr_j->polarizable_offset+jj;
+			struct pme_site site, site_conj;
+			double bn[3], bc[3];
+
+			vec_t dr = {
+				pt->x - pt_j->x + swf.cell.x,
+				pt->y - pt_j->y + swf.cell.y,
+				pt->z - pt_j->z + swf.cell.z
+			};
+
+			get_pol_site(pt_j, id + idx, &site);
+			get_pol_site(pt_j, id_conj + idx, &site_conj);
+			get_pol_pme_kernel(efp, fr_i, fr_j, vec_len(&dr),
+			    2, bn, bc);
+			efp_pme_site_field(&site, &dr, bn, 1, phi);
+			efp_pme_site_field(&site_conj, &dr, bn, 1, phi_conj);
+		}
+	}
+
+	for (size_t jj = 0; jj < fr_i->n_polarizable_pts; jj++) {
+		struct polarizable_pt *pt_j = fr_i->polarizable_pts + jj;
+		size_t idx = fr_i->polarizable_offset + jj;
+		struct pme_site site, site_conj;
+
+		get_pol_site(pt_j, id + idx, &site);
+		get_pol_site(pt_j, id_conj + idx, &site_conj);
+		sub_pme_self_field(efp, &site, CVEC(pt->x), phi);
+		sub_pme_self_field(efp, &site_conj, CVEC(pt->x), phi_conj);
+	}
+
+	field->x = -phi[1];
+	field->y = -phi[2];
+	field->z = -phi[3];
+
+	field_conj->x = -phi_conj[1];
+	field_conj->y = -phi_conj[2];
+	field_conj->z = -phi_conj[3];
+}
+
+/* Reciprocal space part of the field of induced dipoles and conjugate
+ * induced dipoles at all polarizable points. Both sets share one grid.
+ * This is computed by all processes. */
+static void
+compute_induced_dipole_field_rec(struct efp *efp, const vec_t *id,
+    const vec_t *id_conj, vec_t *field, vec_t *field_conj)
+{
+	efp_pme_clear(&efp->pme);
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+			size_t idx = frag->polarizable_offset + j;
+			struct pme_site site;
+
+			get_pol_site(frag->polarizable_pts + j,
+			    id + idx, &site);
+			efp_pme_spread(&efp->pme, &site, 0);
+			get_pol_site(frag->polarizable_pts + j,
+			    id_conj + idx, &site);
+			efp_pme_spread(&efp->pme, &site, 1);
+		}
+	}
+
+	efp_pme_solve(&efp->pme, 0, NULL, NULL);
+	gather_pme_field(efp, 0, field);
+	gather_pme_field(efp, 1, field_conj);
+}
+
+/* Far field of induced dipoles and conjugate induced dipoles at all
+ * polarizable points with fast multipole method. This is computed by all
+ * processes. */
+static void
+compute_induced_dipole_field_far(struct efp *efp, const vec_t *id,
+    const vec_t *id_conj, vec_t *field, vec_t *field_conj)
+{
+	efp_fmm_clear(&efp->fmm);
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+			size_t idx = frag->polarizable_offset + j;
+			struct pme_site site;
+
+			get_pol_site(frag->polarizable_pts + j,
+			    id + idx, &site);
+			efp_fmm_add_site(&efp->fmm, i, &site, 0);
+			get_pol_site(frag->polarizable_pts + j,
+			    id_conj + idx, &site);
+			efp_fmm_add_site(&efp->fmm, i, &site, 1);
+		}
+	}
+
+	efp_fmm_solve(&efp->fmm);
+	gather_fmm_field(efp, 0, field);
+	gather_fmm_field(efp, 1, field_conj);
+}
+
+/* Dipole field tensor of polarizable point pt_j of fragment fr_j at point
+ * pt of fragment fr_i. Field of dipole d located at pt_j is T d. */
+static mat_t
+get_id_tensor(const struct efp *efp, const struct frag *fr_i,
+    const struct polarizable_pt *pt, const struct frag *fr_j,
+    const struct polarizable_pt *pt_j, const struct swf *swf)
+{
+	vec_t dr = {
+		pt->x - pt_j->x + swf->cell.x,
+		pt->y - pt_j->y + swf->cell.y,
+		pt->z - pt_j->z + swf->cell.z
+	};
+
+	double r = vec_len(&dr);
+	double r3 = r * r * r;
+	double r5 = r3 * r * r;
+	double p1 = 1.0;
+
+	if (efp->opts.pol_damp == EFP_POL_DAMP_TT)
+		p1 = efp_get_pol_damp_tt(r, fr_i->pol_damp, fr_j->pol_damp);
+
+	double a = swf->swf * p1 * 3.0 / r5;
+	double b = swf->swf * p1 / r3;
+
+	mat_t t = {
+		a * dr.x * dr.x - b, a * dr.x * dr.y, a * dr.x * dr.z,
+		a * dr.y * dr.x, a * dr.y * dr.y - b, a * dr.y * dr.z,
+		a * dr.z * dr.x, a * dr.z * dr.y, a * dr.z * dr.z - b
+	};
+
+	return t;
+}
+
+/* Real space part of dipole field tensor with particle mesh Ewald. Points
+ * of the same fragment only contribute the correction for the excluded
+ * reciprocal space interaction. As the field is linear in dipole, columns
+ * are obtained from fields of unit dipoles. */
+static mat_t
+get_id_tensor_pme(const struct efp *efp, const struct frag *fr_i,
+    const struct polarizable_pt *pt, const struct frag *fr_j,
+    const struct polarizable_pt *pt_j, const struct swf *swf)
+{
+	double t[9], bn[3], bc[3];
+
+	vec_t dr = {
+		pt->x - pt_j->x + swf->cell.x,
+		pt->y - pt_j->y + swf->cell.y,
+		pt->z - pt_j->z + swf->cell.z
+	};
+
+	if (fr_i != fr_j)
+		get_pol_pme_kernel(efp, fr_i, fr_j, vec_len(&dr), 2, bn, bc);
+
+	for (size_t k = 0; k < 3; k++) {
+		double phi[4] = { 0.0, 0.0, 0.0, 0.0 };
+		vec_t dipole = vec_zero;
+		struct pme_site site;
+
+		((double *)&dipole)[k] = 1.0;
+		get_pol_site(pt_j, &dipole, &site);
+
+		if (fr_i != fr_j)
+			efp_pme_site_field(&site, &dr, bn, 1, phi);
+		else
+			sub_pme_self_field(efp, &site, CVEC(pt->x), phi);
+
+		t[0 + k] = -phi[1];
+		t[3 + k] = -phi[2];
+		t[6 + k] = -phi[3];
+	}
+
+	return *(mat_t *)t;
+}
+
+/* Sets up partner lists of the dipole field tensor cache for the current
+ * geometry. Fragments are taken in order while their tensors fit into
+ * the memory limit, tensors are computed on first use. Arrays are kept
+ * between geometries and only grow. */
+static enum efp_result
+setup_pol_cache(struct efp *efp)
+{
+	struct pol_cache *cache = &efp->pol_cache;
+	size_t limit = efp->opts.pol_cache_size * 1024 * 1024;
+	size_t n_frag = 0, n_col = 0, n_tensor = 0, size = 0;
+
+	if (cache->valid)
+		return EFP_RESULT_SUCCESS;
+
+	cache->n_frag = 0;
+	cache->col_offset = (size_t *)efp_reserve(efp, cache->col_offset,
+	    &cache->col_offset_size, (efp->n_frag + 1) * sizeof(size_t));
+	if (cache->col_offset == NULL)
+		return EFP_RESULT_NO_MEMORY;
+	cache->tensor_offset = (size_t *)efp_reserve(efp, cache->tensor_offset,
+	    &cache->tensor_offset_size, (efp->n_frag + 1) * sizeof(size_t));
+	if (cache->tensor_offset == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	cache->col_offset[0] = 0;
+	cache->tensor_offset[0] = 0;
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+		const size_t *nb;
+		size_t n_nb = get_pol_row(efp, i, &nb), n = 0;
+
+		for (size_t m = 0; m < n_nb; m++) {
+			size_t j = nb ? nb[m] : m;
+
+			if (j == i || skip_pol_pair(efp, i, j))
+				continue;
+
+			n += efp->frags[j].n_polarizable_pts;
+		}
+
+		if (efp->opts.enable_pme)
+			n += frag->n_polarizable_pts;
+
+		size += n * (sizeof(size_t) +
+		    frag->n_polarizable_pts * sizeof(mat_t));
+
+		if (limit > 0 && size > limit)
+			break;
+
+		n_col += n;
+		n_tensor += n * frag->n_polarizable_pts;
+		cache->col_offset[i + 1] = n_col;
+		cache->tensor_offset[i + 1] = n_tensor;
+		n_frag++;
+	}
+
+	cache->col = (size_t *)efp_reserve(efp, cache->col, &cache->col_size,
+	    n_col * sizeof(size_t));
+	if (cache->col == NULL)
+		return EFP_RESULT_NO_MEMORY;
+	cache->tensor = (mat_t *)efp_reserve(efp, cache->tensor,
+	    &cache->tensor_size, n_tensor * sizeof(mat_t));
+	if (cache->tensor == NULL)
+		return EFP_RESULT_NO_MEMORY;
+	cache->ready = (char *)efp_reserve(efp, cache->ready,
+	    &cache->ready_size, n_frag);
+	if (cache->ready == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	memset(cache->ready, 0, n_frag);
+
+	cache->n_frag = n_frag;
+	cache->valid = 1;
+
+	return EFP_RESULT_SUCCESS;
+}
+
+/* Computes cached dipole field tensors of fragment frag_idx. */
+static void
+fill_pol_cache(struct efp *efp, size_t frag_idx)
+{
+	struct pol_cache *cache = &efp->pol_cache;
+	const struct frag *fr_i = efp->frags + frag_idx;
+	size_t *col = cache->col + cache->col_offset[frag_idx];
+	size_t n_col = cache->col_offset[frag_idx + 1] -
+	    cache->col_offset[frag_idx];
+	mat_t *tensor = cache->tensor + cache->tensor_offset[frag_idx];
+	size_t k = 0;
+
+	const size_t *nb;
+	size_t n_nb = get_pol_row(efp, frag_idx, &nb);
+
+	for (size_t m = 0; m <= n_nb; m++) {
+		size_t j = frag_idx;
+
+		/* own fragment goes last, it is only needed with PME */
+		if (m < n_nb) {
+			j = nb ? nb[m] : m;
+
+			if (j == frag_idx || skip_pol_pair(efp, frag_idx, j))
+				continue;
+		} else if (!efp->opts.enable_pme)
+			break;
+
+		const struct frag *fr_j = efp->frags + j;
+		struct swf swf = fr_j == fr_i ?
+		    efp_make_unit_swf(fr_i, fr_j) :
+		    make_pol_swf(efp, fr_i, fr_j);
+
+		for (size_t jj = 0; jj < fr_j->n_polarizable_pts; jj++, k++) {
+			const struct polarizable_pt *pt_j =
+			    fr_j->polarizable_pts + jj;
+
+			col[k] = fr_j->polarizable_offset + jj;
+
+			for (size_t ii = 0; ii < fr_i->n_polarizable_pts;
+			    ii++) {
+				const struct polarizable_pt *pt =
+				    fr_i->polarizable_pts + ii;
+
+				tensor[ii * n_col + k] =
+				    efp->opts.enable_pme ?
+				    get_id_tensor_pme(efp, fr_i, pt, fr_j,
+				    pt_j, &swf) :
+				    get_id_tensor(efp, fr_i, pt, fr_j, pt_j,
+				    &swf);
+			}
+		}
+	}
+
+	assert(k == n_col);
+	cache->ready[frag_idx] = 1;
+}
+
+/* Field of induced dipoles at a polarizable point from cached tensors. */
+static void
+get_cached_id_field(const struct efp *efp, size_t frag_idx, size_t pt_idx,
+    const vec_t *id, const vec_t *id_conj, vec_t *field, vec_t *field_conj)
+{
+	const struct pol_cache *cache = &efp->pol_cache;
+	const size_t *col = cache->col + cache->col_offset[frag_idx];
+	size_t n_col = cache->col_offset[frag_idx + 1] -
+	    cache->col_offset[frag_idx];
+	const mat_t *tensor = cache->tensor +
+	    cache->tensor_offset[frag_idx] + pt_idx * n_col;
+
+	*field = vec_zero;
+	*field_conj = vec_zero;
+
+	for (size_t k = 0; k < n_col; k++) {
+		vec_t f = mat_vec(tensor + k, id + col[k]);
+		vec_t fc = mat_vec(tensor + k, id_conj + col[k]);
+
+		field->x += f.x;
+		field->y += f.y;
+		field->z += f.z;
+		field_conj->x += fc.x;
+		field_conj->y += fc.y;
+		field_conj->z += fc.z;
+	}
+}
+
+void
+efp_free_pol_cache(struct pol_cache *cache)
+{
+	free(cache->col_offset);
+	free(cache->tensor_offset);
+	free(cache->col);
+	free(cache->tensor);
+	free(cache->ready);
+	memset(cache, 0, sizeof(*cache));
+}
+
+static void
+compute_id_range(struct efp *efp, size_t from, size_t to, void *data)
+{
+	struct id_work_data *wd = (struct id_work_data *)data;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (size_t i = from; i < to; i++) {
+		struct frag *frag = efp->frags + i;
+		int cached = efp->opts.enable_pol_cache &&
+		    i < efp->pol_cache.n_frag;
+
+		if (cached && !efp->pol_cache.ready[i])
+			fill_pol_cache(efp, i);
+
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+			struct polarizable_pt *pt = frag->polarizable_pts + j;
+			size_t idx = frag->polarizable_offset + j;
+			vec_t field, field_conj;
+
+			if (cached)
+				get_cached_id_field(efp, i, j, wd->id,
+				    wd->id_conj, &field, &field_conj);
+			else if (efp->opts.enable_pme)
+				get_induced_dipole_field_pme(efp, i, pt, wd->id,
+				    wd->id_conj, &field, &field_conj);
+			else
+				get_induced_dipole_field(efp, i, pt, wd->id,
+				    wd->id_conj, &field, &field_conj);
+
+			/* reciprocal space part with PME or far field with
+			 * FMM */
+			if (wd->field_rec) {
+				field = vec_add(&field, wd->field_rec + idx);
+				field_conj = vec_add(&field_conj,
+				    wd->field_conj_rec + idx);
+			}
+
+			wd->field[idx] = field;
+			wd->field_conj[idx] = field_conj;
+		}
+	}
+}
+
+/* Field of induced dipoles from fragment pairs owned by fragments in the
+ * range. Threads accumulate fields in private buffers. */
+static void
+compute_id_range_pairs(struct efp *efp, size_t from, size_t to, void *data)
+{
+	struct id_work_data *wd = (struct id_work_data *)data;
+	size_t npts = efp->n_polarizable_pts;
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		vec_t *field = (vec_t *)efp_scratch_alloc(efp,
+		    2 * npts * sizeof(vec_t));
+		vec_t *field_conj = field + npts;
+		memset(field, 0, 2 * npts * sizeof(vec_t));
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+		for (size_t i = from; i < to; i++) {
+			const struct frag *fr_i = efp->frags + i;
+			const size_t *nb;
+			size_t n_nb = get_pol_row(efp, i, &nb);
+
+			for (size_t m = 0; m < n_nb; m++) {
+				size_t j = nb ? nb[m] : m;
+
+				if (!owns_pol_pair(efp, i, j))
+					continue;
+
+				struct swf swf = make_pol_swf(efp, fr_i,
+				    efp->frags + j);
+
+				add_id_field_pair(efp, i, j, &swf, wd->id,
+				    wd->id_conj, field, field_conj);
+			}
+
+			/* far field with FMM */
+			if (wd->field_rec == NULL)
+				continue;
+
+			for (size_t k = 0; k < fr_i->n_polarizable_pts; k++) {
+				size_t idx = fr_i->polarizable_offset + k;
+
+				field[idx] = vec_add(field + idx,
+				    wd->field_rec + idx);
+				field_conj[idx] = vec_add(field_conj + idx,
+				    wd->field_conj_rec + idx);
+			}
+		}
+
+		reduce_field(npts, field, wd->field);
+		reduce_field(npts, field_conj, wd->field_conj);
+		efp_scratch_free(efp, field);
+	}
+}
+
+/* Computes electric field of dipoles id and conjugate dipoles id_conj
+ * located at polarizable points at all polarizable points. */
+static void
+compute_id_field(struct efp *efp, const vec_t *id, const vec_t *id_conj,
+    vec_t *field, vec_t *field_conj)
+{
+	struct id_work_data data;
+	size_t npts = efp->n_polarizable_pts;
+
+	data.id = id;
+	data.id_conj = id_conj;
+	data.field = field;
+	data.field_conj = field_conj;
+	data.field_rec = NULL;
+	data.field_conj_rec = NULL;
+
+	memset(field, 0, npts * sizeof(vec_t));
+	memset(field_conj, 0, npts * sizeof(vec_t));
+
+	if (efp->opts.enable_pme || efp->opts.enable_fmm) {
+		data.field_rec = (vec_t *)efp_scratch_alloc(efp,
+		    npts * sizeof(vec_t));
+		data.field_conj_rec = (vec_t *)efp_scratch_alloc(efp,
+		    npts * sizeof(vec_t));
+
+		if (efp->opts.enable_pme)
+			compute_induced_dipole_field_rec(efp, id, id_conj,
+			    data.field_rec, data.field_conj_rec);
+		else
+			compute_induced_dipole_field_far(efp, id, id_conj,
+			    data.field_rec, data.field_conj_rec);
+	}
+
+	/* cached tensors and real space part of particle mesh Ewald are
+	 * evaluated for each polarizable point */
+	if (efp->opts.enable_pol_cache || efp->opts.enable_pme)
+		efp_balance_work(efp, compute_id_range, &data);
+	else
+		efp_balance_work(efp, compute_id_range_pairs, &data);
+
+	efp_allreduce((double *)field, 3 * npts);
+	efp_allreduce((double *)field_conj, 3 * npts);
+
+	efp_scratch_free(efp, data.field_conj_rec);
+	efp_scratch_free(efp, data.field_rec);
+}
+
+/* Field at a polarizable point that doesn't change during scf. */
+static vec_t
+get_static_field(const struct polarizable_pt *pt)
+{
+	return vec_add(&pt->elec_field, &pt->elec_field_wf);
+}
+
+/* One Jacobi iteration for induced dipoles. If delta is not NULL, changes of
+ * dipoles and conjugate dipoles are stored in delta and delta_conj. */
+static double
+pol_scf_iter(struct efp *efp, vec_t *delta, vec_t *delta_conj)
+{
+	size_t npts = efp->n_polarizable_pts;
+	vec_t *field, *field_conj;
+	double conv = 0.0;
+
+	field = (vec_t *)efp_scratch_alloc(efp, npts * sizeof(vec_t));
+	field_conj = (vec_t *)efp_scratch_alloc(efp, npts * sizeof(vec_t));
+
+	/* electric field from other induced dipoles */
+	compute_id_field(efp, efp->indip, efp->indipconj, field, field_conj);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) reduction(+:conv)
+#endif
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+			struct polarizable_pt *pt = frag->polarizable_pts + j;
+			size_t idx = frag->polarizable_offset + j;
+			vec_t field_st = get_static_field(pt);
+			vec_t id_new, id_conj_new;
+
+			field[idx] = vec_add(field + idx, &field_st);
+			field_conj[idx] = vec_add(field_conj + idx, &field_st);
+
+			id_new = mat_vec(&pt->tensor, field + idx);
+			id_conj_new = mat_trans_vec(&pt->tensor,
+			    field_conj + idx);
+
+			conv += vec_dist(&id_new, &efp->indip[idx]);
+			conv += vec_dist(&id_conj_new, &efp->indipconj[idx]);
+
+			if (delta) {
+				delta[idx] = vec_sub(&id_new, efp->indip + idx);
+				delta_conj[idx] = vec_sub(&id_conj_new,
+				    efp->indipconj + idx);
+			}
+
+			efp->indip[idx] = id_new;
+			efp->indipconj[idx] = id_conj_new;
+		}
+	}
+
+	efp_scratch_free(efp, field_conj);
+	efp_scratch_free(efp, field);
+
+	return conv / npts / 2;
+}
 
 static void
 compute_energy_range(struct efp *efp, size_t from, size_t to, void *data)
@@ -427,28 +1446,621 @@ compute_energy_range(struct efp *efp, size_t from, size_t to, void *data)
 			struct polarizable_pt *pt = frag->polarizable_pts + j;
 			size_t idx = frag->polarizable_offset + j;
 
-			energy += 0.5 * vec_dot(&efp->indipconj[idx],
-						&pt->elec_field_wf) -
-				  0.5 * vec_dot(&efp->indip[idx],
-						&pt->elec_field);
+			energy += 0.5 * vec_dot(&efp->indipconj[idx],
+						&pt->elec_field_wf) -
+				  0.5 * vec_dot(&efp->indip[idx],
+						&pt->elec_field);
+		}
+	}
+
+	*(double *)data += energy;
+}
+
+static double
+get_scf_tol(const struct efp *efp)
+{
+	return efp->opts.pol_scf_tol > 0.0 ? efp->opts.pol_scf_tol :
+	    POL_SCF_TOL;
+}
+
+static size_t
+get_scf_max_iter(const struct efp *efp)
+{
+	return efp->opts.pol_scf_max_iter > 0 ? efp->opts.pol_scf_max_iter :
+	    POL_SCF_MAX_ITER;
+}
+
+static void
+set_vec_sp(float *a, size_t n, size_t idx, const vec_t *v)
+{
+	a[idx] = (float)v->x;
+	a[idx + n] = (float)v->y;
+	a[idx + 2 * n] = (float)v->z;
+}
+
+static vec_t
+get_vec_sp(const float *a, size_t n, size_t idx)
+{
+	vec_t v = { a[idx], a[idx + n], a[idx + 2 * n] };
+
+	return v;
+}
+
+/* Approximates exp(-u) for u >= 0 without library calls, so that loops
+ * using it can be vectorized. Truncated series of exp(u / 32) is raised to
+ * the 32nd power, relative error is below 2.0e-5 for u < 20. For large u
+ * the power overflows and the result is zero. */
+static inline float
+exp_neg_sp(float u)
+{
+	float v = u * (1.0f / 32.0f);
+	float e = 1.0f + v * (1.0f + v * (1.0f / 2.0f + v * (1.0f / 6.0f +
+	    v * (1.0f / 24.0f + v * (1.0f / 120.0f + v * (1.0f / 720.0f +
+	    v * (1.0f / 5040.0f)))))));
+
+	/* exp(u) = exp(u / 32) ^ 32 */
+	e *= e;
+	e *= e;
+	e *= e;
+	e *= e;
+	e *= e;
+
+	return 1.0f / e;
+}
+
+/* Adds field of single precision induced dipoles of each fragment of a
+ * pair at polarizable points of the other one. Points are stored relative
+ * to fragment centers, so that only the distance between the centers is
+ * taken from double precision. */
+static void
+add_id_field_pair_sp(const struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
+    const struct swf *swf, const struct id_sp_work_data *wd, float *field,
+    float *field_conj)
+{
+	const struct frag *fr_i = efp->frags + fr_i_idx;
+	const struct frag *fr_j = efp->frags + fr_j_idx;
+	size_t n = wd->n, off_j = fr_j->polarizable_offset;
+	const float *xj = wd->xyz + off_j;
+	const float *dj = wd->id + off_j;
+	const float *cj = wd->id_conj + off_j;
+	float *fj = field + off_j;
+	float *gj = field_conj + off_j;
+	float damp = efp->opts.pol_damp == EFP_POL_DAMP_TT ? 1.0f : 0.0f;
+	float ab = (float)sqrt(fr_i->pol_damp * fr_j->pol_damp);
+	float s = (float)swf->swf;
+
+	for (size_t ii = 0; ii < fr_i->n_polarizable_pts; ii++) {
+		size_t idx_i = fr_i->polarizable_offset + ii;
+		vec_t d_i = get_vec_sp(wd->id, n, idx_i);
+		vec_t c_i = get_vec_sp(wd->id_conj, n, idx_i);
+		float dix = (float)d_i.x, diy = (float)d_i.y, diz = (float)d_i.z;
+		float cix = (float)c_i.x, ciy = (float)c_i.y, ciz = (float)c_i.z;
+		float fx = 0.0f, fy = 0.0f, fz = 0.0f;
+		float gx = 0.0f, gy = 0.0f, gz = 0.0f;
+
+		float xi = wd->xyz[idx_i] - (float)swf->dr.x;
+		float yi = wd->xyz[idx_i + n] - (float)swf->dr.y;
+		float zi = wd->xyz[idx_i + 2 * n] - (float)swf->dr.z;
+
+		for (size_t j0 = 0; j0 < fr_j->n_polarizable_pts;
+		    j0 += POL_SP_BLOCK) {
+			size_t nb = fr_j->n_polarizable_pts - j0;
+			float r2[POL_SP_BLOCK], r[POL_SP_BLOCK];
+
+			if (nb > POL_SP_BLOCK)
+				nb = POL_SP_BLOCK;
+
+			vec_dist_block_sp(nb, xj + j0, xj + j0 + n,
+			    xj + j0 + 2 * n, xi, yi, zi, r2, r);
+
+#ifdef _OPENMP
+#pragma omp simd reduction(+:fx,fy,fz,gx,gy,gz)
+#endif
+			for (size_t k = 0; k < nb; k++) {
+				size_t jj = j0 + k;
+				float x = xi - xj[jj];
+				float y = yi - xj[jj + n];
+				float z = zi - xj[jj + 2 * n];
+				float abr2 = ab * r2[k];
+				float p = s * (1.0f - damp * exp_neg_sp(abr2) *
+				    (1.0f + abr2));
+				float ri = 1.0f / r[k];
+				float r3i = p * ri * ri * ri;
+				float r5i = 3.0f * r3i * ri * ri;
+				float t;
+
+				/* field at point of i */
+				t = r5i * (dj[jj] * x + dj[jj + n] * y +
+				    dj[jj + 2 * n] * z);
+				fx += t * x - r3i * dj[jj];
+				fy += t * y - r3i * dj[jj + n];
+				fz += t * z - r3i * dj[jj + 2 * n];
+
+				t = r5i * (cj[jj] * x + cj[jj + n] * y +
+				    cj[jj + 2 * n] * z);
+				gx += t * x - r3i * cj[jj];
+				gy += t * y - r3i * cj[jj + n];
+				gz += t * z - r3i * cj[jj + 2 * n];
+
+				/* field at point of j */
+				t = r5i * (dix * x + diy * y + diz * z);
+				fj[jj] += t * x - r3i * dix;
+				fj[jj + n] += t * y - r3i * diy;
+				fj[jj + 2 * n] += t * z - r3i * diz;
+
+				t = r5i * (cix * x + ciy * y + ciz * z);
+				gj[jj] += t * x - r3i * cix;
+				gj[jj + n] += t * y - r3i * ciy;
+				gj[jj + 2 * n] += t * z - r3i * ciz;
+			}
+		}
+
+		field[idx_i] += fx;
+		field[idx_i + n] += fy;
+		field[idx_i + 2 * n] += fz;
+		field_conj[idx_i] += gx;
+		field_conj[idx_i + n] += gy;
+		field_conj[idx_i + 2 * n] += gz;
+	}
+}
+
+/* Single precision field of induced dipoles from fragment pairs owned by
+ * fragments in the range. Far field with FMM and reciprocal space part with
+ * PME are left to double precision iterations. */
+static void
+compute_id_range_sp(struct efp *efp, size_t from, size_t to, void *data)
+{
+	struct id_sp_work_data *wd = (struct id_sp_work_data *)data;
+	size_t n = wd->n;
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		float *field = (float *)efp_scratch_alloc(efp,
+		    6 * n * sizeof(float));
+		float *field_conj = field + 3 * n;
+		memset(field, 0, 6 * n * sizeof(float));
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+		for (size_t i = from; i < to; i++) {
+			const size_t *nb;
+			size_t n_nb = get_pol_row(efp, i, &nb);
+
+			for (size_t m = 0; m < n_nb; m++) {
+				size_t j = nb ? nb[m] : m;
+
+				if (!owns_pol_pair(efp, i, j))
+					continue;
+
+				struct swf swf = make_pol_swf(efp,
+				    efp->frags + i, efp->frags + j);
+
+				add_id_field_pair_sp(efp, i, j, &swf, wd,
+				    field, field_conj);
+			}
+		}
+
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+		for (size_t k = 0; k < n; k++) {
+			vec_t f = get_vec_sp(field, n, k);
+			vec_t g = get_vec_sp(field_conj, n, k);
+
+			wd->field[k] = vec_add(wd->field + k, &f);
+			wd->field_conj[k] = vec_add(wd->field_conj + k, &g);
+		}
+
+		efp_scratch_free(efp, field);
+	}
+}
+
+/* Refines induced dipoles after a double precision Jacobi iteration that
+ * changed them by delta and delta_conj. The correction x of the dipoles
+ * before that iteration solves (1 - alpha T) x = delta, which is done by
+ * Jacobi iterations in single precision. Its error is removed by the next
+ * double precision iteration. */
+static void
+refine_id_sp(struct efp *efp, const vec_t *delta, const vec_t *delta_conj)
+{
+	size_t n = efp->n_polarizable_pts;
+	size_t max_iter = get_scf_max_iter(efp);
+	struct id_sp_work_data data;
+	float *xyz, *x, *x_conj;
+	vec_t *field, *field_conj;
+	double tol = 0.0;
+
+	xyz = (float *)efp_scratch_alloc(efp, 3 * n * sizeof(float));
+	x = (float *)efp_scratch_alloc(efp, 3 * n * sizeof(float));
+	x_conj = (float *)efp_scratch_alloc(efp, 3 * n * sizeof(float));
+	field = (vec_t *)efp_scratch_alloc(efp, n * sizeof(vec_t));
+	field_conj = (vec_t *)efp_scratch_alloc(efp, n * sizeof(vec_t));
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+			const struct polarizable_pt *pt =
+			    frag->polarizable_pts + j;
+			size_t idx = frag->polarizable_offset + j;
+			vec_t dr = vec_sub(CVEC(pt->x), CVEC(frag->x));
+
+			set_vec_sp(xyz, n, idx, &dr);
+			set_vec_sp(x, n, idx, delta + idx);
+			set_vec_sp(x_conj, n, idx, delta_conj + idx);
+			tol += vec_len(delta + idx) + vec_len(delta_conj + idx);
+		}
+	}
+
+	tol *= POL_SP_REL_TOL / n / 2;
+
+	data.n = n;
+	data.xyz = xyz;
+	data.id = x;
+	data.id_conj = x_conj;
+	data.field = field;
+	data.field_conj = field_conj;
+
+	for (size_t iter = 1; iter <= max_iter; iter++) {
+		double conv = 0.0;
+
+		memset(field, 0, n * sizeof(vec_t));
+		memset(field_conj, 0, n * sizeof(vec_t));
+
+		efp_balance_work(efp, compute_id_range_sp, &data);
+		efp_allreduce((double *)field, 3 * n);
+		efp_allreduce((double *)field_conj, 3 * n);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) reduction(+:conv)
+#endif
+		for (size_t i = 0; i < efp->n_frag; i++) {
+			struct frag *frag = efp->frags + i;
+
+			for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+				struct polarizable_pt *pt =
+				    frag->polarizable_pts + j;
+				size_t idx = frag->polarizable_offset + j;
+				vec_t x_old = get_vec_sp(x, n, idx);
+				vec_t x_conj_old = get_vec_sp(x_conj, n, idx);
+				vec_t x_new, x_conj_new;
+
+				x_new = mat_vec(&pt->tensor, field + idx);
+				x_new = vec_add(&x_new, delta + idx);
+				x_conj_new = mat_trans_vec(&pt->tensor,
+				    field_conj + idx);
+				x_conj_new = vec_add(&x_conj_new,
+				    delta_conj + idx);
+
+				conv += vec_dist(&x_new, &x_old);
+				conv += vec_dist(&x_conj_new, &x_conj_old);
+
+				set_vec_sp(x, n, idx, &x_new);
+				set_vec_sp(x_conj, n, idx, &x_conj_new);
+			}
+		}
+
+		if (conv / n / 2 < tol)
+			break;
+	}
+
+	/* dipoles already include delta */
+	for (size_t i = 0; i < n; i++) {
+		vec_t dx = get_vec_sp(x, n, i);
+		vec_t dx_conj = get_vec_sp(x_conj, n, i);
+
+		dx = vec_sub(&dx, delta + i);
+		dx_conj = vec_sub(&dx_conj, delta_conj + i);
+		efp->indip[i] = vec_add(efp->indip + i, &dx);
+		efp->indipconj[i] = vec_add(efp->indipconj + i, &dx_conj);
+	}
+
+	efp_scratch_free(efp, field_conj);
+	efp_scratch_free(efp, field);
+	efp_scratch_free(efp, x_conj);
+	efp_scratch_free(efp, x);
+	efp_scratch_free(efp, xyz);
+}
+
+static enum efp_result
+efp_compute_id_iterative(struct efp *efp)
+{
+	size_t npts = efp->n_polarizable_pts;
+	size_t max_iter = get_scf_max_iter(efp);
+	vec_t *delta = NULL, *delta_conj = NULL;
+	enum efp_result res = EFP_RESULT_SUCCESS;
+
+	if (!efp->pol_guess) {
+		memset(efp->indip, 0, npts * sizeof(vec_t));
+		memset(efp->indipconj, 0, npts * sizeof(vec_t));
+	}
+
+	/* double precision iterations check convergence and are followed by
+	 * single precision corrections in mixed precision mode */
+	if (efp->opts.enable_pol_mixed_precision) {
+		delta = (vec_t *)efp_scratch_alloc(efp, npts * sizeof(vec_t));
+		delta_conj = (vec_t *)efp_scratch_alloc(efp,
+		    npts * sizeof(vec_t));
+	}
+
+	for (size_t iter = 1; iter <= max_iter; iter++) {
+		if (pol_scf_iter(efp, delta, delta_conj) < get_scf_tol(efp))
+			break;
+		if (iter == max_iter) {
+			res = EFP_RESULT_POL_NOT_CONVERGED;
+			break;
+		}
+		if (delta)
+			refine_id_sp(efp, delta, delta_conj);
+	}
+
+	efp_scratch_free(efp, delta_conj);
+	efp_scratch_free(efp, delta);
+	return res;
+}
+
+/* Applies polarizability tensors of points to residuals r and r_conj of
+ * the system and of the transposed system. These are the updates of the
+ * Jacobi iteration, so the sum of their lengths is returned to measure
+ * convergence in the same way. */
+static double
+precondition(struct efp *efp, const vec_t *r, const vec_t *r_conj, vec_t *z,
+    vec_t *z_conj)
+{
+	double conv = 0.0;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) reduction(+:conv)
+#endif
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+			const struct polarizable_pt *pt =
+			    frag->polarizable_pts + j;
+			size_t idx = frag->polarizable_offset + j;
+
+			z[idx] = mat_vec(&pt->tensor, r + idx);
+			z_conj[idx] = mat_trans_vec(&pt->tensor, r_conj + idx);
+
+			conv += vec_len(z + idx) + vec_len(z_conj + idx);
+		}
+	}
+	return conv;
+}
+
+static double
+dot(size_t n, const vec_t *a, const vec_t *b)
+{
+	double sum = 0.0;
+
+	for (size_t i = 0; i < n; i++)
+		sum += vec_dot(a + i, b + i);
+
+	return sum;
+}
+
+/* Solves polarization equations (A^-1 - T) mu = E and (A^-T - T) mu* = E,
+ * where A are polarizability tensors of points and T is the dipole field
+ * tensor, by biconjugate gradient method. The two systems are transposes of
+ * each other, so conjugate induced dipoles are the solution of the shadow
+ * system. Polarizability tensors of points are used as the preconditioner.
+ * Inverse tensors are applied to search directions through the recurrence
+ * A^-1 p = r + beta A^-1 p, so they are needed only for the initial guess.
+ * Each iteration costs one evaluation of the induced dipole field. */
+static enum efp_result
+efp_compute_id_krylov(struct efp *efp)
+{
+	size_t n = efp->n_polarizable_pts, max_iter = get_scf_max_iter(efp);
+	double tol = get_scf_tol(efp), rho, conv;
+	vec_t *r, *rc, *p, *pc, *u, *uc, *q, *qc;
+	enum efp_result res = EFP_RESULT_POL_NOT_CONVERGED;
+
+	r = (vec_t *)efp_scratch_alloc(efp, n * sizeof(vec_t));
+	rc = (vec_t *)efp_scratch_alloc(efp, n * sizeof(vec_t));
+	p = (vec_t *)efp_scratch_alloc(efp, n * sizeof(vec_t));
+	pc = (vec_t *)efp_scratch_alloc(efp, n * sizeof(vec_t));
+	u = (vec_t *)efp_scratch_alloc(efp, n * sizeof(vec_t));
+	uc = (vec_t *)efp_scratch_alloc(efp, n * sizeof(vec_t));
+	q = (vec_t *)efp_scratch_alloc(efp, n * sizeof(vec_t));
+	qc = (vec_t *)efp_scratch_alloc(efp, n * sizeof(vec_t));
+
+	/* initial residuals r = E + T mu - A^-1 mu */
+	if (efp->pol_guess)
+		compute_id_field(efp, efp->indip, efp->indipconj, q, qc);
+	else {
+		memset(efp->indip, 0, n * sizeof(vec_t));
+		memset(efp->indipconj, 0, n * sizeof(vec_t));
+		memset(q, 0, n * sizeof(vec_t));
+		memset(qc, 0, n * sizeof(vec_t));
+	}
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+			const struct polarizable_pt *pt =
+			    frag->polarizable_pts + j;
+			size_t idx = frag->polarizable_offset + j;
+			vec_t field = get_static_field(pt);
+
+			r[idx] = vec_add(&field, q + idx);
+			rc[idx] = vec_add(&field, qc + idx);
+
+			if (efp->pol_guess) {
+				mat_t inv = mat_inv(&pt->tensor);
+				vec_t id = mat_vec(&inv, efp->indip + idx);
+				vec_t idc = mat_trans_vec(&inv,
+				    efp->indipconj + idx);
+
+				r[idx] = vec_sub(r + idx, &id);
+				rc[idx] = vec_sub(rc + idx, &idc);
+			}
+		}
+	}
+
+	conv = precondition(efp, r, rc, p, pc);
+	memcpy(u, r, n * sizeof(vec_t));
+	memcpy(uc, rc, n * sizeof(vec_t));
+	rho = dot(n, p, rc);
+
+	for (size_t iter = 0; conv / n / 2 >= tol; iter++) {
+		double sigma, alpha, beta, rho_new;
+
+		if (iter == max_iter)
+			goto error;
+
+		/* q = (A^-1 - T) p and qc = (A^-T - T) pc */
+		compute_id_field(efp, p, pc, q, qc);
+
+		for (size_t i = 0; i < n; i++) {
+			q[i] = vec_sub(u + i, q + i);
+			qc[i] = vec_sub(uc + i, qc + i);
+		}
+
+		if ((sigma = dot(n, pc, q)) == 0.0)
+			goto error;
+
+		alpha = rho / sigma;
+
+		for (size_t i = 0; i < n; i++) {
+			efp->indip[i].x += alpha * p[i].x;
+			efp->indip[i].y += alpha * p[i].y;
+			efp->indip[i].z += alpha * p[i].z;
+			efp->indipconj[i].x += alpha * pc[i].x;
+			efp->indipconj[i].y += alpha * pc[i].y;
+			efp->indipconj[i].z += alpha * pc[i].z;
+			r[i].x -= alpha * q[i].x;
+			r[i].y -= alpha * q[i].y;
+			r[i].z -= alpha * q[i].z;
+			rc[i].x -= alpha * qc[i].x;
+			rc[i].y -= alpha * qc[i].y;
+			rc[i].z -= alpha * qc[i].z;
+		}
+
+		/* preconditioned residuals are stored in q */
+		conv = precondition(efp, r, rc, q, qc);
+		rho_new = dot(n, q, rc);
+		beta = rho_new / rho;
+		rho = rho_new;
+
+		for (size_t i = 0; i < n; i++) {
+			p[i].x = q[i].x + beta * p[i].x;
+			p[i].y = q[i].y + beta * p[i].y;
+			p[i].z = q[i].z + beta * p[i].z;
+			pc[i].x = qc[i].x + beta * pc[i].x;
+			pc[i].y = qc[i].y + beta * pc[i].y;
+			pc[i].z = qc[i].z + beta * pc[i].z;
+			u[i].x = r[i].x + beta * u[i].x;
+			u[i].y = r[i].y + beta * u[i].y;
+			u[i].z = r[i].z + beta * u[i].z;
+			uc[i].x = rc[i].x + beta * uc[i].x;
+			uc[i].y = rc[i].y + beta * uc[i].y;
+			uc[i].z = rc[i].z + beta * uc[i].z;
+		}
+	}
+	res = EFP_RESULT_SUCCESS;
+error:
+	efp_scratch_free(efp, qc);
+	efp_scratch_free(efp, q);
+	efp_scratch_free(efp, uc);
+	efp_scratch_free(efp, u);
+	efp_scratch_free(efp, pc);
+	efp_scratch_free(efp, p);
+	efp_scratch_free(efp, rc);
+	efp_scratch_free(efp, r);
+	return res;
+}
+
+/* Binomial coefficient. */
+static double
+binom(size_t n, size_t k)
+{
+	double c = 1.0;
+
+	for (size_t i = 1; i <= k; i++)
+		c = c * (n - k + i) / i;
+
+	return c;
+}
+
+/* Predicts induced dipoles from solutions of previous computations using
+ * coefficients of the always stable predictor-corrector method of Kolafa,
+ * J. Comput. Chem. 25, 335 (2004). With one stored solution it is used as
+ * is. */
+static void
+predict_id(struct efp *efp)
+{
+	size_t n = efp->n_polarizable_pts;
+	size_t n_hist = efp->n_pol_history;
+	size_t k = n_hist < 2 ? 0 : n_hist - 2;
+
+	memset(efp->indip, 0, n * sizeof(vec_t));
+	memset(efp->indipconj, 0, n * sizeof(vec_t));
+
+	for (size_t j = 1; j <= n_hist; j++) {
+		/* j-th most recent solution */
+		size_t slot = (efp->pol_history_pos + efp->pol_history_size -
+		    j) % efp->pol_history_size;
+		const vec_t *id = efp->pol_history + 2 * slot * n;
+		const vec_t *id_conj = id + n;
+		double b = 1.0;
+
+		if (n_hist > 1)
+			b = (j % 2 ? 1.0 : -1.0) * j *
+			    binom(2 * k + 4, k + 2 - j) /
+			    binom(2 * k + 2, k + 1);
+
+		for (size_t i = 0; i < n; i++) {
+			efp->indip[i].x += b * id[i].x;
+			efp->indip[i].y += b * id[i].y;
+			efp->indip[i].z += b * id[i].z;
+			efp->indipconj[i].x += b * id_conj[i].x;
+			efp->indipconj[i].y += b * id_conj[i].y;
+			efp->indipconj[i].z += b * id_conj[i].z;
 		}
 	}
-
-	*(double *)data += energy;
 }
 
+/* Stores current induced dipoles for prediction in next computations. If
+ * nothing has moved since the last stored solution it is replaced, so that
+ * repeated computations at one geometry, e.g. during scf, take a single
+ * slot. */
 static enum efp_result
-efp_compute_id_iterative(struct efp *efp)
+store_id(struct efp *efp, int replace)
 {
-	memset(efp->indip, 0, efp->n_polarizable_pts * sizeof(vec_t));
-	memset(efp->indipconj, 0, efp->n_polarizable_pts * sizeof(vec_t));
-
-	for (size_t iter = 1; iter <= POL_SCF_MAX_ITER; iter++) {
-		if (pol_scf_iter(efp) < POL_SCF_TOL)
-			break;
-		if (iter == POL_SCF_MAX_ITER)
-			return EFP_RESULT_POL_NOT_CONVERGED;
+	size_t n = efp->n_polarizable_pts;
+	size_t size = efp->opts.pol_guess_history;
+	vec_t *id;
+
+	if (efp->pol_history_size != size) {
+		free(efp->pol_history);
+		efp->pol_history = (vec_t *)efp_malloc(efp, 2 * size * n *
+		    sizeof(vec_t));
+		efp->pol_history_size = 0;
+		efp->pol_history_pos = 0;
+		efp->n_pol_history = 0;
+
+		if (efp->pol_history == NULL)
+			return EFP_RESULT_NO_MEMORY;
+
+		efp->pol_history_size = size;
 	}
+
+	if (replace && efp->n_pol_history > 0)
+		efp->pol_history_pos = (efp->pol_history_pos + size - 1) % size;
+	else if (efp->n_pol_history < size)
+		efp->n_pol_history++;
+
+	id = efp->pol_history + 2 * efp->pol_history_pos * n;
+	memcpy(id, efp->indip, n * sizeof(vec_t));
+	memcpy(id + n, efp->indipconj, n * sizeof(vec_t));
+
+	efp->pol_history_pos = (efp->pol_history_pos + 1) % size;
+
 	return EFP_RESULT_SUCCESS;
 }
 
@@ -456,12 +2068,30 @@ enum efp_result
 efp_compute_pol_energy(struct efp *efp, double *energy)
 {
 	enum efp_result res;
+	int pol_guess = efp->pol_guess;
+	int use_history = efp->opts.pol_guess_history > 0 && !pol_guess &&
+	    efp->opts.pol_driver != EFP_POL_DRIVER_DIRECT;
+	int same_geometry = efp->elec_field_valid;
 
 	assert(energy);
 
 	if ((res = compute_elec_field(efp)))
 		return res;
 
+	if (efp->opts.enable_pol_cache &&
+	    efp->opts.pol_driver != EFP_POL_DRIVER_DIRECT &&
+	    (res = setup_pol_cache(efp)))
+		return res;
+
+	if (use_history && efp->pol_history_size ==
+	    efp->opts.pol_guess_history && efp->n_pol_history > 0) {
+		/* current dipoles were found at this geometry and are better
+		 * than extrapolation */
+		if (!same_geometry)
+			predict_id(efp);
+		efp->pol_guess = 1;
+	}
+
 	switch (efp->opts.pol_driver) {
 	case EFP_POL_DRIVER_ITERATIVE:
 		res = efp_compute_id_iterative(efp);
@@ -469,9 +2099,19 @@ efp_compute_pol_energy(struct efp *efp, double *energy)
 	case EFP_POL_DRIVER_DIRECT:
 		res = efp_compute_id_direct(efp);
 		break;
+	case EFP_POL_DRIVER_KRYLOV:
+		res = efp_compute_id_krylov(efp);
+		break;
 	}
 
-	if (res)
+	efp->pol_guess = pol_guess;
+
+	if (res) {
+		/* history is not a good guess after a failed solution */
+		efp->n_pol_history = 0;
+		return res;
+	}
+	if (use_history && (res = store_id(efp, same_geometry)))
 		return res;
 
 	*energy = 0.0;
@@ -482,38 +2122,55 @@ efp_compute_pol_energy(struct efp *efp, double *energy)
 }
 
 static void
-compute_grad_point(struct efp *efp, size_t frag_idx, size_t pt_idx)
+compute_grad_point_ai(struct efp *efp, size_t frag_idx, size_t pt_idx,
+    const vec_t *dipole_i)
 {
 	const struct frag *fr_i = efp->frags + frag_idx;
 	const struct polarizable_pt *pt_i = fr_i->polarizable_pts + pt_idx;
-	size_t idx_i = fr_i->polarizable_offset + pt_idx;
-	vec_t force, add_i, add_j, force_, add_i_, add_j_;
-	double e;
+	vec_t force, add_i, add_j;
 
-	vec_t dipole_i = {
-		0.5 * (efp->indip[idx_i].x + efp->indipconj[idx_i].x),
-		0.5 * (efp->indip[idx_i].y + efp->indipconj[idx_i].y),
-		0.5 * (efp->indip[idx_i].z + efp->indipconj[idx_i].z)
-	};
+	for (size_t j = 0; j < efp->n_ptc; j++) {
+		vec_t dr = vec_sub(efp->ptc_xyz + j, CVEC(pt_i->x));
 
-	for (size_t j = 0; j < efp->n_frag; j++) {
-		if (j == frag_idx || efp_skip_frag_pair(efp, frag_idx, j))
-			continue;
+		efp_charge_dipole_grad(efp->ptc[j], dipole_i, &dr,
+		    &force, &add_j, &add_i);
+		vec_negate(&add_i);
+		efp_add_ptc_grad(efp, j, &force);
+		efp_sub_force(efp, frag_idx, CVEC(fr_i->x),
+		    CVEC(pt_i->x), &force, &add_i);
+	}
+}
 
-		struct frag *fr_j = efp->frags + j;
-		struct swf swf = efp_make_swf(efp, fr_i, fr_j);
+/* Adds gradient of the interaction of induced dipoles of fragment frag_idx
+ * with nuclei and multipoles of fragment j. Returns the energy without
+ * switching applied. */
+static double
+add_grad_static_pair(struct efp *efp, size_t frag_idx, size_t j,
+    const struct swf *swf)
+{
+	const struct frag *fr_i = efp->frags + frag_idx;
+	const struct frag *fr_j = efp->frags + j;
+	vec_t force, add_i, add_j, force_, add_i_, add_j_;
+	double e, energy = 0.0;
 
-		/* energy without switching applied */
-		double energy = 0.0;
+	for (size_t ii = 0; ii < fr_i->n_polarizable_pts; ii++) {
+		const struct polarizable_pt *pt_i = fr_i->polarizable_pts + ii;
+		size_t idx_i = fr_i->polarizable_offset + ii;
+
+		vec_t dipole_i = {
+			0.5 * (efp->indip[idx_i].x + efp->indipconj[idx_i].x),
+			0.5 * (efp->indip[idx_i].y + efp->indipconj[idx_i].y),
+			0.5 * (efp->indip[idx_i].z + efp->indipconj[idx_i].z)
+		};
 
 		/* induced dipole - nuclei */
 		for (size_t k = 0; k < fr_j->n_atoms; k++) {
-			struct efp_atom *at_j = fr_j->atoms + k;
+			const struct efp_atom *at_j = fr_j->atoms + k;
 
 			vec_t dr = {
-				at_j->x - pt_i->x - swf.cell.x,
-				at_j->y - pt_i->y - swf.cell.y,
-				at_j->z - pt_i->z - swf.cell.z
+				at_j->x - pt_i->x - swf->cell.x,
+				at_j->y - pt_i->y - swf->cell.y,
+				at_j->z - pt_i->z - swf->cell.z
 			};
 
 			double p1 = 1.0, p2 = 0.0;
@@ -541,27 +2198,28 @@ compute_grad_point(struct efp *efp, size_t frag_idx, size_t pt_idx)
 			force.y += p2 * e * dr.y;
 			force.z += p2 * e * dr.z;
 
-			vec_scale(&force, swf.swf);
-			vec_scale(&add_i, swf.swf);
-			vec_scale(&add_j, swf.swf);
+			vec_scale(&force, swf->swf);
+			vec_scale(&add_i, swf->swf);
+			vec_scale(&add_j, swf->swf);
 
-			efp_add_force(efp->grad + frag_idx, CVEC(fr_i->x),
+			efp_add_force(efp, frag_idx, CVEC(fr_i->x),
 			    CVEC(pt_i->x), &force, &add_i);
-			efp_sub_force(efp->grad + j, CVEC(fr_j->x),
+			efp_sub_force(efp, j, CVEC(fr_j->x),
 			    CVEC(at_j->x), &force, &add_j);
-			efp_add_stress(&swf.dr, &force, &efp->stress);
+			efp_add_stress(efp, &swf->dr, &force);
 
 			energy += p1 * e;
 		}
 
 		/* induced dipole - multipoles */
 		for (size_t k = 0; k < fr_j->n_multipole_pts; k++) {
-			struct multipole_pt *pt_j = fr_j->multipole_pts + k;
+			const struct multipole_pt *pt_j =
+			    fr_j->multipole_pts + k;
 
 			vec_t dr = {
-				pt_j->x - pt_i->x - swf.cell.x,
-				pt_j->y - pt_i->y - swf.cell.y,
-				pt_j->z - pt_i->z - swf.cell.z
+				pt_j->x - pt_i->x - swf->cell.x,
+				pt_j->y - pt_i->y - swf->cell.y,
+				pt_j->z - pt_i->z - swf->cell.z
 			};
 
 			double p1 = 1.0, p2 = 0.0;
@@ -615,34 +2273,60 @@ compute_grad_point(struct efp *efp, size_t frag_idx, size_t pt_idx)
 			force.y += p2 * e * dr.y;
 			force.z += p2 * e * dr.z;
 
-			vec_scale(&force, swf.swf);
-			vec_scale(&add_i, swf.swf);
-			vec_scale(&add_j, swf.swf);
+			vec_scale(&force, swf->swf);
+			vec_scale(&add_i, swf->swf);
+			vec_scale(&add_j, swf->swf);
 
-			efp_add_force(efp->grad + frag_idx, CVEC(fr_i->x),
+			efp_add_force(efp, frag_idx, CVEC(fr_i->x),
 			    CVEC(pt_i->x), &force, &add_i);
-			efp_sub_force(efp->grad + j, CVEC(fr_j->x),
+			efp_sub_force(efp, j, CVEC(fr_j->x),
 			    CVEC(pt_j->x), &force, &add_j);
-			efp_add_stress(&swf.dr, &force, &efp->stress);
+			efp_add_stress(efp, &swf->dr, &force);
 
 			energy += p1 * e;
 		}
+	}
+
+	return energy;
+}
+
+/* Adds gradient of the interaction of induced dipoles of fragments i and j
+ * with conjugate induced dipoles of the other fragment. Distance and
+ * damping are computed once for each pair of points. Returns the energy
+ * without switching applied. */
+static double
+add_grad_id_pair(struct efp *efp, size_t i, size_t j, const struct swf *swf)
+{
+	const struct frag *fr_i = efp->frags + i;
+	const struct frag *fr_j = efp->frags + j;
+	vec_t force, add_i, add_j;
+	double energy = 0.0;
+
+	for (size_t ii = 0; ii < fr_i->n_polarizable_pts; ii++) {
+		const struct polarizable_pt *pt_i = fr_i->polarizable_pts + ii;
+		size_t idx_i = fr_i->polarizable_offset + ii;
+
+		vec_t half_dipole_i = {
+			0.5 * efp->indip[idx_i].x,
+			0.5 * efp->indip[idx_i].y,
+			0.5 * efp->indip[idx_i].z
+		};
 
-		/* induced dipole - induced dipoles */
 		for (size_t jj = 0; jj < fr_j->n_polarizable_pts; jj++) {
-			struct polarizable_pt *pt_j = fr_j->polarizable_pts+jj;
-			size_t idx_j = fr_j->polarizable_offset+jj;
+			const struct polarizable_pt *pt_j =
+			    fr_j->polarizable_pts + jj;
+			size_t idx_j = fr_j->polarizable_offset + jj;
 
 			vec_t dr = {
-				pt_j->x - pt_i->x - swf.cell.x,
-				pt_j->y - pt_i->y - swf.cell.y,
-				pt_j->z - pt_i->z - swf.cell.z
+				pt_j->x - pt_i->x - swf->cell.x,
+				pt_j->y - pt_i->y - swf->cell.y,
+				pt_j->z - pt_i->z - swf->cell.z
 			};
 
-			vec_t half_dipole_i = {
-				0.5 * efp->indip[idx_i].x,
-				0.5 * efp->indip[idx_i].y,
-				0.5 * efp->indip[idx_i].z
+			vec_t half_dipole_j = {
+				0.5 * efp->indip[idx_j].x,
+				0.5 * efp->indip[idx_j].y,
+				0.5 * efp->indip[idx_j].z
 			};
 
 			double p1 = 1.0, p2 = 0.0;
@@ -656,69 +2340,463 @@ compute_grad_point(struct efp *efp, size_t frag_idx, size_t pt_idx)
 				    fr_j->pol_damp);
 			}
 
-			e = efp_dipole_dipole_energy(&half_dipole_i,
-			    &efp->indipconj[idx_j], &dr);
-			efp_dipole_dipole_grad(&half_dipole_i,
-			    &efp->indipconj[idx_j], &dr, &force,
-			    &add_i, &add_j);
-			vec_negate(&add_j);
+			/* both directions of the pair: induced dipole of i
+			 * with conjugate dipole of j and conjugate dipole of
+			 * i with induced dipole of j */
+			for (size_t k = 0; k < 2; k++) {
+				const vec_t *d_i = k ? efp->indipconj + idx_i :
+				    &half_dipole_i;
+				const vec_t *d_j = k ? &half_dipole_j :
+				    efp->indipconj + idx_j;
+				double e;
+
+				e = efp_dipole_dipole_energy(d_i, d_j, &dr);
+				efp_dipole_dipole_grad(d_i, d_j, &dr, &force,
+				    &add_i, &add_j);
+				vec_negate(&add_j);
+
+				vec_scale(&force, p1);
+				vec_scale(&add_i, p1);
+				vec_scale(&add_j, p1);
+
+				force.x += p2 * e * dr.x;
+				force.y += p2 * e * dr.y;
+				force.z += p2 * e * dr.z;
+
+				vec_scale(&force, swf->swf);
+				vec_scale(&add_i, swf->swf);
+				vec_scale(&add_j, swf->swf);
+
+				efp_add_force(efp, i, CVEC(fr_i->x),
+				    CVEC(pt_i->x), &force, &add_i);
+				efp_sub_force(efp, j, CVEC(fr_j->x),
+				    CVEC(pt_j->x), &force, &add_j);
+				efp_add_stress(efp, &swf->dr, &force);
+				energy += p1 * e;
+			}
+		}
+	}
 
-			vec_scale(&force, p1);
-			vec_scale(&add_i, p1);
-			vec_scale(&add_j, p1);
+	return energy;
+}
 
-			force.x += p2 * e * dr.x;
-			force.y += p2 * e * dr.y;
-			force.z += p2 * e * dr.z;
+/* Polarization gradient of a fragment pair. Interactions in both directions
+ * are computed in one visit and the switching function derivative is
+ * applied to their sum. */
+static void
+compute_grad_pair(struct efp *efp, size_t i, size_t j)
+{
+	const struct frag *fr_i = efp->frags + i;
+	const struct frag *fr_j = efp->frags + j;
+	struct swf swf = make_pol_swf(efp, fr_i, fr_j);
+	struct swf swf_ji = reverse_swf(&swf);
+	double energy;
+	vec_t force;
+
+	energy = add_grad_static_pair(efp, i, j, &swf) +
+	    add_grad_static_pair(efp, j, i, &swf_ji) +
+	    add_grad_id_pair(efp, i, j, &swf);
+
+	force.x = swf.dswf.x * energy;
+	force.y = swf.dswf.y * energy;
+	force.z = swf.dswf.z * energy;
+	efp_add_grad(efp, i, &force, NULL);
+	efp_sub_grad(efp, j, &force, NULL);
+	efp_add_stress(efp, &swf.dr, &force);
+}
 
-			vec_scale(&force, swf.swf);
-			vec_scale(&add_i, swf.swf);
-			vec_scale(&add_j, swf.swf);
+/* Adds gradient of the interaction of site si of fragment i with site
+ * sj of fragment j in real space part of particle mesh Ewald sum. */
+static void
+add_pme_pair_grad(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
+    const struct swf *swf, const struct pme_site *si,
+    const struct pme_site *sj)
+{
+	const struct frag *fr_i = efp->frags + fr_i_idx;
+	const struct frag *fr_j = efp->frags + fr_j_idx;
+	double bn[5], bc[5], p2;
+	vec_t force, add_i, add_j;
 
-			efp_add_force(efp->grad + frag_idx, CVEC(fr_i->x),
-			    CVEC(pt_i->x), &force, &add_i);
-			efp_sub_force(efp->grad + j, CVEC(fr_j->x),
-			    CVEC(pt_j->x), &force, &add_j);
-			efp_add_stress(&swf.dr, &force, &efp->stress);
-			energy += p1 * e;
+	vec_t dr = {
+		sj->r.x - si->r.x - swf->cell.x,
+		sj->r.y - si->r.y - swf->cell.y,
+		sj->r.z - si->r.z - swf->cell.z
+	};
+
+	p2 = get_pol_pme_kernel(efp, fr_i, fr_j, vec_len(&dr),
+	    si->rank + sj->rank + 1, bn, bc);
+	efp_pme_site_pair(si, sj, &dr, bn, &force, &add_i, &add_j);
+	vec_negate(&force);
+	vec_negate(&add_j);
+
+	if (efp->opts.pol_damp == EFP_POL_DAMP_TT) {
+		double e = efp_pme_site_pair(si, sj, &dr, bc,
+		    NULL, NULL, NULL);
+
+		force.x += p2 * e * dr.x;
+		force.y += p2 * e * dr.y;
+		force.z += p2 * e * dr.z;
+	}
+
+	efp_add_force(efp, fr_i_idx, CVEC(fr_i->x), &si->r, &force, &add_i);
+	efp_sub_force(efp, fr_j_idx, CVEC(fr_j->x), &sj->r, &force, &add_j);
+	efp_add_stress(efp, &swf->dr, &force);
+}
+
+/* Real space part of polarization gradient with particle mesh Ewald. */
+static void
+compute_grad_point_pme(struct efp *efp, size_t frag_idx, size_t pt_idx)
+{
+	const struct frag *fr_i = efp->frags + frag_idx;
+	const struct polarizable_pt *pt_i = fr_i->polarizable_pts + pt_idx;
+	size_t idx_i = fr_i->polarizable_offset + pt_idx;
+	struct pme_site site_i, half_site_i;
+
+	vec_t dipole_i = {
+		0.5 * (efp->indip[idx_i].x + efp->indipconj[idx_i].x),
+		0.5 * (efp->indip[idx_i].y + efp->indipconj[idx_i].y),
+		0.5 * (efp->indip[idx_i].z + efp->indipconj[idx_i].z)
+	};
+
+	vec_t half_dipole_i = {
+		0.5 * efp->indip[idx_i].x,
+		0.5 * efp->indip[idx_i].y,
+		0.5 * efp->indip[idx_i].z
+	};
+
+	get_pol_site(pt_i, &dipole_i, &site_i);
+	get_pol_site(pt_i, &half_dipole_i, &half_site_i);
+
+	const size_t *nb;
+	size_t n_nb = efp_nblist_get_row(efp, frag_idx, &nb);
+
+	for (size_t m = 0; m < n_nb; m++) {
+		size_t j = nb ? nb[m] : m;
+
+		if (j == frag_idx || efp_skip_frag_pair(efp, frag_idx, j))
+			continue;
+
+		struct frag *fr_j = efp->frags + j;
+		struct swf swf = efp_make_swf(efp, fr_i, fr_j);
+
+		/* induced dipole - nuclei and multipoles */
+		for (size_t k = 0; k < efp_pme_get_site_count(fr_j); k++) {
+			struct pme_site site_j;
+
+			efp_pme_get_site(fr_j, k, &site_j);
+			add_pme_pair_grad(efp, frag_idx, j, &swf,
+			    &site_i, &site_j);
 		}
 
-		force.x = swf.dswf.x * energy;
-		force.y = swf.dswf.y * energy;
-		force.z = swf.dswf.z * energy;
-		six_atomic_add_xyz(efp->grad + frag_idx, &force);
-		six_atomic_sub_xyz(efp->grad + j, &force);
-		efp_add_stress(&swf.dr, &force, &efp->stress);
+		/* induced dipole - induced dipoles */
+		for (size_t jj = 0; jj < fr_j->n_polarizable_pts; jj++) {
+			size_t idx_j = fr_j->polarizable_offset + jj;
+			struct pme_site site_j;
+
+			get_pol_site(fr_j->polarizable_pts + jj,
+			    efp->indipconj + idx_j, &site_j);
+			add_pme_pair_grad(efp, frag_idx, j, &swf,
+			    &half_site_i, &site_j);
+		}
 	}
 
 	/* induced dipole - ab initio nuclei */
-	if (efp->opts.terms & EFP_TERM_AI_POL) {
-		for (size_t j = 0; j < efp->n_ptc; j++) {
-			vec_t dr = vec_sub(efp->ptc_xyz + j, CVEC(pt_i->x));
+	if (efp->opts.terms & EFP_TERM_AI_POL)
+		compute_grad_point_ai(efp, frag_idx, pt_idx, &dipole_i);
+}
+
+/* Reciprocal space part of polarization gradient with particle mesh Ewald.
+ * Interactions within fragments do not contribute to gradient as
+ * fragments are rigid. */
+static void
+compute_grad_rec(struct efp *efp)
+{
+	/* averaged induced dipoles in the real part of the grid interact
+	 * with multipoles in the imaginary part */
+	efp_pme_clear(&efp->pme);
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+			size_t idx = frag->polarizable_offset + j;
+			struct pme_site site;
+
+			vec_t dipole = {
+				0.5 * (efp->indip[idx].x +
+				    efp->indipconj[idx].x),
+				0.5 * (efp->indip[idx].y +
+				    efp->indipconj[idx].y),
+				0.5 * (efp->indip[idx].z +
+				    efp->indipconj[idx].z)
+			};
+
+			get_pol_site(frag->polarizable_pts + j, &dipole, &site);
+			efp_pme_spread(&efp->pme, &site, 0);
+		}
+		for (size_t j = 0; j < efp_pme_get_site_count(frag); j++) {
+			struct pme_site site;
+
+			efp_pme_get_site(frag, j, &site);
+			efp_pme_spread(&efp->pme, &site, 1);
+		}
+	}
+
+	efp_pme_solve(&efp->pme, 1, NULL, &efp->stress);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+			size_t idx = frag->polarizable_offset + j;
+			struct pme_site site;
+
+			vec_t dipole = {
+				0.5 * (efp->indip[idx].x +
+				    efp->indipconj[idx].x),
+				0.5 * (efp->indip[idx].y +
+				    efp->indipconj[idx].y),
+				0.5 * (efp->indip[idx].z +
+				    efp->indipconj[idx].z)
+			};
+
+			get_pol_site(frag->polarizable_pts + j, &dipole, &site);
+			efp_pme_add_site_grad(efp, i, &site, 1);
+		}
+		for (size_t j = 0; j < efp_pme_get_site_count(frag); j++) {
+			struct pme_site site;
+
+			efp_pme_get_site(frag, j, &site);
+			efp_pme_add_site_grad(efp, i, &site, 0);
+		}
+	}
+
+	/* halved induced dipoles in the real part of the grid interact
+	 * with conjugate induced dipoles in the imaginary part */
+	efp_pme_clear(&efp->pme);
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+			size_t idx = frag->polarizable_offset + j;
+			struct pme_site site;
+
+			vec_t dipole = {
+				0.5 * efp->indip[idx].x,
+				0.5 * efp->indip[idx].y,
+				0.5 * efp->indip[idx].z
+			};
+
+			get_pol_site(frag->polarizable_pts + j, &dipole, &site);
+			efp_pme_spread(&efp->pme, &site, 0);
+			get_pol_site(frag->polarizable_pts + j,
+			    efp->indipconj + idx, &site);
+			efp_pme_spread(&efp->pme, &site, 1);
+		}
+	}
+
+	efp_pme_solve(&efp->pme, 1, NULL, &efp->stress);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+			size_t idx = frag->polarizable_offset + j;
+			struct pme_site site;
+
+			vec_t dipole = {
+				0.5 * efp->indip[idx].x,
+				0.5 * efp->indip[idx].y,
+				0.5 * efp->indip[idx].z
+			};
+
+			get_pol_site(frag->polarizable_pts + j, &dipole, &site);
+			efp_pme_add_site_grad(efp, i, &site, 1);
+			get_pol_site(frag->polarizable_pts + j,
+			    efp->indipconj + idx, &site);
+			efp_pme_add_site_grad(efp, i, &site, 0);
+		}
+	}
+}
+
+/* Far field part of polarization gradient with fast multipole method. Sites
+ * of each set interact with the potential of the other set. */
+static void
+compute_grad_far(struct efp *efp)
+{
+	struct fmm *fmm = &efp->fmm;
+
+	/* averaged induced dipoles in the first set interact with
+	 * multipoles in the second set */
+	efp_fmm_clear(fmm);
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+			size_t idx = frag->polarizable_offset + j;
+			struct pme_site site;
+
+			vec_t dipole = {
+				0.5 * (efp->indip[idx].x +
+				    efp->indipconj[idx].x),
+				0.5 * (efp->indip[idx].y +
+				    efp->indipconj[idx].y),
+				0.5 * (efp->indip[idx].z +
+				    efp->indipconj[idx].z)
+			};
+
+			get_pol_site(frag->polarizable_pts + j, &dipole, &site);
+			efp_fmm_add_site(fmm, i, &site, 0);
+		}
+		for (size_t j = 0; j < efp_pme_get_site_count(frag); j++) {
+			struct pme_site site;
+
+			efp_pme_get_site(frag, j, &site);
+			efp_fmm_add_site(fmm, i, &site, 1);
+		}
+	}
+
+	efp_fmm_solve(fmm);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+			size_t idx = frag->polarizable_offset + j;
+			struct pme_site site;
+
+			vec_t dipole = {
+				0.5 * (efp->indip[idx].x +
+				    efp->indipconj[idx].x),
+				0.5 * (efp->indip[idx].y +
+				    efp->indipconj[idx].y),
+				0.5 * (efp->indip[idx].z +
+				    efp->indipconj[idx].z)
+			};
+
+			get_pol_site(frag->polarizable_pts + j, &dipole, &site);
+			efp_fmm_add_site_grad(efp, i, &site, 1);
+		}
+		for (size_t j = 0; j < efp_pme_get_site_count(frag); j++) {
+			struct pme_site site;
+
+			efp_pme_get_site(frag, j, &site);
+			efp_fmm_add_site_grad(efp, i, &site, 0);
+		}
+	}
+
+	/* halved induced dipoles in the first set interact with conjugate
+	 * induced dipoles in the second set */
+	efp_fmm_clear(fmm);
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+			size_t idx = frag->polarizable_offset + j;
+			struct pme_site site;
+
+			vec_t dipole = {
+				0.5 * efp->indip[idx].x,
+				0.5 * efp->indip[idx].y,
+				0.5 * efp->indip[idx].z
+			};
+
+			get_pol_site(frag->polarizable_pts + j, &dipole, &site);
+			efp_fmm_add_site(fmm, i, &site, 0);
+			get_pol_site(frag->polarizable_pts + j,
+			    efp->indipconj + idx, &site);
+			efp_fmm_add_site(fmm, i, &site, 1);
+		}
+	}
+
+	efp_fmm_solve(fmm);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+			size_t idx = frag->polarizable_offset + j;
+			struct pme_site site;
+
+			vec_t dipole = {
+				0.5 * efp->indip[idx].x,
+				0.5 * efp->indip[idx].y,
+				0.5 * efp->indip[idx].z
+			};
+
+			get_pol_site(frag->polarizable_pts + j, &dipole, &site);
+			efp_fmm_add_site_grad(efp, i, &site, 1);
+			get_pol_site(frag->polarizable_pts + j,
+			    efp->indipconj + idx, &site);
+			efp_fmm_add_site_grad(efp, i, &site, 0);
+		}
+	}
+}
+
+static void
+compute_grad_range(struct efp *efp, size_t from, size_t to, void *data)
+{
+	(void)data;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (size_t i = from; i < to; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		if (efp->opts.enable_pme) {
+			for (size_t j = 0; j < frag->n_polarizable_pts; j++)
+				compute_grad_point_pme(efp, i, j);
+			continue;
+		}
+
+		/* each pair is computed by one of its fragments */
+		const size_t *nb;
+		size_t n_nb = get_pol_row(efp, i, &nb);
+
+		for (size_t m = 0; m < n_nb; m++) {
+			size_t j = nb ? nb[m] : m;
+
+			if (owns_pol_pair(efp, i, j))
+				compute_grad_pair(efp, i, j);
+		}
+
+		/* induced dipole - ab initio nuclei */
+		if (!(efp->opts.terms & EFP_TERM_AI_POL))
+			continue;
+
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+			size_t idx = frag->polarizable_offset + j;
+
+			vec_t dipole = {
+				0.5 * (efp->indip[idx].x +
+				    efp->indipconj[idx].x),
+				0.5 * (efp->indip[idx].y +
+				    efp->indipconj[idx].y),
+				0.5 * (efp->indip[idx].z +
+				    efp->indipconj[idx].z)
+			};
 
-			efp_charge_dipole_grad(efp->ptc[j], &dipole_i, &dr,
-			    &force, &add_j, &add_i);
-			vec_negate(&add_i);
-			vec_atomic_add(efp->ptc_grad + j, &force);
-			efp_sub_force(efp->grad + frag_idx, CVEC(fr_i->x),
-			    CVEC(pt_i->x), &force, &add_i);
+			compute_grad_point_ai(efp, i, j, &dipole);
 		}
 	}
 }
 
-static void
-compute_grad_range(struct efp *efp, size_t from, size_t to, void *data)
-{
-	(void)data;
-
-#ifdef _OPENMP
-#pragma omp parallel for schedule(dynamic)
-#endif
-	for (size_t i = from; i < to; i++)
-		for (size_t j = 0; j < efp->frags[i].n_polarizable_pts; j++)
-			compute_grad_point(efp, i, j);
-}
-
 enum efp_result
 efp_compute_pol(struct efp *efp)
 {
@@ -731,9 +2809,17 @@ efp_compute_pol(struct efp *efp)
 	if ((res = efp_compute_pol_energy(efp, &efp->energy.polarization)))
 		return res;
 
-	if (efp->do_gradient)
+	if (efp->do_gradient) {
 		efp_balance_work(efp, compute_grad_range, NULL);
 
+		/* reciprocal space part with PME and far field with FMM are
+		 * computed by the master process */
+		if (efp->opts.enable_pme && efp_mpi_rank() == 0)
+			compute_grad_rec(efp);
+		if (efp->opts.enable_fmm && efp_mpi_rank() == 0)
+			compute_grad_far(efp);
+	}
+
 	return EFP_RESULT_SUCCESS;
 }
 
@@ -752,33 +2838,181 @@ efp_update_pol(struct frag *frag)
 	}
 }
 
-EFP_EXPORT enum efp_result
-efp_get_electric_field(struct efp *efp, size_t frag_idx, const double *xyz,
-    double *field)
+/* Computes potential grid of all multipoles and induced dipoles which is
+ * reused by efp_get_electric_field until coordinates or induced dipoles
+ * change. */
+static enum efp_result
+update_pme_field(struct efp *efp)
 {
-	assert(efp);
-	assert(frag_idx < efp->n_frag);
-	assert(xyz);
-	assert(field);
+	struct pme *pme = &efp->pme;
+	enum efp_result res;
 
-	const struct frag *frag = efp->frags + frag_idx;
-	vec_t elec_field = vec_zero;
+	if ((res = efp_pme_update(efp, pme)))
+		return res;
+
+	efp_pme_clear(pme);
 
 	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+		struct pme_site site;
+
+		for (size_t j = 0; j < efp_pme_get_site_count(frag); j++) {
+			efp_pme_get_site(frag, j, &site);
+			efp_pme_spread(pme, &site, 0);
+		}
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+			get_pol_site(frag->polarizable_pts + j,
+			    efp->indip + frag->polarizable_offset + j, &site);
+			efp_pme_spread(pme, &site, 0);
+		}
+	}
+
+	efp_pme_solve(pme, 0, NULL, NULL);
+	memcpy(pme->field, pme->grid,
+	    2 * pme->n[0] * pme->n[1] * pme->n[2] * sizeof(double));
+	pme->field_valid = 1;
+
+	return EFP_RESULT_SUCCESS;
+}
+
+/* Electric field at a point close to a fragment with particle mesh Ewald.
+ * Potential grid must be up to date. */
+static vec_t
+get_electric_field_pme(const struct efp *efp, size_t frag_idx,
+    const vec_t *xyz)
+{
+	const struct frag *frag = efp->frags + frag_idx;
+	struct pme_site site;
+	double phi[4], bn[3];
+
+	efp_pme_gather(&efp->pme, efp->pme.field, xyz, 1, 0, phi);
+
+	const size_t *nb;
+	size_t n_nb = efp_nblist_get_row(efp, frag_idx, &nb);
+
+	for (size_t m = 0; m < n_nb; m++) {
+		size_t i = nb ? nb[m] : m;
+
 		if (i == frag_idx || efp_skip_frag_pair(efp, i, frag_idx))
 			continue;
 
 		const struct frag *fr_i = efp->frags + i;
 		struct swf swf = efp_make_swf(efp, fr_i, frag);
 
+		for (size_t j = 0; j < efp_pme_get_site_count(fr_i) +
+		    fr_i->n_polarizable_pts; j++) {
+			if (j < efp_pme_get_site_count(fr_i))
+				efp_pme_get_site(fr_i, j, &site);
+			else {
+				size_t k = j - efp_pme_get_site_count(fr_i);
+
+				get_pol_site(fr_i->polarizable_pts + k,
+				    efp->indip + fr_i->polarizable_offset + k,
+				    &site);
+			}
+
+			vec_t dr = {
+				xyz->x - site.r.x - swf.cell.x,
+				xyz->y - site.r.y - swf.cell.y,
+				xyz->z - site.r.z - swf.cell.z
+			};
+
+			efp_pme_bn(efp->pme.alpha, vec_len(&dr),
+			    site.rank + 1, bn);
+			efp_pme_site_field(&site, &dr, bn, 1, phi);
+		}
+	}
+
+	for (size_t j = 0; j < efp_pme_get_site_count(frag); j++) {
+		efp_pme_get_site(frag, j, &site);
+		sub_pme_self_field(efp, &site, xyz, phi);
+	}
+	for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+		get_pol_site(frag->polarizable_pts + j,
+		    efp->indip + frag->polarizable_offset + j, &site);
+		sub_pme_self_field(efp, &site, xyz, phi);
+	}
+
+	return (vec_t){ -phi[1], -phi[2], -phi[3] };
+}
+
+/* Computes local expansions of all multipoles and induced dipoles which
+ * are reused by efp_get_electric_field until coordinates or induced dipoles
+ * change. */
+static enum efp_result
+update_fmm_field(struct efp *efp)
+{
+	struct fmm *fmm = &efp->fmm;
+	enum efp_result res;
+
+	if ((res = efp_fmm_update(efp, fmm)))
+		return res;
+
+	efp_fmm_clear(fmm);
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+		struct pme_site site;
+
+		for (size_t j = 0; j < efp_pme_get_site_count(frag); j++) {
+			efp_pme_get_site(frag, j, &site);
+			efp_fmm_add_site(fmm, i, &site, 0);
+		}
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+			get_pol_site(frag->polarizable_pts + j,
+			    efp->indip + frag->polarizable_offset + j, &site);
+			efp_fmm_add_site(fmm, i, &site, 0);
+		}
+	}
+
+	efp_fmm_solve(fmm);
+	memcpy(fmm->field, fmm->local,
+	    fmm->n_cells * fmm->n_coef * sizeof(double));
+	fmm->field_valid = 1;
+
+	return EFP_RESULT_SUCCESS;
+}
+
+/* Far field part of electric field at a point close to a fragment with
+ * fast multipole method. Local expansions must be up to date. */
+static vec_t
+get_electric_field_far(const struct efp *efp, size_t frag_idx,
+    const vec_t *xyz)
+{
+	double phi[4];
+
+	efp_fmm_eval(&efp->fmm, efp->fmm.field, frag_idx, xyz, 1, 0, phi);
+
+	return (vec_t){ -phi[1], -phi[2], -phi[3] };
+}
+
+/* Electric field of fragments near fragment frag_idx at a single point. */
+static vec_t
+get_electric_field(const struct efp *efp, size_t frag_idx, const vec_t *xyz)
+{
+	const struct frag *frag = efp->frags + frag_idx;
+	vec_t elec_field = vec_zero;
+
+	const size_t *nb;
+	size_t n_nb = get_pol_row(efp, frag_idx, &nb);
+
+	for (size_t m = 0; m < n_nb; m++) {
+		size_t i = nb ? nb[m] : m;
+
+		if (i == frag_idx || skip_pol_pair(efp, i, frag_idx))
+			continue;
+
+		const struct frag *fr_i = efp->frags + i;
+		struct swf swf = make_pol_swf(efp, fr_i, frag);
+
 		/* field due to nuclei */
 		for (size_t j = 0; j < fr_i->n_atoms; j++) {
 			const struct efp_atom *at = fr_i->atoms + j;
 
 			vec_t dr = {
-				xyz[0] - at->x - swf.cell.x,
-				xyz[1] - at->y - swf.cell.y,
-				xyz[2] - at->z - swf.cell.z
+				xyz->x - at->x - swf.cell.x,
+				xyz->y - at->y - swf.cell.y,
+				xyz->z - at->z - swf.cell.z
 			};
 
 			double r = vec_len(&dr);
@@ -792,8 +3026,7 @@ efp_get_electric_field(struct efp *efp, size_t frag_idx, const double *xyz,
 		/* field due to multipoles */
 		for (size_t j = 0; j < fr_i->n_multipole_pts; j++) {
 			const struct multipole_pt *mpt = fr_i->multipole_pts+j;
-			vec_t mult_field = get_multipole_field(
-			    (const vec_t *)xyz, mpt, &swf);
+			vec_t mult_field = get_multipole_field(xyz, mpt, &swf);
 
 			elec_field.x += mult_field.x;
 			elec_field.y += mult_field.y;
@@ -802,43 +3035,473 @@ efp_get_electric_field(struct efp *efp, size_t frag_idx, const double *xyz,
 
 		/* field due to induced dipoles */
 		for (size_t j = 0; j < fr_i->n_polarizable_pts; j++) {
-			struct polarizable_pt *pt_i = fr_i->polarizable_pts + j;
-			size_t idx = fr_i->polarizable_offset + j;
+			const struct polarizable_pt *pt_i =
+			    fr_i->polarizable_pts + j;
+			const vec_t *dipole =
+			    efp->indip + fr_i->polarizable_offset + j;
 
 			vec_t dr = {
-				xyz[0] - pt_i->x - swf.cell.x,
-				xyz[1] - pt_i->y - swf.cell.y,
-				xyz[2] - pt_i->z - swf.cell.z
+				xyz->x - pt_i->x - swf.cell.x,
+				xyz->y - pt_i->y - swf.cell.y,
+				xyz->z - pt_i->z - swf.cell.z
 			};
 
 			double r = vec_len(&dr);
 			double r3 = r * r * r;
 			double r5 = r3 * r * r;
-			double t1 = vec_dot(&efp->indip[idx], &dr);
+			double t1 = vec_dot(dipole, &dr);
 
-			elec_field.x -= swf.swf * (efp->indip[idx].x / r3 -
+			elec_field.x -= swf.swf * (dipole->x / r3 -
 			    3.0 * t1 * dr.x / r5);
-			elec_field.y -= swf.swf * (efp->indip[idx].y / r3 -
+			elec_field.y -= swf.swf * (dipole->y / r3 -
 			    3.0 * t1 * dr.y / r5);
-			elec_field.z -= swf.swf * (efp->indip[idx].z / r3 -
+			elec_field.z -= swf.swf * (dipole->z / r3 -
 			    3.0 * t1 * dr.z / r5);
 		}
 	}
 
-	if (efp->opts.terms & EFP_TERM_AI_POL) {
-		/* field due to nuclei from ab initio subsystem */
-		for (size_t i = 0; i < efp->n_ptc; i++) {
-			vec_t dr = vec_sub((const vec_t *)xyz, efp->ptc_xyz+i);
+	return elec_field;
+}
 
-			double r = vec_len(&dr);
+/* Adds field of fragment fr_i at a block of n points. Each point sums the
+ * sources in the same order as a single point would. */
+static void
+add_electric_field_block(const struct efp *efp, const struct frag *fr_i,
+    const struct swf *swf, size_t n, const double *px, const double *py,
+    const double *pz, double *fx, double *fy, double *fz)
+{
+	double rr[POL_FIELD_BLOCK];
+
+	/* field due to nuclei */
+	for (size_t j = 0; j < fr_i->n_atoms; j++) {
+		const struct efp_atom *at = fr_i->atoms + j;
+
+		vec_dist_block(n, px, py, pz, CVEC(at->x), &swf->cell, rr);
+
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+		for (size_t k = 0; k < n; k++) {
+			vec_t dr = {
+				px[k] - at->x - swf->cell.x,
+				py[k] - at->y - swf->cell.y,
+				pz[k] - at->z - swf->cell.z
+			};
+
+			double r = rr[k];
+			double r3 = r * r * r;
+
+			fx[k] += swf->swf * at->znuc * dr.x / r3;
+			fy[k] += swf->swf * at->znuc * dr.y / r3;
+			fz[k] += swf->swf * at->znuc * dr.z / r3;
+		}
+	}
+
+	/* field due to multipoles */
+	for (size_t j = 0; j < fr_i->n_multipole_pts; j++) {
+		const struct multipole_pt *mpt = fr_i->multipole_pts + j;
+
+		vec_dist_block(n, px, py, pz, CVEC(mpt->x), &swf->cell, rr);
+
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+		for (size_t k = 0; k < n; k++) {
+			vec_t dr = {
+				px[k] - mpt->x - swf->cell.x,
+				py[k] - mpt->y - swf->cell.y,
+				pz[k] - mpt->z - swf->cell.z
+			};
+
+			const double *quad = mpt->quadrupole;
+
+			double t1, t2;
+			double r = rr[k];
+			double r3 = r * r * r;
+			double r5 = r3 * r * r;
+			double r7 = r5 * r * r;
+
+			/* charge */
+			double gx = swf->swf * mpt->monopole * dr.x / r3;
+			double gy = swf->swf * mpt->monopole * dr.y / r3;
+			double gz = swf->swf * mpt->monopole * dr.z / r3;
+
+			/* dipole */
+			t1 = vec_dot(&mpt->dipole, &dr);
+
+			gx += swf->swf * (3.0 / r5 * t1 * dr.x -
+			    mpt->dipole.x / r3);
+			gy += swf->swf * (3.0 / r5 * t1 * dr.y -
+			    mpt->dipole.y / r3);
+			gz += swf->swf * (3.0 / r5 * t1 * dr.z -
+			    mpt->dipole.z / r3);
+
+			/* quadrupole */
+			t1 = quadrupole_sum(quad, &dr);
+
+			t2 = quad[quad_idx(0, 0)] * dr.x +
+			     quad[quad_idx(1, 0)] * dr.y +
+			     quad[quad_idx(2, 0)] * dr.z;
+			gx += swf->swf * (-2.0 / r5 * t2 +
+			    5.0 / r7 * t1 * dr.x);
+
+			t2 = quad[quad_idx(0, 1)] * dr.x +
+			     quad[quad_idx(1, 1)] * dr.y +
+			     quad[quad_idx(2, 1)] * dr.z;
+			gy += swf->swf * (-2.0 / r5 * t2 +
+			    5.0 / r7 * t1 * dr.y);
+
+			t2 = quad[quad_idx(0, 2)] * dr.x +
+			     quad[quad_idx(1, 2)] * dr.y +
+			     quad[quad_idx(2, 2)] * dr.z;
+			gz += swf->swf * (-2.0 / r5 * t2 +
+			    5.0 / r7 * t1 * dr.z);
+
+			fx[k] += gx;
+			fy[k] += gy;
+			fz[k] += gz;
+		}
+	}
+
+	/* field due to induced dipoles */
+	for (size_t j = 0; j < fr_i->n_polarizable_pts; j++) {
+		const struct polarizable_pt *pt_i = fr_i->polarizable_pts + j;
+		const vec_t *dipole = efp->indip + fr_i->polarizable_offset + j;
+
+		vec_dist_block(n, px, py, pz, CVEC(pt_i->x), &swf->cell, rr);
+
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+		for (size_t k = 0; k < n; k++) {
+			vec_t dr = {
+				px[k] - pt_i->x - swf->cell.x,
+				py[k] - pt_i->y - swf->cell.y,
+				pz[k] - pt_i->z - swf->cell.z
+			};
+
+			double r = rr[k];
 			double r3 = r * r * r;
+			double r5 = r3 * r * r;
+			double t1 = vec_dot(dipole, &dr);
+
+			fx[k] -= swf->swf * (dipole->x / r3 -
+			    3.0 * t1 * dr.x / r5);
+			fy[k] -= swf->swf * (dipole->y / r3 -
+			    3.0 * t1 * dr.y / r5);
+			fz[k] -= swf->swf * (dipole->z / r3 -
+			    3.0 * t1 * dr.z / r5);
+		}
+	}
+}
+
+/* Switching function between fragment fr_i and a point which does not
+ * belong to any fragment. Only the value and the periodic image are set. */
+static struct swf
+make_point_swf(const struct efp *efp, const struct frag *fr_i,
+    const vec_t *xyz)
+{
+	struct swf swf;
+
+	memset(&swf, 0, sizeof(swf));
+	swf.swf = 1.0;
+
+	if (efp->opts.enable_fmm || !efp->opts.enable_cutoff)
+		return swf;
+
+	vec_t dr = vec_sub(xyz, CVEC(fr_i->x));
+
+	if (efp->opts.enable_pbc) {
+		swf.cell.x = efp->box.x * round(dr.x / efp->box.x);
+		swf.cell.y = efp->box.y * round(dr.y / efp->box.y);
+		swf.cell.z = efp->box.z * round(dr.z / efp->box.z);
+		dr = vec_sub(&dr, &swf.cell);
+	}
+
+	swf.swf = efp_get_swf(vec_len(&dr), efp->opts.swf_cutoff);
+	return swf;
+}
+
+/* Adds field of fragments near fragment frag_idx at points idx[0..n) of
+ * this fragment. Points of frag_idx EFP_NO_FRAG get field of all fragments,
+ * with cutoff each such point has its own switching function. */
+static void
+add_electric_field(const struct efp *efp, size_t frag_idx, size_t n,
+    const size_t *idx, const double *xyz, vec_t *field)
+{
+	int no_frag = frag_idx == EFP_NO_FRAG;
+	int per_point = no_frag && efp->opts.enable_cutoff &&
+	    !efp->opts.enable_fmm;
+	double px[POL_FIELD_BLOCK], py[POL_FIELD_BLOCK], pz[POL_FIELD_BLOCK];
+	double fx[POL_FIELD_BLOCK], fy[POL_FIELD_BLOCK], fz[POL_FIELD_BLOCK];
+
+	const size_t *nb = NULL;
+	size_t n_nb = no_frag ? efp->n_frag : get_pol_row(efp, frag_idx, &nb);
+
+	for (size_t from = 0; from < n; from += POL_FIELD_BLOCK) {
+		size_t n_blk = n - from < POL_FIELD_BLOCK ?
+		    n - from : POL_FIELD_BLOCK;
+
+		for (size_t k = 0; k < n_blk; k++) {
+			size_t p = idx[from + k];
+
+			px[k] = xyz[3 * p + 0];
+			py[k] = xyz[3 * p + 1];
+			pz[k] = xyz[3 * p + 2];
+			fx[k] = field[p].x;
+			fy[k] = field[p].y;
+			fz[k] = field[p].z;
+		}
+
+		for (size_t m = 0; m < n_nb; m++) {
+			size_t i = nb ? nb[m] : m;
+
+			if (!no_frag && (i == frag_idx ||
+			    skip_pol_pair(efp, i, frag_idx)))
+				continue;
+
+			const struct frag *fr_i = efp->frags + i;
+			size_t cnt = per_point ? 1 : n_blk;
+
+			/* single call site of the block kernel keeps it
+			 * inlined */
+			for (size_t k = 0; k < n_blk; k += cnt) {
+				vec_t pt = { px[k], py[k], pz[k] };
+				struct swf swf = no_frag ?
+				    make_point_swf(efp, fr_i, &pt) :
+				    make_pol_swf(efp, fr_i,
+				    efp->frags + frag_idx);
+
+				if (no_frag && swf.swf == 0.0)
+					continue;
+
+				add_electric_field_block(efp, fr_i, &swf, cnt,
+				    px + k, py + k, pz + k, fx + k, fy + k,
+				    fz + k);
+			}
+		}
+
+		for (size_t k = 0; k < n_blk; k++) {
+			size_t p = idx[from + k];
+
+			field[p].x = fx[k];
+			field[p].y = fy[k];
+			field[p].z = fz[k];
+		}
+	}
+}
+
+/* Brings potential grid and local expansions used by electric field
+ * evaluation up to date. */
+static enum efp_result
+update_electric_field(struct efp *efp)
+{
+	enum efp_result res;
+
+	if (efp->opts.enable_pme && !efp->pme.field_valid)
+		if ((res = update_pme_field(efp)))
+			return res;
+
+	if (efp->opts.enable_fmm && (!efp->fmm.valid || !efp->fmm.field_valid))
+		if ((res = update_fmm_field(efp)))
+			return res;
+
+	return EFP_RESULT_SUCCESS;
+}
+
+/* Computes electric field at points idx[0..n) of fragment frag_idx or, for
+ * EFP_NO_FRAG, at points which do not belong to any fragment. */
+static void
+compute_electric_field(const struct efp *efp, size_t frag_idx, size_t n,
+    const size_t *idx, const double *xyz, double *field)
+{
+	vec_t *elec_field = (vec_t *)field;
+	int no_frag = frag_idx == EFP_NO_FRAG;
+
+	for (size_t k = 0; k < n; k++) {
+		const vec_t *pt = (const vec_t *)(xyz + 3 * idx[k]);
+
+		if (efp->opts.enable_pme)
+			elec_field[idx[k]] = get_electric_field_pme(efp,
+			    frag_idx, pt);
+		else
+			elec_field[idx[k]] = vec_zero;
+	}
+
+	if (!efp->opts.enable_pme) {
+		if (n == 1 && !no_frag)
+			elec_field[idx[0]] = get_electric_field(efp, frag_idx,
+			    (const vec_t *)(xyz + 3 * idx[0]));
+		else
+			add_electric_field(efp, frag_idx, n, idx, xyz,
+			    elec_field);
+	}
+
+	for (size_t k = 0; k < n; k++) {
+		const vec_t *pt = (const vec_t *)(xyz + 3 * idx[k]);
+
+		/* points without fragment sum all fragments directly */
+		if (efp->opts.enable_fmm && !no_frag) {
+			vec_t field_far = get_electric_field_far(efp,
+			    frag_idx, pt);
+			elec_field[idx[k]] = vec_add(elec_field + idx[k],
+			    &field_far);
+		}
+		if (efp->opts.terms & EFP_TERM_AI_POL) {
+			vec_t ptc_field = get_ptc_field(efp, pt);
+			elec_field[idx[k]] = vec_add(elec_field + idx[k],
+			    &ptc_field);
+		}
+	}
+}
+
+struct elec_field_batch {
+	const size_t *offset; /* first sorted point of each fragment */
+	const size_t *order;  /* point indices sorted by fragment */
+	const double *xyz;
+	double *field;
+};
+
+static void
+compute_electric_field_batch_range(struct efp *efp, size_t from, size_t to,
+    void *data)
+{
+	const struct elec_field_batch *batch =
+	    (const struct elec_field_batch *)data;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (size_t i = from; i < to; i++)
+		compute_electric_field(efp, i,
+		    batch->offset[i + 1] - batch->offset[i],
+		    batch->order + batch->offset[i], batch->xyz, batch->field);
+}
+
+EFP_EXPORT enum efp_result
+efp_get_electric_field(struct efp *efp, size_t frag_idx, const double *xyz,
+    double *field)
+{
+	enum efp_result res;
+	size_t idx = 0;
+
+	assert(efp);
+	assert(frag_idx < efp->n_frag);
+	assert(xyz);
+	assert(field);
+
+	if ((res = update_electric_field(efp)))
+		return res;
+
+	compute_electric_field(efp, frag_idx, 1, &idx, xyz, field);
+	return EFP_RESULT_SUCCESS;
+}
+
+EFP_EXPORT enum efp_result
+efp_get_electric_field_batch(struct efp *efp, size_t n_pt,
+    const size_t *frag_idx, const double *xyz, double *field)
+{
+	struct elec_field_batch batch;
+	size_t *offset, *order, n_free;
+	double *cost;
+	enum efp_result res;
+	int rank = 0, size = 1;
+
+	assert(efp);
+
+	if (n_pt == 0)
+		return EFP_RESULT_SUCCESS;
+
+	assert(frag_idx);
+	assert(xyz);
+	assert(field);
 
-			elec_field.x += efp->ptc[i] * dr.x / r3;
-			elec_field.y += efp->ptc[i] * dr.y / r3;
-			elec_field.z += efp->ptc[i] * dr.z / r3;
+	if (efp->opts.enable_pme) {
+		for (size_t i = 0; i < n_pt; i++) {
+			if (frag_idx[i] == EFP_NO_FRAG) {
+				efp_log("points without fragment are not "
+				    "supported with particle mesh Ewald");
+				return EFP_RESULT_FATAL;
+			}
 		}
 	}
 
-	*((vec_t *)field) = elec_field;
+	if ((res = update_electric_field(efp)))
+		return res;
+
+	/* points without fragment form the last group */
+	offset = (size_t *)efp_scratch_alloc(efp,
+	    (efp->n_frag + 2) * sizeof(size_t));
+	order = (size_t *)efp_scratch_alloc(efp, (n_pt + 1) * sizeof(size_t));
+	cost = (double *)efp_scratch_alloc(efp,
+	    (efp->n_frag + 1) * sizeof(double));
+
+	if (offset == NULL || order == NULL || cost == NULL) {
+		efp_scratch_free(efp, cost);
+		efp_scratch_free(efp, order);
+		efp_scratch_free(efp, offset);
+		return EFP_RESULT_NO_MEMORY;
+	}
+
+	memset(offset, 0, (efp->n_frag + 2) * sizeof(size_t));
+	memset(cost, 0, (efp->n_frag + 1) * sizeof(double));
+
+	/* sort points by fragment so that each fragment pair is visited
+	 * once for all its points */
+	for (size_t i = 0; i < n_pt; i++) {
+		size_t frag = frag_idx[i] == EFP_NO_FRAG ?
+		    efp->n_frag : frag_idx[i];
+
+		assert(frag <= efp->n_frag);
+		offset[frag + 1]++;
+		cost[frag] += 1.0;
+	}
+	for (size_t i = 0; i < efp->n_frag + 1; i++)
+		offset[i + 1] += offset[i];
+	for (size_t i = 0; i < n_pt; i++) {
+		size_t frag = frag_idx[i] == EFP_NO_FRAG ?
+		    efp->n_frag : frag_idx[i];
+
+		order[offset[frag]++] = i;
+	}
+	for (size_t i = efp->n_frag + 1; i > 0; i--)
+		offset[i] = offset[i - 1];
+	offset[0] = 0;
+
+	memset(field, 0, 3 * n_pt * sizeof(double));
+
+	batch.offset = offset;
+	batch.order = order;
+	batch.xyz = xyz;
+	batch.field = field;
+
+	efp_balance_work_cost(efp, compute_electric_field_batch_range, &batch,
+	    cost);
+
+	/* blocks of points without fragment are spread over processes */
+	n_free = offset[efp->n_frag + 1] - offset[efp->n_frag];
+
+#ifdef EFP_USE_MPI
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &size);
+#endif
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (size_t from = (size_t)rank * POL_FIELD_BLOCK; from < n_free;
+	    from += (size_t)size * POL_FIELD_BLOCK) {
+		size_t n_blk = n_free - from < POL_FIELD_BLOCK ?
+		    n_free - from : POL_FIELD_BLOCK;
+
+		compute_electric_field(efp, EFP_NO_FRAG, n_blk,
+		    order + offset[efp->n_frag] + from, xyz, field);
+	}
+
+	efp_allreduce(field, 3 * n_pt);
+
+	efp_scratch_free(efp, cost);
+	efp_scratch_free(efp, order);
+	efp_scratch_free(efp, offset);
 	return EFP_RESULT_SUCCESS;
 }
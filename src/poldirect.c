@@ -25,52 +25,27 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 
+#include "balance.h"
 #include "clapack.h"
 #include "private.h"
 
 double efp_get_pol_damp_tt(double, double, double);
 enum efp_result efp_compute_id_direct(struct efp *);
 
-static void
-copy_matrix(double *dst, size_t n, size_t off_i, size_t off_j, const mat_t *m)
-{
-	dst[n * (3 * off_i + 0) + 3 * off_j + 0] = m->xx;
-	dst[n * (3 * off_i + 0) + 3 * off_j + 1] = m->xy;
-	dst[n * (3 * off_i + 0) + 3 * off_j + 2] = m->xz;
-	dst[n * (3 * off_i + 1) + 3 * off_j + 0] = m->yx;
-	dst[n * (3 * off_i + 1) + 3 * off_j + 1] = m->yy;
-	dst[n * (3 * off_i + 1) + 3 * off_j + 2] = m->yz;
-	dst[n * (3 * off_i + 2) + 3 * off_j + 0] = m->zx;
-	dst[n * (3 * off_i + 2) + 3 * off_j + 1] = m->zy;
-	dst[n * (3 * off_i + 2) + 3 * off_j + 2] = m->zz;
-}
-
-static void
-transpose_matrix(double *m, size_t n)
-{
-	for (size_t i = 0; i < n; i++)
-		for (size_t j = i + 1; j < n; j++) {
-			double t = m[n * i + j];
-			m[n * i + j] = m[n * j + i];
-			m[n * j + i] = t;
-		}
-}
-
 static mat_t
-get_int_mat(const struct efp *efp, size_t i, size_t j, size_t ii, size_t jj)
+get_int_mat(const struct efp *efp, const struct frag *fr_i,
+    const struct frag *fr_j, size_t ii, size_t jj, const struct swf *swf)
 {
 	mat_t m;
-	const struct frag *fr_i = efp->frags + i;
-	const struct frag *fr_j = efp->frags + j;
 	const struct polarizable_pt *pt_i = fr_i->polarizable_pts + ii;
 	const struct polarizable_pt *pt_j = fr_j->polarizable_pts + jj;
-	struct swf swf = efp_make_swf(efp, fr_i, fr_j);
 
 	vec_t dr = {
-		pt_j->x - pt_i->x - swf.cell.x,
-		pt_j->y - pt_i->y - swf.cell.y,
-		pt_j->z - pt_i->z - swf.cell.z
+		pt_j->x - pt_i->x - swf->cell.x,
+		pt_j->y - pt_i->y - swf->cell.y,
+		pt_j->z - pt_i->z - swf->cell.z
 	};
 
 	double p1 = 1.0;
@@ -81,116 +56,361 @@ get_int_mat(const struct efp *efp, size_t i, size_t j, size_t ii, size_t jj)
 	if (efp->opts.pol_damp == EFP_POL_DAMP_TT)
 		p1 = efp_get_pol_damp_tt(r, fr_i->pol_damp, fr_j->pol_damp);
 
-	m.xx = swf.swf * p1 * (3.0 * dr.x * dr.x / r5 - 1.0 / r3);
-	m.xy = swf.swf * p1 *  3.0 * dr.x * dr.y / r5;
-	m.xz = swf.swf * p1 *  3.0 * dr.x * dr.z / r5;
-	m.yx = swf.swf * p1 *  3.0 * dr.y * dr.x / r5;
-	m.yy = swf.swf * p1 * (3.0 * dr.y * dr.y / r5 - 1.0 / r3);
-	m.yz = swf.swf * p1 *  3.0 * dr.y * dr.z / r5;
-	m.zx = swf.swf * p1 *  3.0 * dr.z * dr.x / r5;
-	m.zy = swf.swf * p1 *  3.0 * dr.z * dr.y / r5;
-	m.zz = swf.swf * p1 * (3.0 * dr.z * dr.z / r5 - 1.0 / r3);
+	m.xx = swf->swf * p1 * (3.0 * dr.x * dr.x / r5 - 1.0 / r3);
+	m.xy = swf->swf * p1 *  3.0 * dr.x * dr.y / r5;
+	m.xz = swf->swf * p1 *  3.0 * dr.x * dr.z / r5;
+	m.yx = swf->swf * p1 *  3.0 * dr.y * dr.x / r5;
+	m.yy = swf->swf * p1 * (3.0 * dr.y * dr.y / r5 - 1.0 / r3);
+	m.yz = swf->swf * p1 *  3.0 * dr.y * dr.z / r5;
+	m.zx = swf->swf * p1 *  3.0 * dr.z * dr.x / r5;
+	m.zy = swf->swf * p1 *  3.0 * dr.z * dr.y / r5;
+	m.zz = swf->swf * p1 * (3.0 * dr.z * dr.z / r5 - 1.0 / r3);
 
 	return m;
 }
 
-static void
-compute_lhs(const struct efp *efp, double *c, int conj)
+/* Nonzero if polarizable points of fragments i and j interact. */
+static int
+is_partner(const struct efp *efp, size_t i, size_t j)
 {
-	size_t i, ii, j, jj, offset_i, offset_j;
-	size_t n = 3 * efp->n_polarizable_pts;
-
-	for (i = 0, offset_i = 0; i < efp->n_frag; i++) {
-	for (ii = 0; ii < efp->frags[i].n_polarizable_pts; ii++, offset_i++) {
-	for (j = 0, offset_j = 0; j < efp->n_frag; j++) {
-	for (jj = 0; jj < efp->frags[j].n_polarizable_pts; jj++, offset_j++) {
-		if (i == j) {
-			if (ii == jj) {
-				copy_matrix(c, n, offset_i, offset_j,
-				    &mat_identity);
-			} else {
-				copy_matrix(c, n, offset_i, offset_j,
-				    &mat_zero);
+	return j != i && !efp_skip_frag_pair(efp, i, j);
+}
+
+/* Orders fragments with reverse Cuthill-McKee algorithm on the graph of
+ * interacting fragment pairs, which reduces bandwidth of the matrix. */
+static enum efp_result
+order_frags(struct efp *efp, size_t *order)
+{
+	size_t n = efp->n_frag, head = 0, tail = 0;
+	size_t *degree;
+	char *visited;
+
+	degree = (size_t *)efp_scratch_alloc(efp, n * sizeof(size_t));
+	visited = (char *)efp_scratch_alloc(efp, n * sizeof(char));
+
+	if (degree == NULL || visited == NULL) {
+		efp_scratch_free(efp, visited);
+		efp_scratch_free(efp, degree);
+		return EFP_RESULT_NO_MEMORY;
+	}
+
+	memset(degree, 0, n * sizeof(size_t));
+	memset(visited, 0, n * sizeof(char));
+
+	for (size_t i = 0; i < n; i++) {
+		const size_t *nb;
+		size_t n_nb = efp_nblist_get_row(efp, i, &nb);
+
+		for (size_t m = 0; m < n_nb; m++)
+			if (is_partner(efp, i, nb ? nb[m] : m))
+				degree[i]++;
+	}
+
+	while (tail < n) {
+		size_t start = n;
+
+		/* each connected component starts from a fragment of the
+		 * lowest degree */
+		for (size_t i = 0; i < n; i++)
+			if (!visited[i] && (start == n ||
+			    degree[i] < degree[start]))
+				start = i;
+
+		visited[start] = 1;
+		order[tail++] = start;
+
+		while (head < tail) {
+			size_t i = order[head++], first = tail;
+			const size_t *nb;
+			size_t n_nb = efp_nblist_get_row(efp, i, &nb);
+
+			for (size_t m = 0; m < n_nb; m++) {
+				size_t j = nb ? nb[m] : m, k;
+
+				if (visited[j] || !is_partner(efp, i, j))
+					continue;
+
+				visited[j] = 1;
+
+				/* neighbors go by increasing degree */
+				for (k = tail++; k > first &&
+				    degree[order[k - 1]] > degree[j]; k--)
+					order[k] = order[k - 1];
+
+				order[k] = j;
 			}
-			continue;
 		}
-		const struct polarizable_pt *pt_i =
-		    efp->frags[i].polarizable_pts + ii;
-		mat_t m = get_int_mat(efp, i, j, ii, jj);
+	}
 
-		if (conj)
-			m = mat_trans_mat(&pt_i->tensor, &m);
-		else
-			m = mat_mat(&pt_i->tensor, &m);
+	for (size_t i = 0; i < n / 2; i++) {
+		size_t t = order[i];
+		order[i] = order[n - i - 1];
+		order[n - i - 1] = t;
+	}
+
+	efp_scratch_free(efp, visited);
+	efp_scratch_free(efp, degree);
+	return EFP_RESULT_SUCCESS;
+}
 
-		mat_negate(&m);
-		copy_matrix(c, n, offset_i, offset_j, &m);
-	}}}}
+static size_t
+get_ld(const struct pol_direct *pd)
+{
+	return pd->band ? 3 * pd->kl + 1 : pd->n;
 }
 
 static void
-compute_rhs(const struct efp *efp, vec_t *id, int conj)
+set_block(struct pol_direct *pd, size_t row, size_t col, const mat_t *m)
 {
-	for (size_t i = 0, idx = 0; i < efp->n_frag; i++) {
-		const struct frag *frag = efp->frags + i;
+	size_t ld = get_ld(pd);
 
-		for (size_t j = 0; j < frag->n_polarizable_pts; j++, idx++) {
-			const struct polarizable_pt *pt =
-			    frag->polarizable_pts + j;
-			vec_t field = vec_add(&pt->elec_field,
-			    &pt->elec_field_wf);
+	for (size_t a = 0; a < 3; a++) {
+		for (size_t b = 0; b < 3; b++) {
+			size_t r = row + a, c = col + b;
+			size_t idx = pd->band ? 2 * pd->kl + r - c : r;
 
-			if (conj)
-				id[idx] = mat_trans_vec(&pt->tensor, &field);
-			else
-				id[idx] = mat_vec(&pt->tensor, &field);
+			pd->lu[idx + c * ld] = ((const double *)m)[3 * a + b];
 		}
 	}
 }
 
-enum efp_result
-efp_compute_id_direct(struct efp *efp)
+/* Matrix rows of fragment i are I - A_i T_ij blocks, where A_i are
+ * polarizability tensors and T_ij are dipole field tensors. */
+static void
+compute_lhs(const struct efp *efp, struct pol_direct *pd)
 {
-	double *c;
-	size_t n;
-	fortranint_t *ipiv;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *fr_i = efp->frags + i;
+		size_t row = pd->offset[i];
+
+		for (size_t ii = 0; ii < fr_i->n_polarizable_pts; ii++)
+			set_block(pd, row + 3 * ii, row + 3 * ii,
+			    &mat_identity);
+
+		const size_t *nb;
+		size_t n_nb = efp_nblist_get_row(efp, i, &nb);
+
+		for (size_t m = 0; m < n_nb; m++) {
+			size_t j = nb ? nb[m] : m;
+
+			if (!is_partner(efp, i, j))
+				continue;
+
+			const struct frag *fr_j = efp->frags + j;
+			struct swf swf = efp_make_swf(efp, fr_i, fr_j);
+			size_t col = pd->offset[j];
+
+			for (size_t ii = 0; ii < fr_i->n_polarizable_pts;
+			    ii++) {
+				const struct polarizable_pt *pt_i =
+				    fr_i->polarizable_pts + ii;
+
+				for (size_t jj = 0;
+				    jj < fr_j->n_polarizable_pts; jj++) {
+					mat_t t = get_int_mat(efp, fr_i, fr_j,
+					    ii, jj, &swf);
+
+					t = mat_mat(&pt_i->tensor, &t);
+					mat_negate(&t);
+					set_block(pd, row + 3 * ii,
+					    col + 3 * jj, &t);
+				}
+			}
+		}
+	}
+}
+
+static enum efp_result
+factorize(struct efp *efp)
+{
+	struct pol_direct *pd = &efp->pol_direct;
+	size_t *order, n = 3 * efp->n_polarizable_pts, kl = 0, ld;
+	double start = efp_wtime();
+	fortranint_t info;
 	enum efp_result res;
 
-	n = 3 * efp->n_polarizable_pts;
-	c = (double *)calloc(n * n, sizeof *c);
-	ipiv = (fortranint_t *)calloc(n, sizeof *ipiv);
+	pd->valid = 0;
+	pd->offset = (size_t *)efp_reserve(efp, pd->offset, &pd->offset_size,
+	    efp->n_frag * sizeof(size_t));
+	if (pd->offset == NULL)
+		return EFP_RESULT_NO_MEMORY;
 
-	if (c == NULL || ipiv == NULL) {
-		res = EFP_RESULT_NO_MEMORY;
-		goto error;
+	order = (size_t *)efp_scratch_alloc(efp, efp->n_frag * sizeof(size_t));
+	if (order == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	/* without cutoff all fragments interact and the order does not
+	 * matter */
+	if (efp->opts.enable_cutoff) {
+		if ((res = order_frags(efp, order))) {
+			efp_scratch_free(efp, order);
+			return res;
+		}
+	} else {
+		for (size_t i = 0; i < efp->n_frag; i++)
+			order[i] = i;
 	}
 
-	/* induced dipoles */
-	compute_lhs(efp, c, 0);
-	compute_rhs(efp, efp->indip, 0);
-	transpose_matrix(c, n);
+	for (size_t i = 0, offset = 0; i < efp->n_frag; i++) {
+		pd->offset[order[i]] = offset;
+		offset += 3 * efp->frags[order[i]].n_polarizable_pts;
+	}
 
-	if (efp_dgesv((fortranint_t)n, 1, c, (fortranint_t)n, ipiv,
-	    (double *)efp->indip, (fortranint_t)n) != 0) {
-		efp_log("dgesv: error solving for induced dipoles");
-		res = EFP_RESULT_FATAL;
-		goto error;
+	efp_scratch_free(efp, order);
+
+	/* half bandwidth of the matrix */
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const size_t *nb;
+		size_t n_nb = efp_nblist_get_row(efp, i, &nb);
+		size_t n_i = efp->frags[i].n_polarizable_pts;
+
+		if (n_i > 0 && kl < 2)
+			kl = 2;
+
+		for (size_t m = 0; m < n_nb; m++) {
+			size_t j = nb ? nb[m] : m;
+			size_t n_j = efp->frags[j].n_polarizable_pts;
+
+			if (n_i == 0 || n_j == 0 || pd->offset[j] <
+			    pd->offset[i] || !is_partner(efp, i, j))
+				continue;
+
+			if (kl < pd->offset[j] + 3 * n_j - 1 - pd->offset[i])
+				kl = pd->offset[j] + 3 * n_j - 1 -
+				    pd->offset[i];
+		}
 	}
 
-	/* conjugate induced dipoles */
-	compute_lhs(efp, c, 1);
-	compute_rhs(efp, efp->indipconj, 1);
-	transpose_matrix(c, n);
+	pd->n = n;
+	pd->kl = kl;
+	pd->band = 3 * kl + 1 < n;
+
+	ld = get_ld(pd);
+	pd->lu = (double *)efp_reserve(efp, pd->lu, &pd->lu_size,
+	    ld * n * sizeof(double));
+	if (pd->lu == NULL)
+		return EFP_RESULT_NO_MEMORY;
+	pd->ipiv = (fortranint_t *)efp_reserve(efp, pd->ipiv, &pd->ipiv_size,
+	    n * sizeof(fortranint_t));
+	if (pd->ipiv == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	memset(pd->lu, 0, ld * n * sizeof(double));
 
-	if (efp_dgesv((fortranint_t)n, 1, c, (fortranint_t)n, ipiv,
-	    (double *)efp->indipconj, (fortranint_t)n) != 0) {
-		efp_log("dgesv: error solving for conjugate induced dipoles");
-		res = EFP_RESULT_FATAL;
+	pd->size = ld * n * sizeof(double) + n * sizeof(fortranint_t);
+
+	if (n > 0) {
+		compute_lhs(efp, pd);
+
+		if (pd->band)
+			info = efp_dgbtrf((fortranint_t)n, (fortranint_t)n,
+			    (fortranint_t)kl, (fortranint_t)kl, pd->lu,
+			    (fortranint_t)ld, pd->ipiv);
+		else
+			info = efp_dgetrf((fortranint_t)n, (fortranint_t)n,
+			    pd->lu, (fortranint_t)ld, pd->ipiv);
+
+		if (info != 0) {
+			efp_log("error factorizing polarization matrix");
+			return EFP_RESULT_FATAL;
+		}
+	}
+
+	pd->time = efp_wtime() - start;
+	pd->valid = 1;
+
+	return EFP_RESULT_SUCCESS;
+}
+
+static enum efp_result
+solve(struct pol_direct *pd, char trans, double *b)
+{
+	size_t ld = get_ld(pd);
+	fortranint_t info;
+
+	if (pd->band)
+		info = efp_dgbtrs(trans, (fortranint_t)pd->n,
+		    (fortranint_t)pd->kl, (fortranint_t)pd->kl, 1, pd->lu,
+		    (fortranint_t)ld, pd->ipiv, b, (fortranint_t)pd->n);
+	else
+		info = efp_dgetrs(trans, (fortranint_t)pd->n, 1, pd->lu,
+		    (fortranint_t)ld, pd->ipiv, b, (fortranint_t)pd->n);
+
+	if (info != 0) {
+		efp_log("error solving for induced dipoles");
+		return EFP_RESULT_FATAL;
+	}
+	return EFP_RESULT_SUCCESS;
+}
+
+/* With M = I - A T the induced dipoles solve M mu = A E. As T is
+ * symmetric, conjugate induced dipoles are mu' = A^T nu, where nu solves
+ * the transposed system M^T nu = E. One factorization serves both and is
+ * kept until geometry changes. */
+enum efp_result
+efp_compute_id_direct(struct efp *efp)
+{
+	struct pol_direct *pd = &efp->pol_direct;
+	vec_t *b, *b_conj;
+	enum efp_result res;
+
+	if (!pd->valid && (res = factorize(efp)))
+		return res;
+
+	if (pd->n == 0)
+		return EFP_RESULT_SUCCESS;
+
+	b = (vec_t *)efp_scratch_alloc(efp, pd->n * sizeof(double));
+	b_conj = (vec_t *)efp_scratch_alloc(efp, pd->n * sizeof(double));
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+		size_t idx = pd->offset[i] / 3;
+
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+			const struct polarizable_pt *pt =
+			    frag->polarizable_pts + j;
+			vec_t field = vec_add(&pt->elec_field,
+			    &pt->elec_field_wf);
+
+			b[idx + j] = mat_vec(&pt->tensor, &field);
+			b_conj[idx + j] = field;
+		}
+	}
+
+	if ((res = solve(pd, 'N', (double *)b)))
+		goto error;
+	if ((res = solve(pd, 'T', (double *)b_conj)))
 		goto error;
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+		size_t idx = pd->offset[i] / 3;
+
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+			const struct polarizable_pt *pt =
+			    frag->polarizable_pts + j;
+			size_t k = frag->polarizable_offset + j;
+
+			efp->indip[k] = b[idx + j];
+			efp->indipconj[k] = mat_trans_vec(&pt->tensor,
+			    b_conj + idx + j);
+		}
 	}
-	res = EFP_RESULT_SUCCESS;
 error:
-	free(c);
-	free(ipiv);
+	efp_scratch_free(efp, b_conj);
+	efp_scratch_free(efp, b);
 	return res;
 }
+
+void
+efp_free_pol_direct(struct pol_direct *pd)
+{
+	free(pd->offset);
+	free(pd->lu);
+	free(pd->ipiv);
+	memset(pd, 0, sizeof(*pd));
+}
@@ -29,9 +29,13 @@
 
 #include <assert.h>
 
+#include "clapack.h"
 #include "efp.h"
+#include "fmm.h"
 #include "int.h"
 #include "log.h"
+#include "nblist.h"
+#include "pme.h"
 #include "swf.h"
 #include "terms.h"
 #include "util.h"
@@ -48,6 +52,17 @@ struct multipole_pt {
 	double octupole[10];
 };
 
+/* multipole points of a fragment in structure-of-arrays layout, component
+ * c of point i is stored at [c * stride + i] */
+struct multipole_soa {
+	size_t stride;       /* distance between components */
+	double *x, *y, *z;   /* coordinates */
+	double *monopole;    /* monopoles */
+	double *dipole;      /* 3 dipole components */
+	double *quadrupole;  /* 6 quadrupole components */
+	double *octupole;    /* 10 octupole components */
+};
+
 struct polarizable_pt {
 	double x, y, z;
 	mat_t tensor;
@@ -70,6 +85,31 @@ struct ff_link {
 	size_t idx2;   /* index in ff_atoms array */
 };
 
+struct skip_list {
+	size_t n;      /* number of skipped partners */
+	size_t size;   /* allocated size of idx */
+	size_t *idx;   /* sorted indices of skipped partners */
+};
+
+struct xr_tail {
+	double a;      /* smallest exponent of a shell */
+	double w;      /* largest sum of absolute LMO coefficients */
+	size_t l;      /* angular momentum */
+};
+
+struct scratch {
+	char *buf;     /* preallocated memory */
+	size_t size;   /* size of buf in bytes */
+	size_t used;   /* number of bytes in use */
+};
+
+struct pair_energy {
+	double electrostatic;       /* multipole electrostatics */
+	double charge_penetration;  /* charge penetration */
+	double dispersion;          /* dispersion */
+	double exchange_repulsion;  /* exchange repulsion */
+};
+
 struct frag {
 	/* fragment name */
 	char name[32];
@@ -95,6 +135,10 @@ struct frag {
 	/* number of distributed multipole points */
 	size_t n_multipole_pts;
 
+	/* copy of multipole points for vectorized electrostatics, not set
+	 * for library fragments */
+	struct multipole_soa multipole_soa;
+
 	/* electrostatic screening parameters */
 	double *screen_params;
 
@@ -116,6 +160,10 @@ struct frag {
 	/* number of dynamic polarizability points */
 	size_t n_dynamic_polarizable_pts;
 
+	/* isotropic dynamic polarizabilities of each point at all 12
+	 * frequencies, set for library fragments only */
+	double *disp_traces;
+
 	/* number of localized molecular orbitals */
 	size_t n_lmo;
 
@@ -131,6 +179,9 @@ struct frag {
 	/* exchange repulsion atoms */
 	struct xr_atom *xr_atoms;
 
+	/* exchange repulsion basis, only set for library fragments */
+	struct xr_basis xr_basis;
+
 	/* upper triangle of fock matrix, size = n_lmo * (n_lmo + 1) / 2 */
 	double *xr_fock_mat;
 
@@ -140,16 +191,62 @@ struct frag {
 	/* exchange repulsion wavefunction, size = n_lmo * xr_wf_size */
 	double *xr_wf;
 
-	/* rotational derivatives of MO coefficients */
+	/* rotational derivatives of MO coefficients, stored contiguously */
 	double *xr_wf_deriv[3];
 
 	/* fitted ai-efp exchange-repulsion parameters */
 	double *xrfit;
 
+	/* number of basis shell tails for exchange repulsion screening */
+	size_t n_xr_tails;
+
+	/* basis shell tails for exchange repulsion screening */
+	struct xr_tail *xr_tails;
+
+	/* largest distance of basis centers and LMO centroids from center
+	 * of mass */
+	double xr_extent;
+
 	/* offset of polarizable points for this fragment */
 	size_t polarizable_offset;
 };
 
+/* Dipole field tensors between polarizable points used by iterative
+ * polarization drivers. Only the first n_frag fragments whose tensors fit
+ * into the memory limit are cached, the rest are computed on the fly. */
+struct pol_cache {
+	size_t n_frag;         /* number of cached fragments */
+	size_t *col_offset;    /* offsets of partner point lists */
+	size_t *col;           /* partner polarizable points of fragments */
+	size_t *tensor_offset; /* offsets of tensors of fragments */
+	mat_t *tensor;         /* tensors, row of partners for each point */
+	char *ready;           /* nonzero if tensors of fragment are computed */
+	size_t col_offset_size; /* allocated sizes of arrays in bytes */
+	size_t col_size;
+	size_t tensor_offset_size;
+	size_t tensor_size;
+	size_t ready_size;
+	int valid;             /* nonzero if partner lists match geometry */
+};
+
+/* LU factorization of the matrix of the direct polarization driver. Band
+ * storage is used if the matrix is sparse enough after reordering of
+ * fragments. */
+struct pol_direct {
+	size_t n;              /* matrix dimension */
+	size_t kl;             /* number of sub- and superdiagonals */
+	int band;              /* nonzero if band storage is used */
+	size_t *offset;        /* matrix row of the first point of fragments */
+	double *lu;            /* LU factors */
+	fortranint_t *ipiv;    /* pivot indices */
+	size_t size;           /* memory used by factorization in bytes */
+	size_t offset_size;    /* allocated sizes of arrays in bytes */
+	size_t lu_size;
+	size_t ipiv_size;
+	double time;           /* time of the last factorization in seconds */
+	int valid;             /* nonzero if factorization matches geometry */
+};
+
 struct efp {
 	/* number of fragments */
 	size_t n_frag;
@@ -196,6 +293,9 @@ struct efp {
 	/* gradient on point charges */
 	vec_t *ptc_grad;
 
+	/* allocated number of point charges */
+	size_t ptc_size;
+
 	/* polarization induced dipoles */
 	vec_t *indip;
 
@@ -218,15 +318,112 @@ struct efp {
 	 * size [n_ai_occ + n_ai_vir] */
 	double *ai_orbital_energies;
 
-	/* ab initio dipole moment integrals on polarizable points
-	 * size [3 * (n_ai_occ + n_ai_vir) ^ 2] */
+	/* ab initio occupied-virtual transition dipole integrals
+	 * size [n_ai_occ * n_ai_vir * 3] */
 	double *ai_dipole_integrals;
 
 	/* EFP energy terms */
 	struct efp_energy energy;
 
-	/* skip-list of fragments - boolean array of nfrag^2 elements */
-	char *skiplist;
+	/* total number of entries in skip-list */
+	size_t n_skipped;
+
+	/* skip-list of fragments - array of n_frag sorted lists of skipped
+	 * partners, allocated on first use */
+	struct skip_list *skiplist;
+
+	/* fragment pairs within the cutoff, used if cutoff is enabled */
+	struct nblist nblist;
+
+	/* estimated or measured cost of two-body work for each fragment */
+	double *two_body_cost;
+
+	/* nonzero if two_body_cost holds timings from the previous call */
+	int two_body_cost_measured;
+
+	/* time spent in two-body work for each fragment */
+	double *two_body_time;
+
+	/* order in which fragments are processed in two-body loop */
+	size_t *two_body_order;
+
+	/* number of per-thread gradient buffers */
+	size_t n_thr;
+
+	/* per-thread fragment gradients, size [n_thr * n_frag] */
+	six_t *thr_grad;
+
+	/* per-thread stress tensors, size [n_thr] */
+	mat_t *thr_stress;
+
+	/* per-thread point charge gradients, size [n_thr * n_ptc] */
+	vec_t *thr_ptc_grad;
+
+	/* number of point charges thr_ptc_grad was allocated for */
+	size_t n_thr_ptc;
+
+	/* number of per-thread scratch buffers */
+	size_t n_scratch;
+
+	/* per-thread scratch memory for temporary arrays */
+	struct scratch *scratch;
+
+	/* number of heap allocations of work memory */
+	size_t n_alloc;
+
+	/* number of fragment pairs skipped by exchange repulsion screening */
+	size_t n_xr_screened;
+
+	/* two-body energies of fragment pairs from the last computation,
+	 * stored for pairs i < j or, with cutoff, at neighbor list entries of
+	 * the fragments owning the pairs; kept once efp_compute_incremental
+	 * was called */
+	struct pair_energy *pair_energy;
+
+	/* allocated size of pair_energy */
+	size_t pair_energy_size;
+
+	/* nonzero if efp_compute should store pair energies */
+	int keep_pair_energy;
+
+	/* nonzero if pair_energy is up to date for all clean fragments */
+	int pair_energy_valid;
+
+	/* nonzero for fragments moved since the last computation */
+	char *frag_dirty;
+
+	/* nonzero if induced dipoles from the previous computation are used
+	 * as initial guess */
+	int pol_guess;
+
+	/* induced and conjugate induced dipoles from previous computations,
+	 * ring buffer of pol_history_size solutions */
+	vec_t *pol_history;
+
+	/* number of solutions pol_history is allocated for */
+	size_t pol_history_size;
+
+	/* number of stored solutions */
+	size_t n_pol_history;
+
+	/* slot for the next solution */
+	size_t pol_history_pos;
+
+	/* particle mesh Ewald grid, used if PME is enabled */
+	struct pme pme;
+
+	/* octree and expansions, used if FMM is enabled */
+	struct fmm fmm;
+
+	/* dipole field tensors, used if polarization cache is enabled */
+	struct pol_cache pol_cache;
+
+	/* factorized matrix, used by direct polarization driver */
+	struct pol_direct pol_direct;
+
+	/* nonzero if static field at polarizable points matches fragment
+	 * and point charge positions */
+	int elec_field_valid;
 };
 
 #endif /* LIBEFP_PRIVATE_H */
@@ -29,18 +29,31 @@
 
 #include "mathutil.h"
 
+/* number of occupied-virtual pairs in one block of the ab initio
+ * dispersion contraction */
+#define AI_DISP_BLOCK 1024
+
 struct efp;
 struct frag;
+struct pol_cache;
+struct pol_direct;
 
 double efp_frag_frag_elec(struct efp *, size_t, size_t);
 double efp_frag_frag_disp(struct efp *, size_t, size_t,
     const double *, const six_t *);
 void efp_frag_frag_xr(struct efp *, size_t, size_t, double *,
     six_t *, double *, double *);
+enum efp_result efp_setup_xr_screen(struct efp *, struct frag *);
+int efp_xr_screen(const struct efp *, size_t, size_t);
+enum efp_result efp_compute_elec_pme(struct efp *);
+enum efp_result efp_compute_elec_fmm(struct efp *);
 enum efp_result efp_compute_pol(struct efp *);
 enum efp_result efp_compute_ai_elec(struct efp *);
 enum efp_result efp_compute_ai_disp(struct efp *);
 enum efp_result efp_compute_pol_energy(struct efp *, double *);
+void efp_free_pol_cache(struct pol_cache *);
+void efp_free_pol_direct(struct pol_direct *);
+enum efp_result efp_setup_multipole_soa(struct efp *, struct frag *);
 void efp_update_elec(struct frag *);
 void efp_update_pol(struct frag *);
 void efp_update_disp(struct frag *);
@@ -25,16 +25,40 @@
  */
 
 #include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "private.h"
 #include "util.h"
 
+/* binary search; on return *pos is the insertion point for idx */
 int
-efp_skip_frag_pair(const struct efp *efp, size_t fr_i_idx, size_t fr_j_idx)
+efp_skiplist_find(const struct skip_list *list, size_t idx, size_t *pos)
 {
-	size_t idx = fr_i_idx * efp->n_frag + fr_j_idx;
+	size_t lo = 0, hi = list->n;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (list->idx[mid] < idx)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (pos)
+		*pos = lo;
+	return lo < list->n && list->idx[lo] == idx;
+}
 
-	if (efp->skiplist[idx])
+int
+efp_skip_frag_pair(const struct efp *efp, size_t fr_i_idx, size_t fr_j_idx)
+{
+	if (efp->n_skipped > 0 &&
+	    efp_skiplist_find(efp->skiplist + fr_i_idx, fr_j_idx, NULL))
 		return 1;
 	if (!efp->opts.enable_cutoff)
 		return 0;
@@ -87,6 +111,20 @@ efp_make_swf(const struct efp *efp, const struct frag *fr_i,
 	return swf;
 }
 
+/* Returns switching function which keeps interaction unchanged. It is used
+ * for terms computed for all fragment pairs regardless of cutoff. */
+struct swf
+efp_make_unit_swf(const struct frag *fr_i, const struct frag *fr_j)
+{
+	struct swf swf;
+
+	memset(&swf, 0, sizeof(swf));
+	swf.swf = 1.0;
+	swf.dr = vec_sub(CVEC(fr_j->x), CVEC(fr_i->x));
+
+	return swf;
+}
+
 int
 efp_check_rotation_matrix(const mat_t *rotmat)
 {
@@ -155,28 +193,232 @@ efp_find_lib(struct efp *efp, const char *name)
 	return NULL;
 }
 
+/* Returns index of the calling thread within the only active parallel
+ * team. Contributions of each thread go to its own buffer, so no
+ * synchronization is needed. Threads of nested active teams cannot be given
+ * unique indices without knowing the sizes of all sibling teams, so they get
+ * SIZE_MAX and fall back to atomic updates of the shared arrays and to heap
+ * scratch memory, as do threads with an index beyond the number of buffers. */
+size_t
+efp_get_thread_idx(void)
+{
+#ifdef _OPENMP
+	if (omp_get_active_level() > 1)
+		return SIZE_MAX;
+
+	for (int level = omp_get_level(); level > 0; level--)
+		if (omp_get_team_size(level) > 1)
+			return (size_t)omp_get_ancestor_thread_num(level);
+
+	return 0;
+#else
+	return 0;
+#endif
+}
+
+#define SCRATCH_ALIGN 64
+
+size_t
+efp_scratch_align(size_t size)
+{
+	return (size + SCRATCH_ALIGN - 1) / SCRATCH_ALIGN * SCRATCH_ALIGN;
+}
+
+static void
+count_alloc(struct efp *efp)
+{
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+	efp->n_alloc++;
+}
+
+/* Heap allocation wrappers which count allocations made by the library.
+ * The count is reported by efp_get_alloc_count and is used to check that
+ * no memory is allocated in steady state. */
+void *
+efp_malloc(struct efp *efp, size_t size)
+{
+	count_alloc(efp);
+	return malloc(size > 0 ? size : 1);
+}
+
+void *
+efp_calloc(struct efp *efp, size_t n, size_t size)
+{
+	count_alloc(efp);
+	return calloc(n > 0 ? n : 1, size > 0 ? size : 1);
+}
+
+void *
+efp_realloc(struct efp *efp, void *ptr, size_t size)
+{
+	count_alloc(efp);
+	return realloc(ptr, size > 0 ? size : 1);
+}
+
+/* Returns a buffer of at least size bytes reusing ptr if its capacity is
+ * large enough. Buffers which are set up again for every geometry only grow,
+ * so that no heap allocation is needed in steady state. Contents are not
+ * preserved. On failure ptr is released and NULL is returned. */
+void *
+efp_reserve(struct efp *efp, void *ptr, size_t *capacity, size_t size)
+{
+	if (ptr && *capacity >= size)
+		return ptr;
+
+	free(ptr);
+	*capacity = 0;
+
+	if ((ptr = efp_malloc(efp, size)) == NULL)
+		return NULL;
+
+	*capacity = size;
+	return ptr;
+}
+
+/* Returns temporary memory from the scratch buffer of the calling thread.
+ * Buffers are sized in efp_prepare so that no heap allocation is needed
+ * in steady state. If the buffer is too small the memory is allocated
+ * from the heap and counted. */
+void *
+efp_scratch_alloc(struct efp *efp, size_t size)
+{
+	size_t idx = efp_get_thread_idx();
+
+	size = efp_scratch_align(size);
+
+	if (idx < efp->n_scratch) {
+		struct scratch *scratch = efp->scratch + idx;
+
+		if (scratch->size - scratch->used >= size) {
+			void *ptr = scratch->buf + scratch->used;
+
+			scratch->used += size;
+			return ptr;
+		}
+	}
+	return efp_malloc(efp, size);
+}
+
+/* Releases memory returned by efp_scratch_alloc. Scratch memory is a stack,
+ * releasing a block also releases all blocks allocated after it. */
+void
+efp_scratch_free(struct efp *efp, void *ptr)
+{
+	size_t idx = efp_get_thread_idx();
+
+	if (ptr == NULL)
+		return;
+
+	if (idx < efp->n_scratch) {
+		struct scratch *scratch = efp->scratch + idx;
+		char *p = (char *)ptr;
+
+		if (p >= scratch->buf && p < scratch->buf + scratch->size) {
+			if ((size_t)(p - scratch->buf) < scratch->used)
+				scratch->used = (size_t)(p - scratch->buf);
+			return;
+		}
+	}
+	free(ptr);
+}
+
+static void
+add_outer(mat_t *stress, const vec_t *dr, const vec_t *force)
+{
+	stress->xx += dr->x * force->x;
+	stress->xy += dr->x * force->y;
+	stress->xz += dr->x * force->z;
+	stress->yx += dr->y * force->x;
+	stress->yy += dr->y * force->y;
+	stress->yz += dr->y * force->z;
+	stress->zx += dr->z * force->x;
+	stress->zy += dr->z * force->y;
+	stress->zz += dr->z * force->z;
+}
+
+static six_t *
+get_grad_buf(struct efp *efp)
+{
+	size_t idx = efp_get_thread_idx();
+
+	if (idx < efp->n_thr)
+		return efp->thr_grad + idx * efp->n_frag;
+
+	return NULL;
+}
+
 void
-efp_add_stress(const vec_t *dr, const vec_t *force, mat_t *stress)
+efp_add_stress(struct efp *efp, const vec_t *dr, const vec_t *force)
 {
+	size_t idx = efp_get_thread_idx();
+
+	if (idx < efp->n_thr) {
+		add_outer(efp->thr_stress + idx, dr, force);
+		return;
+	}
 #ifdef _OPENMP
 #pragma omp critical
 #endif
-	{
-		stress->xx += dr->x * force->x;
-		stress->xy += dr->x * force->y;
-		stress->xz += dr->x * force->z;
-		stress->yx += dr->y * force->x;
-		stress->yy += dr->y * force->y;
-		stress->yz += dr->y * force->z;
-		stress->zx += dr->z * force->x;
-		stress->zy += dr->z * force->y;
-		stress->zz += dr->z * force->z;
+	add_outer(&efp->stress, dr, force);
+}
+
+void
+efp_add_grad(struct efp *efp, size_t frag_idx, const vec_t *force,
+    const vec_t *torque)
+{
+	six_t *buf = get_grad_buf(efp);
+
+	if (buf) {
+		six_t *grad = buf + frag_idx;
+
+		grad->x += force->x;
+		grad->y += force->y;
+		grad->z += force->z;
+
+		if (torque) {
+			grad->a += torque->x;
+			grad->b += torque->y;
+			grad->c += torque->z;
+		}
+	} else {
+		six_atomic_add_xyz(efp->grad + frag_idx, force);
+
+		if (torque)
+			six_atomic_add_abc(efp->grad + frag_idx, torque);
 	}
 }
 
 void
-efp_add_force(six_t *grad, const vec_t *com, const vec_t *pt,
-    const vec_t *force, const vec_t *add)
+efp_sub_grad(struct efp *efp, size_t frag_idx, const vec_t *force,
+    const vec_t *torque)
+{
+	six_t *buf = get_grad_buf(efp);
+
+	if (buf) {
+		six_t *grad = buf + frag_idx;
+
+		grad->x -= force->x;
+		grad->y -= force->y;
+		grad->z -= force->z;
+
+		if (torque) {
+			grad->a -= torque->x;
+			grad->b -= torque->y;
+			grad->c -= torque->z;
+		}
+	} else {
+		six_atomic_sub_xyz(efp->grad + frag_idx, force);
+
+		if (torque)
+			six_atomic_sub_abc(efp->grad + frag_idx, torque);
+	}
+}
+
+void
+efp_add_force(struct efp *efp, size_t frag_idx, const vec_t *com,
+    const vec_t *pt, const vec_t *force, const vec_t *add)
 {
 	vec_t dr = vec_sub(CVEC(pt->x), com);
 	vec_t torque = vec_cross(&dr, force);
@@ -186,13 +428,12 @@ efp_add_force(six_t *grad, const vec_t *com, const vec_t *pt,
 		torque.y += add->y;
 		torque.z += add->z;
 	}
-	six_atomic_add_xyz(grad, force);
-	six_atomic_add_abc(grad, &torque);
+	efp_add_grad(efp, frag_idx, force, &torque);
 }
 
 void
-efp_sub_force(six_t *grad, const vec_t *com, const vec_t *pt,
-    const vec_t *force, const vec_t *add)
+efp_sub_force(struct efp *efp, size_t frag_idx, const vec_t *com,
+    const vec_t *pt, const vec_t *force, const vec_t *add)
 {
 	vec_t dr = vec_sub(CVEC(pt->x), com);
 	vec_t torque = vec_cross(&dr, force);
@@ -202,8 +443,22 @@ efp_sub_force(six_t *grad, const vec_t *com, const vec_t *pt,
 		torque.y += add->y;
 		torque.z += add->z;
 	}
-	six_atomic_sub_xyz(grad, force);
-	six_atomic_sub_abc(grad, &torque);
+	efp_sub_grad(efp, frag_idx, force, &torque);
+}
+
+void
+efp_add_ptc_grad(struct efp *efp, size_t ptc_idx, const vec_t *force)
+{
+	size_t idx = efp_get_thread_idx();
+
+	if (idx < efp->n_thr) {
+		vec_t *grad = efp->thr_ptc_grad + idx * efp->n_ptc + ptc_idx;
+
+		grad->x += force->x;
+		grad->y += force->y;
+		grad->z += force->z;
+	} else
+		vec_atomic_add(efp->ptc_grad + ptc_idx, force);
 }
 
 void
@@ -31,18 +31,32 @@
 
 struct efp;
 struct frag;
+struct skip_list;
 
+int efp_skiplist_find(const struct skip_list *, size_t, size_t *);
 int efp_skip_frag_pair(const struct efp *, size_t, size_t);
 struct swf efp_make_swf(const struct efp *, const struct frag *,
     const struct frag *);
+struct swf efp_make_unit_swf(const struct frag *, const struct frag *);
 int efp_check_rotation_matrix(const mat_t *);
 void efp_points_to_matrix(const double *, mat_t *);
 const struct frag *efp_find_lib(struct efp *, const char *);
-void efp_add_stress(const vec_t *, const vec_t *, mat_t *);
-void efp_add_force(six_t *, const vec_t *, const vec_t *,
+size_t efp_get_thread_idx(void);
+size_t efp_scratch_align(size_t);
+void *efp_scratch_alloc(struct efp *, size_t);
+void efp_scratch_free(struct efp *, void *);
+void *efp_malloc(struct efp *, size_t);
+void *efp_calloc(struct efp *, size_t, size_t);
+void *efp_realloc(struct efp *, void *, size_t);
+void *efp_reserve(struct efp *, void *, size_t *, size_t);
+void efp_add_stress(struct efp *, const vec_t *, const vec_t *);
+void efp_add_grad(struct efp *, size_t, const vec_t *, const vec_t *);
+void efp_sub_grad(struct efp *, size_t, const vec_t *, const vec_t *);
+void efp_add_force(struct efp *, size_t, const vec_t *, const vec_t *,
     const vec_t *, const vec_t *);
-void efp_sub_force(six_t *, const vec_t *, const vec_t *,
+void efp_sub_force(struct efp *, size_t, const vec_t *, const vec_t *,
     const vec_t *, const vec_t *);
+void efp_add_ptc_grad(struct efp *, size_t, const vec_t *);
 void efp_move_pt(const vec_t *, const mat_t *, const vec_t *, vec_t *);
 void efp_rotate_t2(const mat_t *, const double *, double *);
 void efp_rotate_t3(const mat_t *, const double *, double *);
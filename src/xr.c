@@ -96,81 +96,32 @@ charge_penetration_grad(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
 	torque_j.z = torque_i.z + force.x * (fr_j->y - fr_i->y - swf->cell.y) -
 				  force.y * (fr_j->x - fr_i->x - swf->cell.x);
 
-	six_atomic_add_xyz(efp->grad + fr_i_idx, &force);
-	six_atomic_sub_xyz(efp->grad + fr_j_idx, &force);
-	six_atomic_add_abc(efp->grad + fr_i_idx, &torque_i);
-	six_atomic_sub_abc(efp->grad + fr_j_idx, &torque_j);
+	efp_add_grad(efp, fr_i_idx, &force, &torque_i);
+	efp_sub_grad(efp, fr_j_idx, &force, &torque_j);
 
-	efp_add_stress(&swf->dr, &force, &efp->stress);
-}
-
-static void
-transform_integrals(size_t n_lmo_i, size_t n_lmo_j, size_t wf_size_i,
-    size_t wf_size_j, double *wf_i, double *wf_j, double *s, double *lmo_s,
-    double *tmp)
-{
-	efp_dgemm('N', 'N', (fortranint_t)wf_size_j, (fortranint_t)n_lmo_i,
-	    (fortranint_t)wf_size_i, 1.0, s, (fortranint_t)wf_size_j, wf_i,
-	    (fortranint_t)wf_size_i, 0.0, tmp, (fortranint_t)wf_size_j);
-	efp_dgemm('T', 'N', (fortranint_t)n_lmo_j, (fortranint_t)n_lmo_i,
-	    (fortranint_t)wf_size_j, 1.0, wf_j, (fortranint_t)wf_size_j, tmp,
-	    (fortranint_t)wf_size_j, 0.0, lmo_s, (fortranint_t)n_lmo_j);
-}
-
-static void
-transform_integral_derivatives(size_t n_lmo_i, size_t n_lmo_j, size_t wf_size_i,
-    size_t wf_size_j, const double *wf_i, const double *wf_j, const six_t *ds,
-    six_t *lmo_ds, six_t *tmp)
-{
-	const six_t *p_ds;
-	six_t *p_tmp, *p_lmo_ds;
-
-	p_tmp = tmp;
-	for (size_t i = 0; i < n_lmo_i; i++) {
-	for (size_t j = 0; j < wf_size_j; j++, p_tmp++) {
-		six_t sum = six_zero;
-		p_ds = ds + j;
-
-		for (size_t k = 0; k < wf_size_i; k++, p_ds += wf_size_j) {
-			double w = wf_i[wf_size_i * i + k];
-
-			sum.x += p_ds->x * w;
-			sum.y += p_ds->y * w;
-			sum.z += p_ds->z * w;
-			sum.a += p_ds->a * w;
-			sum.b += p_ds->b * w;
-			sum.c += p_ds->c * w;
-		}
-		*p_tmp = sum;
-	} }
-
-	p_lmo_ds = lmo_ds;
-	for (size_t i = 0; i < n_lmo_i; i++) {
-	for (size_t j = 0; j < n_lmo_j; j++, p_lmo_ds++) {
-		six_t sum = six_zero;
-		p_tmp = tmp + i * wf_size_j;
-
-		for (size_t k = 0; k < wf_size_j; k++, p_tmp++) {
-			double w = wf_j[wf_size_j * j + k];
-
-			sum.x += p_tmp->x * w;
-			sum.y += p_tmp->y * w;
-			sum.z += p_tmp->z * w;
-			sum.a += p_tmp->a * w;
-			sum.b += p_tmp->b * w;
-			sum.c += p_tmp->c * w;
-		}
-		*p_lmo_ds = sum;
-	} }
+	efp_add_stress(efp, &swf->dr, &force);
 }
 
+/*
+ * Transforms n_blk integral blocks from AO to LMO basis with two GEMM calls.
+ * Row k of ao holds n_blk blocks of wf_size_j elements side by side; on exit
+ * row i of out holds n_blk blocks of n_lmo_j elements. All blocks share the
+ * same pair of coefficient matrices, so e.g. overlap and kinetic energy
+ * integrals, or all six derivative components, go through one wide GEMM.
+ */
 static void
-add_six_vec(size_t el, size_t size, const double *vec, six_t *six)
+transform_blocks(size_t n_rows, size_t n_lmo_j, size_t wf_size_i,
+    size_t wf_size_j, size_t n_blk, double *wf_i, double *wf_j, double *ao,
+    double *out, double *tmp)
 {
-	double *ptr = (double *)six + el;
+	size_t ld = n_blk * wf_size_j;
 
-	for (size_t i = 0; i < size; i++, vec++, ptr += 6)
-		*ptr += *vec;
+	efp_dgemm('N', 'N', (fortranint_t)ld, (fortranint_t)n_rows,
+	    (fortranint_t)wf_size_i, 1.0, ao, (fortranint_t)ld, wf_i,
+	    (fortranint_t)wf_size_i, 0.0, tmp, (fortranint_t)ld);
+	efp_dgemm('T', 'N', (fortranint_t)n_lmo_j, (fortranint_t)(n_rows * n_blk),
+	    (fortranint_t)wf_size_j, 1.0, wf_j, (fortranint_t)wf_size_j, tmp,
+	    (fortranint_t)wf_size_j, 0.0, out, (fortranint_t)n_lmo_j);
 }
 
 /*
@@ -415,12 +366,10 @@ lmo_lmo_xr_grad(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
 		    force.y * (fr_j->x - fr_i->x - swf->cell.x)
 	};
 
-	six_atomic_add_xyz(efp->grad + fr_i_idx, &force);
-	six_atomic_sub_xyz(efp->grad + fr_j_idx, &force);
-	six_atomic_add_abc(efp->grad + fr_i_idx, &torque_i);
-	six_atomic_sub_abc(efp->grad + fr_j_idx, &torque_j);
+	efp_add_grad(efp, fr_i_idx, &force, &torque_i);
+	efp_sub_grad(efp, fr_j_idx, &force, &torque_j);
 
-	efp_add_stress(&swf->dr, &force, &efp->stress);
+	efp_add_stress(efp, &swf->dr, &force);
 }
 
 static double
@@ -514,6 +463,165 @@ lmo_lmo_xr_energy(struct frag *fr_i, struct frag *fr_j, size_t i, size_t j,
 	return 2.0 * exr;
 }
 
+static size_t
+get_shell_l(char type)
+{
+	switch (type) {
+	case 'S':
+		return 0;
+	case 'L':
+	case 'P':
+		return 1;
+	case 'D':
+		return 2;
+	case 'F':
+		return 3;
+	}
+	assert(0);
+	return 0;
+}
+
+static size_t
+get_shell_size(char type)
+{
+	switch (type) {
+	case 'S':
+		return 1;
+	case 'L':
+		return 4;
+	case 'P':
+		return 3;
+	case 'D':
+		return 6;
+	case 'F':
+		return 10;
+	}
+	assert(0);
+	return 0;
+}
+
+/* Computes parameters used to estimate the largest LMO overlap between
+ * this library fragment and any other fragment at a given distance. For
+ * each basis shell the most diffuse exponent is stored together with the
+ * largest weight of the shell in any LMO. */
+enum efp_result
+efp_setup_xr_screen(struct efp *efp, struct frag *frag)
+{
+	size_t n_shells = 0;
+
+	for (size_t i = 0; i < frag->n_xr_atoms; i++)
+		n_shells += frag->xr_atoms[i].n_shells;
+
+	free(frag->xr_tails);
+	frag->n_xr_tails = 0;
+	frag->xr_extent = 0.0;
+	frag->xr_tails = NULL;
+
+	if (n_shells == 0 || frag->xr_wf == NULL)
+		return EFP_RESULT_SUCCESS;
+
+	frag->xr_tails = (struct xr_tail *)efp_calloc(efp, n_shells,
+	    sizeof(struct xr_tail));
+	if (frag->xr_tails == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	for (size_t i = 0, func = 0; i < frag->n_xr_atoms; i++) {
+		const struct xr_atom *at = frag->xr_atoms + i;
+		double r = vec_dist(CVEC(at->x), CVEC(frag->x));
+
+		if (r > frag->xr_extent)
+			frag->xr_extent = r;
+
+		for (size_t j = 0; j < at->n_shells; j++) {
+			const struct shell *sh = at->shells + j;
+			struct xr_tail *tail = frag->xr_tails + frag->n_xr_tails;
+			size_t stride = sh->type == 'L' ? 3 : 2;
+			size_t size = get_shell_size(sh->type);
+
+			tail->l = get_shell_l(sh->type);
+			tail->a = sh->coef[0];
+
+			for (size_t k = 1; k < sh->n_funcs; k++)
+				if (sh->coef[k * stride] < tail->a)
+					tail->a = sh->coef[k * stride];
+
+			for (size_t lmo = 0; lmo < frag->n_lmo; lmo++) {
+				const double *wf = frag->xr_wf +
+				    lmo * frag->xr_wf_size + func;
+				double w = 0.0;
+
+				for (size_t k = 0; k < size; k++)
+					w += fabs(wf[k]);
+
+				if (w > tail->w)
+					tail->w = w;
+			}
+
+			frag->n_xr_tails++;
+			func += size;
+		}
+	}
+
+	for (size_t i = 0; i < frag->n_lmo; i++) {
+		double r = vec_dist(frag->lmo_centroids + i, CVEC(frag->x));
+
+		if (r > frag->xr_extent)
+			frag->xr_extent = r;
+	}
+
+	return EFP_RESULT_SUCCESS;
+}
+
+/* Returns nonzero if the estimated largest LMO overlap between fragments
+ * is below efp_opts::xr_screen_tol so that exchange repulsion, charge
+ * penetration and overlap-based damping are negligible. The estimate is a
+ * heuristic: contraction coefficients other than the most diffuse exponent
+ * are ignored, so it is not a rigorous bound.
+ *
+ * Overlap of two normalized Gaussian shells with exponents a and b
+ * separated by r is approximately (2 sqrt(a b) / (a + b))^(3/2 + l) times
+ * (1 + 2 mu r^2)^l exp(-mu r^2), where mu = a b / (a + b) and l is the
+ * average angular momentum of the shells. The distance
+ * between any two basis centers is at least the distance between centers
+ * of mass minus extents of both fragments. */
+int
+efp_xr_screen(const struct efp *efp, size_t frag_i, size_t frag_j)
+{
+	const struct frag *lib_i = efp->frags[frag_i].lib;
+	const struct frag *lib_j = efp->frags[frag_j].lib;
+
+	if (efp->opts.xr_screen_tol == 0.0)
+		return 0;
+
+	if (lib_i->n_xr_tails == 0 || lib_j->n_xr_tails == 0)
+		return 0;
+
+	struct swf swf = efp_make_swf(efp, efp->frags + frag_i,
+	    efp->frags + frag_j);
+	double r = vec_len(&swf.dr) - lib_i->xr_extent - lib_j->xr_extent;
+
+	if (r <= 0.0)
+		return 0;
+
+	double s_max = 0.0;
+
+	for (size_t i = 0; i < lib_i->n_xr_tails; i++) {
+		const struct xr_tail *ti = lib_i->xr_tails + i;
+
+		for (size_t j = 0; j < lib_j->n_xr_tails; j++) {
+			const struct xr_tail *tj = lib_j->xr_tails + j;
+			double ab = ti->a + tj->a;
+			double mu_r2 = ti->a * tj->a / ab * r * r;
+			double l = 0.5 * (double)(ti->l + tj->l);
+			double p = 2.0 * sqrt(ti->a * tj->a) / ab;
+
+			s_max += ti->w * tj->w * pow(p, 1.5 + l) *
+			    pow(1.0 + 2.0 * mu_r2, l) * exp(-mu_r2);
+		}
+	}
+	return s_max < efp->opts.xr_screen_tol;
+}
+
 void
 efp_frag_frag_xr(struct efp *efp, size_t frag_i, size_t frag_j, double *lmo_s,
     six_t *lmo_ds, double *exr_out, double *ecp_out)
@@ -521,14 +629,23 @@ efp_frag_frag_xr(struct efp *efp, size_t frag_i, size_t frag_j, double *lmo_s,
 	struct frag *fr_i = efp->frags + frag_i;
 	struct frag *fr_j = efp->frags + frag_j;
 
-	size_t ij_wf_size = fr_i->xr_wf_size * fr_j->xr_wf_size;
-	size_t ij_nlmo = fr_i->n_lmo * fr_j->n_lmo;
-	size_t ij_nlmo_wf_size = fr_i->n_lmo * fr_j->xr_wf_size;
-	double *s = (double *)malloc(ij_wf_size * sizeof(double));
-	double *t = (double *)malloc(ij_wf_size * sizeof(double));
-	double *lmo_t = (double *)malloc(ij_nlmo * sizeof(double));
-	double *tmp = (double *)malloc(ij_nlmo_wf_size * sizeof(double));
-	struct xr_atom *atoms_j = (struct xr_atom *)malloc(
+	size_t n_lmo_i = fr_i->n_lmo;
+	size_t n_lmo_j = fr_j->n_lmo;
+	size_t wf_size_i = fr_i->xr_wf_size;
+	size_t wf_size_j = fr_j->xr_wf_size;
+	size_t ij_nlmo = n_lmo_i * n_lmo_j;
+
+	/* overlap and kinetic energy integrals are interleaved row by row so
+	 * that both are transformed at once */
+	double *st = (double *)efp_scratch_alloc(efp,
+	    2 * wf_size_i * wf_size_j * sizeof(double));
+	double *lmo_st = (double *)efp_scratch_alloc(efp,
+	    2 * ij_nlmo * sizeof(double));
+	double *lmo_t = (double *)efp_scratch_alloc(efp,
+	    ij_nlmo * sizeof(double));
+	double *tmp = (double *)efp_scratch_alloc(efp,
+	    2 * n_lmo_i * wf_size_j * sizeof(double));
+	struct xr_atom *atoms_j = (struct xr_atom *)efp_scratch_alloc(efp,
 	    fr_j->n_xr_atoms * sizeof(struct xr_atom));
 	struct swf swf = efp_make_swf(efp, fr_i, fr_j);
 
@@ -539,25 +656,26 @@ efp_frag_frag_xr(struct efp *efp, size_t frag_i, size_t frag_j, double *lmo_s,
 		atoms_j[j].z -= swf.cell.z;
 	}
 
-	efp_st_int(fr_i->n_xr_atoms, fr_i->xr_atoms,
-		   fr_j->n_xr_atoms, atoms_j,
-		   fr_j->xr_wf_size, s, t);
+	efp_st_int(&fr_i->lib->xr_basis, fr_i->xr_atoms,
+		   &fr_j->lib->xr_basis, atoms_j,
+		   2 * wf_size_j, st, st + wf_size_j);
 
-	transform_integrals(fr_i->n_lmo, fr_j->n_lmo,
-			    fr_i->xr_wf_size, fr_j->xr_wf_size,
-			    fr_i->xr_wf, fr_j->xr_wf,
-			    s, lmo_s, tmp);
-	transform_integrals(fr_i->n_lmo, fr_j->n_lmo,
-			    fr_i->xr_wf_size, fr_j->xr_wf_size,
-			    fr_i->xr_wf, fr_j->xr_wf,
-			    t, lmo_t, tmp);
+	transform_blocks(n_lmo_i, n_lmo_j, wf_size_i, wf_size_j, 2,
+	    fr_i->xr_wf, fr_j->xr_wf, st, lmo_st, tmp);
+
+	for (size_t i = 0; i < n_lmo_i; i++) {
+		memcpy(lmo_s + i * n_lmo_j, lmo_st + 2 * i * n_lmo_j,
+		    n_lmo_j * sizeof(double));
+		memcpy(lmo_t + i * n_lmo_j, lmo_st + (2 * i + 1) * n_lmo_j,
+		    n_lmo_j * sizeof(double));
+	}
 
 	double exr = 0.0;
 	double ecp = 0.0;
 
-	for (size_t i = 0, idx = 0; i < fr_i->n_lmo; i++) {
-		for (size_t j = 0; j < fr_j->n_lmo; j++, idx++) {
-			double s_ij = lmo_s[i * fr_j->n_lmo + j];
+	for (size_t i = 0, idx = 0; i < n_lmo_i; i++) {
+		for (size_t j = 0; j < n_lmo_j; j++, idx++) {
+			double s_ij = lmo_s[i * n_lmo_j + j];
 
 			vec_t dr = {
 				fr_j->lmo_centroids[j].x -
@@ -583,48 +701,70 @@ efp_frag_frag_xr(struct efp *efp, size_t frag_i, size_t frag_j, double *lmo_s,
 	*ecp_out = ecp * swf.swf;
 
 	if (!efp->do_gradient) {
-		free(s);
-		free(t);
-		free(lmo_t);
-		free(tmp);
-		free(atoms_j);
+		efp_scratch_free(efp, st);
+		efp_scratch_free(efp, lmo_st);
+		efp_scratch_free(efp, lmo_t);
+		efp_scratch_free(efp, tmp);
+		efp_scratch_free(efp, atoms_j);
 		return;
 	}
 
 	/* compute gradient */
 
-	six_t *ds = (six_t *)malloc(ij_wf_size * sizeof(six_t));
-	six_t *dt = (six_t *)malloc(ij_wf_size * sizeof(six_t));
-	six_t *lmo_dt = (six_t *)malloc(ij_nlmo * sizeof(six_t));
-	six_t *sixtmp = (six_t *)malloc(ij_nlmo_wf_size * sizeof(six_t));
-	double *lmo_tmp = (double *)malloc(ij_nlmo * sizeof(double));
-
-	efp_st_int_deriv(fr_i->n_xr_atoms, fr_i->xr_atoms,
-			 fr_j->n_xr_atoms, atoms_j,
-			 VEC(fr_i->x), fr_i->xr_wf_size, fr_j->xr_wf_size,
-			 ds, dt);
-
-	transform_integral_derivatives(fr_i->n_lmo, fr_j->n_lmo,
-				       fr_i->xr_wf_size, fr_j->xr_wf_size,
-				       fr_i->xr_wf, fr_j->xr_wf,
-				       ds, lmo_ds, sixtmp);
-	transform_integral_derivatives(fr_i->n_lmo, fr_j->n_lmo,
-				       fr_i->xr_wf_size, fr_j->xr_wf_size,
-				       fr_i->xr_wf, fr_j->xr_wf,
-				       dt, lmo_dt, sixtmp);
+	/* six derivative components of overlap integrals followed by six of
+	 * kinetic energy integrals in each row */
+	double *dst = (double *)efp_scratch_alloc(efp,
+	    12 * wf_size_i * wf_size_j * sizeof(double));
+	double *lmo_dst = (double *)efp_scratch_alloc(efp,
+	    12 * ij_nlmo * sizeof(double));
+	double *dtmp = (double *)efp_scratch_alloc(efp,
+	    12 * n_lmo_i * wf_size_j * sizeof(double));
+	six_t *lmo_dt = (six_t *)efp_scratch_alloc(efp,
+	    ij_nlmo * sizeof(six_t));
+
+	efp_st_int_deriv(&fr_i->lib->xr_basis, fr_i->xr_atoms,
+			 &fr_j->lib->xr_basis, atoms_j,
+			 VEC(fr_i->x), 12 * wf_size_j,
+			 dst, dst + 6 * wf_size_j);
+
+	transform_blocks(n_lmo_i, n_lmo_j, wf_size_i, wf_size_j, 12,
+	    fr_i->xr_wf, fr_j->xr_wf, dst, lmo_dst, dtmp);
+
+	for (size_t i = 0; i < n_lmo_i; i++) {
+		for (size_t j = 0; j < n_lmo_j; j++) {
+			const double *ps = lmo_dst + 12 * i * n_lmo_j + j;
+			const double *pt = ps + 6 * n_lmo_j;
+			double *ds_ij = (double *)(lmo_ds + i * n_lmo_j + j);
+			double *dt_ij = (double *)(lmo_dt + i * n_lmo_j + j);
+
+			for (size_t c = 0; c < 6; c++) {
+				ds_ij[c] = ps[c * n_lmo_j];
+				dt_ij[c] = pt[c * n_lmo_j];
+			}
+		}
+	}
+
+	/* rotational derivatives of LMO coefficients of fragment i; rows of
+	 * xr_wf_deriv are contiguous so all three are handled at once */
+	transform_blocks(3 * n_lmo_i, n_lmo_j, wf_size_i, wf_size_j, 2,
+	    fr_i->xr_wf_deriv[0], fr_j->xr_wf, st, lmo_dst, dtmp);
 
 	for (size_t a = 0; a < 3; a++) {
-		transform_integrals(fr_i->n_lmo, fr_j->n_lmo,
-				    fr_i->xr_wf_size, fr_j->xr_wf_size,
-				    fr_i->xr_wf_deriv[a], fr_j->xr_wf,
-				    s, lmo_tmp, tmp);
-		add_six_vec(3 + a, fr_i->n_lmo * fr_j->n_lmo, lmo_tmp, lmo_ds);
-
-		transform_integrals(fr_i->n_lmo, fr_j->n_lmo,
-				    fr_i->xr_wf_size, fr_j->xr_wf_size,
-				    fr_i->xr_wf_deriv[a], fr_j->xr_wf,
-				    t, lmo_tmp, tmp);
-		add_six_vec(3 + a, fr_i->n_lmo * fr_j->n_lmo, lmo_tmp, lmo_dt);
+		for (size_t i = 0; i < n_lmo_i; i++) {
+			const double *ps = lmo_dst +
+			    2 * (a * n_lmo_i + i) * n_lmo_j;
+			const double *pt = ps + n_lmo_j;
+
+			for (size_t j = 0; j < n_lmo_j; j++) {
+				double *ds_ij = (double *)(lmo_ds +
+				    i * n_lmo_j + j);
+				double *dt_ij = (double *)(lmo_dt +
+				    i * n_lmo_j + j);
+
+				ds_ij[3 + a] += ps[j];
+				dt_ij[3 + a] += pt[j];
+			}
+		}
 	}
 
 	for (size_t i = 0, idx = 0; i < fr_i->n_lmo; i++) {
@@ -647,20 +787,19 @@ efp_frag_frag_xr(struct efp *efp, size_t frag_i, size_t frag_j, double *lmo_s,
 		swf.dswf.z * (exr + ecp)
 	};
 
-	six_atomic_add_xyz(efp->grad + frag_i, &force);
-	six_atomic_sub_xyz(efp->grad + frag_j, &force);
-	efp_add_stress(&swf.dr, &force, &efp->stress);
-
-	free(s);
-	free(ds);
-	free(t);
-	free(dt);
-	free(lmo_t);
-	free(lmo_dt);
-	free(lmo_tmp);
-	free(tmp);
-	free(sixtmp);
-	free(atoms_j);
+	efp_add_grad(efp, frag_i, &force, NULL);
+	efp_sub_grad(efp, frag_j, &force, NULL);
+	efp_add_stress(efp, &swf.dr, &force);
+
+	efp_scratch_free(efp, st);
+	efp_scratch_free(efp, lmo_st);
+	efp_scratch_free(efp, lmo_t);
+	efp_scratch_free(efp, tmp);
+	efp_scratch_free(efp, atoms_j);
+	efp_scratch_free(efp, dst);
+	efp_scratch_free(efp, lmo_dst);
+	efp_scratch_free(efp, dtmp);
+	efp_scratch_free(efp, lmo_dt);
 }
 
 static inline size_t
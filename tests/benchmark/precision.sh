@@ -0,0 +1,28 @@
+#!/bin/sh
+#
+# Compares polarization in double and in mixed precision.
+#
+# usage: precision.sh [input]
+
+EFPMD=${EFPMD:-../../efpmd/src/efpmd}
+INPUT=${1:-water-3375-sp.in}
+MIXED=`mktemp`
+
+trap 'rm -f ${MIXED}' EXIT
+
+cat ${INPUT} > ${MIXED}
+echo "enable_pol_mixed_precision true" >> ${MIXED}
+
+echo "PRECISION  TIME, S  POLARIZATION ENERGY  SPEEDUP"
+
+BASE=""
+for PRECISION in double mixed; do
+	[ ${PRECISION} = double ] && FILE=${INPUT} || FILE=${MIXED}
+	START=`date +%s.%N`
+	ENERGY=`${EFPMD} ${FILE} | awk '/POLARIZATION ENERGY/ { print $3; exit }'`
+	END=`date +%s.%N`
+	TIME=`awk "BEGIN { print ${END} - ${START} }"`
+	[ -z "${BASE}" ] && BASE=${TIME}
+	awk "BEGIN { printf \"%9s  %7.3f  %19s  %7.2f\\n\", \
+	    \"${PRECISION}\", ${TIME}, \"${ENERGY}\", ${BASE} / ${TIME} }"
+done
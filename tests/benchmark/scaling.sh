@@ -0,0 +1,24 @@
+#!/bin/sh
+#
+# Measures gradient throughput versus number of OpenMP threads.
+#
+# usage: scaling.sh [input] [max threads]
+
+EFPMD=${EFPMD:-../../efpmd/src/efpmd}
+INPUT=${1:-water-125-grad.in}
+MAX_THREADS=${2:-`nproc 2>/dev/null || echo 1`}
+
+echo "THREADS  TIME, S  GRADIENTS PER SECOND  SPEEDUP"
+
+BASE=""
+THREADS=1
+while [ ${THREADS} -le ${MAX_THREADS} ]; do
+	START=`date +%s.%N`
+	OMP_NUM_THREADS=${THREADS} ${EFPMD} ${INPUT} > /dev/null
+	END=`date +%s.%N`
+	TIME=`awk "BEGIN { print ${END} - ${START} }"`
+	[ -z "${BASE}" ] && BASE=${TIME}
+	awk "BEGIN { printf \"%7d  %7.3f  %20.3f  %7.2f\\n\", \
+	    ${THREADS}, ${TIME}, 1 / ${TIME}, ${BASE} / ${TIME} }"
+	THREADS=`expr ${THREADS} \* 2`
+done